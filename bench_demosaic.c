@@ -0,0 +1,275 @@
+// Demosaic microbenchmark (make bench): times the per-pixel demosaic the
+// converter used to have against the current kernels, in MP/s, and checks
+// the kernels bit for bit against a plain scalar demosaic on random sizes,
+// patterns and samples.
+//
+// bench_demosaic [width height [runs]]   default: a 61 MP frame, 5 runs
+
+#include "fits_demosaic.h"
+#include "fits_platform.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_WIDTH 9576
+#define BENCH_HEIGHT 6388
+#define BENCH_RUNS 5
+#define CHECK_SIZES 400
+
+// ---------------------------------------------------------------------------
+// Baseline: the demosaic as main.c had it just before the vectorized kernels
+// replaced it. That is the original code with one change: its indices and
+// sizes are size_t rather than int, as the 64-bit size work had made them.
+// It branches on the site for every pixel, reads the mosaic as if it were
+// already RGB (3 samples a pixel) and reads one row and one sample past
+// either end, so it is only timed, on a buffer padded for it, and its output
+// is not compared.
+// ---------------------------------------------------------------------------
+
+void demosaic_RGGB_16bit(uint16_t *raw_data, uint16_t *output_image, size_t width, size_t height) {
+    size_t i, j;
+
+    for (i = 0; i < height; i++) {
+        for (j = 0; j < width; j++) {
+            size_t pixel_index = i * width*3 + j*3;
+            int r, g, b;
+
+            if (i % 2 == 0 && j % 2 == 0) {
+                // Red pixel
+                r = raw_data[pixel_index];
+                g = (raw_data[pixel_index + 1] + raw_data[pixel_index + width*3]) / 2; // average of neighboring green pixels
+                b = (raw_data[pixel_index + width*3 + 1] + raw_data[pixel_index + width*3 - 1]) / 2; // average of neighboring blue pixels
+            } else if (i % 2 == 0 && j % 2 == 1) {
+                // Green pixel (even row, odd column)
+                g = raw_data[pixel_index];
+                r = (raw_data[pixel_index - 1] + raw_data[pixel_index + 1]) / 2; // average of neighboring red pixels
+                b = (raw_data[pixel_index + width*3] + raw_data[pixel_index + width*3 - 1]) / 2; // average of neighboring blue pixels
+            } else if (i % 2 == 1 && j % 2 == 0) {
+                // Green pixel (odd row, even column)
+                g = raw_data[pixel_index];
+                r = (raw_data[pixel_index - width*3] + raw_data[pixel_index + width*3]) / 2; // average of neighboring red pixels
+                b = (raw_data[pixel_index - 1] + raw_data[pixel_index + 1]) / 2; // average of neighboring blue pixels
+            } else {
+                // Blue pixel
+                b = raw_data[pixel_index];
+                g = (raw_data[pixel_index - width*3] + raw_data[pixel_index + width*3]) / 2; // average of neighboring green pixels
+                r = (raw_data[pixel_index - width*3 - 1] + raw_data[pixel_index + width*3 + 1]) / 2; // average of neighboring red pixels
+            }
+
+            // Store the result in the output image (RGB)
+            output_image[pixel_index] = r;  // Red channel
+            output_image[pixel_index + 1] = g;  // Green channel
+            output_image[pixel_index + 2] = b;  // Blue channel
+        }
+    }
+}
+
+void demosaic_RGGB_8bit(uint8_t *raw_data, uint8_t *output_image, size_t width, size_t height) {
+    size_t i, j;
+
+    for (i = 0; i < height; i++) {
+        for (j = 0; j < width; j++) {
+            size_t pixel_index = i * width*3 + j*3;
+            int r, g, b;
+
+            if (i % 2 == 0 && j % 2 == 0) {
+                // Red pixel
+                r = raw_data[pixel_index];
+                g = (raw_data[pixel_index + 1] + raw_data[pixel_index + width*3]) / 2; // average of neighboring green pixels
+                b = (raw_data[pixel_index + width*3 + 1] + raw_data[pixel_index + width*3 - 1]) / 2; // average of neighboring blue pixels
+            } else if (i % 2 == 0 && j % 2 == 1) {
+                // Green pixel (even row, odd column)
+                g = raw_data[pixel_index];
+                r = (raw_data[pixel_index - 1] + raw_data[pixel_index + 1]) / 2; // average of neighboring red pixels
+                b = (raw_data[pixel_index + width*3] + raw_data[pixel_index + width*3 - 1]) / 2; // average of neighboring blue pixels
+            } else if (i % 2 == 1 && j % 2 == 0) {
+                // Green pixel (odd row, even column)
+                g = raw_data[pixel_index];
+                r = (raw_data[pixel_index - width*3] + raw_data[pixel_index + width*3]) / 2; // average of neighboring red pixels
+                b = (raw_data[pixel_index - 1] + raw_data[pixel_index + 1]) / 2; // average of neighboring blue pixels
+            } else {
+                // Blue pixel
+                b = raw_data[pixel_index];
+                g = (raw_data[pixel_index - width*3] + raw_data[pixel_index + width*3]) / 2; // average of neighboring green pixels
+                r = (raw_data[pixel_index - width*3 - 1] + raw_data[pixel_index + width*3 + 1]) / 2; // average of neighboring red pixels
+            }
+
+            // Store the result in the output image (RGB)
+            output_image[pixel_index] = r;  // Red channel
+            output_image[pixel_index + 1] = g;  // Green channel
+            output_image[pixel_index + 2] = b;  // Blue channel
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Reference: the bilinear demosaic of fits_demosaic.h written out one pixel
+// at a time, with rows and columns outside the image mirrored
+// ---------------------------------------------------------------------------
+
+static size_t mirror(size_t i, int step, size_t n) {
+    if (n == 1) return 0;
+    if (step < 0) return i > 0 ? i - 1 : 1;
+    return i + 1 < n ? i + 1 : n - 2;
+}
+
+#define REFERENCE_DEMOSAIC(T, name) \
+    static void name(T* out, const T* mosaic, size_t width, size_t height, FITSBayerPattern pattern) { \
+        size_t rx = pattern & 1, ry = (pattern >> 1) & 1; \
+        for (size_t y = 0; y < height; y++) { \
+            const T* row = mosaic + y * width; \
+            const T* above = mosaic + mirror(y, -1, height) * width; \
+            const T* below = mosaic + mirror(y, 1, height) * width; \
+            for (size_t x = 0; x < width; x++) { \
+                size_t l = mirror(x, -1, width), r = mirror(x, 1, width); \
+                uint32_t c = row[x]; \
+                uint32_t h = (uint32_t)row[l] + row[r]; \
+                uint32_t v = (uint32_t)above[x] + below[x]; \
+                uint32_t cross = (h + v + 2) >> 2; \
+                uint32_t diagonal = ((uint32_t)above[l] + above[r] + below[l] + below[r] + 2) >> 2; \
+                uint32_t red, green, blue; \
+                if (((y ^ ry) & 1) == 0) { \
+                    if (((x ^ rx) & 1) == 0) { \
+                        red = c; green = cross; blue = diagonal; \
+                    } else { \
+                        red = (h + 1) >> 1; green = c; blue = (v + 1) >> 1; \
+                    } \
+                } else { \
+                    if (((x ^ rx) & 1) == 0) { \
+                        red = (v + 1) >> 1; green = c; blue = (h + 1) >> 1; \
+                    } else { \
+                        red = diagonal; green = cross; blue = c; \
+                    } \
+                } \
+                T* o = out + (y * width + x) * 3; \
+                o[0] = (T)red; \
+                o[1] = (T)green; \
+                o[2] = (T)blue; \
+            } \
+        } \
+    }
+
+REFERENCE_DEMOSAIC(uint8_t, reference_u8)
+REFERENCE_DEMOSAIC(uint16_t, reference_u16)
+
+// ---------------------------------------------------------------------------
+
+// xorshift64, so every run checks the same cases
+static uint64_t random_state = 0x9e3779b97f4a7c15ull;
+
+static uint32_t random_u32(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return (uint32_t)(random_state >> 32);
+}
+
+static void fill_random(void* data, size_t bytes) {
+    uint8_t* p = (uint8_t*)data;
+    for (size_t i = 0; i < bytes; i++) p[i] = (uint8_t)random_u32();
+}
+
+// Random widths and heights from 1 to 1100, so that rows of every length
+// modulo the vector widths and the 512-site blocks come up, in all four
+// patterns; every thread count gives the same output, so the default is used
+static int check_kernels(void) {
+    int failures = 0;
+    for (int i = 0; i < CHECK_SIZES; i++) {
+        size_t width = 1 + random_u32() % 1100, height = 1 + random_u32() % (i % 4 == 0 ? 1100 : 40);
+        FITSBayerPattern pattern = (FITSBayerPattern)(random_u32() & 3);
+        size_t pixels = width * height;
+        uint16_t* mosaic = (uint16_t*)malloc(pixels * sizeof(uint16_t));
+        uint16_t* out = (uint16_t*)malloc(pixels * 3 * sizeof(uint16_t));
+        uint16_t* expected = (uint16_t*)malloc(pixels * 3 * sizeof(uint16_t));
+        if (!mosaic || !out || !expected) {
+            printf("out of memory\n");
+            free(mosaic);
+            free(out);
+            free(expected);
+            return 0;
+        }
+        fill_random(mosaic, pixels * sizeof(uint16_t));
+
+        fits_demosaic_u16(out, mosaic, width, height, pattern, 0);
+        reference_u16(expected, mosaic, width, height, pattern);
+        if (memcmp(out, expected, pixels * 3 * sizeof(uint16_t)) != 0) {
+            printf("u16 %zux%zu %s differs\n", width, height, fits_bayer_pattern_name(pattern));
+            failures++;
+        }
+        fits_demosaic_u8((uint8_t*)out, (const uint8_t*)mosaic, width, height, pattern, 0);
+        reference_u8((uint8_t*)expected, (const uint8_t*)mosaic, width, height, pattern);
+        if (memcmp(out, expected, pixels * 3) != 0) {
+            printf("u8 %zux%zu %s differs\n", width, height, fits_bayer_pattern_name(pattern));
+            failures++;
+        }
+        free(mosaic);
+        free(out);
+        free(expected);
+    }
+    printf("bit-identical to the reference on %d random sizes: %s\n", CHECK_SIZES, failures ? "NO" : "yes");
+    return failures == 0;
+}
+
+// Best of runs, in megapixels per second
+#define TIME_RUNS(call) do { \
+        double best = 0.0; \
+        for (int run = 0; run < runs; run++) { \
+            double start = fits_time_seconds(); \
+            call; \
+            double seconds = fits_time_seconds() - start; \
+            if (run == 0 || seconds < best) best = seconds; \
+        } \
+        rate = best > 0.0 ? (double)pixels / 1e6 / best : 0.0; \
+    } while (0)
+
+int main(int argc, char** argv) {
+    size_t width = BENCH_WIDTH, height = BENCH_HEIGHT;
+    int runs = BENCH_RUNS;
+    if (argc >= 3) {
+        width = strtoul(argv[1], NULL, 10);
+        height = strtoul(argv[2], NULL, 10);
+    }
+    if (argc >= 4) runs = atoi(argv[3]);
+    if (width < 2 || height < 2 || runs < 1) {
+        printf("usage: bench_demosaic [width height [runs]]\n");
+        return 2;
+    }
+
+    printf("demosaic kernel: %s, %d threads\n", fits_demosaic_kernel_name(), fits_cpu_count());
+    int ok = check_kernels();
+
+    // The baseline reads a whole row beyond both ends of its 3-sample rows
+    size_t pixels = width * height;
+    size_t pad = width * 3 + 1;
+    uint16_t* raw = (uint16_t*)malloc((pixels * 3 + 2 * pad) * sizeof(uint16_t));
+    uint16_t* out = (uint16_t*)malloc(pixels * 3 * sizeof(uint16_t));
+    if (!raw || !out) {
+        printf("out of memory for %zux%zu\n", width, height);
+        return 1;
+    }
+    fill_random(raw, (pixels * 3 + 2 * pad) * sizeof(uint16_t));
+    uint16_t* mosaic16 = raw + pad;
+    uint8_t* mosaic8 = (uint8_t*)raw + pad;
+    double rate, old_rate;
+
+    printf("%zux%zu, best of %d, MP/s:\n", width, height, runs);
+    TIME_RUNS(demosaic_RGGB_16bit(mosaic16, out, width, height));
+    old_rate = rate;
+    TIME_RUNS(fits_demosaic_u16(out, mosaic16, width, height, FITS_BAYER_RGGB, 1));
+    printf("  u16  per-pixel %8.1f   kernel, 1 thread %8.1f", old_rate, rate);
+    TIME_RUNS(fits_demosaic_u16(out, mosaic16, width, height, FITS_BAYER_RGGB, 0));
+    printf("   all threads %8.1f\n", rate);
+
+    TIME_RUNS(demosaic_RGGB_8bit(mosaic8, (uint8_t*)out, width, height));
+    old_rate = rate;
+    TIME_RUNS(fits_demosaic_u8((uint8_t*)out, mosaic8, width, height, FITS_BAYER_RGGB, 1));
+    printf("  u8   per-pixel %8.1f   kernel, 1 thread %8.1f", old_rate, rate);
+    TIME_RUNS(fits_demosaic_u8((uint8_t*)out, mosaic8, width, height, FITS_BAYER_RGGB, 0));
+    printf("   all threads %8.1f\n", rate);
+
+    free(raw);
+    free(out);
+    return ok ? 0 : 1;
+}
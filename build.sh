@@ -7,7 +7,7 @@ set -e
 OS="$(uname)"
 echo "Building on: $OS"
 
-CFLAGS="-Wall -Wextra -D_CRT_SECURE_NO_WARNINGS -DHAVE_STRCPY_S -DHAVE_FOPEN_S -DHAVE_FREAD_S -DHAVE_STRCAT_S -DHAVE_MEMCPY_S -DHAVE_STRNLEN_S -DHAVE_FTELLI64 -DHAVE_FSEEKI64 -DHAVE_FTELLO64 -DHAVE_FSEEKO64"
+CFLAGS="-O2 -Wall -Wextra -D_CRT_SECURE_NO_WARNINGS -DHAVE_STRCPY_S -DHAVE_FOPEN_S -DHAVE_FREAD_S -DHAVE_STRCAT_S -DHAVE_MEMCPY_S -DHAVE_STRNLEN_S -DHAVE_FTELLI64 -DHAVE_FSEEKI64 -DHAVE_FTELLO64 -DHAVE_FSEEKO64"
 LDFLAGS="-mwindows -lcomdlg32 -municode"
 
 # Add local TinyTIFF library
@@ -18,6 +18,7 @@ else
     exit 1
 fi
 TARGET="fits_converter.exe"
+SRCS="main.c fits_io.c fits_header.c fits_inflate.c fits_kernels.c fits_platform.c fits_tilecomp.c fits_output.c fits_demosaic.c fits_catalog.c fits_ser.c fits_stretch.c"
 
 # Set compiler and flags based on OS
 if [[ "$OS" == "Darwin" ]]; then
@@ -34,8 +35,12 @@ rm -f *.o $TARGET
 
 # Build the program
 echo "Building with $CC..."
-$CC $CFLAGS -c main.c -o main.o
-$CC main.o -o $TARGET $LDFLAGS
+OBJS=""
+for SRC in $SRCS; do
+    $CC $CFLAGS -c $SRC -o ${SRC%.c}.o
+    OBJS="$OBJS ${SRC%.c}.o"
+done
+$CC $OBJS -o $TARGET $LDFLAGS
 
 # Check if build succeeded
 if [ -f "$TARGET" ]; then
@@ -0,0 +1,634 @@
+#include "fits_catalog.h"
+#include "fits_header.h"
+#include "fits_io.h"
+#include "fits_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define PATH_SEPARATOR L'\\'
+#else
+#include <dirent.h>
+#include <strings.h>
+#define PATH_SEPARATOR L'/'
+#endif
+
+#define CATALOG_COLUMNS "path,size,mtime,hdu,bitpix,naxis,naxis1,naxis2,naxis3,exptime,filter,bayerpat,date_obs"
+
+// ---------------------------------------------------------------------------
+// Path lists
+// ---------------------------------------------------------------------------
+
+static int path_list_push(FITSPathList* list, const wchar_t* path) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        wchar_t** paths = (wchar_t**)realloc(list->paths, capacity * sizeof(wchar_t*));
+        if (!paths) return 0;
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    size_t len = wcslen(path);
+    wchar_t* copy = (wchar_t*)malloc((len + 1) * sizeof(wchar_t));
+    if (!copy) return 0;
+    memcpy(copy, path, (len + 1) * sizeof(wchar_t));
+    list->paths[list->count++] = copy;
+    return 1;
+}
+
+void fits_path_list_free(FITSPathList* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    memset(list, 0, sizeof(*list));
+}
+
+static int ends_with(const wchar_t* name, size_t len, const wchar_t* suffix) {
+    size_t n = wcslen(suffix);
+    if (len < n) return 0;
+    for (size_t i = 0; i < n; i++) {
+        if ((wchar_t)towlower(name[len - n + i]) != suffix[i]) return 0;
+    }
+    return 1;
+}
+
+static int is_fits_name(const wchar_t* name) {
+    size_t len = wcslen(name);
+    if (ends_with(name, len, L".gz")) len -= 3;
+    return ends_with(name, len, L".fit") || ends_with(name, len, L".fits") || ends_with(name, len, L".fts");
+}
+
+static wchar_t* join_path(const wchar_t* dir, const wchar_t* name) {
+    size_t dir_len = wcslen(dir), name_len = wcslen(name);
+    wchar_t* path = (wchar_t*)malloc((dir_len + name_len + 2) * sizeof(wchar_t));
+    if (!path) return NULL;
+    memcpy(path, dir, dir_len * sizeof(wchar_t));
+    if (dir_len > 0 && dir[dir_len - 1] != PATH_SEPARATOR && dir[dir_len - 1] != L'/') {
+        path[dir_len++] = PATH_SEPARATOR;
+    }
+    memcpy(path + dir_len, name, (name_len + 1) * sizeof(wchar_t));
+    return path;
+}
+
+// Full paths of the entries of a directory, without . and ..; an
+// unreadable directory just has none. Returns 0 if memory runs out.
+#ifdef _WIN32
+
+static int list_directory(FITSPathList* entries, const wchar_t* dir) {
+    wchar_t* pattern = join_path(dir, L"*");
+    if (!pattern) return 0;
+    WIN32_FIND_DATAW found;
+    HANDLE find = FindFirstFileW(pattern, &found);
+    free(pattern);
+    if (find == INVALID_HANDLE_VALUE) return 1;
+    int ok = 1;
+    do {
+        if (wcscmp(found.cFileName, L".") == 0 || wcscmp(found.cFileName, L"..") == 0) continue;
+        wchar_t* path = join_path(dir, found.cFileName);
+        ok = path && path_list_push(entries, path);
+        free(path);
+    } while (ok && FindNextFileW(find, &found));
+    FindClose(find);
+    return ok;
+}
+
+#else
+
+static int list_directory(FITSPathList* entries, const wchar_t* dir) {
+    size_t len = wcstombs(NULL, dir, 0);
+    if (len == (size_t)-1) return 1;
+    char* narrow = (char*)malloc(len + 1);
+    if (!narrow) return 0;
+    wcstombs(narrow, dir, len + 1);
+    DIR* d = opendir(narrow);
+    free(narrow);
+    if (!d) return 1;
+    int ok = 1;
+    struct dirent* entry;
+    while (ok && (entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        size_t wide_len = mbstowcs(NULL, entry->d_name, 0);
+        if (wide_len == (size_t)-1) continue;  // not valid in this locale
+        wchar_t* name = (wchar_t*)malloc((wide_len + 1) * sizeof(wchar_t));
+        wchar_t* path = NULL;
+        if (name) {
+            mbstowcs(name, entry->d_name, wide_len + 1);
+            path = join_path(dir, name);
+        }
+        ok = path && path_list_push(entries, path);
+        free(name);
+        free(path);
+    }
+    closedir(d);
+    return ok;
+}
+
+#endif
+
+static int compare_paths(const void* a, const void* b) {
+    return wcscmp(*(wchar_t* const*)a, *(wchar_t* const*)b);
+}
+
+static int add_path(FITSPathList* list, const wchar_t* path, int from_directory) {
+    uint64_t size;
+    int64_t mtime;
+    int is_directory;
+    if (!fits_file_info(path, &size, &mtime, &is_directory)) {
+        // a named file that does not exist still gets its (unreadable) row
+        return from_directory ? 1 : path_list_push(list, path);
+    }
+    if (!is_directory) {
+        return from_directory && !is_fits_name(path) ? 1 : path_list_push(list, path);
+    }
+
+    FITSPathList entries = {0};
+    int ok = list_directory(&entries, path);
+    if (entries.count > 1) qsort(entries.paths, entries.count, sizeof(wchar_t*), compare_paths);
+    for (size_t i = 0; ok && i < entries.count; i++) {
+        ok = add_path(list, entries.paths[i], 1);
+    }
+    fits_path_list_free(&entries);
+    return ok;
+}
+
+int fits_path_list_add(FITSPathList* list, const wchar_t* path) {
+    return add_path(list, path, 0);
+}
+
+// ---------------------------------------------------------------------------
+// Text output
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    int failed;  // an allocation failed; the text is incomplete
+} Text;
+
+static void text_append(Text* text, const char* s, size_t n) {
+    if (text->failed) return;
+    if (text->length + n + 1 > text->capacity) {
+        size_t capacity = text->capacity ? text->capacity * 2 : 256;
+        while (capacity < text->length + n + 1) capacity *= 2;
+        char* data = (char*)realloc(text->data, capacity);
+        if (!data) {
+            text->failed = 1;
+            return;
+        }
+        text->data = data;
+        text->capacity = capacity;
+    }
+    memcpy(text->data + text->length, s, n);
+    text->length += n;
+    text->data[text->length] = '\0';
+}
+
+static void text_puts(Text* text, const char* s) {
+    text_append(text, s, strlen(s));
+}
+
+// UTF-8 of a path. wchar_t is UTF-16 on Windows, so surrogate pairs are
+// combined; elsewhere it holds code points already.
+static void text_path(Text* text, const wchar_t* path) {
+    for (const wchar_t* p = path; *p; p++) {
+        uint32_t c = (uint32_t)*p;
+        if (c >= 0xD800 && c < 0xDC00 && p[1] >= 0xDC00 && p[1] < 0xE000) {
+            c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)p[1] - 0xDC00);
+            p++;
+        }
+        char u[4];
+        size_t n;
+        if (c < 0x80) {
+            u[0] = (char)c;
+            n = 1;
+        } else if (c < 0x800) {
+            u[0] = (char)(0xC0 | (c >> 6));
+            u[1] = (char)(0x80 | (c & 0x3F));
+            n = 2;
+        } else if (c < 0x10000) {
+            u[0] = (char)(0xE0 | (c >> 12));
+            u[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+            u[2] = (char)(0x80 | (c & 0x3F));
+            n = 3;
+        } else {
+            u[0] = (char)(0xF0 | (c >> 18));
+            u[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+            u[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+            u[3] = (char)(0x80 | (c & 0x3F));
+            n = 4;
+        }
+        text_append(text, u, n);
+    }
+}
+
+// CSV field, quoted only when it has to be
+static void text_csv(Text* text, const char* s) {
+    if (!strpbrk(s, ",\"\r\n")) {
+        text_puts(text, s);
+        return;
+    }
+    text_puts(text, "\"");
+    for (const char* p = s; *p; p++) {
+        text_append(text, p, 1);
+        if (*p == '"') text_append(text, p, 1);
+    }
+    text_puts(text, "\"");
+}
+
+// JSON string with quotes
+static void text_json(Text* text, const char* s) {
+    text_puts(text, "\"");
+    for (const char* p = s; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        char escape[8];
+        if (c == '"' || c == '\\') {
+            escape[0] = '\\';
+            escape[1] = (char)c;
+            text_append(text, escape, 2);
+        } else if (c < 0x20) {
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            text_puts(text, escape);
+        } else {
+            text_append(text, p, 1);
+        }
+    }
+    text_puts(text, "\"");
+}
+
+// ---------------------------------------------------------------------------
+// Header scan
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int hdu;  // first image HDU, -1 if none could be read
+    int bitpix;
+    int naxis;
+    int64_t naxes[3];
+    int has_exptime;
+    double exptime;
+    char filter[72];
+    char bayerpat[72];
+    char date_obs[72];
+} HeaderInfo;
+
+// The keyword from the image HDU, or failing that from the primary header
+static int lookup_string(const FITSHeader* image, const FITSHeader* primary, const char* keyword,
+                         char* value, size_t size) {
+    return fits_header_get_string(image, keyword, value, size) ||
+           (primary && fits_header_get_string(primary, keyword, value, size));
+}
+
+static int lookup_double(const FITSHeader* image, const FITSHeader* primary, const char* keyword, double* value) {
+    return fits_header_get_double(image, keyword, value) ||
+           (primary && fits_header_get_double(primary, keyword, value));
+}
+
+static void scan_headers(HeaderInfo* info, const wchar_t* path) {
+    memset(info, 0, sizeof(*info));
+    info->hdu = -1;
+    FITSInput input;
+    if (!fits_input_open(&input, path, FITS_INPUT_HEADERS)) return;
+
+    // Hop from header to header as the converter does; a gzip file is only
+    // inflated up to the image header before the close cancels it
+    FITSHDUIndex hdus = {0};
+    size_t available = 0;
+    int at_end = 0, hdu = -1;
+    for (;;) {
+        if (!fits_hdu_index_extend(&hdus, input.data, available, at_end)) break;
+        hdu = fits_hdu_index_first_image(&hdus);
+        if (hdu >= 0 || hdus.complete) break;
+        size_t next = available > hdus.next_offset ? available : hdus.next_offset;
+        available = fits_input_wait(&input, next + FITS_BLOCK_SIZE, &at_end);
+    }
+
+    FITSHeader primary, image;
+    if (hdu >= 0 && fits_header_parse(&primary, input.data, available) &&
+        fits_header_parse(&image, input.data + hdus.hdus[hdu].header_offset,
+                          available - hdus.hdus[hdu].header_offset)) {
+        const FITSHDU* h = &hdus.hdus[hdu];
+        const FITSHeader* inherited = hdu > 0 ? &primary : NULL;
+        info->hdu = hdu;
+        info->bitpix = h->bitpix;
+        info->naxis = h->naxis;
+        for (int i = 0; i < 3 && i < h->naxis; i++) {
+            info->naxes[i] = h->naxes[i];
+        }
+        info->has_exptime = lookup_double(&image, inherited, "EXPTIME", &info->exptime) ||
+                            lookup_double(&image, inherited, "EXPOSURE", &info->exptime);
+        lookup_string(&image, inherited, "FILTER", info->filter, sizeof(info->filter));
+        lookup_string(&image, inherited, "BAYERPAT", info->bayerpat, sizeof(info->bayerpat));
+        lookup_string(&image, inherited, "DATE-OBS", info->date_obs, sizeof(info->date_obs));
+    }
+    fits_hdu_index_free(&hdus);
+    fits_input_close(&input);
+}
+
+// One catalog row, without the line end
+static void format_row(Text* text, int json, const wchar_t* path, uint64_t size, int64_t mtime,
+                       const HeaderInfo* info) {
+    Text utf8 = {0};
+    text_path(&utf8, path);
+    const char* path_utf8 = utf8.data ? utf8.data : "";
+
+    char number[8][32] = {{0}};
+    snprintf(number[0], sizeof(number[0]), "%llu", (unsigned long long)size);
+    snprintf(number[1], sizeof(number[1]), "%lld", (long long)mtime);
+    snprintf(number[2], sizeof(number[2]), "%d", info->hdu);
+    if (info->hdu >= 0) {
+        snprintf(number[3], sizeof(number[3]), "%d", info->bitpix);
+        snprintf(number[4], sizeof(number[4]), "%d", info->naxis);
+        for (int i = 0; i < 3 && i < info->naxis; i++) {
+            snprintf(number[5 + i], sizeof(number[5 + i]), "%lld", (long long)info->naxes[i]);
+        }
+    }
+    char exptime[32] = "";
+    if (info->has_exptime) snprintf(exptime, sizeof(exptime), "%.10g", info->exptime);
+
+    static const char* const names[] = { "path", "size", "mtime", "hdu", "bitpix", "naxis", "naxis1", "naxis2",
+                                         "naxis3", "exptime", "filter", "bayerpat", "date_obs" };
+    const char* values[] = { path_utf8, number[0], number[1], number[2], number[3], number[4], number[5],
+                             number[6], number[7], exptime, info->filter, info->bayerpat, info->date_obs };
+    for (int i = 0; i < 13; i++) {
+        int is_string = i == 0 || i >= 10;
+        if (json) {
+            text_puts(text, i == 0 ? "{\"" : ",\"");
+            text_puts(text, names[i]);
+            text_puts(text, "\":");
+            if (!values[i][0] && i > 0) {
+                text_puts(text, "null");
+            } else if (is_string) {
+                text_json(text, values[i]);
+            } else {
+                text_puts(text, values[i]);
+            }
+        } else {
+            if (i > 0) text_puts(text, ",");
+            text_csv(text, values[i]);
+        }
+    }
+    if (json) text_puts(text, "}");
+    free(utf8.data);
+}
+
+// ---------------------------------------------------------------------------
+// Previous catalog
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char* path;        // UTF-8
+    uint64_t size;
+    int64_t mtime;
+    const char* line;  // the whole row, reused verbatim
+} CachedRow;
+
+typedef struct {
+    char* text;        // the catalog file, split into lines in place
+    CachedRow* rows;
+    size_t count;
+    size_t* slots;     // open addressing over rows by path, index + 1 (0 = empty)
+    size_t mask;
+} Cache;
+
+static size_t hash_path(const char* s) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for (; *s; s++) {
+        h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+// Path and the two numbers after it from the front of a CSV row
+static int parse_csv_row(const char* line, char* path, uint64_t* size, int64_t* mtime) {
+    const char* p = line;
+    size_t n = 0;
+    if (*p == '"') {
+        for (p++; *p; p++) {
+            if (*p == '"') {
+                if (p[1] != '"') break;
+                p++;
+            }
+            path[n++] = *p;
+        }
+        if (*p++ != '"') return 0;
+    } else {
+        while (*p && *p != ',') path[n++] = *p++;
+    }
+    path[n] = '\0';
+    char* end;
+    if (*p++ != ',') return 0;
+    *size = strtoull(p, &end, 10);
+    if (end == p || *end != ',') return 0;
+    p = end + 1;
+    *mtime = strtoll(p, &end, 10);
+    return end != p && *end == ',';
+}
+
+// Same for a JSON row as format_row writes it
+static int parse_json_row(const char* line, char* path, uint64_t* size, int64_t* mtime) {
+    const char* p = line;
+    if (strncmp(p, "{\"path\":\"", 9) != 0) return 0;
+    size_t n = 0;
+    for (p += 9; *p && *p != '"'; p++) {
+        if (*p != '\\') {
+            path[n++] = *p;
+            continue;
+        }
+        p++;
+        if (*p == 'u') {
+            unsigned c;
+            if (sscanf(p + 1, "%4x", &c) != 1 || c >= 0x80) return 0;  // only control characters are escaped
+            path[n++] = (char)c;
+            p += 4;
+        } else if (*p == '"' || *p == '\\' || *p == '/') {
+            path[n++] = *p;
+        } else {
+            return 0;
+        }
+    }
+    path[n] = '\0';
+    char* end;
+    if (strncmp(p, "\",\"size\":", 9) != 0) return 0;
+    p += 9;
+    *size = strtoull(p, &end, 10);
+    if (end == p || strncmp(end, ",\"mtime\":", 9) != 0) return 0;
+    p = end + 9;
+    *mtime = strtoll(p, &end, 10);
+    return end != p && *end == ',';
+}
+
+static int cache_load(Cache* cache, const char* catalog_path, int json) {
+    memset(cache, 0, sizeof(*cache));
+    FILE* f = fopen(catalog_path, "rb");
+    if (!f) return 1;  // first scan
+    size_t length = 0, capacity = 1 << 16;
+    char* text = (char*)malloc(capacity);
+    while (text) {
+        length += fread(text + length, 1, capacity - length - 1, f);
+        if (length < capacity - 1) break;
+        capacity *= 2;
+        char* grown = (char*)realloc(text, capacity);
+        if (!grown) free(text);
+        text = grown;
+    }
+    fclose(f);
+    if (!text) return 0;
+    text[length] = '\0';
+    cache->text = text;
+
+    size_t lines = 1;
+    for (size_t i = 0; i < length; i++) lines += text[i] == '\n';
+    cache->rows = (CachedRow*)calloc(lines, sizeof(CachedRow));
+    size_t slots = 16;
+    while (slots < lines * 2) slots *= 2;
+    cache->slots = (size_t*)calloc(slots, sizeof(size_t));
+    cache->mask = slots - 1;
+    if (!cache->rows || !cache->slots) return 0;
+
+    for (char* line = text; *line;) {
+        char* next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        } else {
+            next = line + strlen(line);
+        }
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+
+        CachedRow* row = &cache->rows[cache->count];
+        row->path = (char*)malloc(len + 1);  // never longer than its row
+        if (!row->path) return 0;
+        if (json ? parse_json_row(line, row->path, &row->size, &row->mtime)
+                 : parse_csv_row(line, row->path, &row->size, &row->mtime)) {
+            row->line = line;
+            size_t slot = hash_path(row->path) & cache->mask;
+            while (cache->slots[slot]) slot = (slot + 1) & cache->mask;
+            cache->slots[slot] = ++cache->count;
+        } else {
+            free(row->path);  // the CSV header row, or not a row of ours
+            row->path = NULL;
+        }
+        line = next;
+    }
+    return 1;
+}
+
+static const CachedRow* cache_find(const Cache* cache, const char* path) {
+    if (!cache->count) return NULL;
+    for (size_t slot = hash_path(path) & cache->mask; cache->slots[slot]; slot = (slot + 1) & cache->mask) {
+        const CachedRow* row = &cache->rows[cache->slots[slot] - 1];
+        if (strcmp(row->path, path) == 0) return row;
+    }
+    return NULL;
+}
+
+static void cache_free(Cache* cache) {
+    for (size_t i = 0; i < cache->count; i++) {
+        free(cache->rows[i].path);
+    }
+    free(cache->rows);
+    free(cache->slots);
+    free(cache->text);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// ---------------------------------------------------------------------------
+// Catalog
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const char* line;  // reused row, or row.data
+    Text row;          // freshly scanned row
+    int scanned;
+    int unreadable;
+} CatalogEntry;
+
+typedef struct {
+    wchar_t** paths;
+    CatalogEntry* entries;
+    const Cache* cache;
+    int json;
+} CatalogJob;
+
+static void catalog_entry(void* context, size_t index) {
+    CatalogJob* job = (CatalogJob*)context;
+    CatalogEntry* entry = &job->entries[index];
+    const wchar_t* path = job->paths[index];
+
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    int is_directory = 0;
+    int exists = fits_file_info(path, &size, &mtime, &is_directory);
+    if (exists) {
+        Text utf8 = {0};
+        text_path(&utf8, path);
+        const CachedRow* cached = utf8.data ? cache_find(job->cache, utf8.data) : NULL;
+        free(utf8.data);
+        if (cached && cached->size == size && cached->mtime == mtime) {
+            entry->line = cached->line;
+            return;
+        }
+    }
+
+    HeaderInfo info;
+    if (exists && !is_directory) {
+        scan_headers(&info, path);
+    } else {
+        memset(&info, 0, sizeof(info));
+        info.hdu = -1;
+    }
+    format_row(&entry->row, job->json, path, size, mtime, &info);
+    entry->line = entry->row.data;
+    entry->scanned = 1;
+    entry->unreadable = info.hdu < 0;
+}
+
+static int is_json_path(const char* path) {
+    const char* ext = strrchr(path, '.');
+    if (!ext) return 0;
+#ifdef _WIN32
+    return _stricmp(ext, ".json") == 0 || _stricmp(ext, ".jsonl") == 0;
+#else
+    return strcasecmp(ext, ".json") == 0 || strcasecmp(ext, ".jsonl") == 0;
+#endif
+}
+
+int fits_catalog_write(const char* catalog_path, wchar_t** paths, size_t count, int threads,
+                       FITSCatalogStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    int json = is_json_path(catalog_path);
+    Cache cache;
+    CatalogEntry* entries = (CatalogEntry*)calloc(count ? count : 1, sizeof(CatalogEntry));
+    int ok = cache_load(&cache, catalog_path, json) && entries;
+
+    if (ok) {
+        CatalogJob job = { paths, entries, &cache, json };
+        fits_parallel_for(count, threads, catalog_entry, &job);
+    }
+
+    // Only now is the old catalog overwritten, with the reused rows still in memory
+    FILE* f = ok ? fopen(catalog_path, "wb") : NULL;
+    ok = f != NULL;
+    if (ok && !json) ok = fputs(CATALOG_COLUMNS "\n", f) >= 0;
+    for (size_t i = 0; i < count && ok; i++) {
+        CatalogEntry* entry = &entries[i];
+        ok = entry->line && !entry->row.failed && fputs(entry->line, f) >= 0 && fputc('\n', f) != EOF;
+        stats->scanned += entry->scanned;
+        stats->reused += !entry->scanned;
+        stats->unreadable += entry->unreadable;
+    }
+    if (f && fclose(f) != 0) ok = 0;
+
+    for (size_t i = 0; entries && i < count; i++) {
+        free(entries[i].row.data);
+    }
+    free(entries);
+    cache_free(&cache);
+    return ok;
+}
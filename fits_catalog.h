@@ -0,0 +1,48 @@
+#ifndef FITS_CATALOG_H
+#define FITS_CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+// Header-only inventory of many FITS files. Each file is opened, its HDU
+// headers are hopped through up to the first image HDU, and one catalog row
+// records what the converter would see there:
+//
+//   path, size, mtime, hdu, bitpix, naxis, naxis1, naxis2, naxis3,
+//   exptime, filter, bayerpat, date_obs
+//
+// Data units are never read. Keywords missing from the image HDU are taken
+// from the primary header. Files without a readable image HDU get hdu -1
+// and no values past it.
+
+// Growable list of file paths
+typedef struct {
+    wchar_t** paths;
+    size_t count;
+    size_t capacity;
+} FITSPathList;
+
+// Add path to the list; a directory adds the FITS files below it instead
+// (.fit, .fits, .fts, optionally .gz), recursively and sorted by name.
+// Returns 0 if memory runs out.
+int fits_path_list_add(FITSPathList* list, const wchar_t* path);
+void fits_path_list_free(FITSPathList* list);
+
+typedef struct {
+    size_t scanned;     // files whose headers were read
+    size_t reused;      // rows taken over from the previous catalog
+    size_t unreadable;  // files with no readable image header
+} FITSCatalogStats;
+
+// Scan the headers of count files on up to threads threads (0 means one per
+// logical processor) and write the catalog to catalog_path, one row per file
+// in the given order. A path ending in .json or .jsonl gets JSON lines,
+// anything else CSV with a header row. If catalog_path already holds a
+// catalog in that format, rows of files whose size and mtime are unchanged
+// are copied from it instead of scanning the files again.
+// Returns 0 if the catalog cannot be written.
+int fits_catalog_write(const char* catalog_path, wchar_t** paths, size_t count, int threads,
+                       FITSCatalogStats* stats);
+
+#endif // FITS_CATALOG_H
@@ -0,0 +1,1252 @@
+#include "fits_demosaic.h"
+#include "fits_kernels.h"
+#include "fits_platform.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FITS_X86_SIMD 1
+#include <immintrin.h>
+#define FITS_TARGET_SSE2 __attribute__((target("sse2")))
+#define FITS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Rows per band of the whole-image demosaic; bands are spread over threads
+#define DEMOSAIC_BAND 64
+
+// Interior pixels are computed a block at a time into three colour planes,
+// which fits_interleave3 then turns into RGB triples; the planes stay in L1.
+#define DEMOSAIC_BLOCK 512
+
+// Red sits in column RX and row RY of each 2x2 quad (both 0 for RGGB), blue
+// diagonally opposite. Each missing colour is the average of the nearest two
+// or four samples of it: on a red or blue site green comes from the four
+// edge neighbours and the opposite colour from the four diagonals; on a
+// green site the two colours come from the horizontal and the vertical
+// neighbour pair. l and r are the columns left and right of x, mirrored at
+// the edges. T is uint8_t, uint16_t or float; the sums are formed in
+// DEMOSAIC_SUM_##T and turned into means by DEMOSAIC_HALF_##T and
+// DEMOSAIC_QUARTER_##T.
+#define DEMOSAIC_SITE(T, R, G, B, x, l, r, RX, RY) do { \
+        DEMOSAIC_SUM_##T c = row[x]; \
+        DEMOSAIC_SUM_##T h = (DEMOSAIC_SUM_##T)row[l] + row[r]; \
+        DEMOSAIC_SUM_##T v = (DEMOSAIC_SUM_##T)above[x] + below[x]; \
+        DEMOSAIC_SUM_##T cross = DEMOSAIC_QUARTER_##T(h + v); \
+        DEMOSAIC_SUM_##T diagonal = DEMOSAIC_QUARTER_##T(((DEMOSAIC_SUM_##T)above[l] + above[r]) + \
+                                                         ((DEMOSAIC_SUM_##T)below[l] + below[r])); \
+        if (((y ^ (RY)) & 1) == 0) { \
+            if ((((x) ^ (RX)) & 1) == 0) {  /* red */ \
+                R = (T)c; G = (T)cross; B = (T)diagonal; \
+            } else {                        /* green on a red row */ \
+                R = (T)DEMOSAIC_HALF_##T(h); G = (T)c; B = (T)DEMOSAIC_HALF_##T(v); \
+            } \
+        } else { \
+            if ((((x) ^ (RX)) & 1) == 0) {  /* green on a blue row */ \
+                R = (T)DEMOSAIC_HALF_##T(v); G = (T)c; B = (T)DEMOSAIC_HALF_##T(h); \
+            } else {                        /* blue */ \
+                R = (T)diagonal; G = (T)cross; B = (T)c; \
+            } \
+        } \
+    } while (0)
+
+// Integer samples are summed in 32 bits and their means rounded to nearest;
+// float samples stay float, which keeps stacked -32 masters free of any
+// integer round trip. Float sums are paired ((a + b) + (c + d)) exactly as
+// the vector kernels pair them, so both give the same bits.
+#define DEMOSAIC_SUM_uint8_t uint32_t
+#define DEMOSAIC_SUM_uint16_t uint32_t
+#define DEMOSAIC_SUM_float float
+#define DEMOSAIC_HALF_uint8_t(sum) (((sum) + 1) >> 1)
+#define DEMOSAIC_HALF_uint16_t(sum) (((sum) + 1) >> 1)
+#define DEMOSAIC_HALF_float(sum) ((sum) * 0.5f)
+#define DEMOSAIC_QUARTER_uint8_t(sum) (((sum) + 2) >> 2)
+#define DEMOSAIC_QUARTER_uint16_t(sum) (((sum) + 2) >> 2)
+#define DEMOSAIC_QUARTER_float(sum) ((sum) * 0.25f)
+
+#ifdef FITS_X86_SIMD
+
+// One vector covers step consecutive sites of a row, alternating between the
+// two kinds of site a quad row has, so every lane computes all candidates
+// and a lane mask picks the right ones: no per-pixel branches. Everything
+// stays in the sample width. For integers the pair means (a + b + 1) >> 1
+// are exactly the rounding average instruction and the four-sample mean
+// (a + b + c + d + 2) >> 2 is rebuilt exactly from the floored pair means
+// and their low bits; floats just add and scale. NUM (INT or FLOAT) picks
+// those operations. row, above and below point at column x0 >= 1 and sites
+// up to x0 + n must be readable; returns how many sites were done. Only the
+// parity of x0 and y is used, as RGGB coordinates: callers fold the CFA
+// phase into them.
+#define DEMOSAIC_KERNEL(T, V, P, SI, E, U, EVEN_LANES, NUM) \
+    V even = EVEN_LANES; \
+    if (x0 & 1) even = DEMOSAIC_FLIP_##NUM(P, SI, E, even); \
+    size_t step = sizeof(V) / sizeof(T); \
+    size_t i = 0; \
+    for (; i + step <= n; i += step) { \
+        V c = DEMOSAIC_LOAD_##NUM(V, P, SI, row + i); \
+        V l = DEMOSAIC_LOAD_##NUM(V, P, SI, row + i - 1); \
+        V r = DEMOSAIC_LOAD_##NUM(V, P, SI, row + i + 1); \
+        V a = DEMOSAIC_LOAD_##NUM(V, P, SI, above + i); \
+        V b = DEMOSAIC_LOAD_##NUM(V, P, SI, below + i); \
+        V h = DEMOSAIC_MEAN2_##NUM(P, U, l, r); \
+        V v = DEMOSAIC_MEAN2_##NUM(P, U, a, b); \
+        V cross, diagonal; \
+        DEMOSAIC_MEAN4_##NUM(V, P, SI, E, U, cross, l, r, a, b); \
+        DEMOSAIC_MEAN4_##NUM(V, P, SI, E, U, diagonal, DEMOSAIC_LOAD_##NUM(V, P, SI, above + i - 1), \
+                             DEMOSAIC_LOAD_##NUM(V, P, SI, above + i + 1), \
+                             DEMOSAIC_LOAD_##NUM(V, P, SI, below + i - 1), \
+                             DEMOSAIC_LOAD_##NUM(V, P, SI, below + i + 1)); \
+        V red, green, blue; \
+        if ((y & 1) == 0) { \
+            red = DEMOSAIC_SELECT(P, SI, even, c, h); \
+            green = DEMOSAIC_SELECT(P, SI, even, cross, c); \
+            blue = DEMOSAIC_SELECT(P, SI, even, diagonal, v); \
+        } else { \
+            red = DEMOSAIC_SELECT(P, SI, even, v, diagonal); \
+            green = DEMOSAIC_SELECT(P, SI, even, c, cross); \
+            blue = DEMOSAIC_SELECT(P, SI, even, h, c); \
+        } \
+        DEMOSAIC_STORE_##NUM(V, P, SI, R + i, red); \
+        DEMOSAIC_STORE_##NUM(V, P, SI, G + i, green); \
+        DEMOSAIC_STORE_##NUM(V, P, SI, B + i, blue); \
+    } \
+    return i;
+
+#define DEMOSAIC_LOAD_INT(V, P, SI, p) P##_loadu_##SI((const V*)(p))
+#define DEMOSAIC_STORE_INT(V, P, SI, p, x) P##_storeu_##SI((V*)(p), x)
+#define DEMOSAIC_FLIP_INT(P, SI, E, mask) P##_andnot_##SI(mask, P##_set1_##E(-1))
+#define DEMOSAIC_MEAN2_INT(P, U, a, b) P##_avg_##U(a, b)
+
+// floor((a + b) / 2) is the rounding average less the dropped low bit; the
+// two floored means are averaged with one added back when both bits were set
+#define DEMOSAIC_MEAN4_INT(V, P, SI, E, U, result, a, b, c, d) do { \
+        V a_ = (a), b_ = (b), c_ = (c), d_ = (d); \
+        V one_ = P##_set1_##E(1); \
+        V i_ = P##_and_##SI(P##_xor_##SI(a_, b_), one_); \
+        V j_ = P##_and_##SI(P##_xor_##SI(c_, d_), one_); \
+        V p_ = P##_sub_##E(P##_avg_##U(a_, b_), i_); \
+        V q_ = P##_sub_##E(P##_avg_##U(c_, d_), j_); \
+        result = P##_avg_##U(P##_add_##E(p_, P##_and_##SI(i_, j_)), q_); \
+    } while (0)
+
+// For floats SI is ps and E the integer vector (si128 or si256), for the
+// all-ones mask
+#define DEMOSAIC_LOAD_FLOAT(V, P, SI, p) P##_loadu_ps(p)
+#define DEMOSAIC_STORE_FLOAT(V, P, SI, p, x) P##_storeu_ps(p, x)
+#define DEMOSAIC_FLIP_FLOAT(P, SI, E, mask) P##_xor_ps(mask, P##_cast##E##_ps(P##_set1_epi32(-1)))
+#define DEMOSAIC_MEAN2_FLOAT(P, U, a, b) P##_mul_ps(P##_add_ps(a, b), P##_set1_ps(0.5f))
+#define DEMOSAIC_MEAN4_FLOAT(V, P, SI, E, U, result, a, b, c, d) \
+    result = P##_mul_ps(P##_add_ps(P##_add_ps(a, b), P##_add_ps(c, d)), P##_set1_ps(0.25f))
+
+// even lanes take on_even, odd lanes on_odd
+#define DEMOSAIC_SELECT(P, SI, mask, on_even, on_odd) \
+    P##_or_##SI(P##_and_##SI(mask, on_even), P##_andnot_##SI(mask, on_odd))
+
+FITS_TARGET_SSE2 static size_t demosaic_sites_u8_sse2(uint8_t* R, uint8_t* G, uint8_t* B, const uint8_t* above,
+                                                      const uint8_t* row, const uint8_t* below, size_t n,
+                                                      size_t x0, size_t y) {
+    DEMOSAIC_KERNEL(uint8_t, __m128i, _mm, si128, epi8, epu8, _mm_set1_epi16(0x00FF), INT)
+}
+
+FITS_TARGET_SSE2 static size_t demosaic_sites_u16_sse2(uint16_t* R, uint16_t* G, uint16_t* B, const uint16_t* above,
+                                                       const uint16_t* row, const uint16_t* below, size_t n,
+                                                       size_t x0, size_t y) {
+    DEMOSAIC_KERNEL(uint16_t, __m128i, _mm, si128, epi16, epu16, _mm_set1_epi32(0x0000FFFF), INT)
+}
+
+FITS_TARGET_SSE2 static size_t demosaic_sites_f32_sse2(float* R, float* G, float* B, const float* above,
+                                                    const float* row, const float* below, size_t n, size_t x0,
+                                                    size_t y) {
+    DEMOSAIC_KERNEL(float, __m128, _mm, ps, si128, ps, _mm_castsi128_ps(_mm_set1_epi64x(0xFFFFFFFF)), FLOAT)
+}
+
+FITS_TARGET_AVX2 static size_t demosaic_sites_u8_avx2(uint8_t* R, uint8_t* G, uint8_t* B, const uint8_t* above,
+                                                      const uint8_t* row, const uint8_t* below, size_t n,
+                                                      size_t x0, size_t y) {
+    DEMOSAIC_KERNEL(uint8_t, __m256i, _mm256, si256, epi8, epu8, _mm256_set1_epi16(0x00FF), INT)
+}
+
+FITS_TARGET_AVX2 static size_t demosaic_sites_u16_avx2(uint16_t* R, uint16_t* G, uint16_t* B, const uint16_t* above,
+                                                       const uint16_t* row, const uint16_t* below, size_t n,
+                                                       size_t x0, size_t y) {
+    DEMOSAIC_KERNEL(uint16_t, __m256i, _mm256, si256, epi16, epu16, _mm256_set1_epi32(0x0000FFFF), INT)
+}
+
+FITS_TARGET_AVX2 static size_t demosaic_sites_f32_avx2(float* R, float* G, float* B, const float* above,
+                                                    const float* row, const float* below, size_t n, size_t x0,
+                                                    size_t y) {
+    DEMOSAIC_KERNEL(float, __m256, _mm256, ps, si256, ps, _mm256_castsi256_ps(_mm256_set1_epi64x(0xFFFFFFFF)), FLOAT)
+}
+
+// Superpixel quads, step per vector: two loads of each row are split into
+// their even and odd columns, red and blue are the ones the pattern names
+// and green is the rounding average of the other two, exactly as in the
+// scalar loop. red_row and blue_row point at the first quad; returns how
+// many quads were done. NUM picks the operations as for DEMOSAIC_KERNEL.
+#define SUPERPIXEL_KERNEL(T, V, P, SI, U, SPLIT, NUM) \
+    size_t step = sizeof(V) / sizeof(T); \
+    size_t i = 0; \
+    for (; i + step <= n; i += step) { \
+        V red_even, red_odd, blue_even, blue_odd; \
+        SPLIT(V, red_even, red_odd, DEMOSAIC_LOAD_##NUM(V, P, SI, red_row + 2 * i), \
+              DEMOSAIC_LOAD_##NUM(V, P, SI, red_row + 2 * i + step)); \
+        SPLIT(V, blue_even, blue_odd, DEMOSAIC_LOAD_##NUM(V, P, SI, blue_row + 2 * i), \
+              DEMOSAIC_LOAD_##NUM(V, P, SI, blue_row + 2 * i + step)); \
+        V red = rx ? red_odd : red_even; \
+        V green = DEMOSAIC_MEAN2_##NUM(P, U, rx ? red_even : red_odd, rx ? blue_odd : blue_even); \
+        V blue = rx ? blue_even : blue_odd; \
+        DEMOSAIC_STORE_##NUM(V, P, SI, R + i, red); \
+        DEMOSAIC_STORE_##NUM(V, P, SI, G + i, green); \
+        DEMOSAIC_STORE_##NUM(V, P, SI, B + i, blue); \
+    } \
+    return i;
+
+// Even and odd columns of a and b, in order. The packs work per 128-bit
+// lane, which AVX2 puts back in order with one permute.
+#define SUPERPIXEL_SPLIT_U8(V, P, SI, FIX, even, odd, a, b) do { \
+        V a_ = (a), b_ = (b); \
+        V low_ = P##_set1_epi16(0x00FF); \
+        even = FIX(P##_packus_epi16(P##_and_##SI(a_, low_), P##_and_##SI(b_, low_))); \
+        odd = FIX(P##_packus_epi16(P##_srli_epi16(a_, 8), P##_srli_epi16(b_, 8))); \
+    } while (0)
+
+// sign-extending each 16-bit half keeps the signed pack exact
+#define SUPERPIXEL_SPLIT_U16(V, P, SI, FIX, even, odd, a, b) do { \
+        V a_ = (a), b_ = (b); \
+        even = FIX(P##_packs_epi32(P##_srai_epi32(P##_slli_epi32(a_, 16), 16), \
+                                   P##_srai_epi32(P##_slli_epi32(b_, 16), 16))); \
+        odd = FIX(P##_packs_epi32(P##_srai_epi32(a_, 16), P##_srai_epi32(b_, 16))); \
+    } while (0)
+
+// the float shuffle picks even and odd lanes of both inputs directly
+#define SUPERPIXEL_SPLIT_F32(V, P, FIX, even, odd, a, b) do { \
+        V a_ = (a), b_ = (b); \
+        even = FIX(P##_shuffle_ps(a_, b_, _MM_SHUFFLE(2, 0, 2, 0))); \
+        odd = FIX(P##_shuffle_ps(a_, b_, _MM_SHUFFLE(3, 1, 3, 1))); \
+    } while (0)
+
+#define SUPERPIXEL_IN_ORDER(x) (x)
+#define SUPERPIXEL_LANES_IN_ORDER(x) _mm256_permute4x64_epi64((x), 0xD8)
+#define SUPERPIXEL_FLOAT_LANES_IN_ORDER(x) _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(x), 0xD8))
+#define SUPERPIXEL_SPLIT_U8_SSE2(V, even, odd, a, b) \
+    SUPERPIXEL_SPLIT_U8(V, _mm, si128, SUPERPIXEL_IN_ORDER, even, odd, a, b)
+#define SUPERPIXEL_SPLIT_U16_SSE2(V, even, odd, a, b) \
+    SUPERPIXEL_SPLIT_U16(V, _mm, si128, SUPERPIXEL_IN_ORDER, even, odd, a, b)
+#define SUPERPIXEL_SPLIT_F32_SSE2(V, even, odd, a, b) \
+    SUPERPIXEL_SPLIT_F32(V, _mm, SUPERPIXEL_IN_ORDER, even, odd, a, b)
+#define SUPERPIXEL_SPLIT_U8_AVX2(V, even, odd, a, b) \
+    SUPERPIXEL_SPLIT_U8(V, _mm256, si256, SUPERPIXEL_LANES_IN_ORDER, even, odd, a, b)
+#define SUPERPIXEL_SPLIT_U16_AVX2(V, even, odd, a, b) \
+    SUPERPIXEL_SPLIT_U16(V, _mm256, si256, SUPERPIXEL_LANES_IN_ORDER, even, odd, a, b)
+#define SUPERPIXEL_SPLIT_F32_AVX2(V, even, odd, a, b) \
+    SUPERPIXEL_SPLIT_F32(V, _mm256, SUPERPIXEL_FLOAT_LANES_IN_ORDER, even, odd, a, b)
+
+FITS_TARGET_SSE2 static size_t superpixel_quads_u8_sse2(uint8_t* R, uint8_t* G, uint8_t* B, const uint8_t* red_row,
+                                                        const uint8_t* blue_row, size_t n, size_t rx) {
+    SUPERPIXEL_KERNEL(uint8_t, __m128i, _mm, si128, epu8, SUPERPIXEL_SPLIT_U8_SSE2, INT)
+}
+
+FITS_TARGET_SSE2 static size_t superpixel_quads_u16_sse2(uint16_t* R, uint16_t* G, uint16_t* B,
+                                                         const uint16_t* red_row, const uint16_t* blue_row, size_t n,
+                                                         size_t rx) {
+    SUPERPIXEL_KERNEL(uint16_t, __m128i, _mm, si128, epu16, SUPERPIXEL_SPLIT_U16_SSE2, INT)
+}
+
+FITS_TARGET_SSE2 static size_t superpixel_quads_f32_sse2(float* R, float* G, float* B, const float* red_row,
+                                                      const float* blue_row, size_t n, size_t rx) {
+    SUPERPIXEL_KERNEL(float, __m128, _mm, ps, ps, SUPERPIXEL_SPLIT_F32_SSE2, FLOAT)
+}
+
+FITS_TARGET_AVX2 static size_t superpixel_quads_u8_avx2(uint8_t* R, uint8_t* G, uint8_t* B, const uint8_t* red_row,
+                                                        const uint8_t* blue_row, size_t n, size_t rx) {
+    SUPERPIXEL_KERNEL(uint8_t, __m256i, _mm256, si256, epu8, SUPERPIXEL_SPLIT_U8_AVX2, INT)
+}
+
+FITS_TARGET_AVX2 static size_t superpixel_quads_u16_avx2(uint16_t* R, uint16_t* G, uint16_t* B,
+                                                         const uint16_t* red_row, const uint16_t* blue_row, size_t n,
+                                                         size_t rx) {
+    SUPERPIXEL_KERNEL(uint16_t, __m256i, _mm256, si256, epu16, SUPERPIXEL_SPLIT_U16_AVX2, INT)
+}
+
+FITS_TARGET_AVX2 static size_t superpixel_quads_f32_avx2(float* R, float* G, float* B, const float* red_row,
+                                                      const float* blue_row, size_t n, size_t rx) {
+    SUPERPIXEL_KERNEL(float, __m256, _mm256, ps, ps, SUPERPIXEL_SPLIT_F32_AVX2, FLOAT)
+}
+
+#endif // FITS_X86_SIMD
+
+// ---------------------------------------------------------------------------
+// Runtime dispatch
+// ---------------------------------------------------------------------------
+
+typedef size_t (*sites_u8_fn)(uint8_t*, uint8_t*, uint8_t*, const uint8_t*, const uint8_t*, const uint8_t*,
+                              size_t, size_t, size_t);
+typedef size_t (*sites_u16_fn)(uint16_t*, uint16_t*, uint16_t*, const uint16_t*, const uint16_t*, const uint16_t*,
+                               size_t, size_t, size_t);
+typedef size_t (*quads_u8_fn)(uint8_t*, uint8_t*, uint8_t*, const uint8_t*, const uint8_t*, size_t, size_t);
+typedef size_t (*quads_u16_fn)(uint16_t*, uint16_t*, uint16_t*, const uint16_t*, const uint16_t*, size_t, size_t);
+typedef size_t (*sites_f32_fn)(float*, float*, float*, const float*, const float*, const float*, size_t, size_t,
+                               size_t);
+typedef size_t (*quads_f32_fn)(float*, float*, float*, const float*, const float*, size_t, size_t);
+
+static struct {
+    int initialized;
+    const char* name;
+    sites_u8_fn sites_u8;
+    sites_u16_fn sites_u16;
+    quads_u8_fn quads_u8;
+    quads_u16_fn quads_u16;
+    sites_f32_fn sites_f32;
+    quads_f32_fn quads_f32;
+} demosaic_kernels;
+
+static void init_demosaic_kernels(void) {
+    // an empty interleave sets up its shuffles now, before any worker thread
+    // of a banded demosaic can race to do it
+    uint8_t none[3] = {0};
+    fits_interleave3(none, none, none, none, 0, 1);
+
+    demosaic_kernels.name = "scalar";
+#ifdef FITS_X86_SIMD
+    if (fits_cpu_has_avx2()) {
+        demosaic_kernels.name = "avx2";
+        demosaic_kernels.sites_u8 = demosaic_sites_u8_avx2;
+        demosaic_kernels.sites_u16 = demosaic_sites_u16_avx2;
+        demosaic_kernels.quads_u8 = superpixel_quads_u8_avx2;
+        demosaic_kernels.quads_u16 = superpixel_quads_u16_avx2;
+        demosaic_kernels.sites_f32 = demosaic_sites_f32_avx2;
+        demosaic_kernels.quads_f32 = superpixel_quads_f32_avx2;
+    } else if (fits_cpu_has_sse2()) {
+        demosaic_kernels.name = "sse2";
+        demosaic_kernels.sites_u8 = demosaic_sites_u8_sse2;
+        demosaic_kernels.sites_u16 = demosaic_sites_u16_sse2;
+        demosaic_kernels.quads_u8 = superpixel_quads_u8_sse2;
+        demosaic_kernels.quads_u16 = superpixel_quads_u16_sse2;
+        demosaic_kernels.sites_f32 = demosaic_sites_f32_sse2;
+        demosaic_kernels.quads_f32 = superpixel_quads_f32_sse2;
+    }
+#endif
+    demosaic_kernels.initialized = 1;
+}
+
+const char* fits_demosaic_kernel_name(void) {
+    if (!demosaic_kernels.initialized) init_demosaic_kernels();
+    return demosaic_kernels.name;
+}
+
+// ---------------------------------------------------------------------------
+// Rows and images
+// ---------------------------------------------------------------------------
+
+// The first and last column mirror their missing neighbour (column 1 and
+// width - 2), which keeps the CFA phase; columns 1 .. width - 2 have both
+// neighbours and go through the vector kernel in blocks, or straight to the
+// output where there is none.
+#define DEMOSAIC_ROW(T, sites, RX, RY) do { \
+        if (!demosaic_kernels.initialized) init_demosaic_kernels(); \
+        size_t last = width - 1; \
+        if (width < 3) { \
+            for (size_t x = 0; x < width; x++) { \
+                size_t m = width > 1 ? 1 - x : 0; \
+                DEMOSAIC_SITE(T, out[x * 3], out[x * 3 + 1], out[x * 3 + 2], x, m, m, RX, RY); \
+            } \
+            break; \
+        } \
+        DEMOSAIC_SITE(T, out[0], out[1], out[2], 0, 1, 1, RX, RY); \
+        if (!sites) { \
+            for (size_t x = 1; x < last; x++) { \
+                DEMOSAIC_SITE(T, out[x * 3], out[x * 3 + 1], out[x * 3 + 2], x, x - 1, x + 1, RX, RY); \
+            } \
+        } \
+        T R[DEMOSAIC_BLOCK], G[DEMOSAIC_BLOCK], B[DEMOSAIC_BLOCK]; \
+        for (size_t x0 = 1; sites && x0 < last; x0 += DEMOSAIC_BLOCK) { \
+            size_t n = last - x0 < DEMOSAIC_BLOCK ? last - x0 : DEMOSAIC_BLOCK; \
+            size_t i = sites(R, G, B, above + x0, row + x0, below + x0, n, x0 ^ (RX), y ^ (RY)); \
+            for (; i < n; i++) { \
+                size_t x = x0 + i; \
+                DEMOSAIC_SITE(T, R[i], G[i], B[i], x, x - 1, x + 1, RX, RY); \
+            } \
+            fits_interleave3(out + x0 * 3, R, G, B, n, sizeof(T)); \
+        } \
+        DEMOSAIC_SITE(T, out[last * 3], out[last * 3 + 1], out[last * 3 + 2], last, last - 1, last - 1, RX, RY); \
+    } while (0)
+
+// 16-bit mosaic to 8-bit RGB in one pass: each block of 16-bit colour
+// planes, edge columns included, goes through lut into 8-bit planes before
+// it is interleaved, so no 16-bit RGB row is ever stored.
+#define DEMOSAIC_ROW_LUT(sites, RX, RY) do { \
+        if (!demosaic_kernels.initialized) init_demosaic_kernels(); \
+        size_t last = width - 1; \
+        uint16_t R[DEMOSAIC_BLOCK], G[DEMOSAIC_BLOCK], B[DEMOSAIC_BLOCK]; \
+        uint8_t r8[DEMOSAIC_BLOCK], g8[DEMOSAIC_BLOCK], b8[DEMOSAIC_BLOCK]; \
+        for (size_t x0 = 0; x0 < width; x0 += DEMOSAIC_BLOCK) { \
+            size_t n = width - x0 < DEMOSAIC_BLOCK ? width - x0 : DEMOSAIC_BLOCK; \
+            size_t start = x0 > 0 ? x0 : 1; \
+            size_t end = x0 + n < last ? x0 + n : last; \
+            size_t done = sites && end > start \
+                              ? sites(R + (start - x0), G + (start - x0), B + (start - x0), above + start, \
+                                      row + start, below + start, end - start, start ^ (RX), y ^ (RY)) \
+                              : 0; \
+            for (size_t x = start + done; x < end; x++) { \
+                DEMOSAIC_SITE(uint16_t, R[x - x0], G[x - x0], B[x - x0], x, x - 1, x + 1, RX, RY); \
+            } \
+            for (size_t x = x0; x < start && x < x0 + n; x++) {  /* column 0 */ \
+                size_t m = width > 1 ? 1 : 0; \
+                DEMOSAIC_SITE(uint16_t, R[0], G[0], B[0], x, m, m, RX, RY); \
+            } \
+            for (size_t x = end > start ? end : start; x < x0 + n; x++) {  /* column width - 1 */ \
+                size_t m = width > 1 ? last - 1 : 0; \
+                DEMOSAIC_SITE(uint16_t, R[x - x0], G[x - x0], B[x - x0], x, m, m, RX, RY); \
+            } \
+            fits_lut_u16(r8, R, n, lut); \
+            fits_lut_u16(g8, G, n, lut); \
+            fits_lut_u16(b8, B, n, lut); \
+            fits_interleave3(out + x0 * 3, r8, g8, b8, n, 1); \
+        } \
+    } while (0)
+
+// One row function per CFA phase and sample type, with the phase a
+// compile-time constant; the pattern picks a function once, never a branch
+// per pixel
+#define DEMOSAIC_ROW_FUNCTIONS(name, RX, RY) \
+    static void demosaic_row_u8_##name(uint8_t* out, const uint8_t* above, const uint8_t* row, \
+                                       const uint8_t* below, size_t width, size_t y) { \
+        DEMOSAIC_ROW(uint8_t, demosaic_kernels.sites_u8, RX, RY); \
+    } \
+    static void demosaic_row_u16_##name(uint16_t* out, const uint16_t* above, const uint16_t* row, \
+                                        const uint16_t* below, size_t width, size_t y) { \
+        DEMOSAIC_ROW(uint16_t, demosaic_kernels.sites_u16, RX, RY); \
+    } \
+    static void demosaic_row_f32_##name(float* out, const float* above, const float* row, const float* below, \
+                                        size_t width, size_t y) { \
+        DEMOSAIC_ROW(float, demosaic_kernels.sites_f32, RX, RY); \
+    } \
+    static void demosaic_row_lut_##name(uint8_t* out, const uint16_t* above, const uint16_t* row, \
+                                        const uint16_t* below, size_t width, size_t y, const uint8_t* lut) { \
+        DEMOSAIC_ROW_LUT(demosaic_kernels.sites_u16, RX, RY); \
+    }
+
+DEMOSAIC_ROW_FUNCTIONS(rggb, 0, 0)
+DEMOSAIC_ROW_FUNCTIONS(grbg, 1, 0)
+DEMOSAIC_ROW_FUNCTIONS(gbrg, 0, 1)
+DEMOSAIC_ROW_FUNCTIONS(bggr, 1, 1)
+
+typedef void (*row_u8_fn)(uint8_t*, const uint8_t*, const uint8_t*, const uint8_t*, size_t, size_t);
+typedef void (*row_u16_fn)(uint16_t*, const uint16_t*, const uint16_t*, const uint16_t*, size_t, size_t);
+typedef void (*row_f32_fn)(float*, const float*, const float*, const float*, size_t, size_t);
+typedef void (*row_lut_fn)(uint8_t*, const uint16_t*, const uint16_t*, const uint16_t*, size_t, size_t,
+                           const uint8_t*);
+
+// indexed by FITSBayerPattern
+static const row_u8_fn rows_u8[4] = { demosaic_row_u8_rggb, demosaic_row_u8_grbg, demosaic_row_u8_gbrg,
+                                      demosaic_row_u8_bggr };
+static const row_u16_fn rows_u16[4] = { demosaic_row_u16_rggb, demosaic_row_u16_grbg, demosaic_row_u16_gbrg,
+                                        demosaic_row_u16_bggr };
+static const row_f32_fn rows_f32[4] = { demosaic_row_f32_rggb, demosaic_row_f32_grbg, demosaic_row_f32_gbrg,
+                                        demosaic_row_f32_bggr };
+static const row_lut_fn rows_lut[4] = { demosaic_row_lut_rggb, demosaic_row_lut_grbg, demosaic_row_lut_gbrg,
+                                        demosaic_row_lut_bggr };
+
+void fits_demosaic_row_u8(uint8_t* out, const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                          size_t width, size_t y, FITSBayerPattern pattern) {
+    rows_u8[pattern & 3](out, above, row, below, width, y);
+}
+
+void fits_demosaic_row_u16(uint16_t* out, const uint16_t* above, const uint16_t* row, const uint16_t* below,
+                           size_t width, size_t y, FITSBayerPattern pattern) {
+    rows_u16[pattern & 3](out, above, row, below, width, y);
+}
+
+void fits_demosaic_row_f32(float* out, const float* above, const float* row, const float* below, size_t width,
+                           size_t y, FITSBayerPattern pattern) {
+    rows_f32[pattern & 3](out, above, row, below, width, y);
+}
+
+// Every output row depends only on mosaic rows y - 1 .. y + 1, so the image
+// is cut into bands that each read a one-row halo from their neighbours and
+// write only their own rows; the result does not depend on the thread count.
+typedef struct {
+    void* out;
+    const void* mosaic;
+    size_t width, height;
+    row_u8_fn row_u8;    // the row function of the pattern, for 8-bit
+    row_u16_fn row_u16;  // or 16-bit samples
+    row_f32_fn row_f32;  // or float samples
+    row_lut_fn row_lut;  // or 16-bit samples to 8-bit RGB through lut
+    const uint8_t* lut;
+} DemosaicJob;
+
+// Rows above the top and below the bottom are mirrored like the columns
+#define DEMOSAIC_BAND_ROWS(T, row_fn) do { \
+        T* out = (T*)job->out; \
+        const T* mosaic = (const T*)job->mosaic; \
+        size_t width = job->width, height = job->height; \
+        for (size_t y = first; y < end; y++) { \
+            size_t above = y > 0 ? y - 1 : (height > 1 ? 1 : 0); \
+            size_t below = y + 1 < height ? y + 1 : (height > 1 ? y - 1 : y); \
+            row_fn(out + y * width * 3, mosaic + above * width, mosaic + y * width, mosaic + below * width, \
+                   width, y); \
+        } \
+    } while (0)
+
+static void demosaic_band(void* context, size_t band) {
+    const DemosaicJob* job = (const DemosaicJob*)context;
+    size_t first = band * DEMOSAIC_BAND;
+    size_t end = job->height - first < DEMOSAIC_BAND ? job->height : first + DEMOSAIC_BAND;
+    if (job->row_u8) {
+        DEMOSAIC_BAND_ROWS(uint8_t, job->row_u8);
+    } else if (job->row_f32) {
+        DEMOSAIC_BAND_ROWS(float, job->row_f32);
+    } else if (job->row_lut) {
+        uint8_t* out = (uint8_t*)job->out;
+        const uint16_t* mosaic = (const uint16_t*)job->mosaic;
+        size_t width = job->width, height = job->height;
+        for (size_t y = first; y < end; y++) {
+            size_t above = y > 0 ? y - 1 : (height > 1 ? 1 : 0);
+            size_t below = y + 1 < height ? y + 1 : (height > 1 ? y - 1 : y);
+            job->row_lut(out + y * width * 3, mosaic + above * width, mosaic + y * width, mosaic + below * width,
+                         width, y, job->lut);
+        }
+    } else {
+        DEMOSAIC_BAND_ROWS(uint16_t, job->row_u16);
+    }
+}
+
+static void demosaic_bands(DemosaicJob* job, int threads) {
+    if (!demosaic_kernels.initialized) init_demosaic_kernels();
+    fits_parallel_for((job->height + DEMOSAIC_BAND - 1) / DEMOSAIC_BAND, threads, demosaic_band, job);
+}
+
+void fits_demosaic_u8(uint8_t* out, const uint8_t* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                      int threads) {
+    DemosaicJob job = { out, mosaic, width, height, rows_u8[pattern & 3], NULL, NULL, NULL, NULL };
+    demosaic_bands(&job, threads);
+}
+
+void fits_demosaic_u16(uint16_t* out, const uint16_t* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                       int threads) {
+    DemosaicJob job = { out, mosaic, width, height, NULL, rows_u16[pattern & 3], NULL, NULL, NULL };
+    demosaic_bands(&job, threads);
+}
+
+void fits_demosaic_f32(float* out, const float* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                       int threads) {
+    DemosaicJob job = { out, mosaic, width, height, NULL, NULL, rows_f32[pattern & 3], NULL, NULL };
+    demosaic_bands(&job, threads);
+}
+
+void fits_demosaic_u16_lut(uint8_t* out, const uint16_t* mosaic, size_t width, size_t height,
+                           FITSBayerPattern pattern, const uint8_t* lut, int threads) {
+    DemosaicJob job = { out, mosaic, width, height, NULL, NULL, NULL, rows_lut[pattern & 3], lut };
+    demosaic_bands(&job, threads);
+}
+
+// ---------------------------------------------------------------------------
+// Superpixel
+// ---------------------------------------------------------------------------
+
+// Each quad becomes one pixel: red and blue as they are, green the rounded
+// mean of the two greens. The vector kernel splits a block of quads into
+// planes, the scalar loop finishes it, and the planes are interleaved like
+// the bilinear ones.
+#define SUPERPIXEL_ROW(T, quads) do { \
+        if (!demosaic_kernels.initialized) init_demosaic_kernels(); \
+        const T* red_row = pattern & 2 ? bottom : top; \
+        const T* blue_row = pattern & 2 ? top : bottom; \
+        size_t rx = pattern & 1; \
+        const T* red = red_row + rx; \
+        const T* green_red = red_row + (rx ^ 1); \
+        const T* green_blue = blue_row + rx; \
+        const T* blue = blue_row + (rx ^ 1); \
+        size_t count = width / 2; \
+        T R[DEMOSAIC_BLOCK], G[DEMOSAIC_BLOCK], B[DEMOSAIC_BLOCK]; \
+        for (size_t x0 = 0; x0 < count; x0 += DEMOSAIC_BLOCK) { \
+            size_t n = count - x0 < DEMOSAIC_BLOCK ? count - x0 : DEMOSAIC_BLOCK; \
+            size_t i = quads ? quads(R, G, B, red_row + 2 * x0, blue_row + 2 * x0, n, rx) : 0; \
+            for (; i < n; i++) { \
+                size_t x = 2 * (x0 + i); \
+                R[i] = red[x]; \
+                G[i] = (T)DEMOSAIC_HALF_##T((DEMOSAIC_SUM_##T)green_red[x] + green_blue[x]); \
+                B[i] = blue[x]; \
+            } \
+            fits_interleave3(out + x0 * 3, R, G, B, n, sizeof(T)); \
+        } \
+    } while (0)
+
+void fits_superpixel_row_u8(uint8_t* out, const uint8_t* top, const uint8_t* bottom, size_t width,
+                            FITSBayerPattern pattern) {
+    SUPERPIXEL_ROW(uint8_t, demosaic_kernels.quads_u8);
+}
+
+void fits_superpixel_row_u16(uint16_t* out, const uint16_t* top, const uint16_t* bottom, size_t width,
+                             FITSBayerPattern pattern) {
+    SUPERPIXEL_ROW(uint16_t, demosaic_kernels.quads_u16);
+}
+
+void fits_superpixel_row_f32(float* out, const float* top, const float* bottom, size_t width,
+                             FITSBayerPattern pattern) {
+    SUPERPIXEL_ROW(float, demosaic_kernels.quads_f32);
+}
+
+// Output rows are independent quads, so bands need no halo
+typedef struct {
+    void* out;
+    const void* mosaic;
+    size_t width, height;
+    size_t sample_size;  // 4 for float
+    FITSBayerPattern pattern;
+} SuperpixelJob;
+
+static void superpixel_band(void* context, size_t band) {
+    const SuperpixelJob* job = (const SuperpixelJob*)context;
+    size_t rows = job->height / 2;
+    size_t first = band * DEMOSAIC_BAND;
+    size_t end = rows - first < DEMOSAIC_BAND ? rows : first + DEMOSAIC_BAND;
+    size_t out_row = job->width / 2 * 3 * job->sample_size;
+    size_t in_row = job->width * job->sample_size;
+    for (size_t y = first; y < end; y++) {
+        uint8_t* out = (uint8_t*)job->out + y * out_row;
+        const uint8_t* top = (const uint8_t*)job->mosaic + 2 * y * in_row;
+        if (job->sample_size == 1) {
+            fits_superpixel_row_u8(out, top, top + in_row, job->width, job->pattern);
+        } else if (job->sample_size == 4) {
+            fits_superpixel_row_f32((float*)out, (const float*)top, (const float*)(top + in_row), job->width,
+                                    job->pattern);
+        } else {
+            fits_superpixel_row_u16((uint16_t*)out, (const uint16_t*)top, (const uint16_t*)(top + in_row),
+                                    job->width, job->pattern);
+        }
+    }
+}
+
+static void superpixel_bands(SuperpixelJob* job, int threads) {
+    if (!demosaic_kernels.initialized) init_demosaic_kernels();
+    fits_parallel_for((job->height / 2 + DEMOSAIC_BAND - 1) / DEMOSAIC_BAND, threads, superpixel_band, job);
+}
+
+void fits_superpixel_u8(uint8_t* out, const uint8_t* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                        int threads) {
+    SuperpixelJob job = { out, mosaic, width, height, 1, pattern };
+    superpixel_bands(&job, threads);
+}
+
+void fits_superpixel_u16(uint16_t* out, const uint16_t* mosaic, size_t width, size_t height,
+                         FITSBayerPattern pattern, int threads) {
+    SuperpixelJob job = { out, mosaic, width, height, 2, pattern };
+    superpixel_bands(&job, threads);
+}
+
+void fits_superpixel_f32(float* out, const float* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                         int threads) {
+    SuperpixelJob job = { out, mosaic, width, height, sizeof(float), pattern };
+    superpixel_bands(&job, threads);
+}
+
+// ---------------------------------------------------------------------------
+// RCD
+// ---------------------------------------------------------------------------
+
+// Ratio corrected demosaicing (Luis Sanz Rodríguez, as used by RawTherapee).
+// Green is interpolated at red and blue sites from colour ratios, weighted
+// towards the direction with less high-pass energy; red and blue then come
+// from colour differences, along the diagonal with less energy at the
+// opposite colour and along the vertical/horizontal direction at green
+// sites. Samples are floats in 0 .. 1 while a tile is worked on.
+//
+// Each step reads a few rows and columns around the sites the previous one
+// filled, nine in all, so the image is cut into RCD_TILE square tiles that
+// overlap by RCD_BORDER on every side and only their core is written. The
+// eight float planes of a tile take 512 KB, which stays in L2 on cores with
+// 1 MB or more of it but not on older ones with 256 KB; smaller tiles would
+// fit there, at the price of more overlap (a 64 tile recomputes over twice
+// its core, a 128 tile 1.4 times). Pixels outside the image are read
+// mirrored like the bilinear demosaic, which keeps the CFA phase, so the
+// edges are interpolated the same way as the rest. Tiles start on even
+// coordinates, so a tile shares the image's pattern.
+#define RCD_TILE 128
+#define RCD_BORDER 10
+#define RCD_CORE (RCD_TILE - 2 * RCD_BORDER)
+
+typedef struct {
+    float cfa[RCD_TILE * RCD_TILE];
+    float rgb[3][RCD_TILE * RCD_TILE];
+    float vh_dir[RCD_TILE * RCD_TILE];  // vertical share of the directional energy, 0 .. 1
+    float buffer[3][RCD_TILE * RCD_TILE];  // high-pass energies, then the low-pass and diagonal shares
+    float slack[RCD_TILE];                 // for vector loads past the last row
+} RCDTile;
+
+static size_t rcd_mirror(ptrdiff_t i, size_t n) {
+    if (i < 0) return (size_t)-i;
+    if ((size_t)i >= n) return 2 * (n - 1) - (size_t)i;
+    return (size_t)i;
+}
+
+// The column of the first red or blue site in tile row r, and its colour
+#define RCD_FIRST_SITE(r) (rx ^ (((r) ^ ry) & 1))
+#define RCD_SITE_COLOUR(r) ((((r) ^ ry) & 1) ? 2 : 0)
+
+// Interpolate the rows x cols tile in t, whose cfa and rgb planes hold the
+// mosaic, so that the sites RCD_BORDER in from every side are done
+static void rcd_tile(RCDTile* t, size_t rows, size_t cols, FITSBayerPattern pattern) {
+    const float eps = 1e-5f, epssq = 1e-10f;
+    const size_t w1 = RCD_TILE, w2 = 2 * RCD_TILE, w3 = 3 * RCD_TILE, w4 = 4 * RCD_TILE;
+    size_t rx = pattern & 1, ry = (pattern >> 1) & 1;
+    const float* cfa = t->cfa;
+    float* R = t->rgb[0];
+    float* G = t->rgb[1];
+    float* B = t->rgb[2];
+    float* vh_dir = t->vh_dir;
+    float* v_hpf = t->buffer[0];
+    float* h_hpf = t->buffer[1];
+    float* lpf = t->buffer[2];
+
+    // Step 1: squared vertical and horizontal high-pass of the colour
+    // differences, then their share over three sites
+    for (size_t r = 3; r < rows - 3; r++) {
+        for (size_t c = 3, i = r * w1 + c; c < cols - 3; c++, i++) {
+            float v = (cfa[i - w3] - cfa[i - w1] - cfa[i + w1] + cfa[i + w3]) - 3.0f * (cfa[i - w2] + cfa[i + w2]) +
+                      6.0f * cfa[i];
+            float h = (cfa[i - 3] - cfa[i - 1] - cfa[i + 1] + cfa[i + 3]) - 3.0f * (cfa[i - 2] + cfa[i + 2]) +
+                      6.0f * cfa[i];
+            v_hpf[i] = v * v;
+            h_hpf[i] = h * h;
+        }
+    }
+    for (size_t r = 4; r < rows - 4; r++) {
+        for (size_t c = 4, i = r * w1 + c; c < cols - 4; c++, i++) {
+            float v_stat = v_hpf[i - w1] + v_hpf[i] + v_hpf[i + w1];
+            float h_stat = h_hpf[i - 1] + h_hpf[i] + h_hpf[i + 1];
+            v_stat = v_stat > epssq ? v_stat : epssq;
+            h_stat = h_stat > epssq ? h_stat : epssq;
+            vh_dir[i] = v_stat / (v_stat + h_stat);
+        }
+    }
+
+    // Step 2: low-pass of the red and blue sites, which carries the local
+    // level of all three colours
+    for (size_t r = 2; r < rows - 2; r++) {
+        for (size_t c = 2 + RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 2; c += 2, i += 2) {
+            lpf[i] = cfa[i] + 0.5f * (cfa[i - w1] + cfa[i + w1] + cfa[i - 1] + cfa[i + 1]) +
+                     0.25f * (cfa[i - w1 - 1] + cfa[i - w1 + 1] + cfa[i + w1 - 1] + cfa[i + w1 + 1]);
+        }
+    }
+
+    // Step 3: green at red and blue sites
+    for (size_t r = 4; r < rows - 4; r++) {
+        for (size_t c = 4 + RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 4; c += 2, i += 2) {
+            // cardinal gradients
+            float n_grad = eps + fabsf(cfa[i - w1] - cfa[i + w1]) + fabsf(cfa[i] - cfa[i - w2]) +
+                           fabsf(cfa[i - w1] - cfa[i - w3]) + fabsf(cfa[i - w2] - cfa[i - w4]);
+            float s_grad = eps + fabsf(cfa[i - w1] - cfa[i + w1]) + fabsf(cfa[i] - cfa[i + w2]) +
+                           fabsf(cfa[i + w1] - cfa[i + w3]) + fabsf(cfa[i + w2] - cfa[i + w4]);
+            float w_grad = eps + fabsf(cfa[i - 1] - cfa[i + 1]) + fabsf(cfa[i] - cfa[i - 2]) +
+                           fabsf(cfa[i - 1] - cfa[i - 3]) + fabsf(cfa[i - 2] - cfa[i - 4]);
+            float e_grad = eps + fabsf(cfa[i - 1] - cfa[i + 1]) + fabsf(cfa[i] - cfa[i + 2]) +
+                           fabsf(cfa[i + 1] - cfa[i + 3]) + fabsf(cfa[i + 2] - cfa[i + 4]);
+
+            // cardinal estimates, the neighbour green scaled by the level ratio
+            float twice = lpf[i] + lpf[i];
+            float n_est = cfa[i - w1] * twice / (eps + lpf[i] + lpf[i - w2]);
+            float s_est = cfa[i + w1] * twice / (eps + lpf[i] + lpf[i + w2]);
+            float w_est = cfa[i - 1] * twice / (eps + lpf[i] + lpf[i - 2]);
+            float e_est = cfa[i + 1] * twice / (eps + lpf[i] + lpf[i + 2]);
+            float v_est = (s_grad * n_est + n_grad * s_est) / (n_grad + s_grad);
+            float h_est = (w_grad * e_est + e_grad * w_est) / (e_grad + w_grad);
+
+            // the direction of the site or, when that is more decided, of its
+            // diagonal neighbours
+            float central = vh_dir[i];
+            float around = 0.25f * (vh_dir[i - w1 - 1] + vh_dir[i - w1 + 1] + vh_dir[i + w1 - 1] + vh_dir[i + w1 + 1]);
+            float disc = fabsf(0.5f - central) < fabsf(0.5f - around) ? around : central;
+            float g = disc * h_est + (1.0f - disc) * v_est;
+            G[i] = g < 0.0f ? 0.0f : g > 1.0f ? 1.0f : g;
+        }
+    }
+
+    // Step 4: red at blue sites and blue at red ones, from the diagonal with
+    // less high-pass energy. The buffers are free again: P and Q energies
+    // go where the vertical and horizontal ones were, the share where the
+    // low-pass was.
+    float* p_hpf = v_hpf;
+    float* q_hpf = h_hpf;
+    float* pq_dir = lpf;
+    for (size_t r = 3; r < rows - 3; r++) {
+        for (size_t c = 4 - RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 3; c += 2, i += 2) {
+            float p = (cfa[i - w3 - 3] - cfa[i - w1 - 1] - cfa[i + w1 + 1] + cfa[i + w3 + 3]) -
+                      3.0f * (cfa[i - w2 - 2] + cfa[i + w2 + 2]) + 6.0f * cfa[i];
+            float q = (cfa[i - w3 + 3] - cfa[i - w1 + 1] - cfa[i + w1 - 1] + cfa[i + w3 - 3]) -
+                      3.0f * (cfa[i - w2 + 2] + cfa[i + w2 - 2]) + 6.0f * cfa[i];
+            p_hpf[i] = p * p;
+            q_hpf[i] = q * q;
+        }
+    }
+    for (size_t r = 4; r < rows - 4; r++) {
+        for (size_t c = 4 + RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 4; c += 2, i += 2) {
+            float p_stat = p_hpf[i - w1 - 1] + p_hpf[i] + p_hpf[i + w1 + 1];
+            float q_stat = q_hpf[i - w1 + 1] + q_hpf[i] + q_hpf[i + w1 - 1];
+            p_stat = p_stat > epssq ? p_stat : epssq;
+            q_stat = q_stat > epssq ? q_stat : epssq;
+            pq_dir[i] = p_stat / (p_stat + q_stat);
+        }
+    }
+    for (size_t r = 6; r < rows - 6; r++) {
+        float* out = RCD_SITE_COLOUR(r) == 0 ? B : R;  // the colour missing at this row's sites
+        for (size_t c = 6 + RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 6; c += 2, i += 2) {
+            float central = pq_dir[i];
+            float around = 0.25f * (pq_dir[i - w1 - 1] + pq_dir[i - w1 + 1] + pq_dir[i + w1 - 1] + pq_dir[i + w1 + 1]);
+            float disc = fabsf(0.5f - central) < fabsf(0.5f - around) ? around : central;
+
+            // diagonal gradients; the diagonal neighbours are raw samples of
+            // the missing colour
+            float nw_grad = eps + fabsf(cfa[i - w1 - 1] - cfa[i + w1 + 1]) + fabsf(cfa[i - w1 - 1] - cfa[i - w3 - 3]) +
+                            fabsf(G[i] - G[i - w2 - 2]);
+            float ne_grad = eps + fabsf(cfa[i - w1 + 1] - cfa[i + w1 - 1]) + fabsf(cfa[i - w1 + 1] - cfa[i - w3 + 3]) +
+                            fabsf(G[i] - G[i - w2 + 2]);
+            float sw_grad = eps + fabsf(cfa[i - w1 + 1] - cfa[i + w1 - 1]) + fabsf(cfa[i + w1 - 1] - cfa[i + w3 - 3]) +
+                            fabsf(G[i] - G[i + w2 - 2]);
+            float se_grad = eps + fabsf(cfa[i - w1 - 1] - cfa[i + w1 + 1]) + fabsf(cfa[i + w1 + 1] - cfa[i + w3 + 3]) +
+                            fabsf(G[i] - G[i + w2 + 2]);
+
+            // diagonal colour differences
+            float nw_est = cfa[i - w1 - 1] - G[i - w1 - 1];
+            float ne_est = cfa[i - w1 + 1] - G[i - w1 + 1];
+            float sw_est = cfa[i + w1 - 1] - G[i + w1 - 1];
+            float se_est = cfa[i + w1 + 1] - G[i + w1 + 1];
+            float p_est = (nw_grad * se_est + se_grad * nw_est) / (nw_grad + se_grad);
+            float q_est = (ne_grad * sw_est + sw_grad * ne_est) / (ne_grad + sw_grad);
+            out[i] = G[i] + (1.0f - disc) * p_est + disc * q_est;
+        }
+    }
+
+    // Step 5: red and blue at green sites, along the direction step 3 used
+    for (size_t r = 9; r < rows - 9; r++) {
+        for (size_t c = 9 + RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 9; c += 2, i += 2) {
+            float central = vh_dir[i];
+            float around = 0.25f * (vh_dir[i - w1 - 1] + vh_dir[i - w1 + 1] + vh_dir[i + w1 - 1] + vh_dir[i + w1 + 1]);
+            float disc = fabsf(0.5f - central) < fabsf(0.5f - around) ? around : central;
+
+            float g = G[i];
+            float n_diff = eps + fabsf(g - G[i - w2]);
+            float s_diff = eps + fabsf(g - G[i + w2]);
+            float w_diff = eps + fabsf(g - G[i - 2]);
+            float e_diff = eps + fabsf(g - G[i + 2]);
+            for (int k = 0; k < 2; k++) {
+                float* ch = k ? B : R;
+                float sn = fabsf(ch[i - w1] - ch[i + w1]);
+                float ew = fabsf(ch[i - 1] - ch[i + 1]);
+                float n_grad = n_diff + sn + fabsf(ch[i - w1] - ch[i - w3]);
+                float s_grad = s_diff + sn + fabsf(ch[i + w1] - ch[i + w3]);
+                float w_grad = w_diff + ew + fabsf(ch[i - 1] - ch[i - 3]);
+                float e_grad = e_diff + ew + fabsf(ch[i + 1] - ch[i + 3]);
+
+                // cardinal colour differences
+                float n_est = ch[i - w1] - G[i - w1];
+                float s_est = ch[i + w1] - G[i + w1];
+                float w_est = ch[i - 1] - G[i - 1];
+                float e_est = ch[i + 1] - G[i + 1];
+                float v_est = (n_grad * s_est + s_grad * n_est) / (n_grad + s_grad);
+                float h_est = (e_grad * w_est + w_grad * e_est) / (e_grad + w_grad);
+                ch[i] = g + (1.0f - disc) * v_est + disc * h_est;
+            }
+        }
+    }
+}
+
+#ifdef FITS_X86_SIMD
+// The same steps a vector of columns at a time. Red/blue and green sites
+// alternate along a row, so the site steps compute every lane, starting at
+// a site, and keep the even lanes; the scalar steps' operations are done in
+// the same order, so the results are bit-identical. Vectors may run up to a
+// vector past the end of a row: those columns are never read back, and the
+// tile's slack keeps the last rows in bounds.
+#define RCD_TILE_KERNEL(V, P, LT, EVEN_LANES) \
+    const size_t w1 = RCD_TILE, w2 = 2 * RCD_TILE, w3 = 3 * RCD_TILE, w4 = 4 * RCD_TILE; \
+    const size_t step = sizeof(V) / sizeof(float); \
+    size_t rx = pattern & 1, ry = (pattern >> 1) & 1; \
+    const float* cfa = t->cfa; \
+    float* R = t->rgb[0]; \
+    float* G = t->rgb[1]; \
+    float* B = t->rgb[2]; \
+    float* vh_dir = t->vh_dir; \
+    float* v_hpf = t->buffer[0]; \
+    float* h_hpf = t->buffer[1]; \
+    float* lpf = t->buffer[2]; \
+    const V eps = P##_set1_ps(1e-5f), epssq = P##_set1_ps(1e-10f); \
+    const V zero = P##_setzero_ps(), one = P##_set1_ps(1.0f); \
+    const V half = P##_set1_ps(0.5f), quarter = P##_set1_ps(0.25f); \
+    const V three = P##_set1_ps(3.0f), six = P##_set1_ps(6.0f); \
+    const V even = EVEN_LANES; \
+    for (size_t r = 3; r < rows - 3; r++) { \
+        for (size_t c = 3, i = r * w1 + c; c < cols - 3; c += step, i += step) { \
+            V centre = P##_mul_ps(six, RCD_AT(P, cfa, i)); \
+            V v = RCD_HPF(P, RCD_AT(P, cfa, i - w3), RCD_AT(P, cfa, i - w1), RCD_AT(P, cfa, i + w1), \
+                          RCD_AT(P, cfa, i + w3), RCD_AT(P, cfa, i - w2), RCD_AT(P, cfa, i + w2), centre); \
+            V h = RCD_HPF(P, RCD_AT(P, cfa, i - 3), RCD_AT(P, cfa, i - 1), RCD_AT(P, cfa, i + 1), \
+                          RCD_AT(P, cfa, i + 3), RCD_AT(P, cfa, i - 2), RCD_AT(P, cfa, i + 2), centre); \
+            P##_storeu_ps(v_hpf + i, P##_mul_ps(v, v)); \
+            P##_storeu_ps(h_hpf + i, P##_mul_ps(h, h)); \
+        } \
+    } \
+    for (size_t r = 4; r < rows - 4; r++) { \
+        for (size_t c = 4, i = r * w1 + c; c < cols - 4; c += step, i += step) { \
+            V v_stat = P##_add_ps(P##_add_ps(RCD_AT(P, v_hpf, i - w1), RCD_AT(P, v_hpf, i)), \
+                                  RCD_AT(P, v_hpf, i + w1)); \
+            V h_stat = P##_add_ps(P##_add_ps(RCD_AT(P, h_hpf, i - 1), RCD_AT(P, h_hpf, i)), \
+                                  RCD_AT(P, h_hpf, i + 1)); \
+            v_stat = P##_max_ps(v_stat, epssq); \
+            h_stat = P##_max_ps(h_stat, epssq); \
+            P##_storeu_ps(vh_dir + i, P##_div_ps(v_stat, P##_add_ps(v_stat, h_stat))); \
+        } \
+    } \
+    for (size_t r = 2; r < rows - 2; r++) { \
+        for (size_t c = 2 + RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 2; c += step, i += step) { \
+            V cross = RCD_SUM4(P, RCD_AT(P, cfa, i - w1), RCD_AT(P, cfa, i + w1), RCD_AT(P, cfa, i - 1), \
+                               RCD_AT(P, cfa, i + 1)); \
+            V diagonal = RCD_SUM4(P, RCD_AT(P, cfa, i - w1 - 1), RCD_AT(P, cfa, i - w1 + 1), \
+                                  RCD_AT(P, cfa, i + w1 - 1), RCD_AT(P, cfa, i + w1 + 1)); \
+            P##_storeu_ps(lpf + i, P##_add_ps(P##_add_ps(RCD_AT(P, cfa, i), P##_mul_ps(half, cross)), \
+                                              P##_mul_ps(quarter, diagonal))); \
+        } \
+    } \
+    for (size_t r = 4; r < rows - 4; r++) { \
+        for (size_t c = 4 + RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 4; c += step, i += step) { \
+            V centre = RCD_AT(P, cfa, i); \
+            V north = RCD_AT(P, cfa, i - w1), south = RCD_AT(P, cfa, i + w1); \
+            V west = RCD_AT(P, cfa, i - 1), east = RCD_AT(P, cfa, i + 1); \
+            V vertical = RCD_ABS(P, P##_sub_ps(north, south)); \
+            V horizontal = RCD_ABS(P, P##_sub_ps(west, east)); \
+            V n_grad = RCD_GRAD(P, vertical, RCD_ABS(P, P##_sub_ps(centre, RCD_AT(P, cfa, i - w2))), \
+                                RCD_ABS(P, P##_sub_ps(north, RCD_AT(P, cfa, i - w3))), \
+                                RCD_ABS(P, P##_sub_ps(RCD_AT(P, cfa, i - w2), RCD_AT(P, cfa, i - w4)))); \
+            V s_grad = RCD_GRAD(P, vertical, RCD_ABS(P, P##_sub_ps(centre, RCD_AT(P, cfa, i + w2))), \
+                                RCD_ABS(P, P##_sub_ps(south, RCD_AT(P, cfa, i + w3))), \
+                                RCD_ABS(P, P##_sub_ps(RCD_AT(P, cfa, i + w2), RCD_AT(P, cfa, i + w4)))); \
+            V w_grad = RCD_GRAD(P, horizontal, RCD_ABS(P, P##_sub_ps(centre, RCD_AT(P, cfa, i - 2))), \
+                                RCD_ABS(P, P##_sub_ps(west, RCD_AT(P, cfa, i - 3))), \
+                                RCD_ABS(P, P##_sub_ps(RCD_AT(P, cfa, i - 2), RCD_AT(P, cfa, i - 4)))); \
+            V e_grad = RCD_GRAD(P, horizontal, RCD_ABS(P, P##_sub_ps(centre, RCD_AT(P, cfa, i + 2))), \
+                                RCD_ABS(P, P##_sub_ps(east, RCD_AT(P, cfa, i + 3))), \
+                                RCD_ABS(P, P##_sub_ps(RCD_AT(P, cfa, i + 2), RCD_AT(P, cfa, i + 4)))); \
+            V level = RCD_AT(P, lpf, i); \
+            V twice = P##_add_ps(level, level); \
+            V ratio_base = P##_add_ps(eps, level); \
+            V n_est = P##_div_ps(P##_mul_ps(north, twice), P##_add_ps(ratio_base, RCD_AT(P, lpf, i - w2))); \
+            V s_est = P##_div_ps(P##_mul_ps(south, twice), P##_add_ps(ratio_base, RCD_AT(P, lpf, i + w2))); \
+            V w_est = P##_div_ps(P##_mul_ps(west, twice), P##_add_ps(ratio_base, RCD_AT(P, lpf, i - 2))); \
+            V e_est = P##_div_ps(P##_mul_ps(east, twice), P##_add_ps(ratio_base, RCD_AT(P, lpf, i + 2))); \
+            V v_est = RCD_BLEND2(P, s_grad, n_est, n_grad, s_est); \
+            V h_est = RCD_BLEND2(P, w_grad, e_est, e_grad, w_est); \
+            V disc; \
+            RCD_DISC(V, P, LT, disc, vh_dir, i); \
+            V g = P##_add_ps(P##_mul_ps(disc, h_est), P##_mul_ps(P##_sub_ps(one, disc), v_est)); \
+            g = P##_min_ps(P##_max_ps(g, zero), one); \
+            P##_storeu_ps(G + i, RCD_SELECT(P, even, g, RCD_AT(P, G, i))); \
+        } \
+    } \
+    float* p_hpf = v_hpf; \
+    float* q_hpf = h_hpf; \
+    float* pq_dir = lpf; \
+    for (size_t r = 3; r < rows - 3; r++) { \
+        for (size_t c = 4 - RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 3; c += step, i += step) { \
+            V centre = P##_mul_ps(six, RCD_AT(P, cfa, i)); \
+            V p = RCD_HPF(P, RCD_AT(P, cfa, i - w3 - 3), RCD_AT(P, cfa, i - w1 - 1), RCD_AT(P, cfa, i + w1 + 1), \
+                          RCD_AT(P, cfa, i + w3 + 3), RCD_AT(P, cfa, i - w2 - 2), RCD_AT(P, cfa, i + w2 + 2), \
+                          centre); \
+            V q = RCD_HPF(P, RCD_AT(P, cfa, i - w3 + 3), RCD_AT(P, cfa, i - w1 + 1), RCD_AT(P, cfa, i + w1 - 1), \
+                          RCD_AT(P, cfa, i + w3 - 3), RCD_AT(P, cfa, i - w2 + 2), RCD_AT(P, cfa, i + w2 - 2), \
+                          centre); \
+            P##_storeu_ps(p_hpf + i, P##_mul_ps(p, p)); \
+            P##_storeu_ps(q_hpf + i, P##_mul_ps(q, q)); \
+        } \
+    } \
+    for (size_t r = 4; r < rows - 4; r++) { \
+        for (size_t c = 4 + RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 4; c += step, i += step) { \
+            V p_stat = P##_add_ps(P##_add_ps(RCD_AT(P, p_hpf, i - w1 - 1), RCD_AT(P, p_hpf, i)), \
+                                  RCD_AT(P, p_hpf, i + w1 + 1)); \
+            V q_stat = P##_add_ps(P##_add_ps(RCD_AT(P, q_hpf, i - w1 + 1), RCD_AT(P, q_hpf, i)), \
+                                  RCD_AT(P, q_hpf, i + w1 - 1)); \
+            p_stat = P##_max_ps(p_stat, epssq); \
+            q_stat = P##_max_ps(q_stat, epssq); \
+            P##_storeu_ps(pq_dir + i, P##_div_ps(p_stat, P##_add_ps(p_stat, q_stat))); \
+        } \
+    } \
+    for (size_t r = 6; r < rows - 6; r++) { \
+        float* out = RCD_SITE_COLOUR(r) == 0 ? B : R; \
+        for (size_t c = 6 + RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 6; c += step, i += step) { \
+            V disc; \
+            RCD_DISC(V, P, LT, disc, pq_dir, i); \
+            V green = RCD_AT(P, G, i); \
+            V nw = RCD_AT(P, cfa, i - w1 - 1), ne = RCD_AT(P, cfa, i - w1 + 1); \
+            V sw = RCD_AT(P, cfa, i + w1 - 1), se = RCD_AT(P, cfa, i + w1 + 1); \
+            V falling = RCD_ABS(P, P##_sub_ps(nw, se)); \
+            V rising = RCD_ABS(P, P##_sub_ps(ne, sw)); \
+            V nw_grad = RCD_GRAD3(P, falling, RCD_ABS(P, P##_sub_ps(nw, RCD_AT(P, cfa, i - w3 - 3))), \
+                                  RCD_ABS(P, P##_sub_ps(green, RCD_AT(P, G, i - w2 - 2)))); \
+            V ne_grad = RCD_GRAD3(P, rising, RCD_ABS(P, P##_sub_ps(ne, RCD_AT(P, cfa, i - w3 + 3))), \
+                                  RCD_ABS(P, P##_sub_ps(green, RCD_AT(P, G, i - w2 + 2)))); \
+            V sw_grad = RCD_GRAD3(P, rising, RCD_ABS(P, P##_sub_ps(sw, RCD_AT(P, cfa, i + w3 - 3))), \
+                                  RCD_ABS(P, P##_sub_ps(green, RCD_AT(P, G, i + w2 - 2)))); \
+            V se_grad = RCD_GRAD3(P, falling, RCD_ABS(P, P##_sub_ps(se, RCD_AT(P, cfa, i + w3 + 3))), \
+                                  RCD_ABS(P, P##_sub_ps(green, RCD_AT(P, G, i + w2 + 2)))); \
+            V nw_est = P##_sub_ps(nw, RCD_AT(P, G, i - w1 - 1)); \
+            V ne_est = P##_sub_ps(ne, RCD_AT(P, G, i - w1 + 1)); \
+            V sw_est = P##_sub_ps(sw, RCD_AT(P, G, i + w1 - 1)); \
+            V se_est = P##_sub_ps(se, RCD_AT(P, G, i + w1 + 1)); \
+            V p_est = RCD_BLEND2(P, nw_grad, se_est, se_grad, nw_est); \
+            V q_est = RCD_BLEND2(P, ne_grad, sw_est, sw_grad, ne_est); \
+            V value = P##_add_ps(P##_add_ps(green, P##_mul_ps(P##_sub_ps(one, disc), p_est)), \
+                                 P##_mul_ps(disc, q_est)); \
+            P##_storeu_ps(out + i, RCD_SELECT(P, even, value, RCD_AT(P, out, i))); \
+        } \
+    } \
+    for (size_t r = 9; r < rows - 9; r++) { \
+        for (size_t c = 9 + RCD_FIRST_SITE(r), i = r * w1 + c; c < cols - 9; c += step, i += step) { \
+            V disc; \
+            RCD_DISC(V, P, LT, disc, vh_dir, i); \
+            V g = RCD_AT(P, G, i); \
+            V n_diff = P##_add_ps(eps, RCD_ABS(P, P##_sub_ps(g, RCD_AT(P, G, i - w2)))); \
+            V s_diff = P##_add_ps(eps, RCD_ABS(P, P##_sub_ps(g, RCD_AT(P, G, i + w2)))); \
+            V w_diff = P##_add_ps(eps, RCD_ABS(P, P##_sub_ps(g, RCD_AT(P, G, i - 2)))); \
+            V e_diff = P##_add_ps(eps, RCD_ABS(P, P##_sub_ps(g, RCD_AT(P, G, i + 2)))); \
+            for (int k = 0; k < 2; k++) { \
+                float* ch = k ? B : R; \
+                V north = RCD_AT(P, ch, i - w1), south = RCD_AT(P, ch, i + w1); \
+                V west = RCD_AT(P, ch, i - 1), east = RCD_AT(P, ch, i + 1); \
+                V sn = RCD_ABS(P, P##_sub_ps(north, south)); \
+                V ew = RCD_ABS(P, P##_sub_ps(west, east)); \
+                V n_grad = P##_add_ps(P##_add_ps(n_diff, sn), RCD_ABS(P, P##_sub_ps(north, RCD_AT(P, ch, i - w3)))); \
+                V s_grad = P##_add_ps(P##_add_ps(s_diff, sn), RCD_ABS(P, P##_sub_ps(south, RCD_AT(P, ch, i + w3)))); \
+                V w_grad = P##_add_ps(P##_add_ps(w_diff, ew), RCD_ABS(P, P##_sub_ps(west, RCD_AT(P, ch, i - 3)))); \
+                V e_grad = P##_add_ps(P##_add_ps(e_diff, ew), RCD_ABS(P, P##_sub_ps(east, RCD_AT(P, ch, i + 3)))); \
+                V n_est = P##_sub_ps(north, RCD_AT(P, G, i - w1)); \
+                V s_est = P##_sub_ps(south, RCD_AT(P, G, i + w1)); \
+                V w_est = P##_sub_ps(west, RCD_AT(P, G, i - 1)); \
+                V e_est = P##_sub_ps(east, RCD_AT(P, G, i + 1)); \
+                V v_est = RCD_BLEND2(P, n_grad, s_est, s_grad, n_est); \
+                V h_est = RCD_BLEND2(P, e_grad, w_est, w_grad, e_est); \
+                V value = P##_add_ps(P##_add_ps(g, P##_mul_ps(P##_sub_ps(one, disc), v_est)), \
+                                     P##_mul_ps(disc, h_est)); \
+                P##_storeu_ps(ch + i, RCD_SELECT(P, even, value, RCD_AT(P, ch, i))); \
+            } \
+        } \
+    }
+
+#define RCD_AT(P, plane, index) P##_loadu_ps((plane) + (index))
+#define RCD_ABS(P, x) P##_andnot_ps(P##_set1_ps(-0.0f), (x))
+#define RCD_SELECT(P, mask, on_even, on_odd) P##_or_ps(P##_and_ps(mask, on_even), P##_andnot_ps(mask, on_odd))
+#define RCD_SUM4(P, a, b, c, d) P##_add_ps(P##_add_ps(P##_add_ps(a, b), c), d)
+// ((a - b - c + d) - 3 (e + f)) + 6 x, with 6 x passed in
+#define RCD_HPF(P, a, b, c, d, e, f, centre) \
+    P##_add_ps(P##_sub_ps(P##_add_ps(P##_sub_ps(P##_sub_ps(a, b), c), d), P##_mul_ps(three, P##_add_ps(e, f))), \
+               centre)
+#define RCD_GRAD(P, a, b, c, d) P##_add_ps(P##_add_ps(P##_add_ps(P##_add_ps(eps, a), b), c), d)
+#define RCD_GRAD3(P, a, b, c) P##_add_ps(P##_add_ps(P##_add_ps(eps, a), b), c)
+// (wa a + wb b) / (wa + wb)
+#define RCD_BLEND2(P, wa, a, wb, b) \
+    P##_div_ps(P##_add_ps(P##_mul_ps(wa, a), P##_mul_ps(wb, b)), P##_add_ps(wa, wb))
+// the direction share at i or, where that of the diagonal neighbours is
+// further from undecided, theirs
+#define RCD_DISC(V, P, LT, result, dir, i) do { \
+        V central_ = RCD_AT(P, dir, i); \
+        V around_ = P##_mul_ps(quarter, RCD_SUM4(P, RCD_AT(P, dir, (i) - w1 - 1), RCD_AT(P, dir, (i) - w1 + 1), \
+                                                 RCD_AT(P, dir, (i) + w1 - 1), RCD_AT(P, dir, (i) + w1 + 1))); \
+        V more_ = LT(RCD_ABS(P, P##_sub_ps(half, central_)), RCD_ABS(P, P##_sub_ps(half, around_))); \
+        result = RCD_SELECT(P, more_, around_, central_); \
+    } while (0)
+#define RCD_LT_SSE2(a, b) _mm_cmplt_ps(a, b)
+#define RCD_LT_AVX2(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+
+FITS_TARGET_SSE2 static void rcd_tile_sse2(RCDTile* t, size_t rows, size_t cols, FITSBayerPattern pattern) {
+    RCD_TILE_KERNEL(__m128, _mm, RCD_LT_SSE2, _mm_castsi128_ps(_mm_set_epi32(0, -1, 0, -1)))
+}
+
+FITS_TARGET_AVX2 static void rcd_tile_avx2(RCDTile* t, size_t rows, size_t cols, FITSBayerPattern pattern) {
+    RCD_TILE_KERNEL(__m256, _mm256, RCD_LT_AVX2, _mm256_castsi256_ps(_mm256_set_epi32(0, -1, 0, -1, 0, -1, 0, -1)))
+}
+
+// The store's clamp, scale and truncation, eight samples at a time. SSE2
+// has no unsigned 32-bit pack, so 16-bit samples are packed with a bias.
+FITS_TARGET_SSE2 static size_t rcd_quantize_sse2(void* out, const float* in, size_t n, size_t sample_size) {
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+    const __m128 scale = _mm_set1_ps(sample_size == 1 ? 255.0f : 65535.0f);
+    const __m128i bias = _mm_set1_epi32(32768);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), zero), one);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i + 4), zero), one);
+        __m128i low = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(a, scale), half));
+        __m128i high = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(b, scale), half));
+        if (sample_size == 1) {
+            __m128i words = _mm_packs_epi32(low, high);
+            _mm_storel_epi64((__m128i*)((uint8_t*)out + i), _mm_packus_epi16(words, words));
+        } else {
+            __m128i words = _mm_packs_epi32(_mm_sub_epi32(low, bias), _mm_sub_epi32(high, bias));
+            _mm_storeu_si128((__m128i*)((uint16_t*)out + i), _mm_xor_si128(words, _mm_set1_epi16(-32768)));
+        }
+    }
+    return i;
+}
+#endif // FITS_X86_SIMD
+
+// Smaller images cannot be mirrored RCD_BORDER deep and use bilinear
+#define RCD_MIN_SIZE 16
+
+typedef struct {
+    void* out;
+    const void* mosaic;
+    size_t width, height;
+    size_t sample_size;
+    FITSBayerPattern pattern;
+    void (*tile)(RCDTile*, size_t, size_t, FITSBayerPattern);  // the scalar or a vector rcd_tile
+    size_t (*quantize)(void*, const float*, size_t, size_t);   // vector head of the store, or NULL
+    volatile int failed;  // set by a band that could not allocate its tile
+} RCDJob;
+
+// Mirrored mosaic into the tile, then each sample also into its own colour
+// plane; only the columns outside the image go through the mirror
+#define RCD_LOAD(T) do { \
+        const T* mosaic = (const T*)job->mosaic; \
+        size_t inside = x0 < RCD_BORDER ? RCD_BORDER - x0 : 0; \
+        size_t outside = job->width + RCD_BORDER - x0 < cols ? job->width + RCD_BORDER - x0 : cols; \
+        for (size_t r = 0; r < rows; r++) { \
+            const T* row = mosaic + rcd_mirror((ptrdiff_t)(y0 + r) - RCD_BORDER, job->height) * job->width; \
+            float* cfa = t->cfa + r * RCD_TILE; \
+            for (size_t c = 0; c < inside; c++) { \
+                cfa[c] = row[rcd_mirror((ptrdiff_t)(x0 + c) - RCD_BORDER, job->width)] * inverse; \
+            } \
+            for (size_t c = inside; c < outside; c++) { \
+                cfa[c] = row[x0 + c - RCD_BORDER] * inverse; \
+            } \
+            for (size_t c = outside; c < cols; c++) { \
+                cfa[c] = row[rcd_mirror((ptrdiff_t)(x0 + c) - RCD_BORDER, job->width)] * inverse; \
+            } \
+            size_t site = RCD_FIRST_SITE(r); \
+            float* colour = t->rgb[RCD_SITE_COLOUR(r)] + r * RCD_TILE; \
+            float* green = t->rgb[1] + r * RCD_TILE; \
+            for (size_t c = site; c < cols; c += 2) colour[c] = cfa[c]; \
+            for (size_t c = site ^ 1; c < cols; c += 2) green[c] = cfa[c]; \
+        } \
+    } while (0)
+
+// The tile's core, clamped and rounded, row by row into sample planes that
+// are interleaved into the output
+#define RCD_STORE(T) do { \
+        T* out = (T*)job->out; \
+        T planes[3][RCD_CORE]; \
+        size_t n = cols - 2 * RCD_BORDER; \
+        for (size_t r = RCD_BORDER; r < rows - RCD_BORDER; r++) { \
+            for (int k = 0; k < 3; k++) { \
+                const float* in = t->rgb[k] + r * RCD_TILE + RCD_BORDER; \
+                size_t c = job->quantize ? job->quantize(planes[k], in, n, sizeof(T)) : 0; \
+                for (; c < n; c++) { \
+                    float v = in[c]; \
+                    v = v < 0.0f ? 0.0f : v > 1.0f ? 1.0f : v; \
+                    planes[k][c] = (T)(v * scale + 0.5f); \
+                } \
+            } \
+            fits_interleave3(out + ((y0 + r - RCD_BORDER) * job->width + x0) * 3, planes[0], planes[1], planes[2], \
+                             n, sizeof(T)); \
+        } \
+    } while (0)
+
+// One row of tiles, reusing a single tile buffer. It starts zeroed, so the
+// vector kernels never see stray NaNs in the columns they compute for nothing.
+static void rcd_band(void* context, size_t band) {
+    RCDJob* job = (RCDJob*)context;
+    RCDTile* t = (RCDTile*)calloc(1, sizeof(RCDTile));
+    if (!t) {
+        job->failed = 1;
+        return;
+    }
+    size_t rx = job->pattern & 1, ry = (job->pattern >> 1) & 1;
+    float scale = job->sample_size == 1 ? 255.0f : 65535.0f;
+    float inverse = 1.0f / scale;
+    size_t y0 = band * RCD_CORE;
+    size_t rows = (job->height - y0 < RCD_CORE ? job->height - y0 : RCD_CORE) + 2 * RCD_BORDER;
+    for (size_t x0 = 0; x0 < job->width; x0 += RCD_CORE) {
+        size_t cols = (job->width - x0 < RCD_CORE ? job->width - x0 : RCD_CORE) + 2 * RCD_BORDER;
+        if (job->sample_size == 1) {
+            RCD_LOAD(uint8_t);
+        } else {
+            RCD_LOAD(uint16_t);
+        }
+        job->tile(t, rows, cols, job->pattern);
+        if (job->sample_size == 1) {
+            RCD_STORE(uint8_t);
+        } else {
+            RCD_STORE(uint16_t);
+        }
+    }
+    free(t);
+}
+
+static int rcd_bands(RCDJob* job, int threads) {
+    if (job->width < RCD_MIN_SIZE || job->height < RCD_MIN_SIZE) {
+        if (job->sample_size == 1) {
+            fits_demosaic_u8((uint8_t*)job->out, (const uint8_t*)job->mosaic, job->width, job->height, job->pattern,
+                             threads);
+        } else {
+            fits_demosaic_u16((uint16_t*)job->out, (const uint16_t*)job->mosaic, job->width, job->height,
+                              job->pattern, threads);
+        }
+        return 1;
+    }
+    if (!demosaic_kernels.initialized) init_demosaic_kernels();
+    job->tile = rcd_tile;
+    job->quantize = NULL;
+#ifdef FITS_X86_SIMD
+    if (fits_cpu_has_avx2()) {
+        job->tile = rcd_tile_avx2;
+        job->quantize = rcd_quantize_sse2;
+    } else if (fits_cpu_has_sse2()) {
+        job->tile = rcd_tile_sse2;
+        job->quantize = rcd_quantize_sse2;
+    }
+#endif
+    fits_parallel_for((job->height + RCD_CORE - 1) / RCD_CORE, threads, rcd_band, job);
+    return !job->failed;
+}
+
+int fits_demosaic_rcd_u8(uint8_t* out, const uint8_t* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                         int threads) {
+    RCDJob job = { out, mosaic, width, height, 1, pattern, NULL, NULL, 0 };
+    return rcd_bands(&job, threads);
+}
+
+int fits_demosaic_rcd_u16(uint16_t* out, const uint16_t* mosaic, size_t width, size_t height,
+                          FITSBayerPattern pattern, int threads) {
+    RCDJob job = { out, mosaic, width, height, 2, pattern, NULL, NULL, 0 };
+    return rcd_bands(&job, threads);
+}
+
+// ---------------------------------------------------------------------------
+// Patterns
+// ---------------------------------------------------------------------------
+
+static const char* const pattern_names[4] = { "RGGB", "GRBG", "GBRG", "BGGR" };
+
+int fits_bayer_pattern_parse(const char* name, int64_t x_offset, int64_t y_offset, FITSBayerPattern* pattern) {
+    while (*name == ' ') name++;
+    char upper[5];
+    size_t n = 0;
+    for (; n < 4 && name[n]; n++) {
+        upper[n] = name[n] >= 'a' && name[n] <= 'z' ? (char)(name[n] - 'a' + 'A') : name[n];
+    }
+    upper[n] = '\0';
+    for (const char* rest = name + n; *rest; rest++) {
+        if (*rest != ' ') return 0;
+    }
+    for (int p = 0; p < 4; p++) {
+        if (strcmp(upper, pattern_names[p]) == 0) {
+            // an odd offset moves red to the other column or row of the quad
+            *pattern = (FITSBayerPattern)(p ^ (int)(x_offset & 1) ^ ((int)(y_offset & 1) << 1));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const char* fits_bayer_pattern_name(FITSBayerPattern pattern) {
+    return pattern_names[pattern & 3];
+}
@@ -0,0 +1,84 @@
+#ifndef FITS_DEMOSAIC_H
+#define FITS_DEMOSAIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Colour filter arrays, named by their top-left 2x2 quad. The value is the
+// position of red within the quad: bit 0 its column, bit 1 its row. The
+// order matches the SER colour IDs 8 to 11.
+typedef enum {
+    FITS_BAYER_RGGB,
+    FITS_BAYER_GRBG,
+    FITS_BAYER_GBRG,
+    FITS_BAYER_BGGR
+} FITSBayerPattern;
+
+// Pattern of a BAYERPAT value ("RGGB", "GRBG", "GBRG" or "BGGR", in any case)
+// as seen from pixel (0, 0) of an image whose pattern starts at XBAYROFF,
+// YBAYROFF. Returns 0 for any other value.
+int fits_bayer_pattern_parse(const char* name, int64_t x_offset, int64_t y_offset, FITSBayerPattern* pattern);
+const char* fits_bayer_pattern_name(FITSBayerPattern pattern);
+
+// Bilinear demosaic of one row of a Bayer mosaic into width RGB triples.
+// above, row and below are mosaic rows y - 1, y and y + 1; at the top and
+// bottom edge the caller passes row 1 / row height - 2 instead, which keeps
+// the CFA phase. Columns are mirrored the same way, so only three rows of
+// input are ever needed.
+void fits_demosaic_row_u8(uint8_t* out, const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                          size_t width, size_t y, FITSBayerPattern pattern);
+void fits_demosaic_row_u16(uint16_t* out, const uint16_t* above, const uint16_t* row, const uint16_t* below,
+                           size_t width, size_t y, FITSBayerPattern pattern);
+void fits_demosaic_row_f32(float* out, const float* above, const float* row, const float* below, size_t width,
+                           size_t y, FITSBayerPattern pattern);
+
+// Whole-image bilinear demosaic of a width x height mosaic into interleaved
+// RGB, with the same edge handling as the row functions. Bands of rows are
+// spread over up to threads threads (0 means one per logical processor); the
+// output is the same for any thread count. Integer means are rounded to
+// nearest; float samples are interpolated as floats.
+void fits_demosaic_u8(uint8_t* out, const uint8_t* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                      int threads);
+void fits_demosaic_u16(uint16_t* out, const uint16_t* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                       int threads);
+void fits_demosaic_f32(float* out, const float* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                       int threads);
+
+// The same bilinear demosaic of a 16-bit mosaic, written straight as 8-bit
+// RGB: colours are interpolated at full precision and each then maps through
+// lut, a table of 65536 output values (a stretch, or just v >> 8). One pass,
+// with no 16-bit RGB image in between.
+void fits_demosaic_u16_lut(uint8_t* out, const uint16_t* mosaic, size_t width, size_t height,
+                           FITSBayerPattern pattern, const uint8_t* lut, int threads);
+
+// Ratio corrected demosaic (RCD) of the same mosaics, for quality: far less
+// zippering and fewer colour fringes on stars and edges than bilinear, at
+// several times its cost. Threaded over tiles; images under 16 pixels a side
+// get the bilinear demosaic. Returns 0 if memory runs out.
+int fits_demosaic_rcd_u8(uint8_t* out, const uint8_t* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                         int threads);
+int fits_demosaic_rcd_u16(uint16_t* out, const uint16_t* mosaic, size_t width, size_t height,
+                          FITSBayerPattern pattern, int threads);
+
+// Superpixel demosaic for previews: each 2x2 quad becomes one RGB pixel
+// (red, the mean of the two greens, blue), so the output is width / 2 x
+// height / 2 and an odd last row or column is dropped. The row functions
+// take mosaic rows 2y and 2y + 1; the whole-image ones are threaded like the
+// bilinear demosaic.
+void fits_superpixel_row_u8(uint8_t* out, const uint8_t* top, const uint8_t* bottom, size_t width,
+                            FITSBayerPattern pattern);
+void fits_superpixel_row_u16(uint16_t* out, const uint16_t* top, const uint16_t* bottom, size_t width,
+                             FITSBayerPattern pattern);
+void fits_superpixel_row_f32(float* out, const float* top, const float* bottom, size_t width,
+                             FITSBayerPattern pattern);
+void fits_superpixel_u8(uint8_t* out, const uint8_t* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                        int threads);
+void fits_superpixel_u16(uint16_t* out, const uint16_t* mosaic, size_t width, size_t height,
+                         FITSBayerPattern pattern, int threads);
+void fits_superpixel_f32(float* out, const float* mosaic, size_t width, size_t height, FITSBayerPattern pattern,
+                         int threads);
+
+// Name of the vector kernel the demosaic uses ("avx2", "sse2" or "scalar").
+const char* fits_demosaic_kernel_name(void);
+
+#endif // FITS_DEMOSAIC_H
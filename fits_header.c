@@ -0,0 +1,388 @@
+#include "fits_header.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Keywords are compared as 8-byte integers: the space-padded keyword field
+// packed big-endian, so a case label reads like the keyword it matches
+#define KEY8(a, b, c, d, e, f, g, h) \
+    (((uint64_t)(a) << 56) | ((uint64_t)(b) << 48) | ((uint64_t)(c) << 40) | ((uint64_t)(d) << 32) | \
+     ((uint64_t)(e) << 24) | ((uint64_t)(f) << 16) | ((uint64_t)(g) << 8) | (uint64_t)(h))
+
+static inline uint64_t pack_keyword(const char* card) {
+    const uint8_t* p = (const uint8_t*)card;
+    return KEY8(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
+}
+
+static uint64_t pack_keyword_string(const char* keyword) {
+    char padded[8];
+    size_t len = strlen(keyword);
+    if (len > 8) len = 8;
+    memset(padded, ' ', sizeof(padded));
+    memcpy(padded, keyword, len);
+    return pack_keyword(padded);
+}
+
+// Map a packed keyword to its FITSKey slot, or -1
+static int known_key(uint64_t key) {
+    switch (key) {
+        case KEY8('S','I','M','P','L','E',' ',' '): return FITS_KEY_SIMPLE;
+        case KEY8('X','T','E','N','S','I','O','N'): return FITS_KEY_XTENSION;
+        case KEY8('B','I','T','P','I','X',' ',' '): return FITS_KEY_BITPIX;
+        case KEY8('N','A','X','I','S',' ',' ',' '): return FITS_KEY_NAXIS;
+        case KEY8('N','A','X','I','S','1',' ',' '): return FITS_KEY_NAXIS1;
+        case KEY8('N','A','X','I','S','2',' ',' '): return FITS_KEY_NAXIS1 + 1;
+        case KEY8('N','A','X','I','S','3',' ',' '): return FITS_KEY_NAXIS1 + 2;
+        case KEY8('N','A','X','I','S','4',' ',' '): return FITS_KEY_NAXIS1 + 3;
+        case KEY8('N','A','X','I','S','5',' ',' '): return FITS_KEY_NAXIS1 + 4;
+        case KEY8('N','A','X','I','S','6',' ',' '): return FITS_KEY_NAXIS1 + 5;
+        case KEY8('N','A','X','I','S','7',' ',' '): return FITS_KEY_NAXIS1 + 6;
+        case KEY8('N','A','X','I','S','8',' ',' '): return FITS_KEY_NAXIS1 + 7;
+        case KEY8('N','A','X','I','S','9',' ',' '): return FITS_KEY_NAXIS1 + 8;
+        case KEY8('P','C','O','U','N','T',' ',' '): return FITS_KEY_PCOUNT;
+        case KEY8('G','C','O','U','N','T',' ',' '): return FITS_KEY_GCOUNT;
+        case KEY8('E','X','T','N','A','M','E',' '): return FITS_KEY_EXTNAME;
+        case KEY8('B','Z','E','R','O',' ',' ',' '): return FITS_KEY_BZERO;
+        case KEY8('B','S','C','A','L','E',' ',' '): return FITS_KEY_BSCALE;
+        case KEY8('D','A','T','A','M','I','N',' '): return FITS_KEY_DATAMIN;
+        case KEY8('D','A','T','A','M','A','X',' '): return FITS_KEY_DATAMAX;
+        default: return -1;
+    }
+}
+
+int fits_header_parse(FITSHeader* header, const uint8_t* data, size_t available) {
+    const uint64_t end_key = KEY8('E','N','D',' ',' ',' ',' ',' ');
+    memset(header, 0, sizeof(*header));
+    header->cards = (const char*)data;
+
+    // Whole blocks at a time; each card costs one 8-byte load and a switch
+    for (size_t block = 0; block + FITS_BLOCK_SIZE <= available; block += FITS_BLOCK_SIZE) {
+        const char* card = (const char*)data + block;
+        for (int i = 0; i < FITS_BLOCK_SIZE / FITS_CARD_SIZE; i++, card += FITS_CARD_SIZE) {
+            uint64_t key = pack_keyword(card);
+            if (key == end_key) {
+                header->size = block + FITS_BLOCK_SIZE;
+                return 1;
+            }
+            int slot = known_key(key);
+            if (slot >= 0 && !header->known[slot]) {
+                header->known[slot] = card;
+            }
+            header->ncards++;
+        }
+    }
+    return 0;
+}
+
+const char* fits_header_find(const FITSHeader* header, const char* keyword) {
+    uint64_t key = pack_keyword_string(keyword);
+    int slot = known_key(key);
+    if (slot >= 0) {
+        return header->known[slot];
+    }
+    const char* card = header->cards;
+    for (size_t i = 0; i < header->ncards; i++, card += FITS_CARD_SIZE) {
+        if (pack_keyword(card) == key) return card;
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Lazy value parsing
+// ---------------------------------------------------------------------------
+
+// First non-blank character of the value field, or NULL for cards without a
+// "= " value indicator in columns 9-10
+static const char* value_start(const char* card, const char** field_end) {
+    *field_end = card ? card + FITS_CARD_SIZE : NULL;
+    if (!card || card[8] != '=' || card[9] != ' ') return NULL;
+    const char* p = card + 10;
+    while (p < *field_end && *p == ' ') p++;
+    return p < *field_end ? p : NULL;
+}
+
+// End of a numeric or logical token
+static const char* token_end(const char* p, const char* end) {
+    while (p < end && *p != ' ' && *p != '/') p++;
+    return p;
+}
+
+static FITSValueType card_type(const char* card) {
+    const char* end;
+    const char* p = value_start(card, &end);
+    if (!p || *p == '/') return FITS_VALUE_NONE;
+    if (*p == '\'') return FITS_VALUE_STRING;
+    const char* stop = token_end(p, end);
+    if ((*p == 'T' || *p == 'F') && stop == p + 1) return FITS_VALUE_LOGICAL;
+
+    int digits = 0, real = 0;
+    for (const char* q = p; q < stop; q++) {
+        char c = *q;
+        if (c >= '0' && c <= '9') digits = 1;
+        else if (c == '.' || c == 'E' || c == 'e' || c == 'D' || c == 'd') real = 1;
+        else if (c != '+' && c != '-') return FITS_VALUE_NONE;  // e.g. complex values
+    }
+    if (!digits) return FITS_VALUE_NONE;
+    return real ? FITS_VALUE_FLOAT : FITS_VALUE_INT;
+}
+
+static int card_int(const char* card, int64_t* value) {
+    const char* end;
+    const char* p = value_start(card, &end);
+    const char* stop = token_end(p, end);
+    int negative = 0;
+    if (*p == '+' || *p == '-') negative = *p++ == '-';
+    uint64_t v = 0;
+    for (; p < stop; p++) {
+        if (*p < '0' || *p > '9' || v > (UINT64_MAX - 9) / 10) return 0;
+        v = v * 10 + (uint64_t)(*p - '0');
+    }
+    if (v > (uint64_t)INT64_MAX + negative) return 0;
+    *value = negative ? (int64_t)(0 - v) : (int64_t)v;
+    return 1;
+}
+
+static int card_double(const char* card, double* value) {
+    const char* end;
+    const char* p = value_start(card, &end);
+    const char* stop = token_end(p, end);
+    char token[FITS_CARD_SIZE + 1];
+    size_t len = (size_t)(stop - p);
+    memcpy(token, p, len);
+    token[len] = '\0';
+    for (size_t i = 0; i < len; i++) {
+        if (token[i] == 'D' || token[i] == 'd') token[i] = 'E';  // Fortran double exponent
+    }
+    char* parsed;
+    double v = strtod(token, &parsed);
+    if (parsed != token + len) return 0;
+    *value = v;
+    return 1;
+}
+
+static int card_string(const char* card, char* value, size_t size) {
+    const char* end;
+    const char* p = value_start(card, &end) + 1;  // skip opening quote
+    size_t n = 0;
+    while (p < end) {
+        if (*p == '\'') {
+            if (p + 1 < end && p[1] == '\'') {
+                p++;  // '' is an escaped quote
+            } else {
+                break;
+            }
+        }
+        if (n + 1 < size) value[n++] = *p;
+        p++;
+    }
+    while (n > 0 && value[n - 1] == ' ') n--;  // trailing blanks are not significant
+    if (size > 0) value[n] = '\0';
+    return 1;
+}
+
+static int get_int(const char* card, int64_t* value) {
+    switch (card_type(card)) {
+        case FITS_VALUE_INT:
+            return card_int(card, value);
+        case FITS_VALUE_FLOAT: {
+            double d;
+            if (!card_double(card, &d) || d != (double)(int64_t)d) return 0;
+            *value = (int64_t)d;
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+static int get_double(const char* card, double* value) {
+    FITSValueType type = card_type(card);
+    if (type != FITS_VALUE_INT && type != FITS_VALUE_FLOAT) return 0;
+    return card_double(card, value);
+}
+
+static int get_string(const char* card, char* value, size_t size) {
+    if (card_type(card) != FITS_VALUE_STRING) return 0;
+    return card_string(card, value, size);
+}
+
+FITSValueType fits_header_type(const FITSHeader* header, const char* keyword) {
+    const char* card = fits_header_find(header, keyword);
+    return card ? card_type(card) : FITS_VALUE_NONE;
+}
+
+int fits_header_get_int(const FITSHeader* header, const char* keyword, int64_t* value) {
+    return get_int(fits_header_find(header, keyword), value);
+}
+
+int fits_header_get_double(const FITSHeader* header, const char* keyword, double* value) {
+    return get_double(fits_header_find(header, keyword), value);
+}
+
+int fits_header_get_logical(const FITSHeader* header, const char* keyword, int* value) {
+    const char* card = fits_header_find(header, keyword);
+    if (card_type(card) != FITS_VALUE_LOGICAL) return 0;
+    const char* end;
+    *value = *value_start(card, &end) == 'T';
+    return 1;
+}
+
+int fits_header_get_string(const FITSHeader* header, const char* keyword, char* value, size_t size) {
+    return get_string(fits_header_find(header, keyword), value, size);
+}
+
+int fits_header_key_int(const FITSHeader* header, FITSKey key, int64_t* value) {
+    return get_int(header->known[key], value);
+}
+
+int fits_header_key_double(const FITSHeader* header, FITSKey key, double* value) {
+    return get_double(header->known[key], value);
+}
+
+int fits_header_key_string(const FITSHeader* header, FITSKey key, char* value, size_t size) {
+    return get_string(header->known[key], value, size);
+}
+
+// ---------------------------------------------------------------------------
+// HDU index
+// ---------------------------------------------------------------------------
+
+// Fill in the shape and data unit size of an HDU from its parsed header
+static int describe_hdu(FITSHDU* hdu, const FITSHeader* header, int primary) {
+    int64_t value;
+    if (!fits_header_key_int(header, FITS_KEY_BITPIX, &value)) return 0;
+    hdu->bitpix = (int)value;
+    if (hdu->bitpix != 8 && hdu->bitpix != 16 && hdu->bitpix != 32 && hdu->bitpix != 64 &&
+        hdu->bitpix != -32 && hdu->bitpix != -64) return 0;
+    if (!fits_header_key_int(header, FITS_KEY_NAXIS, &value) || value < 0 || value > FITS_MAX_NAXIS) return 0;
+    hdu->naxis = (int)value;
+
+    for (int i = 0; i < hdu->naxis; i++) {
+        if (!fits_header_key_int(header, FITS_KEY_NAXIS1 + i, &hdu->naxes[i]) || hdu->naxes[i] < 0) return 0;
+    }
+    int64_t pcount = 0, gcount = 1;
+    fits_header_key_int(header, FITS_KEY_PCOUNT, &pcount);
+    fits_header_key_int(header, FITS_KEY_GCOUNT, &gcount);
+    if (pcount < 0 || gcount < 0) return 0;
+
+    if (!primary) {
+        fits_header_key_string(header, FITS_KEY_XTENSION, hdu->xtension, sizeof(hdu->xtension));
+    }
+    fits_header_key_string(header, FITS_KEY_EXTNAME, hdu->extname, sizeof(hdu->extname));
+
+    // Nbits = |BITPIX| * GCOUNT * (PCOUNT + NAXIS1 * ... * NAXISn); a primary
+    // random-groups array has NAXIS1 = 0, which is left out of the product
+    uint64_t elements = 0;
+    if (hdu->naxis > 0) {
+        int first = primary && hdu->naxes[0] == 0 && hdu->naxis > 1 ? 1 : 0;
+        elements = 1;
+        for (int i = first; i < hdu->naxis; i++) {
+            if (hdu->naxes[i] != 0 && elements > UINT64_MAX / (uint64_t)hdu->naxes[i]) return 0;
+            elements *= (uint64_t)hdu->naxes[i];
+        }
+        elements = ((uint64_t)pcount + elements) * (uint64_t)gcount;
+    }
+    uint64_t bytes = elements * (uint64_t)(hdu->bitpix < 0 ? -hdu->bitpix : hdu->bitpix) / 8;
+    if (bytes > SIZE_MAX - FITS_BLOCK_SIZE) return 0;
+    hdu->data_size = (size_t)bytes;
+
+    hdu->is_image = hdu->naxis > 0 && hdu->data_size > 0 &&
+                    (primary ? hdu->naxes[0] > 0 : strcmp(hdu->xtension, "IMAGE") == 0);
+
+    // A compressed image table describes the image in Z keywords
+    int zimage = 0;
+    int64_t zbitpix, znaxis, znaxes[FITS_MAX_NAXIS];
+    if (strcmp(hdu->xtension, "BINTABLE") == 0 && fits_header_get_logical(header, "ZIMAGE", &zimage) && zimage &&
+        fits_header_get_int(header, "ZBITPIX", &zbitpix) &&
+        fits_header_get_int(header, "ZNAXIS", &znaxis) && znaxis >= 1 && znaxis <= FITS_MAX_NAXIS) {
+        for (int i = 0; i < znaxis; i++) {
+            char keyword[] = "ZNAXIS1";
+            keyword[6] = (char)('1' + i);
+            if (!fits_header_get_int(header, keyword, &znaxes[i]) || znaxes[i] <= 0) return 1;
+        }
+        hdu->bitpix = (int)zbitpix;
+        hdu->naxis = (int)znaxis;
+        memcpy(hdu->naxes, znaxes, (size_t)znaxis * sizeof(int64_t));
+        hdu->compressed = 1;
+        hdu->is_image = 1;
+    }
+    return 1;
+}
+
+int fits_hdu_index_build(FITSHDUIndex* index, const uint8_t* data, size_t size) {
+    memset(index, 0, sizeof(*index));
+    return fits_hdu_index_extend(index, data, size, 1) && index->count > 0;
+}
+
+int fits_hdu_index_extend(FITSHDUIndex* index, const uint8_t* data, size_t available, int at_end) {
+    while (!index->complete) {
+        size_t offset = index->next_offset;
+        FITSHeader header;
+        if (offset >= available || !fits_header_parse(&header, data + offset, available - offset)) {
+            // either the rest of the header is still to come or the file ends here
+            index->complete = at_end;
+            break;
+        }
+        int primary = index->count == 0;
+        // extensions must start with XTENSION; anything else is trailing junk
+        if (!primary && !header.known[FITS_KEY_XTENSION]) {
+            index->complete = 1;
+            break;
+        }
+
+        FITSHDU hdu;
+        memset(&hdu, 0, sizeof(hdu));
+        hdu.header_offset = offset;
+        hdu.data_offset = offset + header.size;
+        if (!describe_hdu(&hdu, &header, primary)) {
+            index->complete = 1;
+            break;
+        }
+
+        if (index->count == index->capacity) {
+            size_t capacity = index->capacity ? index->capacity * 2 : 8;
+            FITSHDU* grown = (FITSHDU*)realloc(index->hdus, capacity * sizeof(FITSHDU));
+            if (!grown) return 0;
+            index->hdus = grown;
+            index->capacity = capacity;
+        }
+        index->hdus[index->count++] = hdu;
+
+        // the next header follows the block-padded data unit
+        size_t padded = (hdu.data_size + FITS_BLOCK_SIZE - 1) / FITS_BLOCK_SIZE * FITS_BLOCK_SIZE;
+        if (padded > SIZE_MAX - hdu.data_offset) {
+            index->complete = 1;
+            break;
+        }
+        index->next_offset = hdu.data_offset + padded;
+    }
+    return 1;
+}
+
+void fits_hdu_index_free(FITSHDUIndex* index) {
+    free(index->hdus);
+    memset(index, 0, sizeof(*index));
+}
+
+static int equal_nocase(const char* a, const char* b) {
+    for (; *a && *b; a++, b++) {
+        char ca = *a >= 'a' && *a <= 'z' ? *a - 'a' + 'A' : *a;
+        char cb = *b >= 'a' && *b <= 'z' ? *b - 'a' + 'A' : *b;
+        if (ca != cb) return 0;
+    }
+    return *a == *b;
+}
+
+int fits_hdu_index_find(const FITSHDUIndex* index, const char* extname) {
+    for (size_t i = 0; i < index->count; i++) {
+        if (equal_nocase(index->hdus[i].extname, extname)) return (int)i;
+    }
+    return -1;
+}
+
+int fits_hdu_index_first_image(const FITSHDUIndex* index) {
+    for (size_t i = 0; i < index->count; i++) {
+        if (index->hdus[i].is_image) return (int)i;
+    }
+    return -1;
+}
@@ -0,0 +1,119 @@
+#ifndef FITS_HEADER_H
+#define FITS_HEADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FITS_CARD_SIZE 80     // keyword(8) + value indicator(2) + value/comment(70)
+#define FITS_BLOCK_SIZE 2880  // 36 cards per block; header and data units are padded to blocks
+#define FITS_MAX_NAXIS 9      // highest NAXISn kept in the fast lookup table
+
+// Keywords the converter asks for, resolved once per card during the block
+// scan so lookups of these are a single table read.
+typedef enum {
+    FITS_KEY_SIMPLE,
+    FITS_KEY_XTENSION,
+    FITS_KEY_BITPIX,
+    FITS_KEY_NAXIS,
+    FITS_KEY_NAXIS1,  // NAXIS1 .. NAXIS9 are consecutive
+    FITS_KEY_NAXIS9 = FITS_KEY_NAXIS1 + FITS_MAX_NAXIS - 1,
+    FITS_KEY_PCOUNT,
+    FITS_KEY_GCOUNT,
+    FITS_KEY_EXTNAME,
+    FITS_KEY_BZERO,
+    FITS_KEY_BSCALE,
+    FITS_KEY_DATAMIN,
+    FITS_KEY_DATAMAX,
+    FITS_KEY_COUNT
+} FITSKey;
+
+typedef enum {
+    FITS_VALUE_NONE,     // keyword absent, or a commentary card without a value
+    FITS_VALUE_INT,
+    FITS_VALUE_FLOAT,
+    FITS_VALUE_STRING,
+    FITS_VALUE_LOGICAL
+} FITSValueType;
+
+// Header dictionary over the cards of one HDU. Cards are not copied: they
+// point into the caller's buffer (usually the file mapping), and values are
+// only parsed when a getter asks for them.
+typedef struct {
+    const char* cards;                 // first card of the header
+    size_t ncards;                     // number of cards before END
+    size_t size;                       // header size in bytes, a multiple of FITS_BLOCK_SIZE
+    const char* known[FITS_KEY_COUNT]; // card of each known keyword, or NULL
+} FITSHeader;
+
+// Scan header blocks starting at data until the END card. Returns 1 on
+// success, 0 if no END card is found within the available bytes.
+int fits_header_parse(FITSHeader* header, const uint8_t* data, size_t available);
+
+// Card of a keyword (up to 8 characters), or NULL if it is not present.
+// Known keywords are a table read, others a scan comparing packed keywords.
+const char* fits_header_find(const FITSHeader* header, const char* keyword);
+
+// Type of the value stored for a keyword
+FITSValueType fits_header_type(const FITSHeader* header, const char* keyword);
+
+// Typed getters. Each returns 1 if the keyword exists and holds a value of a
+// compatible type (integers also satisfy get_double, and floats with no
+// fractional part satisfy get_int), 0 otherwise; *value is left untouched
+// on failure so callers can pre-load defaults.
+int fits_header_get_int(const FITSHeader* header, const char* keyword, int64_t* value);
+int fits_header_get_double(const FITSHeader* header, const char* keyword, double* value);
+int fits_header_get_logical(const FITSHeader* header, const char* keyword, int* value);
+int fits_header_get_string(const FITSHeader* header, const char* keyword, char* value, size_t size);
+
+// Same getters for the known keywords, skipping the keyword lookup
+int fits_header_key_int(const FITSHeader* header, FITSKey key, int64_t* value);
+int fits_header_key_double(const FITSHeader* header, FITSKey key, double* value);
+int fits_header_key_string(const FITSHeader* header, FITSKey key, char* value, size_t size);
+
+// ---------------------------------------------------------------------------
+// HDU index
+// ---------------------------------------------------------------------------
+
+// Location and shape of one header-data unit, as read from its header
+typedef struct {
+    size_t header_offset;           // file offset of the first header card
+    size_t data_offset;             // file offset of the data unit
+    size_t data_size;               // data unit size in bytes, without block padding
+    int bitpix;
+    int naxis;
+    int64_t naxes[FITS_MAX_NAXIS];  // NAXIS1 .. NAXISn
+    int is_image;                   // primary array, IMAGE extension or compressed image with data
+    int compressed;                 // tile-compressed image stored in a BINTABLE; bitpix, naxis
+                                    // and naxes then describe the image (ZBITPIX, ZNAXISn)
+    char xtension[16];              // XTENSION value, empty for the primary HDU
+    char extname[72];               // EXTNAME value, empty if absent
+} FITSHDU;
+
+typedef struct {
+    FITSHDU* hdus;
+    size_t count;
+    size_t capacity;
+    size_t next_offset;  // where the header of the next HDU starts
+    int complete;        // all HDUs of the file are indexed
+} FITSHDUIndex;
+
+// Build the index by hopping from header to header: each data unit is
+// skipped using the size implied by BITPIX, NAXISn, PCOUNT and GCOUNT, so no
+// data is ever read. Stops quietly at a truncated trailing HDU; returns 0 if
+// not even the primary header could be read or memory runs out.
+int fits_hdu_index_build(FITSHDUIndex* index, const uint8_t* data, size_t size);
+
+// Incremental form for input that is still arriving: index the HDUs whose
+// headers lie within the first available bytes, continuing where the last
+// call stopped. at_end says available is the whole file, which lets the
+// index complete. Start from a zeroed index; returns 0 if memory runs out.
+int fits_hdu_index_extend(FITSHDUIndex* index, const uint8_t* data, size_t available, int at_end);
+void fits_hdu_index_free(FITSHDUIndex* index);
+
+// Index of the HDU whose EXTNAME matches (case-insensitive), or -1
+int fits_hdu_index_find(const FITSHDUIndex* index, const char* extname);
+
+// Index of the first HDU holding image data, or -1
+int fits_hdu_index_first_image(const FITSHDUIndex* index);
+
+#endif // FITS_HEADER_H
@@ -0,0 +1,420 @@
+#include "fits_inflate.h"
+
+#include <string.h>
+
+#define MAX_CODE_BITS 15
+#define FAST_BITS 10        // codes up to this length decode with one table read
+#define MAX_LIT_CODES 288
+#define MAX_DIST_CODES 32
+
+// LSB-first bit reader over the compressed stream. Past the end it feeds
+// zero padding bytes; using any of them is an error, checked once per block.
+typedef struct {
+    const uint8_t* src;
+    const uint8_t* end;
+    const uint8_t* start;
+    uint64_t bits;
+    int nbits;
+    int pad;  // padding bytes fed so far, always the top bytes of bits
+} BitReader;
+
+static inline void refill(BitReader* br) {
+    while (br->nbits <= 56) {
+        if (br->src < br->end) {
+            br->bits |= (uint64_t)*br->src++ << br->nbits;
+        } else {
+            br->pad++;
+        }
+        br->nbits += 8;
+    }
+}
+
+static inline int overrun(const BitReader* br) {
+    return br->pad * 8 > br->nbits;
+}
+
+// Whole input bytes loaded into the bit buffer but not used yet
+static inline int unused_bytes(const BitReader* br) {
+    return br->nbits / 8 - br->pad;
+}
+
+static inline uint32_t get_bits(BitReader* br, int n) {
+    if (br->nbits < n) refill(br);
+    uint32_t v = (uint32_t)(br->bits & ((1ull << n) - 1));
+    br->bits >>= n;
+    br->nbits -= n;
+    return v;
+}
+
+// Canonical Huffman decoder: a direct table for short codes plus the
+// count/symbol arrays for the rare longer ones
+typedef struct {
+    uint16_t fast[1 << FAST_BITS];  // (length << 9) | symbol, 0 if the code is longer
+    uint16_t count[MAX_CODE_BITS + 1];
+    uint16_t symbol[MAX_LIT_CODES];
+} Huffman;
+
+static int build_huffman(Huffman* h, const uint8_t* lengths, int n) {
+    uint16_t offsets[MAX_CODE_BITS + 2];
+    memset(h->count, 0, sizeof(h->count));
+    for (int i = 0; i < n; i++) h->count[lengths[i]]++;
+    h->count[0] = 0;
+
+    // over-subscribed sets are invalid; incomplete ones are allowed (a
+    // single distance code is common) and just leave holes in the table
+    int left = 1;
+    for (int len = 1; len <= MAX_CODE_BITS; len++) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0) return 0;
+    }
+
+    offsets[1] = 0;
+    for (int len = 1; len <= MAX_CODE_BITS; len++) offsets[len + 1] = offsets[len] + h->count[len];
+    for (int i = 0; i < n; i++) {
+        if (lengths[i]) h->symbol[offsets[lengths[i]]++] = (uint16_t)i;
+    }
+
+    // Fill the fast table. Deflate sends codes MSB first into an LSB-first
+    // stream, so each code is bit-reversed and replicated over the unused
+    // high bits.
+    memset(h->fast, 0, sizeof(h->fast));
+    int code = 0, index = 0;
+    for (int len = 1; len <= FAST_BITS; len++) {
+        for (int k = 0; k < h->count[len]; k++, code++, index++) {
+            int reversed = 0;
+            for (int b = 0; b < len; b++) reversed |= ((code >> b) & 1) << (len - 1 - b);
+            uint16_t entry = (uint16_t)((len << 9) | h->symbol[index]);
+            for (int r = reversed; r < (1 << FAST_BITS); r += 1 << len) h->fast[r] = entry;
+        }
+        code <<= 1;
+    }
+    return 1;
+}
+
+static int decode_symbol(BitReader* br, const Huffman* h) {
+    if (br->nbits < MAX_CODE_BITS) refill(br);
+    uint16_t entry = h->fast[br->bits & ((1 << FAST_BITS) - 1)];
+    if (entry) {
+        int len = entry >> 9;
+        br->bits >>= len;
+        br->nbits -= len;
+        return entry & 511;
+    }
+    // walk the canonical code one bit at a time
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len <= MAX_CODE_BITS; len++) {
+        code |= (int)((br->bits >> (len - 1)) & 1);
+        int count = h->count[len];
+        if (code - first < count) {
+            br->bits >>= len;
+            br->nbits -= len;
+            return h->symbol[index + code - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Where the inflated bytes go. When size bytes are used up, grow (if set) is
+// asked to make more room after them, in place.
+typedef struct {
+    uint8_t* dst;
+    size_t size;
+    FITSInflateGrow grow;
+    void* context;
+} Output;
+
+// The rare path of the bounds checks: room for length more bytes at pos
+static int make_room(Output* output, size_t pos, size_t length) {
+    if (!output->grow || length > (size_t)-1 - pos) return 0;
+    size_t size = output->grow(output->context, pos + length);
+    if (size < pos + length) return 0;
+    output->size = size;
+    return 1;
+}
+
+static int inflate_codes(BitReader* br, const Huffman* lit, const Huffman* dist,
+                         Output* output, size_t* pos) {
+    uint8_t* dst = output->dst;
+    size_t dst_size = output->size;
+    size_t out = *pos;
+    for (;;) {
+        int symbol = decode_symbol(br, lit);
+        if (symbol < 256) {
+            if (symbol < 0) return 0;
+            if (out >= dst_size) {
+                if (!make_room(output, out, 1)) return 0;
+                dst_size = output->size;
+            }
+            dst[out++] = (uint8_t)symbol;
+            continue;
+        }
+        if (symbol == 256) break;
+
+        symbol -= 257;
+        if (symbol >= 29) return 0;
+        size_t length = length_base[symbol] + get_bits(br, length_extra[symbol]);
+        int dsym = decode_symbol(br, dist);
+        if (dsym < 0 || dsym >= 30) return 0;
+        size_t distance = dist_base[dsym] + get_bits(br, dist_extra[dsym]);
+        if (distance > out) return 0;
+        if (length > dst_size - out) {
+            if (!make_room(output, out, length)) return 0;
+            dst_size = output->size;
+        }
+
+        uint8_t* d = dst + out;
+        const uint8_t* s = d - distance;
+        if (distance >= length) {
+            memcpy(d, s, length);
+        } else {
+            for (size_t i = 0; i < length; i++) d[i] = s[i];  // overlapping run
+        }
+        out += length;
+    }
+    *pos = out;
+    return !overrun(br);
+}
+
+static int inflate_stored(BitReader* br, Output* output, size_t* pos) {
+    // drop to the byte boundary, giving back whole bytes still in the buffer
+    get_bits(br, br->nbits & 7);
+    if (overrun(br)) return 0;
+    br->src -= unused_bytes(br);
+    br->bits = 0;
+    br->nbits = 0;
+    br->pad = 0;
+    if (br->end - br->src < 4) return 0;
+
+    size_t len = br->src[0] | (br->src[1] << 8);
+    size_t nlen = br->src[2] | (br->src[3] << 8);
+    br->src += 4;
+    if (len != (~nlen & 0xffff) || len > (size_t)(br->end - br->src)) return 0;
+    if (len > output->size - *pos && !make_room(output, *pos, len)) return 0;
+    memcpy(output->dst + *pos, br->src, len);
+    br->src += len;
+    *pos += len;
+    return 1;
+}
+
+static int inflate_fixed(BitReader* br, Output* output, size_t* pos) {
+    // Built per block rather than cached so tiles can inflate on any thread;
+    // it is cheap next to decoding the block itself
+    Huffman lit, dist;
+    uint8_t lengths[MAX_LIT_CODES];
+    int i = 0;
+    for (; i < 144; i++) lengths[i] = 8;
+    for (; i < 256; i++) lengths[i] = 9;
+    for (; i < 280; i++) lengths[i] = 7;
+    for (; i < 288; i++) lengths[i] = 8;
+    build_huffman(&lit, lengths, MAX_LIT_CODES);
+    for (i = 0; i < 30; i++) lengths[i] = 5;
+    build_huffman(&dist, lengths, 30);
+    return inflate_codes(br, &lit, &dist, output, pos);
+}
+
+static int inflate_dynamic(BitReader* br, Output* output, size_t* pos) {
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    uint8_t lengths[MAX_LIT_CODES + MAX_DIST_CODES];
+    Huffman lencode, lit, dist;
+
+    int nlen = (int)get_bits(br, 5) + 257;
+    int ndist = (int)get_bits(br, 5) + 1;
+    int ncode = (int)get_bits(br, 4) + 4;
+    if (nlen > 286 || ndist > 30) return 0;
+
+    memset(lengths, 0, 19);
+    for (int i = 0; i < ncode; i++) lengths[order[i]] = (uint8_t)get_bits(br, 3);
+    if (!build_huffman(&lencode, lengths, 19)) return 0;
+
+    for (int i = 0; i < nlen + ndist;) {
+        int symbol = decode_symbol(br, &lencode);
+        if (symbol < 0) return 0;
+        if (symbol < 16) {
+            lengths[i++] = (uint8_t)symbol;
+            continue;
+        }
+        uint8_t value = 0;
+        int repeat;
+        if (symbol == 16) {
+            if (i == 0) return 0;
+            value = lengths[i - 1];
+            repeat = 3 + (int)get_bits(br, 2);
+        } else if (symbol == 17) {
+            repeat = 3 + (int)get_bits(br, 3);
+        } else {
+            repeat = 11 + (int)get_bits(br, 7);
+        }
+        if (i + repeat > nlen + ndist) return 0;
+        while (repeat--) lengths[i++] = value;
+    }
+    if (lengths[256] == 0) return 0;  // no end-of-block code
+
+    if (!build_huffman(&lit, lengths, nlen) || !build_huffman(&dist, lengths + nlen, ndist)) return 0;
+    return inflate_codes(br, &lit, &dist, output, pos);
+}
+
+static int inflate_stream(Output* output, size_t* out_size,
+                          const uint8_t* src, size_t src_size, size_t* consumed,
+                          FITSInflateProgress progress, void* context) {
+    BitReader br = { src, src + src_size, src, 0, 0, 0 };
+    size_t pos = 0;
+    int last;
+    do {
+        last = (int)get_bits(&br, 1);
+        int type = (int)get_bits(&br, 2);
+        int ok;
+        switch (type) {
+            case 0: ok = inflate_stored(&br, output, &pos); break;
+            case 1: ok = inflate_fixed(&br, output, &pos); break;
+            case 2: ok = inflate_dynamic(&br, output, &pos); break;
+            default: ok = 0; break;
+        }
+        if (!ok) return 0;
+        // the last block is left for the caller to report, after any
+        // trailer check
+        if (progress && !last && !progress(context, pos)) return 0;
+    } while (!last);
+
+    *out_size = pos;
+    if (consumed) {
+        // whole bytes still sitting in the bit buffer were not used
+        *consumed = (size_t)(br.src - br.start) - (size_t)unused_bytes(&br);
+    }
+    return 1;
+}
+
+int fits_inflate(uint8_t* dst, size_t dst_size, size_t* out_size,
+                 const uint8_t* src, size_t src_size, size_t* consumed) {
+    Output output = { dst, dst_size, NULL, NULL };
+    return inflate_stream(&output, out_size, src, src_size, consumed, NULL, NULL);
+}
+
+// CRC-32 of the gzip trailer (reflected polynomial 0xEDB88320), eight bytes
+// per step with the slicing-by-8 tables. Built once; every caller builds
+// the same values, so racing tile workers are harmless.
+static uint32_t crc_table[8][256];
+static int crc_table_ready;
+
+static void init_crc_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0xEDB88320u : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t c = crc_table[t - 1][i];
+            crc_table[t][i] = (c >> 8) ^ crc_table[0][c & 0xff];
+        }
+    }
+    crc_table_ready = 1;
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* p, size_t n) {
+    if (!crc_table_ready) init_crc_table();
+    crc = ~crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^ crc_table[5][(lo >> 16) & 0xff] ^
+              crc_table[4][lo >> 24] ^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+    while (n--) crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+// Gzip streams: the CRC-32 is summed block by block as the output is
+// produced, while it is still in cache, then passed on to the caller's
+// progress callback
+typedef struct {
+    const uint8_t* dst;
+    size_t summed;
+    uint32_t crc;
+    FITSInflateProgress progress;
+    void* context;
+} GzipCheck;
+
+static int gzip_check_progress(void* context, size_t produced) {
+    GzipCheck* check = (GzipCheck*)context;
+    check->crc = crc32_update(check->crc, check->dst + check->summed, produced - check->summed);
+    check->summed = produced;
+    return !check->progress || check->progress(check->context, produced);
+}
+
+static uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Length of a gzip member header, or 0 if it is malformed
+static size_t gzip_header_size(const uint8_t* src, size_t src_size) {
+    if (src_size < 10 || src[2] != 8) return 0;
+    int flags = src[3];
+    size_t pos = 10;
+    if (flags & 4) {  // FEXTRA
+        if (src_size - pos < 2) return 0;
+        pos += 2 + (src[pos] | (src[pos + 1] << 8));
+    }
+    for (int field = 8; field <= 16; field <<= 1) {  // FNAME, FCOMMENT: zero-terminated
+        if (flags & field) {
+            while (pos < src_size && src[pos]) pos++;
+            pos++;
+        }
+    }
+    if (flags & 2) pos += 2;  // FHCRC
+    return pos < src_size ? pos : 0;
+}
+
+int fits_decompress(uint8_t* dst, size_t dst_size, size_t* out_size,
+                    const uint8_t* src, size_t src_size) {
+    return fits_decompress_progress(dst, dst_size, out_size, src, src_size, NULL, NULL, NULL);
+}
+
+int fits_decompress_progress(uint8_t* dst, size_t dst_size, size_t* out_size,
+                             const uint8_t* src, size_t src_size, FITSInflateGrow grow,
+                             FITSInflateProgress progress, void* context) {
+    size_t skip = 0;
+    if (src_size >= 2 && src[0] == 0x1f && src[1] == 0x8b) {
+        skip = gzip_header_size(src, src_size);
+        if (!skip) return 0;
+
+        // the trailer after the deflate data holds the CRC-32 and the
+        // length modulo 2^32 of the inflated bytes
+        GzipCheck check = { dst, 0, 0, progress, context };
+        Output output = { dst, dst_size, grow, context };
+        size_t consumed;
+        if (!inflate_stream(&output, out_size, src + skip, src_size - skip, &consumed, gzip_check_progress, &check)) {
+            return 0;
+        }
+        check.crc = crc32_update(check.crc, dst + check.summed, *out_size - check.summed);
+        const uint8_t* trailer = src + skip + consumed;
+        if (src_size - skip - consumed < 8 || read_le32(trailer) != check.crc ||
+            read_le32(trailer + 4) != (uint32_t)*out_size) {
+            return 0;
+        }
+        return !progress || progress(context, *out_size);
+    } else if (src_size >= 2 && (src[0] & 0x0f) == 8 && ((src[0] << 8) | src[1]) % 31 == 0) {
+        if (src[1] & 0x20) return 0;  // preset dictionaries are not used by FITS writers
+        skip = 2;
+    }
+    Output output = { dst, dst_size, grow, context };
+    if (!inflate_stream(&output, out_size, src + skip, src_size - skip, NULL, progress, context)) return 0;
+    return !progress || progress(context, *out_size);
+}
@@ -0,0 +1,39 @@
+#ifndef FITS_INFLATE_H
+#define FITS_INFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Decompress a raw deflate stream (RFC 1951) into dst. On success returns 1
+// and sets *out_size to the bytes written and, if consumed is not NULL, to
+// the compressed bytes read. Returns 0 on corrupt input or when the output
+// would not fit in dst_size bytes.
+int fits_inflate(uint8_t* dst, size_t dst_size, size_t* out_size,
+                 const uint8_t* src, size_t src_size, size_t* consumed);
+
+// Same for a gzip (RFC 1952) or zlib (RFC 1950) wrapped stream; the wrapper
+// is detected from the first bytes, anything else is treated as raw deflate.
+// The gzip trailer is verified: a CRC-32 or length that does not match the
+// output fails the stream. The zlib Adler-32 is skipped.
+int fits_decompress(uint8_t* dst, size_t dst_size, size_t* out_size,
+                    const uint8_t* src, size_t src_size);
+
+// Called with the total output so far each time a deflate block completes;
+// returning 0 abandons the stream
+typedef int (*FITSInflateProgress)(void* context, size_t produced);
+
+// Called when the output needs needed bytes but dst_size is smaller; makes
+// more of the memory after dst usable, in place, and returns the new size,
+// or less than needed to fail the stream
+typedef size_t (*FITSInflateGrow)(void* context, size_t needed);
+
+// fits_decompress reporting its progress, so a consumer on another thread
+// can work on the output while it is still growing. The last block is only
+// reported once a gzip trailer has been checked, so output that fails it
+// never shows as complete. With grow set, dst_size is only the room
+// available so far; both callbacks get context.
+int fits_decompress_progress(uint8_t* dst, size_t dst_size, size_t* out_size,
+                             const uint8_t* src, size_t src_size, FITSInflateGrow grow,
+                             FITSInflateProgress progress, void* context);
+
+#endif // FITS_INFLATE_H
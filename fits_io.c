@@ -0,0 +1,1056 @@
+#ifndef _WIN32
+#define _GNU_SOURCE           // O_DIRECT
+#define _FILE_OFFSET_BITS 64  // files past 2 GB on 32-bit builds
+#endif
+
+#include "fits_io.h"
+#include "fits_inflate.h"
+#include "fits_platform.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+// sequential is 0 when only a few header blocks will be read
+static int map_open(FITSMappedFile* file, const wchar_t* path, int sequential) {
+    memset(file, 0, sizeof(*file));
+
+    HANDLE handle = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL | (sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS),
+                                NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart <= 0 || (ULONGLONG)size.QuadPart > (size_t)-1) {
+        CloseHandle(handle);
+        return 0;
+    }
+
+    HANDLE mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) {
+        CloseHandle(handle);
+        return 0;
+    }
+
+    const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+        CloseHandle(mapping);
+        CloseHandle(handle);
+        return 0;
+    }
+
+    file->data = (const uint8_t*)view;
+    file->size = (size_t)size.QuadPart;
+    file->file_handle = handle;
+    file->mapping_handle = mapping;
+    return 1;
+}
+
+int fits_map_open(FITSMappedFile* file, const wchar_t* path) {
+    return map_open(file, path, 1);
+}
+
+int fits_file_info(const wchar_t* path, uint64_t* size, int64_t* mtime, int* is_directory) {
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &info)) return 0;
+    uint64_t ticks = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    *size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    *mtime = (int64_t)(ticks / 10000000) - 11644473600LL;  // 100 ns ticks since 1601
+    *is_directory = (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    return 1;
+}
+
+void fits_map_close(FITSMappedFile* file) {
+    if (file->data) UnmapViewOfFile(file->data);
+    if (file->mapping_handle) CloseHandle((HANDLE)file->mapping_handle);
+    if (file->file_handle) CloseHandle((HANDLE)file->file_handle);
+    memset(file, 0, sizeof(*file));
+}
+
+// Readahead is left to FILE_FLAG_SEQUENTIAL_SCAN on Windows, and files are
+// always read through the cache
+void fits_input_prefetch(const wchar_t* path) {
+    (void)path;
+}
+
+static void drop_cache(FITSMappedFile* file) {
+    (void)file;
+}
+
+#else
+
+// POSIX paths are narrow; convert using the current locale
+static int open_path(const wchar_t* path, int flags) {
+    size_t len = wcstombs(NULL, path, 0);
+    if (len == (size_t)-1) {
+        return -1;
+    }
+    char* narrow = (char*)malloc(len + 1);
+    if (!narrow) {
+        return -1;
+    }
+    wcstombs(narrow, path, len + 1);
+    int fd = open(narrow, flags);
+    free(narrow);
+    return fd;
+}
+
+static int map_open(FITSMappedFile* file, const wchar_t* path, int sequential) {
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+
+    int fd = open_path(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > (size_t)-1) {
+        close(fd);
+        return 0;
+    }
+
+    void* view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (view == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+
+    if (sequential) {
+        // The file is read front to back exactly once: ask for aggressive
+        // readahead and let the pages go soon after they have been read
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        madvise(view, (size_t)st.st_size, MADV_SEQUENTIAL);
+    } else {
+        // only header blocks are touched; reading the data ahead would waste the I/O
+        posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+        madvise(view, (size_t)st.st_size, MADV_RANDOM);
+    }
+
+    file->data = (const uint8_t*)view;
+    file->size = (size_t)st.st_size;
+    file->fd = fd;
+    return 1;
+}
+
+int fits_map_open(FITSMappedFile* file, const wchar_t* path) {
+    return map_open(file, path, 1);
+}
+
+int fits_file_info(const wchar_t* path, uint64_t* size, int64_t* mtime, int* is_directory) {
+    size_t len = wcstombs(NULL, path, 0);
+    if (len == (size_t)-1) return 0;
+    char* narrow = (char*)malloc(len + 1);
+    if (!narrow) return 0;
+    wcstombs(narrow, path, len + 1);
+    struct stat st;
+    int ok = stat(narrow, &st) == 0;
+    free(narrow);
+    if (!ok) return 0;
+    *size = (uint64_t)st.st_size;
+    *mtime = (int64_t)st.st_mtime;
+    *is_directory = S_ISDIR(st.st_mode);
+    return 1;
+}
+
+void fits_map_close(FITSMappedFile* file) {
+    if (file->data) munmap((void*)file->data, file->size);
+    if (file->fd >= 0) close(file->fd);
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+}
+
+void fits_input_prefetch(const wchar_t* path) {
+    int fd = open_path(path, O_RDONLY);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);  // starts the reads, does not wait for them
+    close(fd);
+}
+
+// Evict a consumed file from the page cache, so a batch of large frames
+// does not push out everything else
+static void drop_cache(FITSMappedFile* file) {
+    if (file->data) {
+        munmap((void*)file->data, file->size);  // pages still mapped would stay
+        file->data = NULL;
+    }
+    if (file->fd >= 0) posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+// Background input: gzip inflate and O_DIRECT reads
+// ---------------------------------------------------------------------------
+
+// A helper thread fills buffer front to back while the converter already
+// works on the part that is done
+struct FITSInputStream {
+    const uint8_t* src;     // gzip: the compressed file, mapped
+    size_t src_size;
+    int fd;                 // direct: the file, opened with O_DIRECT
+    uint8_t* buffer;        // file contents
+    size_t capacity;
+    size_t committed;       // gzip: buffer is reserved address space, usable up to here
+    FITSThread thread;
+    FITSMutex mutex;        // guards the fields below
+    FITSCond changed;
+    size_t available;       // bytes of buffer already filled
+    int done;
+    int failed;             // done, but the stream was corrupt, failed its check or could not be read
+    int cancel;
+};
+
+// One file of a prefetched batch. The stream carries its buffer and read
+// progress to the converter; everything else belongs to the reader thread
+// and is guarded by the prefetcher mutex.
+struct FITSPrefetchEntry {
+    FITSPrefetcher* owner;
+    wchar_t* path;
+    FITSInputStream* stream;
+    intptr_t file;          // open file while the entry is held, -1 for none
+    uint64_t size;
+    size_t allocated;       // buffer bytes counted against the budget
+    int opened;
+    int reading;            // buffer allocated, reads being issued
+    int failed;
+    int released;           // the converter is done with it
+    int freed;
+    size_t submitted;       // bytes covered by issued reads
+    size_t inflight;
+    uint8_t* chunk_done;    // per chunk, reads may complete out of order
+    size_t contiguous;      // chunks complete from the start of the file
+};
+
+static int stream_progress(void* context, size_t produced) {
+    FITSInputStream* stream = (FITSInputStream*)context;
+    fits_mutex_lock(&stream->mutex);
+    stream->available = produced;
+    int cancel = stream->cancel;
+    fits_cond_broadcast(&stream->changed);
+    fits_mutex_unlock(&stream->mutex);
+    return !cancel;
+}
+
+static void stream_finish(FITSInputStream* stream, int ok, size_t produced) {
+    fits_mutex_lock(&stream->mutex);
+    if (ok) stream->available = produced;
+    stream->done = 1;
+    stream->failed = !ok;
+    fits_cond_broadcast(&stream->changed);
+    fits_mutex_unlock(&stream->mutex);
+}
+
+static FITSInputStream* stream_create(void) {
+    FITSInputStream* stream = (FITSInputStream*)calloc(1, sizeof(FITSInputStream));
+    if (!stream) return NULL;
+    stream->fd = -1;
+    fits_mutex_init(&stream->mutex);
+    fits_cond_init(&stream->changed);
+    return stream;
+}
+
+static void stream_free(FITSInputStream* stream) {
+    fits_cond_destroy(&stream->changed);
+    fits_mutex_destroy(&stream->mutex);
+#ifndef _WIN32
+    if (stream->fd >= 0) close(stream->fd);
+#endif
+    if (stream->committed) {
+        fits_memory_release(stream->buffer, stream->capacity);
+    } else {
+        free(stream->buffer);
+    }
+    free(stream);
+}
+
+static int stream_start(FITSInput* input, FITSInputStream* stream, void (*fn)(void* arg)) {
+    if (!fits_thread_start(&stream->thread, fn, stream)) {
+        stream_free(stream);
+        return 0;
+    }
+    input->stream = stream;
+    input->data = stream->buffer;
+    input->size = stream->capacity;
+    return 1;
+}
+
+// Memory is committed to the inflated data this much at a time
+#define GZIP_COMMIT_STEP ((size_t)64 << 20)
+
+// Deflate encodes a run of 258 bytes in as little as 2 bits
+#define DEFLATE_MAX_RATIO 1032
+
+static size_t gzip_grow(void* context, size_t needed) {
+    FITSInputStream* stream = (FITSInputStream*)context;
+    if (needed > stream->capacity) return 0;
+    size_t size = stream->capacity - needed < GZIP_COMMIT_STEP ? stream->capacity
+                : (needed + GZIP_COMMIT_STEP - 1) / GZIP_COMMIT_STEP * GZIP_COMMIT_STEP;
+    if (!fits_memory_commit(stream->buffer + stream->committed, size - stream->committed)) return 0;
+    stream->committed = size;
+    return size;
+}
+
+static void gzip_inflate_thread(void* arg) {
+    FITSInputStream* stream = (FITSInputStream*)arg;
+    size_t produced;
+    int ok = fits_decompress_progress(stream->buffer, stream->committed, &produced, stream->src,
+                                      stream->src_size, gzip_grow, stream_progress, stream);
+    stream_finish(stream, ok, produced);
+}
+
+// The gzip trailer only stores the inflated size modulo 2^32, and nothing
+// bounds the compression ratio below deflate's own maximum, so any candidate
+// up to that can be the real size; a ratio above 1:1 is the usual case, not
+// an exception. Returns the largest candidate, the size to reserve.
+static uint64_t gzip_size_limit(const uint8_t* src, size_t src_size) {
+    const uint8_t* t = src + src_size - 4;
+    uint64_t size = (uint64_t)t[0] | ((uint64_t)t[1] << 8) | ((uint64_t)t[2] << 16) | ((uint64_t)t[3] << 24);
+    uint64_t limit = (uint64_t)src_size <= (uint64_t)SIZE_MAX / DEFLATE_MAX_RATIO
+                   ? (uint64_t)src_size * DEFLATE_MAX_RATIO : (uint64_t)SIZE_MAX;
+    if (size > limit) return 0;  // not a trailer of this stream
+    while (limit - size >= ((uint64_t)1 << 32)) size += (uint64_t)1 << 32;
+    return size;
+}
+
+// The inflated file goes into reserved address space that is committed as
+// the inflater fills it, so its pointer never moves while the converter
+// works on the data and only the real size is ever backed by memory
+static int gzip_open(FITSInput* input, const uint8_t* src, size_t src_size) {
+    uint64_t capacity = src_size >= 18 ? gzip_size_limit(src, src_size) : 0;
+    if (capacity == 0) return 0;
+
+    FITSInputStream* stream = stream_create();
+    if (!stream) return 0;
+    stream->src = src;
+    stream->src_size = src_size;
+    // a smaller address space may not fit the largest candidate; the inflater
+    // then fails on the files that are really bigger than the reservation
+    while (!(stream->buffer = (uint8_t*)fits_memory_reserve((size_t)capacity)) && capacity > ((uint64_t)1 << 32)) {
+        capacity -= (uint64_t)1 << 32;
+    }
+    if (!stream->buffer) {
+        stream_free(stream);
+        return 0;
+    }
+    stream->capacity = (size_t)capacity;
+    if (!gzip_grow(stream, 1)) {
+        fits_memory_release(stream->buffer, stream->capacity);
+        stream->buffer = NULL;
+        stream_free(stream);
+        return 0;
+    }
+    return stream_start(input, stream, gzip_inflate_thread);
+}
+
+#if !defined(_WIN32) && defined(O_DIRECT)
+
+#define DIRECT_ALIGNMENT 4096
+#define DIRECT_CHUNK ((size_t)8 << 20)
+
+static void direct_read_thread(void* arg) {
+    FITSInputStream* stream = (FITSInputStream*)arg;
+    size_t rounded = (stream->capacity + DIRECT_ALIGNMENT - 1) & ~(size_t)(DIRECT_ALIGNMENT - 1);
+    size_t pos = 0;
+    int ok = 1;
+    while (pos < stream->capacity) {
+        // whole aligned chunks; the read at the end of the file comes back short
+        size_t n = rounded - pos < DIRECT_CHUNK ? rounded - pos : DIRECT_CHUNK;
+        ssize_t r = pread(stream->fd, stream->buffer + pos, n, (off_t)pos);
+        if (r <= 0) {
+            ok = 0;
+            break;
+        }
+        pos += (size_t)r;
+        if (!stream_progress(stream, pos < stream->capacity ? pos : stream->capacity)) {
+            ok = 0;
+            break;
+        }
+    }
+    stream_finish(stream, ok, stream->capacity);
+}
+
+// Read a plain file with O_DIRECT into private memory, past the page cache.
+// Returns 0, and the caller maps the file instead, for gzip files and on file
+// systems that refuse O_DIRECT.
+static int direct_open(FITSInput* input, const wchar_t* path) {
+    int fd = open_path(path, O_RDONLY | O_DIRECT);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > (size_t)-1 - DIRECT_ALIGNMENT) {
+        close(fd);
+        return 0;
+    }
+    FITSInputStream* stream = stream_create();
+    if (!stream) {
+        close(fd);
+        return 0;
+    }
+    stream->fd = fd;
+    stream->capacity = (size_t)st.st_size;
+    void* buffer;
+    size_t rounded = (stream->capacity + DIRECT_ALIGNMENT - 1) & ~(size_t)(DIRECT_ALIGNMENT - 1);
+    if (posix_memalign(&buffer, DIRECT_ALIGNMENT, rounded) != 0) {
+        stream_free(stream);
+        return 0;
+    }
+    stream->buffer = (uint8_t*)buffer;
+
+    // gzip input has to go through the inflater, which works on the mapping
+    ssize_t r = pread(fd, buffer, DIRECT_ALIGNMENT, 0);
+    if (r < 2 || (stream->buffer[0] == 0x1f && stream->buffer[1] == 0x8b)) {
+        stream_free(stream);
+        return 0;
+    }
+    return stream_start(input, stream, direct_read_thread);
+}
+
+#else
+
+static int direct_open(FITSInput* input, const wchar_t* path) {
+    (void)input;
+    (void)path;
+    return 0;
+}
+
+#endif
+
+// Cleared, with no file held; -1 marks the descriptor unused, since 0 is a
+// valid one
+static void input_reset(FITSInput* input) {
+    memset(input, 0, sizeof(*input));
+#ifndef _WIN32
+    input->file.fd = -1;
+#endif
+}
+
+int fits_input_open(FITSInput* input, const wchar_t* path, int flags) {
+    input_reset(input);
+    input->flags = flags;
+    if ((flags & FITS_INPUT_DIRECT) && direct_open(input, path)) return 1;
+    if (!map_open(&input->file, path, !(flags & FITS_INPUT_HEADERS))) return 0;
+
+    if (input->file.size >= 2 && input->file.data[0] == 0x1f && input->file.data[1] == 0x8b) {
+        if (!gzip_open(input, input->file.data, input->file.size)) {
+            fits_map_close(&input->file);
+            return 0;
+        }
+    } else {
+        input->data = input->file.data;
+        input->size = input->file.size;
+    }
+    return 1;
+}
+
+size_t fits_input_wait(FITSInput* input, size_t end, int* at_end) {
+    FITSInputStream* stream = input->stream;
+    if (!stream) {
+        if (at_end) *at_end = 1;
+        return input->size;
+    }
+    fits_mutex_lock(&stream->mutex);
+    while (stream->available < end && !stream->done) {
+        fits_cond_wait(&stream->changed, &stream->mutex);
+    }
+    size_t available = stream->available;
+    if (at_end) *at_end = stream->done;
+    fits_mutex_unlock(&stream->mutex);
+    return available;
+}
+
+int fits_input_verify(FITSInput* input) {
+    FITSInputStream* stream = input->stream;
+    if (!stream || !stream->src) return 1;
+    fits_mutex_lock(&stream->mutex);
+    while (!stream->done) {
+        fits_cond_wait(&stream->changed, &stream->mutex);
+    }
+    int ok = !stream->failed;
+    size_t available = stream->available;
+    fits_mutex_unlock(&stream->mutex);
+    if (ok) input->size = available;
+    return ok;
+}
+
+static void prefetch_release(FITSPrefetchEntry* entry);
+
+void fits_input_close(FITSInput* input) {
+    FITSInputStream* stream = input->stream;
+    FITSPrefetchEntry* prefetched = input->prefetched;
+    if (stream && !(prefetched && stream == prefetched->stream)) {
+        fits_mutex_lock(&stream->mutex);
+        stream->cancel = 1;
+        fits_mutex_unlock(&stream->mutex);
+        fits_thread_join(&stream->thread);
+        stream_free(stream);
+    }
+    if (prefetched) prefetch_release(prefetched);
+    if (input->flags & FITS_INPUT_DROP_CACHE) drop_cache(&input->file);
+    fits_map_close(&input->file);
+    input_reset(input);
+}
+
+// ---------------------------------------------------------------------------
+// Batch prefetch
+// ---------------------------------------------------------------------------
+
+#if defined(__linux__)
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define FITS_HAVE_IO_URING 1
+#endif
+#endif
+
+#define PREFETCH_CHUNK ((size_t)1 << 20)
+#define PREFETCH_QUEUE_DEPTH 32
+#define PREFETCH_ALIGNMENT 4096
+
+typedef struct {
+    FITSPrefetchEntry* entry;
+    size_t offset;
+    size_t length;
+    long long result;       // bytes read, negative on error
+    int busy;
+    int complete;           // result is known (reads queued for the reader thread are not)
+} ReadRequest;
+
+struct FITSPrefetcher {
+    FITSPrefetchEntry* entries;  // in conversion order
+    size_t count;
+    size_t next_open;            // next entry the reader opens
+    size_t next_take;            // next entry handed to the converter
+    size_t depth;
+    size_t budget;
+    size_t held;                 // buffer bytes of entries not yet freed
+    int flags;
+    int stop;
+
+    ReadRequest requests[PREFETCH_QUEUE_DEPTH];
+    size_t inflight;
+    ReadRequest* queue[PREFETCH_QUEUE_DEPTH];  // reads for the thread engine, oldest first
+    size_t queue_head, queue_count;
+
+    FITSThread thread;
+    int thread_started;
+    FITSMutex mutex;
+    FITSCond changed;
+
+#ifdef FITS_HAVE_IO_URING
+    int ring;                    // io_uring fd, -1 when the thread engine is used
+    void* sq_ptr;
+    void* cq_ptr;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+#endif
+};
+
+#ifdef _WIN32
+
+static intptr_t file_open_read(const wchar_t* path, int direct, uint64_t* size) {
+    (void)direct;
+    HANDLE handle = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle == INVALID_HANDLE_VALUE) return -1;
+    LARGE_INTEGER length;
+    if (!GetFileSizeEx(handle, &length)) {
+        CloseHandle(handle);
+        return -1;
+    }
+    *size = (uint64_t)length.QuadPart;
+    return (intptr_t)handle;
+}
+
+static long long file_read_at(intptr_t file, uint8_t* buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        OVERLAPPED position = {0};
+        position.Offset = (DWORD)(offset + done);
+        position.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD want = length - done > ((DWORD)1 << 30) ? ((DWORD)1 << 30) : (DWORD)(length - done);
+        DWORD got = 0;
+        if (!ReadFile((HANDLE)file, buffer + done, want, &got, &position)) {
+            if (GetLastError() == ERROR_HANDLE_EOF) break;
+            return -1;
+        }
+        if (got == 0) break;
+        done += got;
+    }
+    return (long long)done;
+}
+
+static void file_close(intptr_t file, int drop) {
+    (void)drop;
+    CloseHandle((HANDLE)file);
+}
+
+#else
+
+static intptr_t file_open_read(const wchar_t* path, int direct, uint64_t* size) {
+    int fd = -1;
+#ifdef O_DIRECT
+    if (direct) fd = open_path(path, O_RDONLY | O_DIRECT);
+#endif
+    if (fd < 0) fd = open_path(path, O_RDONLY);  // also where O_DIRECT is refused
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 0) {
+        close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    *size = (uint64_t)st.st_size;
+    return fd;
+}
+
+static long long file_read_at(intptr_t file, uint8_t* buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t got = pread((int)file, buffer + done, length - done, (off_t)(offset + done));
+        if (got < 0) return -1;
+        if (got == 0) break;
+        done += (size_t)got;
+    }
+    return (long long)done;
+}
+
+static void file_close(intptr_t file, int drop) {
+    if (drop) posix_fadvise((int)file, 0, 0, POSIX_FADV_DONTNEED);
+    close((int)file);
+}
+
+#endif
+
+// ---- io_uring engine: reads are submitted to the kernel and reaped as they
+// complete, in any order. Raw system calls, no liburing. ----
+
+#ifdef FITS_HAVE_IO_URING
+
+static int uring_setup(FITSPrefetcher* p) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring = (int)syscall(__NR_io_uring_setup, PREFETCH_QUEUE_DEPTH, &params);
+    if (ring < 0) return 0;  // old kernel or blocked by a sandbox
+
+    p->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    p->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        if (p->cq_size > p->sq_size) p->sq_size = p->cq_size;
+        p->cq_size = p->sq_size;
+    }
+    p->sq_ptr = mmap(NULL, p->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    p->cq_ptr = single ? p->sq_ptr
+                       : mmap(NULL, p->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    p->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    p->sqes = (struct io_uring_sqe*)mmap(NULL, p->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                         ring, IORING_OFF_SQES);
+    if (p->sq_ptr == MAP_FAILED || p->cq_ptr == MAP_FAILED || p->sqes == MAP_FAILED) {
+        if (p->sq_ptr != MAP_FAILED) munmap(p->sq_ptr, p->sq_size);
+        if (!single && p->cq_ptr != MAP_FAILED) munmap(p->cq_ptr, p->cq_size);
+        if (p->sqes != MAP_FAILED) munmap(p->sqes, p->sqes_size);
+        close(ring);
+        return 0;
+    }
+
+    uint8_t* sq = (uint8_t*)p->sq_ptr;
+    uint8_t* cq = (uint8_t*)p->cq_ptr;
+    p->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    p->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    p->sq_array = (unsigned*)(sq + params.sq_off.array);
+    p->cq_head = (unsigned*)(cq + params.cq_off.head);
+    p->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    p->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    p->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    p->ring = ring;
+    return 1;
+}
+
+static void uring_close(FITSPrefetcher* p) {
+    if (p->ring < 0) return;
+    munmap(p->sqes, p->sqes_size);
+    if (p->cq_ptr != p->sq_ptr) munmap(p->cq_ptr, p->cq_size);
+    munmap(p->sq_ptr, p->sq_size);
+    close(p->ring);
+    p->ring = -1;
+}
+
+static int uring_submit(FITSPrefetcher* p, ReadRequest* r) {
+    unsigned tail = *p->sq_tail;
+    unsigned index = tail & *p->sq_mask;
+    struct io_uring_sqe* sqe = &p->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = (int)r->entry->file;
+    sqe->addr = (uint64_t)(uintptr_t)(r->entry->stream->buffer + r->offset);
+    sqe->len = (uint32_t)r->length;
+    sqe->off = r->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)r;
+    p->sq_array[index] = index;
+    __atomic_store_n(p->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (syscall(__NR_io_uring_enter, p->ring, 1, 0, 0, NULL, 0) == 1) return 1;
+    __atomic_store_n(p->sq_tail, tail, __ATOMIC_RELEASE);  // not consumed, the reader thread takes it
+    return 0;
+}
+
+static ReadRequest* uring_reap(FITSPrefetcher* p) {
+    for (;;) {
+        unsigned head = *p->cq_head;
+        if (head != __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &p->cqes[head & *p->cq_mask];
+            ReadRequest* r = (ReadRequest*)(uintptr_t)cqe->user_data;
+            r->result = cqe->res;
+            __atomic_store_n(p->cq_head, head + 1, __ATOMIC_RELEASE);
+            return r;
+        }
+        if (syscall(__NR_io_uring_enter, p->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            return NULL;
+        }
+    }
+}
+
+#endif // FITS_HAVE_IO_URING
+
+static int use_uring(const FITSPrefetcher* p) {
+#ifdef FITS_HAVE_IO_URING
+    return p->ring >= 0;
+#else
+    (void)p;
+    return 0;
+#endif
+}
+
+// Called with the mutex held. The thread engine only queues the read; it is
+// done by prefetch_reap, outside the lock.
+static void engine_submit(FITSPrefetcher* p, ReadRequest* r) {
+    r->complete = 0;
+#ifdef FITS_HAVE_IO_URING
+    if (use_uring(p) && uring_submit(p, r)) return;
+#endif
+    p->queue[(p->queue_head + p->queue_count) % PREFETCH_QUEUE_DEPTH] = r;
+    p->queue_count++;
+}
+
+// Wait for one read to finish, called without the mutex. Reads the kernel
+// failed or cut short (an io_uring without IORING_OP_READ, say) are redone
+// with plain blocking reads, so either way the result is final.
+static ReadRequest* engine_reap(FITSPrefetcher* p) {
+    ReadRequest* r = NULL;
+    fits_mutex_lock(&p->mutex);
+    if (p->queue_count) {
+        r = p->queue[p->queue_head];
+        p->queue_head = (p->queue_head + 1) % PREFETCH_QUEUE_DEPTH;
+        p->queue_count--;
+    }
+    fits_mutex_unlock(&p->mutex);
+#ifdef FITS_HAVE_IO_URING
+    if (!r && use_uring(p)) {
+        r = uring_reap(p);
+        if (!r) return NULL;
+        r->complete = 1;
+    }
+#endif
+    if (!r) return NULL;
+    FITSPrefetchEntry* e = r->entry;
+    size_t expected = e->size - r->offset < r->length ? (size_t)(e->size - r->offset) : r->length;
+    if (!r->complete || r->result < (long long)expected) {
+        r->result = file_read_at(e->file, e->stream->buffer + r->offset, r->length, r->offset);
+    }
+    r->complete = 1;
+    return r;
+}
+
+// ---- scheduling, all with the mutex held ----
+
+static void prefetch_free(FITSPrefetcher* p, FITSPrefetchEntry* e) {
+    if (e->file >= 0) file_close(e->file, (p->flags & FITS_INPUT_DROP_CACHE) != 0);
+    e->file = -1;
+    stream_free(e->stream);
+    e->stream = NULL;
+    free(e->chunk_done);
+    e->chunk_done = NULL;
+    p->held -= e->allocated;
+    e->freed = 1;
+}
+
+static void prefetch_fail(FITSPrefetchEntry* e) {
+    e->failed = 1;
+    stream_finish(e->stream, 0, 0);
+}
+
+// Open the next files and give them buffers, as far as depth and budget allow
+static void prefetch_open_entries(FITSPrefetcher* p) {
+    while (p->next_open < p->count && p->next_open < p->next_take + p->depth) {
+        FITSPrefetchEntry* e = &p->entries[p->next_open];
+        if (e->released) {  // skipped before it was opened
+            p->next_open++;
+            continue;
+        }
+        if (!e->opened) {
+            e->opened = 1;
+            e->file = file_open_read(e->path, (p->flags & FITS_INPUT_DIRECT) != 0, &e->size);
+            if (e->file < 0 || e->size == 0 || e->size > (uint64_t)SIZE_MAX - PREFETCH_CHUNK) {
+                prefetch_fail(e);  // the converter falls back to opening it itself
+                p->next_open++;
+                continue;
+            }
+        }
+        size_t rounded = ((size_t)e->size + PREFETCH_ALIGNMENT - 1) & ~(size_t)(PREFETCH_ALIGNMENT - 1);
+        if (rounded > p->budget) {
+            prefetch_fail(e);  // never fits; the converter maps it instead
+            p->next_open++;
+            continue;
+        }
+        if (p->held + rounded > p->budget) break;  // wait for a release
+
+        void* buffer = NULL;
+#ifdef _WIN32
+        buffer = malloc(rounded);
+#else
+        if (posix_memalign(&buffer, PREFETCH_ALIGNMENT, rounded) != 0) buffer = NULL;  // O_DIRECT needs alignment
+#endif
+        e->chunk_done = (uint8_t*)calloc((rounded + PREFETCH_CHUNK - 1) / PREFETCH_CHUNK, 1);
+        if (!buffer || !e->chunk_done) {
+            free(buffer);
+            prefetch_fail(e);
+            p->next_open++;
+            continue;
+        }
+        e->allocated = rounded;
+        p->held += rounded;
+        e->reading = 1;
+        fits_mutex_lock(&e->stream->mutex);
+        e->stream->buffer = (uint8_t*)buffer;
+        e->stream->capacity = (size_t)e->size;
+        fits_cond_broadcast(&e->stream->changed);
+        fits_mutex_unlock(&e->stream->mutex);
+        p->next_open++;
+    }
+}
+
+// Keep the queue full, earliest file first, so the file the converter needs
+// next always gets its reads before the ones after it
+static void prefetch_submit(FITSPrefetcher* p) {
+    for (size_t i = p->next_take ? p->next_take - 1 : 0; i < p->next_open; i++) {
+        FITSPrefetchEntry* e = &p->entries[i];
+        if (!e->reading || e->failed || e->released) continue;
+        while (e->submitted < e->allocated && p->inflight < PREFETCH_QUEUE_DEPTH) {
+            ReadRequest* r = p->requests;
+            while (r->busy) r++;
+            r->busy = 1;
+            r->entry = e;
+            r->offset = e->submitted;
+            r->length = e->allocated - e->submitted < PREFETCH_CHUNK ? e->allocated - e->submitted : PREFETCH_CHUNK;
+            e->submitted += r->length;
+            e->inflight++;
+            p->inflight++;
+            engine_submit(p, r);
+        }
+        if (p->inflight == PREFETCH_QUEUE_DEPTH) break;
+    }
+}
+
+static void prefetch_complete(FITSPrefetcher* p, ReadRequest* r) {
+    FITSPrefetchEntry* e = r->entry;
+    size_t expected = e->size - r->offset < r->length ? (size_t)(e->size - r->offset) : r->length;
+    r->busy = 0;
+    e->inflight--;
+    p->inflight--;
+    if (e->failed || e->released) return;
+    if (r->result < (long long)expected) {
+        e->failed = 1;  // the converter sees a truncated file
+        stream_finish(e->stream, 0, 0);
+        return;
+    }
+    e->chunk_done[r->offset / PREFETCH_CHUNK] = 1;
+    size_t chunks = (e->allocated + PREFETCH_CHUNK - 1) / PREFETCH_CHUNK;
+    while (e->contiguous < chunks && e->chunk_done[e->contiguous]) e->contiguous++;
+    size_t ready = e->contiguous * PREFETCH_CHUNK;
+    if (ready >= e->size) {
+        stream_finish(e->stream, 1, (size_t)e->size);
+    } else {
+        stream_progress(e->stream, ready);
+    }
+}
+
+static void prefetch_thread(void* arg) {
+    FITSPrefetcher* p = (FITSPrefetcher*)arg;
+    fits_mutex_lock(&p->mutex);
+    for (;;) {
+        for (size_t i = 0; i < p->next_open; i++) {
+            FITSPrefetchEntry* e = &p->entries[i];
+            if (e->released && !e->freed && e->inflight == 0) prefetch_free(p, e);
+        }
+        if (!p->stop) {
+            prefetch_open_entries(p);
+            prefetch_submit(p);
+        }
+        if (p->inflight == 0) {
+            if (p->stop) break;
+            fits_cond_wait(&p->changed, &p->mutex);
+            continue;
+        }
+        fits_mutex_unlock(&p->mutex);
+        ReadRequest* r = engine_reap(p);
+        fits_mutex_lock(&p->mutex);
+        if (!r) break;  // the ring broke
+        prefetch_complete(p, r);
+    }
+    // Whatever is still unread now never will be; the converter sees it truncated
+    for (size_t i = 0; i < p->count; i++) {
+        FITSPrefetchEntry* e = &p->entries[i];
+        if (!e->failed && !e->freed) prefetch_fail(e);
+    }
+    p->stop = 1;
+    fits_mutex_unlock(&p->mutex);
+}
+
+FITSPrefetcher* fits_prefetcher_create(wchar_t** paths, size_t count, size_t depth, size_t budget, int flags) {
+    FITSPrefetcher* p = (FITSPrefetcher*)calloc(1, sizeof(FITSPrefetcher));
+    if (!p) return NULL;
+    p->entries = (FITSPrefetchEntry*)calloc(count ? count : 1, sizeof(FITSPrefetchEntry));
+    if (!p->entries) {
+        free(p);
+        return NULL;
+    }
+    p->count = count;
+    p->depth = depth + 1;  // the file being converted and depth more
+    p->budget = budget;
+    p->flags = flags;
+    p->stop = 1;  // until the thread runs
+    fits_mutex_init(&p->mutex);
+    fits_cond_init(&p->changed);
+#ifdef FITS_HAVE_IO_URING
+    p->ring = -1;
+#endif
+    for (size_t i = 0; i < count; i++) {
+        FITSPrefetchEntry* e = &p->entries[i];
+        e->owner = p;
+        e->file = -1;
+        size_t len = wcslen(paths[i]);
+        e->path = (wchar_t*)malloc((len + 1) * sizeof(wchar_t));
+        e->stream = stream_create();
+        if (!e->path || !e->stream) {
+            p->count = i + 1;
+            fits_prefetcher_destroy(p);
+            return NULL;
+        }
+        memcpy(e->path, paths[i], (len + 1) * sizeof(wchar_t));
+    }
+#ifdef FITS_HAVE_IO_URING
+    uring_setup(p);
+#endif
+    p->stop = 0;
+    if (!fits_thread_start(&p->thread, prefetch_thread, p)) {
+        fits_prefetcher_destroy(p);
+        return NULL;
+    }
+    p->thread_started = 1;
+    return p;
+}
+
+void fits_prefetcher_destroy(FITSPrefetcher* p) {
+    if (!p) return;
+    if (p->thread_started) {
+        fits_mutex_lock(&p->mutex);
+        p->stop = 1;
+        fits_cond_broadcast(&p->changed);
+        fits_mutex_unlock(&p->mutex);
+        fits_thread_join(&p->thread);  // returns once no read is in flight
+    }
+    for (size_t i = 0; i < p->count; i++) {
+        FITSPrefetchEntry* e = &p->entries[i];
+        if (e->stream && !e->freed) prefetch_free(p, e);
+        free(e->path);
+    }
+#ifdef FITS_HAVE_IO_URING
+    uring_close(p);
+#endif
+    fits_cond_destroy(&p->changed);
+    fits_mutex_destroy(&p->mutex);
+    free(p->entries);
+    free(p);
+}
+
+const char* fits_prefetcher_engine(const FITSPrefetcher* prefetcher) {
+    return use_uring(prefetcher) ? "io_uring" : "reader thread";
+}
+
+static void prefetch_release(FITSPrefetchEntry* entry) {
+    FITSPrefetcher* p = entry->owner;
+    fits_mutex_lock(&p->mutex);
+    entry->released = 1;
+    fits_cond_broadcast(&p->changed);
+    fits_mutex_unlock(&p->mutex);
+}
+
+int fits_input_open_prefetched(FITSInput* input, FITSPrefetcher* p, const wchar_t* path, int flags) {
+    // Take the next entry; files the converter skipped are given up
+    FITSPrefetchEntry* entry = NULL;
+    fits_mutex_lock(&p->mutex);
+    for (size_t i = p->next_take; i < p->count; i++) {
+        if (wcscmp(p->entries[i].path, path) != 0) continue;
+        for (; p->next_take < i; p->next_take++) p->entries[p->next_take].released = 1;
+        entry = &p->entries[i];
+        p->next_take = i + 1;
+        fits_cond_broadcast(&p->changed);
+        break;
+    }
+    fits_mutex_unlock(&p->mutex);
+    if (!entry) return fits_input_open(input, path, flags);
+
+    // Wait for the reader to open it and allocate its buffer
+    FITSInputStream* stream = entry->stream;
+    fits_mutex_lock(&stream->mutex);
+    while (!stream->buffer && !stream->done) {
+        fits_cond_wait(&stream->changed, &stream->mutex);
+    }
+    int ready = stream->buffer != NULL;
+    fits_mutex_unlock(&stream->mutex);
+    if (!ready) {
+        prefetch_release(entry);
+        return fits_input_open(input, path, flags);  // which reports the error
+    }
+
+    input_reset(input);
+    input->flags = flags & ~FITS_INPUT_DROP_CACHE;  // the prefetcher drops the cache itself
+    input->prefetched = entry;
+    input->stream = stream;
+    input->data = stream->buffer;
+    input->size = stream->capacity;
+
+    // Compressed files are inflated from the complete prefetched copy
+    if (fits_input_wait(input, 2, NULL) >= 2 && input->data[0] == 0x1f && input->data[1] == 0x8b) {
+        size_t size = input->size;
+        int read = fits_input_wait(input, size, NULL) == size;
+        input->stream = NULL;
+        if (!read || !gzip_open(input, stream->buffer, size)) {
+            fits_input_close(input);
+            return 0;
+        }
+    }
+    return 1;
+}
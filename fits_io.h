@@ -0,0 +1,107 @@
+#ifndef FITS_IO_H
+#define FITS_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+// Read-only view of a whole input file. The file is mapped once and the
+// header and data units are read straight from the mapping, so later stages
+// can keep pointers into it instead of making private copies.
+typedef struct {
+    const uint8_t* data;  // first byte of the file
+    size_t size;          // file size in bytes
+#ifdef _WIN32
+    void* file_handle;
+    void* mapping_handle;
+#else
+    int fd;
+#endif
+} FITSMappedFile;
+
+// Map the file at path read-only. Returns 1 on success, 0 on failure
+// (missing file, empty file or mapping error).
+int fits_map_open(FITSMappedFile* file, const wchar_t* path);
+
+// Unmap and close a file opened with fits_map_open. Safe to call again on
+// a closed FITSMappedFile, or on one whose fits_map_open failed.
+void fits_map_close(FITSMappedFile* file);
+
+// Size, modification time (seconds since 1970) and type of a file without
+// opening it. Returns 0 if path does not exist.
+int fits_file_info(const wchar_t* path, uint64_t* size, int64_t* mtime, int* is_directory);
+
+typedef struct FITSInputStream FITSInputStream;
+typedef struct FITSPrefetcher FITSPrefetcher;
+typedef struct FITSPrefetchEntry FITSPrefetchEntry;
+
+// The input file as the converter reads it. Plain files are mapped and are
+// available at once. Gzip-compressed files (.fits.gz), and plain files read
+// with FITS_INPUT_DIRECT, are filled into memory by a background thread
+// while the converter already works on the first blocks; readers call
+// fits_input_wait for the bytes they need next.
+typedef struct {
+    FITSMappedFile file;
+    FITSInputStream* stream;  // NULL for mapped plain files
+    FITSPrefetchEntry* prefetched;  // the batch entry whose buffer this is, or NULL
+    int flags;
+    const uint8_t* data;      // file contents, decompressed
+    // File size. For gzip input only an upper bound, the room reserved for
+    // the inflated data, until fits_input_verify sets the real size.
+    size_t size;
+} FITSInput;
+
+// fits_input_open flags, for batches of large files. The first two only
+// have an effect on Linux.
+enum {
+    FITS_INPUT_DROP_CACHE = 1,  // evict the file from the page cache on close
+    FITS_INPUT_DIRECT = 2,      // read plain files with O_DIRECT into private memory, not through the cache
+    FITS_INPUT_HEADERS = 4      // only header blocks will be read, so nothing is read ahead
+};
+
+// Open a plain or gzip-compressed file; the format is detected from its
+// first bytes. Returns 1 on success, 0 on failure.
+int fits_input_open(FITSInput* input, const wchar_t* path, int flags);
+
+// Tell the OS that path will be read soon, so it starts reading it ahead
+// (posix_fadvise WILLNEED) while the current file is converted.
+void fits_input_prefetch(const wchar_t* path);
+
+// Block until the first end bytes of the input can be read. Returns how many
+// bytes are readable, which is less than end only if the file ends earlier
+// or its compressed stream is corrupt. *at_end (if not NULL) is set when no
+// further bytes will arrive.
+size_t fits_input_wait(FITSInput* input, size_t end, int* at_end);
+
+// For gzip input, block until the whole stream is inflated and its trailer
+// checked, then set size to the inflated size. Returns 0 if the stream is
+// corrupt or its CRC-32 or length does not match the trailer. Other input
+// returns 1 at once.
+int fits_input_verify(FITSInput* input);
+
+// Stops any background inflate and releases the input. Safe to call again
+// on a closed FITSInput, or on one whose open failed.
+void fits_input_close(FITSInput* input);
+
+// Reads a batch of input files into memory ahead of the converter. While
+// one file is converted, reads for the next depth files are already in
+// flight, as long as the buffers held stay within budget bytes. Files larger
+// than budget are not prefetched; the converter maps them when it gets to
+// them. Uses io_uring on Linux where the
+// kernel allows it and a reader thread otherwise. flags are FITS_INPUT_*
+// flags applied to every file. Returns NULL on failure.
+FITSPrefetcher* fits_prefetcher_create(wchar_t** paths, size_t count, size_t depth, size_t budget, int flags);
+
+// Stops the reader and frees every buffer. Inputs opened from the
+// prefetcher must be closed first.
+void fits_prefetcher_destroy(FITSPrefetcher* prefetcher);
+
+// "io_uring" or "reader thread"
+const char* fits_prefetcher_engine(const FITSPrefetcher* prefetcher);
+
+// fits_input_open for the next file of the batch, served from its prefetched
+// buffer while the rest of it is still being read. Files the prefetcher does
+// not have (or could not read) are opened normally.
+int fits_input_open_prefetched(FITSInput* input, FITSPrefetcher* prefetcher, const wchar_t* path, int flags);
+
+#endif // FITS_IO_H
@@ -0,0 +1,931 @@
+#include "fits_kernels.h"
+#include "fits_platform.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FITS_X86_SIMD 1
+#include <immintrin.h>
+#define FITS_TARGET_SSE2 __attribute__((target("sse2")))
+#define FITS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#if defined(__GNUC__)
+#define fits_bswap16(x) __builtin_bswap16(x)
+#define fits_bswap32(x) __builtin_bswap32(x)
+#define fits_bswap64(x) __builtin_bswap64(x)
+#else
+static uint16_t fits_bswap16(uint16_t x) { return (uint16_t)((x >> 8) | (x << 8)); }
+static uint32_t fits_bswap32(uint32_t x) {
+    return (x >> 24) | ((x >> 8) & 0x0000FF00u) | ((x << 8) & 0x00FF0000u) | (x << 24);
+}
+static uint64_t fits_bswap64(uint64_t x) {
+    return ((uint64_t)fits_bswap32((uint32_t)x) << 32) | fits_bswap32((uint32_t)(x >> 32));
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// Scalar kernels, also used for the tails of the vector kernels
+// ---------------------------------------------------------------------------
+
+static void swap16_scalar(void* dst, const void* src, size_t count) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    for (size_t i = 0; i < count; i++) {
+        uint16_t v;
+        memcpy(&v, s + i * 2, 2);
+        v = fits_bswap16(v);
+        memcpy(d + i * 2, &v, 2);
+    }
+}
+
+static void swap32_scalar(void* dst, const void* src, size_t count) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t v;
+        memcpy(&v, s + i * 4, 4);
+        v = fits_bswap32(v);
+        memcpy(d + i * 4, &v, 4);
+    }
+}
+
+static void swap64_scalar(void* dst, const void* src, size_t count) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t v;
+        memcpy(&v, s + i * 8, 8);
+        v = fits_bswap64(v);
+        memcpy(d + i * 8, &v, 8);
+    }
+}
+
+#ifdef FITS_X86_SIMD
+
+// ---------------------------------------------------------------------------
+// SSE2 kernels. SSE2 has no byte shuffle, so bytes are swapped within 16-bit
+// lanes with shifts and wider elements are then fixed up with word shuffles.
+// ---------------------------------------------------------------------------
+
+FITS_TARGET_SSE2 static inline __m128i swap16_sse2_vec(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+FITS_TARGET_SSE2 static void swap16_sse2(void* dst, const void* src, size_t count) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + i * 2));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + i * 2 + 16));
+        _mm_storeu_si128((__m128i*)(d + i * 2), swap16_sse2_vec(a));
+        _mm_storeu_si128((__m128i*)(d + i * 2 + 16), swap16_sse2_vec(b));
+    }
+    swap16_scalar(d + i * 2, s + i * 2, count - i);
+}
+
+FITS_TARGET_SSE2 static void swap32_sse2(void* dst, const void* src, size_t count) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = swap16_sse2_vec(_mm_loadu_si128((const __m128i*)(s + i * 4)));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+        _mm_storeu_si128((__m128i*)(d + i * 4), v);
+    }
+    swap32_scalar(d + i * 4, s + i * 4, count - i);
+}
+
+FITS_TARGET_SSE2 static void swap64_sse2(void* dst, const void* src, size_t count) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128i v = swap16_sse2_vec(_mm_loadu_si128((const __m128i*)(s + i * 8)));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0x1B), 0x1B);
+        _mm_storeu_si128((__m128i*)(d + i * 8), v);
+    }
+    swap64_scalar(d + i * 8, s + i * 8, count - i);
+}
+
+// ---------------------------------------------------------------------------
+// AVX2 kernels: one byte shuffle per 32 bytes, two vectors per iteration
+// ---------------------------------------------------------------------------
+
+FITS_TARGET_AVX2 static void swap_avx2(uint8_t* d, const uint8_t* s, size_t bytes, __m256i mask) {
+    size_t i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(s + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s + i + 32));
+        _mm256_storeu_si256((__m256i*)(d + i), _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256((__m256i*)(d + i + 32), _mm256_shuffle_epi8(b, mask));
+    }
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(s + i));
+        _mm256_storeu_si256((__m256i*)(d + i), _mm256_shuffle_epi8(a, mask));
+    }
+}
+
+FITS_TARGET_AVX2 static void swap16_avx2(void* dst, const void* src, size_t count) {
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t vec = count & ~(size_t)15;
+    swap_avx2((uint8_t*)dst, (const uint8_t*)src, vec * 2, mask);
+    swap16_scalar((uint8_t*)dst + vec * 2, (const uint8_t*)src + vec * 2, count - vec);
+}
+
+FITS_TARGET_AVX2 static void swap32_avx2(void* dst, const void* src, size_t count) {
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t vec = count & ~(size_t)7;
+    swap_avx2((uint8_t*)dst, (const uint8_t*)src, vec * 4, mask);
+    swap32_scalar((uint8_t*)dst + vec * 4, (const uint8_t*)src + vec * 4, count - vec);
+}
+
+FITS_TARGET_AVX2 static void swap64_avx2(void* dst, const void* src, size_t count) {
+    const __m256i mask = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    size_t vec = count & ~(size_t)3;
+    swap_avx2((uint8_t*)dst, (const uint8_t*)src, vec * 8, mask);
+    swap64_scalar((uint8_t*)dst + vec * 8, (const uint8_t*)src + vec * 8, count - vec);
+}
+
+#endif // FITS_X86_SIMD
+
+// ---------------------------------------------------------------------------
+// Runtime dispatch
+// ---------------------------------------------------------------------------
+
+typedef void (*swap_fn)(void* dst, const void* src, size_t count);
+
+enum { LEVEL_SCALAR, LEVEL_SSE2, LEVEL_AVX2 };
+
+static struct {
+    int initialized;
+    int level;
+    const char* name;
+    swap_fn swap16;
+    swap_fn swap32;
+    swap_fn swap64;
+} swap_kernels;
+
+static void init_swap_kernels(void) {
+    swap_kernels.name = "scalar";
+    swap_kernels.swap16 = swap16_scalar;
+    swap_kernels.swap32 = swap32_scalar;
+    swap_kernels.swap64 = swap64_scalar;
+#ifdef FITS_X86_SIMD
+    if (fits_cpu_has_avx2()) {
+        swap_kernels.level = LEVEL_AVX2;
+        swap_kernels.name = "avx2";
+        swap_kernels.swap16 = swap16_avx2;
+        swap_kernels.swap32 = swap32_avx2;
+        swap_kernels.swap64 = swap64_avx2;
+    } else if (fits_cpu_has_sse2()) {
+        swap_kernels.level = LEVEL_SSE2;
+        swap_kernels.name = "sse2";
+        swap_kernels.swap16 = swap16_sse2;
+        swap_kernels.swap32 = swap32_sse2;
+        swap_kernels.swap64 = swap64_sse2;
+    }
+#endif
+    swap_kernels.initialized = 1;
+}
+
+void fits_swap16(void* dst, const void* src, size_t count) {
+    if (!swap_kernels.initialized) init_swap_kernels();
+    swap_kernels.swap16(dst, src, count);
+}
+
+void fits_swap32(void* dst, const void* src, size_t count) {
+    if (!swap_kernels.initialized) init_swap_kernels();
+    swap_kernels.swap32(dst, src, count);
+}
+
+void fits_swap64(void* dst, const void* src, size_t count) {
+    if (!swap_kernels.initialized) init_swap_kernels();
+    swap_kernels.swap64(dst, src, count);
+}
+
+void fits_swap(void* dst, const void* src, size_t count, size_t elem_size) {
+    switch (elem_size) {
+        case 2: fits_swap16(dst, src, count); break;
+        case 4: fits_swap32(dst, src, count); break;
+        case 8: fits_swap64(dst, src, count); break;
+        default:
+            if (dst != src) memmove(dst, src, count * elem_size);
+            break;
+    }
+}
+
+const char* fits_swap_kernel_name(void) {
+    if (!swap_kernels.initialized) init_swap_kernels();
+    return swap_kernels.name;
+}
+
+// ---------------------------------------------------------------------------
+// Fused swap + BZERO/BSCALE loaders
+// ---------------------------------------------------------------------------
+
+enum { SCALE_IDENTITY, SCALE_OFFSET, SCALE_GENERAL };
+
+static int classify_scaling(double bzero, double bscale) {
+    if (bscale != 1.0) return SCALE_GENERAL;
+    if (bzero == 0.0) return SCALE_IDENTITY;
+    if (bzero == floor(bzero) && fabs(bzero) < 2147483648.0) return SCALE_OFFSET;
+    return SCALE_GENERAL;
+}
+
+const char* fits_scale_kernel_name(double bzero, double bscale) {
+    switch (classify_scaling(bzero, bscale)) {
+        case SCALE_IDENTITY: return "identity";
+        case SCALE_OFFSET: return "offset";
+        default: return "scaled";
+    }
+}
+
+static inline int16_t read_be_i16(const uint8_t* p) {
+    return (int16_t)(((uint16_t)p[0] << 8) | p[1]);
+}
+
+static inline uint16_t clamp_u16_float(float v) {
+    if (!(v > 0.0f)) return 0;  // also maps NaN to 0
+    if (v >= 65535.0f) return 65535;
+    return (uint16_t)lrintf(v);
+}
+
+static void load_u16_identity_scalar(uint16_t* d, const uint8_t* s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int16_t v = read_be_i16(s + i * 2);
+        d[i] = v < 0 ? 0 : (uint16_t)v;
+    }
+}
+
+static void load_u16_offset_scalar(uint16_t* d, const uint8_t* s, size_t n, int32_t bzero) {
+    for (size_t i = 0; i < n; i++) {
+        int64_t v = (int64_t)read_be_i16(s + i * 2) + bzero;
+        d[i] = v < 0 ? 0 : v > 65535 ? 65535 : (uint16_t)v;
+    }
+}
+
+static void load_u16_scaled_scalar(uint16_t* d, const uint8_t* s, size_t n, float bzero, float bscale) {
+    for (size_t i = 0; i < n; i++) {
+        d[i] = clamp_u16_float((float)read_be_i16(s + i * 2) * bscale + bzero);
+    }
+}
+
+#ifdef FITS_X86_SIMD
+
+// The integer-offset kernels work on raw ^ 0x8000, which is raw + 32768 as an
+// unsigned value, and add the rest of BZERO with unsigned saturation. That
+// clamps to [0, 65535] exactly and needs no widening.
+
+FITS_TARGET_SSE2 static void load_u16_identity_sse2(uint16_t* d, const uint8_t* s, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = swap16_sse2_vec(_mm_loadu_si128((const __m128i*)(s + i * 2)));
+        _mm_storeu_si128((__m128i*)(d + i), _mm_max_epi16(v, zero));
+    }
+    load_u16_identity_scalar(d + i, s + i * 2, n - i);
+}
+
+FITS_TARGET_SSE2 static void load_u16_offset_sse2(uint16_t* d, const uint8_t* s, size_t n, int32_t bzero) {
+    const __m128i sign = _mm_set1_epi16((short)0x8000);
+    int64_t delta = (int64_t)bzero - 32768;  // BZERO may be as low as -2^31 + 1
+    const __m128i add = _mm_set1_epi16((short)(delta > 0 ? (delta > 65535 ? 65535 : delta) : 0));
+    const __m128i sub = _mm_set1_epi16((short)(delta < 0 ? (delta < -65535 ? 65535 : -delta) : 0));
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = swap16_sse2_vec(_mm_loadu_si128((const __m128i*)(s + i * 2)));
+        v = _mm_subs_epu16(_mm_adds_epu16(_mm_xor_si128(v, sign), add), sub);
+        _mm_storeu_si128((__m128i*)(d + i), v);
+    }
+    load_u16_offset_scalar(d + i, s + i * 2, n - i, bzero);
+}
+
+FITS_TARGET_SSE2 static inline __m128i pack_u16_sse2(__m128i lo, __m128i hi) {
+    // SSE2 has no unsigned 32->16 pack: bias into the signed range and back
+    const __m128i bias32 = _mm_set1_epi32(32768);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    return _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(lo, bias32), _mm_sub_epi32(hi, bias32)), bias16);
+}
+
+FITS_TARGET_SSE2 static void load_u16_scaled_sse2(uint16_t* d, const uint8_t* s, size_t n, float bzero, float bscale) {
+    const __m128 zero = _mm_set1_ps(bzero);
+    const __m128 scale = _mm_set1_ps(bscale);
+    const __m128 lo_limit = _mm_setzero_ps();
+    const __m128 hi_limit = _mm_set1_ps(65535.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = swap16_sse2_vec(_mm_loadu_si128((const __m128i*)(s + i * 2)));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        __m128 flo = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), scale), zero);
+        __m128 fhi = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), scale), zero);
+        flo = _mm_min_ps(_mm_max_ps(flo, lo_limit), hi_limit);
+        fhi = _mm_min_ps(_mm_max_ps(fhi, lo_limit), hi_limit);
+        _mm_storeu_si128((__m128i*)(d + i), pack_u16_sse2(_mm_cvtps_epi32(flo), _mm_cvtps_epi32(fhi)));
+    }
+    load_u16_scaled_scalar(d + i, s + i * 2, n - i, bzero, bscale);
+}
+
+FITS_TARGET_AVX2 static inline __m256i swap16_avx2_vec(__m256i v) {
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    return _mm256_shuffle_epi8(v, mask);
+}
+
+FITS_TARGET_AVX2 static void load_u16_identity_avx2(uint16_t* d, const uint8_t* s, size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = swap16_avx2_vec(_mm256_loadu_si256((const __m256i*)(s + i * 2)));
+        _mm256_storeu_si256((__m256i*)(d + i), _mm256_max_epi16(v, zero));
+    }
+    load_u16_identity_scalar(d + i, s + i * 2, n - i);
+}
+
+FITS_TARGET_AVX2 static void load_u16_offset_avx2(uint16_t* d, const uint8_t* s, size_t n, int32_t bzero) {
+    const __m256i sign = _mm256_set1_epi16((short)0x8000);
+    int64_t delta = (int64_t)bzero - 32768;  // BZERO may be as low as -2^31 + 1
+    const __m256i add = _mm256_set1_epi16((short)(delta > 0 ? (delta > 65535 ? 65535 : delta) : 0));
+    const __m256i sub = _mm256_set1_epi16((short)(delta < 0 ? (delta < -65535 ? 65535 : -delta) : 0));
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = swap16_avx2_vec(_mm256_loadu_si256((const __m256i*)(s + i * 2)));
+        v = _mm256_subs_epu16(_mm256_adds_epu16(_mm256_xor_si256(v, sign), add), sub);
+        _mm256_storeu_si256((__m256i*)(d + i), v);
+    }
+    load_u16_offset_scalar(d + i, s + i * 2, n - i, bzero);
+}
+
+// Returns the number of leading samples processed; the caller finishes the tail
+FITS_TARGET_SSE2 static size_t load_u8_offset_sse2(uint8_t* d, const uint8_t* s, size_t n, int32_t offset) {
+    int32_t mag = offset < 0 ? -offset : offset;
+    const __m128i delta = _mm_set1_epi8((char)(mag > 255 ? 255 : mag));
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        v = offset > 0 ? _mm_adds_epu8(v, delta) : _mm_subs_epu8(v, delta);
+        _mm_storeu_si128((__m128i*)(d + i), v);
+    }
+    return i;
+}
+
+#endif // FITS_X86_SIMD
+
+void fits_load_u16(uint16_t* dst, const void* src, size_t count, double bzero, double bscale) {
+    const uint8_t* s = (const uint8_t*)src;
+    if (!swap_kernels.initialized) init_swap_kernels();
+    int kind = classify_scaling(bzero, bscale);
+#ifdef FITS_X86_SIMD
+    int avx2 = swap_kernels.level >= LEVEL_AVX2;
+    int sse2 = swap_kernels.level >= LEVEL_SSE2;
+    if (kind == SCALE_IDENTITY && avx2) { load_u16_identity_avx2(dst, s, count); return; }
+    if (kind == SCALE_IDENTITY && sse2) { load_u16_identity_sse2(dst, s, count); return; }
+    if (kind == SCALE_OFFSET && avx2) { load_u16_offset_avx2(dst, s, count, (int32_t)bzero); return; }
+    if (kind == SCALE_OFFSET && sse2) { load_u16_offset_sse2(dst, s, count, (int32_t)bzero); return; }
+    if (kind == SCALE_GENERAL && sse2) { load_u16_scaled_sse2(dst, s, count, (float)bzero, (float)bscale); return; }
+#endif
+    switch (kind) {
+        case SCALE_IDENTITY: load_u16_identity_scalar(dst, s, count); break;
+        case SCALE_OFFSET: load_u16_offset_scalar(dst, s, count, (int32_t)bzero); break;
+        default: load_u16_scaled_scalar(dst, s, count, (float)bzero, (float)bscale); break;
+    }
+}
+
+void fits_load_u8(uint8_t* dst, const void* src, size_t count, double bzero, double bscale) {
+    const uint8_t* s = (const uint8_t*)src;
+    if (!swap_kernels.initialized) init_swap_kernels();
+    int kind = classify_scaling(bzero, bscale);
+    if (kind == SCALE_IDENTITY) {
+        if (dst != s) memmove(dst, s, count);
+        return;
+    }
+    size_t i = 0;
+    if (kind == SCALE_OFFSET) {
+        int32_t offset = (int32_t)bzero;
+#ifdef FITS_X86_SIMD
+        if (swap_kernels.level >= LEVEL_SSE2) {
+            i = load_u8_offset_sse2(dst, s, count, offset);
+        }
+#endif
+        for (; i < count; i++) {
+            int64_t v = (int64_t)s[i] + offset;
+            dst[i] = v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+        }
+        return;
+    }
+    for (; i < count; i++) {
+        float v = (float)s[i] * (float)bscale + (float)bzero;
+        dst[i] = !(v > 0.0f) ? 0 : v >= 255.0f ? 255 : (uint8_t)lrintf(v);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Typed loaders for all BITPIX values
+// ---------------------------------------------------------------------------
+
+// Wide types are swapped and post-processed one cache-resident block at a
+// time, so each sample is still read from the data unit only once.
+#define LOAD_BLOCK 4096
+
+size_t fits_sample_size(FITSSampleType type) {
+    switch (type) {
+        case FITS_SAMPLE_U8: return 1;
+        case FITS_SAMPLE_U16: return 2;
+        case FITS_SAMPLE_U32:
+        case FITS_SAMPLE_I32:
+        case FITS_SAMPLE_F32: return 4;
+        default: return 8;
+    }
+}
+
+FITSSampleType fits_native_sample_type(int bitpix, double bzero, double bscale) {
+    switch (bitpix) {
+        case 8: return FITS_SAMPLE_U8;
+        case 16: return FITS_SAMPLE_U16;
+        case 32:
+            if (bscale == 1.0 && bzero == 2147483648.0) return FITS_SAMPLE_U32;
+            if (bscale == 1.0 && bzero == 0.0) return FITS_SAMPLE_I32;
+            return FITS_SAMPLE_F64;
+        case 64:
+            if (bscale == 1.0 && bzero == 9223372036854775808.0) return FITS_SAMPLE_U64;
+            if (bscale == 1.0 && bzero == 0.0) return FITS_SAMPLE_I64;
+            return FITS_SAMPLE_F64;
+        case -32: return FITS_SAMPLE_F32;
+        default: return FITS_SAMPLE_F64;
+    }
+}
+
+static void flip_sign32(uint32_t* d, size_t n) {
+    for (size_t i = 0; i < n; i++) d[i] ^= 0x80000000u;
+}
+
+static void flip_sign64(uint64_t* d, size_t n) {
+    for (size_t i = 0; i < n; i++) d[i] ^= 0x8000000000000000ull;
+}
+
+static void scale_f32(float* d, size_t n, float bzero, float bscale) {
+    for (size_t i = 0; i < n; i++) d[i] = d[i] * bscale + bzero;
+}
+
+static void scale_f64(double* d, size_t n, double bzero, double bscale) {
+    for (size_t i = 0; i < n; i++) d[i] = d[i] * bscale + bzero;
+}
+
+// Scalar conversion of one raw (already host-order) sample to physical value
+static inline double raw_to_double(const uint8_t* p, int bitpix) {
+    switch (bitpix) {
+        case 8: return *p;
+        case 16: { int16_t v; memcpy(&v, p, 2); return v; }
+        case 32: { int32_t v; memcpy(&v, p, 4); return v; }
+        case 64: { int64_t v; memcpy(&v, p, 8); return (double)v; }
+        case -32: { float v; memcpy(&v, p, 4); return v; }
+        default: { double v; memcpy(&v, p, 8); return v; }
+    }
+}
+
+static inline uint8_t clamp_u8_double(double v) {
+    if (!(v > 0.0)) return 0;  // also maps NaN to 0
+    if (v >= 255.0) return 255;
+    return (uint8_t)lrint(v);
+}
+
+static void convert_u8_scalar(uint8_t* d, const uint8_t* s, size_t n, int bitpix, double k, double c) {
+    size_t elem = (size_t)(bitpix < 0 ? -bitpix : bitpix) / 8;
+    uint8_t block[LOAD_BLOCK * 8];
+    for (size_t i = 0; i < n; i += LOAD_BLOCK) {
+        size_t m = n - i < LOAD_BLOCK ? n - i : LOAD_BLOCK;
+        fits_swap(block, s + i * elem, m, elem);
+        for (size_t j = 0; j < m; j++) {
+            d[i + j] = clamp_u8_double(raw_to_double(block + j * elem, bitpix) * k + c);
+        }
+    }
+}
+
+#ifdef FITS_X86_SIMD
+
+FITS_TARGET_SSE2 static inline __m128i swap32_sse2_vec(__m128i v) {
+    v = swap16_sse2_vec(v);
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+}
+
+// raw * k + c, clamped to [0, 255]; NaN becomes 0 because max_ps returns its
+// second operand when the first is NaN
+FITS_TARGET_SSE2 static inline __m128i norm_u8_sse2(__m128 v, __m128 k, __m128 c) {
+    v = _mm_add_ps(_mm_mul_ps(v, k), c);
+    v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+    return _mm_cvtps_epi32(v);
+}
+
+// 32-bit sources (BITPIX 32 and -32): 16 samples per iteration
+FITS_TARGET_SSE2 static size_t convert_u8_32_sse2(uint8_t* d, const uint8_t* s, size_t n, int is_float, float k, float c) {
+    const __m128 vk = _mm_set1_ps(k);
+    const __m128 vc = _mm_set1_ps(c);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i q[4];
+        for (int j = 0; j < 4; j++) {
+            __m128i raw = swap32_sse2_vec(_mm_loadu_si128((const __m128i*)(s + (i + j * 4) * 4)));
+            __m128 v = is_float ? _mm_castsi128_ps(raw) : _mm_cvtepi32_ps(raw);
+            q[j] = norm_u8_sse2(v, vk, vc);
+        }
+        __m128i w = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+        _mm_storeu_si128((__m128i*)(d + i), w);
+    }
+    return i;
+}
+
+// BITPIX -64: the affine map is done in double so data with a large offset
+// and a small range keeps its precision, then narrowed for the clamp/pack
+FITS_TARGET_SSE2 static size_t convert_u8_f64_sse2(uint8_t* d, const uint8_t* s, size_t n, double k, double c) {
+    const __m128d vk = _mm_set1_pd(k);
+    const __m128d vc = _mm_set1_pd(c);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 zero = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i q[4];
+        for (int j = 0; j < 4; j++) {
+            __m128i r0 = swap16_sse2_vec(_mm_loadu_si128((const __m128i*)(s + (i + j * 4) * 8)));
+            __m128i r1 = swap16_sse2_vec(_mm_loadu_si128((const __m128i*)(s + (i + j * 4) * 8 + 16)));
+            r0 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(r0, 0x1B), 0x1B);
+            r1 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(r1, 0x1B), 0x1B);
+            __m128 lo = _mm_cvtpd_ps(_mm_add_pd(_mm_mul_pd(_mm_castsi128_pd(r0), vk), vc));
+            __m128 hi = _mm_cvtpd_ps(_mm_add_pd(_mm_mul_pd(_mm_castsi128_pd(r1), vk), vc));
+            q[j] = norm_u8_sse2(_mm_movelh_ps(lo, hi), one, zero);
+        }
+        __m128i w = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+        _mm_storeu_si128((__m128i*)(d + i), w);
+    }
+    return i;
+}
+
+FITS_TARGET_AVX2 static inline __m256i norm_u8_avx2(__m256 v, __m256 k, __m256 c) {
+    v = _mm256_add_ps(_mm256_mul_ps(v, k), c);
+    v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+    return _mm256_cvtps_epi32(v);
+}
+
+// 32-bit sources: 32 samples per iteration
+FITS_TARGET_AVX2 static size_t convert_u8_32_avx2(uint8_t* d, const uint8_t* s, size_t n, int is_float, float k, float c) {
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    // packs/packus work within 128-bit lanes; this restores sample order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const __m256 vk = _mm256_set1_ps(k);
+    const __m256 vc = _mm256_set1_ps(c);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i q[4];
+        for (int j = 0; j < 4; j++) {
+            __m256i raw = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(s + (i + j * 8) * 4)), mask);
+            __m256 v = is_float ? _mm256_castsi256_ps(raw) : _mm256_cvtepi32_ps(raw);
+            q[j] = norm_u8_avx2(v, vk, vc);
+        }
+        __m256i w = _mm256_packus_epi16(_mm256_packs_epi32(q[0], q[1]), _mm256_packs_epi32(q[2], q[3]));
+        _mm256_storeu_si256((__m256i*)(d + i), _mm256_permutevar8x32_epi32(w, order));
+    }
+    return i;
+}
+
+#endif // FITS_X86_SIMD
+
+static void convert_u8(uint8_t* d, const uint8_t* s, size_t n, const FITSLoadParams* p) {
+    double span = p->range_max - p->range_min;
+    double k = span > 0 ? p->bscale * 255.0 / span : 0.0;
+    double c = span > 0 ? (p->bzero - p->range_min) * 255.0 / span : 0.0;
+    size_t elem = (size_t)(p->bitpix < 0 ? -p->bitpix : p->bitpix) / 8;
+    size_t i = 0;
+    if (!swap_kernels.initialized) init_swap_kernels();
+#ifdef FITS_X86_SIMD
+    if (p->bitpix == 32 || p->bitpix == -32) {
+        if (swap_kernels.level >= LEVEL_AVX2) {
+            i = convert_u8_32_avx2(d, s, n, p->bitpix < 0, (float)k, (float)c);
+        } else if (swap_kernels.level >= LEVEL_SSE2) {
+            i = convert_u8_32_sse2(d, s, n, p->bitpix < 0, (float)k, (float)c);
+        }
+    } else if (p->bitpix == -64 && swap_kernels.level >= LEVEL_SSE2) {
+        i = convert_u8_f64_sse2(d, s, n, k, c);
+    }
+    // BITPIX 64 stays scalar: x86 has no 64-bit integer to float conversion before AVX-512
+#endif
+    convert_u8_scalar(d + i, s + i * elem, n - i, p->bitpix, k, c);
+}
+
+int fits_load_samples(void* dst, FITSSampleType type, const void* src, size_t count, const FITSLoadParams* params) {
+    const uint8_t* s = (const uint8_t*)src;
+    int bitpix = params->bitpix;
+    double bzero = params->bzero;
+    double bscale = params->bscale;
+
+    if (type == FITS_SAMPLE_U8) {
+        if (bitpix == 8) {
+            fits_load_u8((uint8_t*)dst, s, count, bzero, bscale);
+        } else {
+            convert_u8((uint8_t*)dst, s, count, params);
+        }
+        return 1;
+    }
+    if (type == FITS_SAMPLE_U16) {
+        if (bitpix != 16) return 0;
+        fits_load_u16((uint16_t*)dst, s, count, bzero, bscale);
+        return 1;
+    }
+
+    size_t elem = (size_t)(bitpix < 0 ? -bitpix : bitpix) / 8;
+    if ((type == FITS_SAMPLE_U32 || type == FITS_SAMPLE_I32) && bitpix != 32) return 0;
+    if ((type == FITS_SAMPLE_U64 || type == FITS_SAMPLE_I64) && bitpix != 64) return 0;
+    if (type == FITS_SAMPLE_F32 && bitpix != -32) return 0;
+
+    uint8_t block[LOAD_BLOCK * 8];
+    for (size_t i = 0; i < count; i += LOAD_BLOCK) {
+        size_t n = count - i < LOAD_BLOCK ? count - i : LOAD_BLOCK;
+        const uint8_t* in = s + i * elem;
+        switch (type) {
+            case FITS_SAMPLE_U32:
+                fits_swap32((uint32_t*)dst + i, in, n);
+                flip_sign32((uint32_t*)dst + i, n);
+                break;
+            case FITS_SAMPLE_I32:
+                fits_swap32((uint32_t*)dst + i, in, n);
+                break;
+            case FITS_SAMPLE_U64:
+                fits_swap64((uint64_t*)dst + i, in, n);
+                flip_sign64((uint64_t*)dst + i, n);
+                break;
+            case FITS_SAMPLE_I64:
+                fits_swap64((uint64_t*)dst + i, in, n);
+                break;
+            case FITS_SAMPLE_F32:
+                fits_swap32((float*)dst + i, in, n);
+                if (bzero != 0.0 || bscale != 1.0) scale_f32((float*)dst + i, n, (float)bzero, (float)bscale);
+                break;
+            default:  // FITS_SAMPLE_F64
+                if (bitpix == -64) {
+                    fits_swap64((double*)dst + i, in, n);
+                } else {
+                    fits_swap(block, in, n, elem);
+                    for (size_t j = 0; j < n; j++) {
+                        ((double*)dst)[i + j] = raw_to_double(block + j * elem, bitpix);
+                    }
+                }
+                if (bzero != 0.0 || bscale != 1.0) scale_f64((double*)dst + i, n, bzero, bscale);
+                break;
+        }
+    }
+    return 1;
+}
+
+int fits_physical_range(const void* src, size_t count, int bitpix, double bzero, double bscale,
+                        double* min_value, double* max_value) {
+    const uint8_t* s = (const uint8_t*)src;
+    size_t elem = (size_t)(bitpix < 0 ? -bitpix : bitpix) / 8;
+    double lo = INFINITY, hi = -INFINITY;
+    uint8_t block[LOAD_BLOCK * 8];
+    for (size_t i = 0; i < count; i += LOAD_BLOCK) {
+        size_t n = count - i < LOAD_BLOCK ? count - i : LOAD_BLOCK;
+        fits_swap(block, s + i * elem, n, elem);
+        if (bitpix == -32) {
+            const float* f = (const float*)block;
+            for (size_t j = 0; j < n; j++) {
+                if (!isfinite(f[j])) continue;
+                if (f[j] < lo) lo = f[j];
+                if (f[j] > hi) hi = f[j];
+            }
+        } else {
+            for (size_t j = 0; j < n; j++) {
+                double v = raw_to_double(block + j * elem, bitpix);
+                if (v < lo && isfinite(v)) lo = v;
+                if (v > hi && isfinite(v)) hi = v;
+            }
+        }
+    }
+    if (lo > hi || !isfinite(lo) || !isfinite(hi)) return 0;
+    lo = lo * bscale + bzero;
+    hi = hi * bscale + bzero;
+    *min_value = lo < hi ? lo : hi;  // negative BSCALE flips the range
+    *max_value = lo < hi ? hi : lo;
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Planar to interleaved RGB
+// ---------------------------------------------------------------------------
+
+#define INTERLEAVE3_SCALAR(T) do { \
+        T* d = (T*)dst; \
+        const T* a = (const T*)p0; \
+        const T* b = (const T*)p1; \
+        const T* c = (const T*)p2; \
+        for (size_t i = 0; i < count; i++) { \
+            d[i * 3] = a[i]; \
+            d[i * 3 + 1] = b[i]; \
+            d[i * 3 + 2] = c[i]; \
+        } \
+    } while (0)
+
+static void interleave3_scalar(uint8_t* dst, const uint8_t* p0, const uint8_t* p1, const uint8_t* p2,
+                               size_t count, size_t sample_size) {
+    switch (sample_size) {
+        case 1: INTERLEAVE3_SCALAR(uint8_t); break;
+        case 2: INTERLEAVE3_SCALAR(uint16_t); break;
+        case 4: INTERLEAVE3_SCALAR(uint32_t); break;
+        default: INTERLEAVE3_SCALAR(uint64_t); break;
+    }
+}
+
+#ifdef FITS_X86_SIMD
+
+// Shuffle masks for sample sizes 1, 2, 4 and 8, built once: callers such as
+// the demosaic hand over short tiles, which must not pay for building them
+static uint8_t interleave_masks[4][3][3][16];
+static int interleave_masks_ready;
+
+static void init_interleave_masks(void) {
+    for (int s = 0; s < 4; s++) {
+        size_t sample_size = (size_t)1 << s;
+        for (int k = 0; k < 3; k++) {
+            for (int b = 0; b < 16; b++) {
+                size_t o = (size_t)k * 16 + b;
+                size_t channel = (o / sample_size) % 3;
+                uint8_t src = (uint8_t)(o / (3 * sample_size) * sample_size + o % sample_size);
+                for (size_t c = 0; c < 3; c++) {
+                    interleave_masks[s][k][c][b] = c == channel ? src : 0x80;
+                }
+            }
+        }
+    }
+    interleave_masks_ready = 1;
+}
+
+// 16 bytes of each plane make 48 output bytes. Each of the three output
+// vectors is the OR of one byte shuffle per plane; the shuffle masks depend
+// only on the sample size, so the same loop serves every sample type.
+FITS_TARGET_AVX2 static size_t interleave3_avx2(uint8_t* dst, const uint8_t* p0, const uint8_t* p1, const uint8_t* p2,
+                                                size_t count, size_t sample_size) {
+    if (!interleave_masks_ready) init_interleave_masks();
+    int s = sample_size == 1 ? 0 : sample_size == 2 ? 1 : sample_size == 4 ? 2 : 3;
+    __m128i m[3][3];
+    for (int k = 0; k < 3; k++) {
+        for (int c = 0; c < 3; c++) {
+            m[k][c] = _mm_loadu_si128((const __m128i*)interleave_masks[s][k][c]);
+        }
+    }
+
+    size_t step = 16 / sample_size;
+    size_t i = 0;
+    for (; i + step <= count; i += step) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(p0 + i * sample_size));
+        __m128i b = _mm_loadu_si128((const __m128i*)(p1 + i * sample_size));
+        __m128i c = _mm_loadu_si128((const __m128i*)(p2 + i * sample_size));
+        uint8_t* d = dst + i * 3 * sample_size;
+        for (int k = 0; k < 3; k++) {
+            __m128i v = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m[k][0]), _mm_shuffle_epi8(b, m[k][1])),
+                                     _mm_shuffle_epi8(c, m[k][2]));
+            _mm_storeu_si128((__m128i*)(d + k * 16), v);
+        }
+    }
+    return i;
+}
+
+#endif // FITS_X86_SIMD
+
+void fits_interleave3(void* dst, const void* plane0, const void* plane1, const void* plane2,
+                      size_t count, size_t sample_size) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* p0 = (const uint8_t*)plane0;
+    const uint8_t* p1 = (const uint8_t*)plane1;
+    const uint8_t* p2 = (const uint8_t*)plane2;
+    size_t i = 0;
+    if (!swap_kernels.initialized) init_swap_kernels();
+#ifdef FITS_X86_SIMD
+    // byte shuffles need SSSE3, which every AVX2 CPU has; older CPUs stay scalar
+    if (swap_kernels.level >= LEVEL_AVX2) {
+        i = interleave3_avx2(d, p0, p1, p2, count, sample_size);
+    }
+#endif
+    size_t offset = i * sample_size;
+    interleave3_scalar(d + offset * 3, p0 + offset, p1 + offset, p2 + offset, count - i, sample_size);
+}
+
+// ---------------------------------------------------------------------------
+// 16-bit to 8-bit through a table
+// ---------------------------------------------------------------------------
+
+// Neither SSE2 nor AVX2 can gather bytes, so this is a plain lookup per
+// sample; the 64 KB table stays in L2 and four independent loads per
+// iteration keep it busy.
+void fits_lut_u16(uint8_t* dst, const uint16_t* src, size_t count, const uint8_t* lut) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        uint8_t a = lut[src[i]], b = lut[src[i + 1]], c = lut[src[i + 2]], d = lut[src[i + 3]];
+        dst[i] = a;
+        dst[i + 1] = b;
+        dst[i + 2] = c;
+        dst[i + 3] = d;
+    }
+    for (; i < count; i++) dst[i] = lut[src[i]];
+}
+
+// ---------------------------------------------------------------------------
+// FITS checksum
+// ---------------------------------------------------------------------------
+
+// Words are summed into 64-bit accumulators and the carries folded back in
+// at the end, which gives the same result as adding with end-around carry
+// word by word.
+static uint32_t fold_checksum(uint64_t sum) {
+    while (sum >> 32) sum = (sum & 0xFFFFFFFFu) + (sum >> 32);
+    return (uint32_t)sum;
+}
+
+static uint64_t checksum_scalar(const uint8_t* s, size_t words) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < words; i++) {
+        uint32_t v;
+        memcpy(&v, s + i * 4, 4);
+        sum += fits_bswap32(v);
+    }
+    return sum;
+}
+
+#ifdef FITS_X86_SIMD
+
+// Swapped words are split into their even and odd 32-bit lanes, zero
+// extended, so each 64-bit lane of the accumulators collects one word per
+// vector
+FITS_TARGET_SSE2 static uint64_t checksum_sse2(const uint8_t* s, size_t words) {
+    const __m128i low = _mm_set1_epi64x(0xFFFFFFFF);
+    __m128i a = _mm_setzero_si128(), b = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= words; i += 4) {
+        __m128i v = swap16_sse2_vec(_mm_loadu_si128((const __m128i*)(s + i * 4)));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+        a = _mm_add_epi64(a, _mm_and_si128(v, low));
+        b = _mm_add_epi64(b, _mm_srli_epi64(v, 32));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(a, b));
+    return lanes[0] + lanes[1] + checksum_scalar(s + i * 4, words - i);
+}
+
+FITS_TARGET_AVX2 static uint64_t checksum_avx2(const uint8_t* s, size_t words) {
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i low = _mm256_set1_epi64x(0xFFFFFFFF);
+    __m256i a = _mm256_setzero_si256(), b = _mm256_setzero_si256();
+    __m256i c = _mm256_setzero_si256(), d = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= words; i += 16) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(s + i * 4)), mask);
+        __m256i w = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(s + i * 4 + 32)), mask);
+        a = _mm256_add_epi64(a, _mm256_and_si256(v, low));
+        b = _mm256_add_epi64(b, _mm256_srli_epi64(v, 32));
+        c = _mm256_add_epi64(c, _mm256_and_si256(w, low));
+        d = _mm256_add_epi64(d, _mm256_srli_epi64(w, 32));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(_mm256_add_epi64(a, b), _mm256_add_epi64(c, d)));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + checksum_scalar(s + i * 4, words - i);
+}
+
+#endif // FITS_X86_SIMD
+
+uint32_t fits_checksum_add(uint32_t sum, const void* data, size_t size, size_t offset) {
+    const uint8_t* s = (const uint8_t*)data;
+    uint64_t (*kernel)(const uint8_t*, size_t) = checksum_scalar;
+    if (!swap_kernels.initialized) init_swap_kernels();
+#ifdef FITS_X86_SIMD
+    if (swap_kernels.level >= LEVEL_AVX2) {
+        kernel = checksum_avx2;
+    } else if (swap_kernels.level >= LEVEL_SSE2) {
+        kernel = checksum_sse2;
+    }
+#endif
+    // 2^28 words per call keep the 64-bit accumulators far from overflowing
+    uint64_t total = 0;
+    size_t words = size / 4;
+    while (words > 0) {
+        size_t n = words < ((size_t)1 << 28) ? words : ((size_t)1 << 28);
+        total = fold_checksum(total) + kernel(s, n);
+        s += n * 4;
+        words -= n;
+    }
+    if (size & 3) {
+        uint8_t tail[4] = {0};
+        memcpy(tail, s, size & 3);
+        total += ((uint32_t)tail[0] << 24) | ((uint32_t)tail[1] << 16) | ((uint32_t)tail[2] << 8);
+    }
+
+    // A chunk starting k bytes into a word has each byte weighted 2^(8k)
+    // less than summed here; modulo 2^32 - 1 that is a rotation
+    uint32_t part = fold_checksum(total);
+    unsigned shift = (unsigned)(offset & 3) * 8;
+    if (shift) part = (part >> shift) | (part << (32 - shift));
+    return fold_checksum((uint64_t)sum + part);
+}
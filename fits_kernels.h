@@ -0,0 +1,89 @@
+#ifndef FITS_KERNELS_H
+#define FITS_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bulk conversion of big-endian FITS samples to host byte order.
+// count is the number of elements; dst and src may be the same buffer.
+// The best kernel (AVX2, SSE2 or scalar) is picked once at first use.
+void fits_swap16(void* dst, const void* src, size_t count);
+void fits_swap32(void* dst, const void* src, size_t count);
+void fits_swap64(void* dst, const void* src, size_t count);
+
+// Dispatch on element size in bytes (1, 2, 4 or 8; size 1 is a plain copy).
+void fits_swap(void* dst, const void* src, size_t count, size_t elem_size);
+
+// Name of the swap kernel selected for this CPU ("avx2", "sse2" or "scalar").
+const char* fits_swap_kernel_name(void);
+
+// Load big-endian FITS integer samples into unsigned output samples, applying
+// physical = raw * bscale + bzero and clamping to the output range, all in the
+// same pass that swaps the bytes. Separate kernels handle the identity case
+// (bzero 0, bscale 1), the integer-offset case (bscale 1, integral bzero, e.g.
+// the usual unsigned 16-bit BZERO=32768) and the general scaled case.
+void fits_load_u8(uint8_t* dst, const void* src, size_t count, double bzero, double bscale);
+void fits_load_u16(uint16_t* dst, const void* src, size_t count, double bzero, double bscale);
+
+// Name of the kernel the loaders use for a given scaling
+// ("identity", "offset" or "scaled").
+const char* fits_scale_kernel_name(double bzero, double bscale);
+
+// Sample types the loaders can produce
+typedef enum {
+    FITS_SAMPLE_U8,
+    FITS_SAMPLE_U16,
+    FITS_SAMPLE_U32,
+    FITS_SAMPLE_I32,
+    FITS_SAMPLE_U64,
+    FITS_SAMPLE_I64,
+    FITS_SAMPLE_F32,
+    FITS_SAMPLE_F64
+} FITSSampleType;
+
+// Describes how to turn raw data unit samples into output samples
+typedef struct {
+    int bitpix;         // FITS BITPIX of the source data (8, 16, 32, 64, -32, -64)
+    double bzero;       // physical = raw * bscale + bzero
+    double bscale;
+    double range_min;   // physical range mapped onto 0..255 when narrowing
+    double range_max;   // wide or floating-point data to FITS_SAMPLE_U8
+} FITSLoadParams;
+
+// Size in bytes of one sample of the given type
+size_t fits_sample_size(FITSSampleType type);
+
+// The sample type that holds the physical values of a data unit without
+// narrowing: unsigned types for the standard sign-flip BZERO values, signed
+// types when unscaled, and double for scaled 32/64-bit integers.
+FITSSampleType fits_native_sample_type(int bitpix, double bzero, double bscale);
+
+// Load count big-endian samples into dst as the given type, in one pass.
+// Narrowing to FITS_SAMPLE_U8 normalizes range_min..range_max onto 0..255,
+// clamps and maps NaN to 0. Returns 0 for unsupported bitpix/type pairs.
+int fits_load_samples(void* dst, FITSSampleType type, const void* src, size_t count, const FITSLoadParams* params);
+
+// Physical min/max over the finite samples of a big-endian data unit, used
+// as the normalization range when the header has no DATAMIN/DATAMAX.
+// Returns 0 if there are no finite samples.
+int fits_physical_range(const void* src, size_t count, int bitpix, double bzero, double bscale,
+                        double* min_value, double* max_value);
+
+// Interleave three planes of count host-order samples of sample_size bytes
+// (1, 2, 4 or 8) into RGB triples, dst[i * 3 + c] = plane c[i]. Callers feed
+// it cache-sized tiles of each plane so all four buffers stay in cache.
+void fits_interleave3(void* dst, const void* plane0, const void* plane1, const void* plane2,
+                      size_t count, size_t sample_size);
+
+// Map count 16-bit samples to 8 bits through lut, a table of 65536 output
+// values (dst[i] = lut[src[i]]), e.g. to narrow or stretch for JPG/PNG.
+void fits_lut_u16(uint8_t* dst, const uint16_t* src, size_t count, const uint8_t* lut);
+
+// FITS checksum (the ones' complement sum of the big-endian 32-bit words
+// behind the CHECKSUM and DATASUM cards) of size bytes added to sum. offset
+// is where data starts within the summed unit, so it can be summed in chunks
+// of any size and in any order; a trailing partial word counts as if padded
+// with zeros.
+uint32_t fits_checksum_add(uint32_t sum, const void* data, size_t size, size_t offset);
+
+#endif // FITS_KERNELS_H
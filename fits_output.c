@@ -0,0 +1,565 @@
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64  // TIFFs past 2 GB on 32-bit builds
+#endif
+
+#include "fits_output.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ---------------------------------------------------------------------------
+// Streaming deflate (RFC 1950/1951) for PNG: greedy LZ77 over a sliding 32K
+// window with hash chains, coded as one long fixed-Huffman block. Data is
+// compressed as it is handed in, so only the window is kept.
+// ---------------------------------------------------------------------------
+
+#define WINDOW_SIZE 32768
+#define HASH_BITS 14
+#define HASH_SIZE (1 << HASH_BITS)
+#define MAX_CHAIN 32
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define IDAT_SIZE 65536
+
+static const uint16_t length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                          3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                        8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+typedef struct {
+    uint8_t window[2 * WINDOW_SIZE];
+    size_t fill;                    // bytes in window; everything below is already coded
+    size_t hashed;                  // positions below this are in the hash chains
+    int32_t head[HASH_SIZE];        // latest position per hash, -1 for none
+    int32_t prev[2 * WINDOW_SIZE];  // previous position with the same hash
+    uint64_t bits;
+    int nbits;
+    uint32_t adler_a, adler_b;
+    uint8_t idat[IDAT_SIZE];        // compressed bytes of the next IDAT chunk
+    size_t idat_len;
+} Deflater;
+
+struct FITSOutput {
+    FILE* file;
+    size_t width, height;
+    int channels;
+    size_t row_bytes;
+    size_t rows;
+    int failed;
+
+    // TIFF
+    FITSSampleType type;
+    int big;             // BigTIFF, for data past the 4 GB reach of classic TIFF
+
+    // PNG
+    Deflater* z;
+    uint8_t* previous;   // previous row, unfiltered; zeros above the first row
+    uint8_t* best;       // filter byte + filtered row chosen for the current row
+    uint8_t* candidate;
+};
+
+static uint32_t crc_table[256];
+
+static void init_crc_table(void) {
+    if (crc_table[1]) return;
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static inline void put_be32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void png_chunk(FITSOutput* o, const char* type, const uint8_t* data, size_t size) {
+    uint8_t head[8];
+    put_be32(head, (uint32_t)size);
+    memcpy(head + 4, type, 4);
+    uint32_t crc = crc32_update(0xFFFFFFFFu, head + 4, 4);
+    crc = crc32_update(crc, data, size);
+    uint8_t tail[4];
+    put_be32(tail, crc ^ 0xFFFFFFFFu);
+    if (fwrite(head, 1, 8, o->file) != 8 || (size && fwrite(data, 1, size, o->file) != size) ||
+        fwrite(tail, 1, 4, o->file) != 4) {
+        o->failed = 1;
+    }
+}
+
+static void put_byte(FITSOutput* o, uint8_t byte) {
+    Deflater* z = o->z;
+    z->idat[z->idat_len++] = byte;
+    if (z->idat_len == IDAT_SIZE) {
+        png_chunk(o, "IDAT", z->idat, z->idat_len);
+        z->idat_len = 0;
+    }
+}
+
+static void put_bits(FITSOutput* o, uint32_t value, int n) {
+    Deflater* z = o->z;
+    z->bits |= (uint64_t)value << z->nbits;
+    z->nbits += n;
+    while (z->nbits >= 8) {
+        put_byte(o, (uint8_t)z->bits);
+        z->bits >>= 8;
+        z->nbits -= 8;
+    }
+}
+
+// Huffman codes are sent most significant bit first
+static void put_code(FITSOutput* o, uint32_t code, int n) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < n; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    put_bits(o, reversed, n);
+}
+
+static void put_symbol(FITSOutput* o, int symbol) {
+    if (symbol < 144) {
+        put_code(o, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        put_code(o, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        put_code(o, symbol - 256, 7);
+    } else {
+        put_code(o, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static void put_match(FITSOutput* o, int length, int distance) {
+    int l = 28;
+    while (length_base[l] > length) l--;
+    put_symbol(o, 257 + l);
+    put_bits(o, length - length_base[l], length_extra[l]);
+    int d = 29;
+    while (dist_base[d] > distance) d--;
+    put_code(o, d, 5);
+    put_bits(o, distance - dist_base[d], dist_extra[d]);
+}
+
+static inline uint32_t window_hash(const uint8_t* p) {
+    return ((uint32_t)p[0] << 10 ^ (uint32_t)p[1] << 5 ^ p[2]) & (HASH_SIZE - 1);
+}
+
+static void insert_hashes(Deflater* z, size_t end) {
+    for (; z->hashed < end && z->hashed + MIN_MATCH <= z->fill; z->hashed++) {
+        uint32_t h = window_hash(z->window + z->hashed);
+        z->prev[z->hashed] = z->head[h];
+        z->head[h] = (int32_t)z->hashed;
+    }
+}
+
+// Drop the older half of the window and rebase the chains onto the rest
+static void slide_window(Deflater* z) {
+    memmove(z->window, z->window + WINDOW_SIZE, WINDOW_SIZE);
+    z->fill -= WINDOW_SIZE;
+    z->hashed -= WINDOW_SIZE;
+    for (size_t i = 0; i < HASH_SIZE; i++) {
+        z->head[i] = z->head[i] >= WINDOW_SIZE ? z->head[i] - WINDOW_SIZE : -1;
+    }
+    for (size_t i = 0; i < WINDOW_SIZE; i++) {
+        int32_t p = z->prev[i + WINDOW_SIZE];
+        z->prev[i] = p >= WINDOW_SIZE ? p - WINDOW_SIZE : -1;
+    }
+}
+
+static void deflate_data(FITSOutput* o, const uint8_t* data, size_t size) {
+    Deflater* z = o->z;
+    while (size) {
+        if (z->fill == 2 * WINDOW_SIZE) slide_window(z);
+        size_t n = 2 * WINDOW_SIZE - z->fill;
+        if (n > size) n = size;
+        memcpy(z->window + z->fill, data, n);
+
+        // Adler-32 of the uncompressed data, reduced often enough not to overflow
+        for (size_t i = 0; i < n; i += 4096) {
+            size_t m = n - i < 4096 ? n - i : 4096;
+            for (size_t j = 0; j < m; j++) {
+                z->adler_a += data[i + j];
+                z->adler_b += z->adler_a;
+            }
+            z->adler_a %= 65521;
+            z->adler_b %= 65521;
+        }
+
+        size_t pos = z->fill;
+        z->fill += n;
+        data += n;
+        size -= n;
+
+        while (pos < z->fill) {
+            insert_hashes(z, pos);
+            int best_length = 0, best_distance = 0;
+            size_t limit = z->fill - pos < MAX_MATCH ? z->fill - pos : MAX_MATCH;
+            if (limit >= MIN_MATCH) {
+                int32_t candidate = z->head[window_hash(z->window + pos)];
+                for (int chain = 0; chain < MAX_CHAIN && candidate >= 0; chain++) {
+                    if (pos - (size_t)candidate > WINDOW_SIZE) break;
+                    const uint8_t* a = z->window + candidate;
+                    const uint8_t* b = z->window + pos;
+                    if (a[best_length] == b[best_length]) {
+                        size_t length = 0;
+                        while (length < limit && a[length] == b[length]) length++;
+                        if ((int)length > best_length) {
+                            best_length = (int)length;
+                            best_distance = (int)(pos - (size_t)candidate);
+                            if (length == limit) break;
+                        }
+                    }
+                    candidate = z->prev[candidate];
+                }
+            }
+            if (best_length >= MIN_MATCH) {
+                put_match(o, best_length, best_distance);
+                pos += best_length;
+            } else {
+                put_symbol(o, z->window[pos]);
+                pos++;
+            }
+        }
+    }
+}
+
+// PNG filters 0-4 of one row; bpp is the distance to the left neighbour
+static void png_filter(uint8_t* out, int filter, const uint8_t* row, const uint8_t* up, size_t n, size_t bpp) {
+    out[0] = (uint8_t)filter;
+    out++;
+    for (size_t i = 0; i < n; i++) {
+        int a = i >= bpp ? row[i - bpp] : 0;
+        int b = up[i];
+        int c = i >= bpp ? up[i - bpp] : 0;
+        int predicted;
+        switch (filter) {
+            case 0: predicted = 0; break;
+            case 1: predicted = a; break;
+            case 2: predicted = b; break;
+            case 3: predicted = (a + b) >> 1; break;
+            default: {
+                int p = a + b - c;
+                int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+                predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                break;
+            }
+        }
+        out[i] = (uint8_t)(row[i] - predicted);
+    }
+}
+
+// The usual heuristic: keep the filter whose output has the smallest sum of
+// absolute values, taking the bytes as signed
+static void png_write_row(FITSOutput* o, const uint8_t* row) {
+    uint32_t best_cost = UINT32_MAX;
+    for (int filter = 0; filter < 5; filter++) {
+        png_filter(o->candidate, filter, row, o->previous, o->row_bytes, (size_t)o->channels);
+        uint32_t cost = 0;
+        for (size_t i = 1; i <= o->row_bytes; i++) {
+            cost += (uint32_t)abs((int8_t)o->candidate[i]);
+        }
+        if (cost < best_cost) {
+            best_cost = cost;
+            uint8_t* t = o->best;
+            o->best = o->candidate;
+            o->candidate = t;
+        }
+    }
+    deflate_data(o, o->best, o->row_bytes + 1);
+    memcpy(o->previous, row, o->row_bytes);
+}
+
+static int png_finish(FITSOutput* o) {
+    put_symbol(o, 256);          // end of the long block
+    put_bits(o, 1 | (1 << 1), 3);  // an empty final fixed-Huffman block
+    put_symbol(o, 256);
+    if (o->z->nbits) put_bits(o, 0, 8 - o->z->nbits);
+    uint32_t adler = (o->z->adler_b << 16) | o->z->adler_a;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        put_byte(o, (uint8_t)(adler >> shift));
+    }
+    if (o->z->idat_len) png_chunk(o, "IDAT", o->z->idat, o->z->idat_len);
+    png_chunk(o, "IEND", NULL, 0);
+    return !o->failed;
+}
+
+FITSOutput* fits_output_open_png(const char* path, size_t width, size_t height, int channels) {
+    if (width == 0 || height == 0 || width > 0x7FFFFFFF || height > 0x7FFFFFFF) return NULL;
+    FITSOutput* o = (FITSOutput*)calloc(1, sizeof(FITSOutput));
+    if (!o) return NULL;
+    o->width = width;
+    o->height = height;
+    o->channels = channels;
+    o->row_bytes = width * channels;
+    o->z = (Deflater*)malloc(sizeof(Deflater));
+    o->previous = (uint8_t*)calloc(o->row_bytes, 1);
+    o->best = (uint8_t*)malloc(o->row_bytes + 1);
+    o->candidate = (uint8_t*)malloc(o->row_bytes + 1);
+    o->file = fopen(path, "wb");
+    if (!o->z || !o->previous || !o->best || !o->candidate || !o->file) {
+        o->failed = 1;
+        fits_output_close(o);
+        return NULL;
+    }
+    Deflater* z = o->z;
+    z->fill = 0;
+    z->hashed = 0;
+    for (size_t i = 0; i < HASH_SIZE; i++) z->head[i] = -1;
+    z->bits = 0;
+    z->nbits = 0;
+    z->adler_a = 1;
+    z->adler_b = 0;
+    z->idat_len = 0;
+    init_crc_table();
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    uint8_t ihdr[13];
+    put_be32(ihdr, (uint32_t)width);
+    put_be32(ihdr + 4, (uint32_t)height);
+    ihdr[8] = 8;                        // bit depth
+    ihdr[9] = channels == 3 ? 2 : 0;    // truecolour or greyscale
+    ihdr[10] = ihdr[11] = ihdr[12] = 0; // deflate, adaptive filtering, no interlace
+    if (fwrite(signature, 1, 8, o->file) != 8) o->failed = 1;
+    png_chunk(o, "IHDR", ihdr, sizeof(ihdr));
+
+    put_byte(o, 0x78);  // zlib header: deflate, 32K window
+    put_byte(o, 0x01);
+    put_bits(o, 1 << 1, 3);  // first fixed-Huffman block, not final
+    return o;
+}
+
+// ---------------------------------------------------------------------------
+// Baseline TIFF, and BigTIFF once the file would outgrow 32-bit offsets
+// ---------------------------------------------------------------------------
+
+#define BIGTIFF_STRIP_SIZE (8 << 20)
+
+static inline void put_le16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void put_le32(uint8_t* p, uint32_t v) {
+    put_le16(p, (uint16_t)v);
+    put_le16(p + 2, (uint16_t)(v >> 16));
+}
+
+static inline void put_le64(uint8_t* p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint8_t* ifd_entry(uint8_t* p, uint16_t tag, uint16_t type, uint32_t count, uint32_t value) {
+    put_le16(p, tag);
+    put_le16(p + 2, type);
+    put_le32(p + 4, count);
+    put_le32(p + 8, 0);
+    if (type == 3 && count <= 2) {
+        put_le16(p + 8, (uint16_t)value);  // one SHORT stored in place
+    } else {
+        put_le32(p + 8, value);
+    }
+    return p + 12;
+}
+
+static int tiff_finish(FITSOutput* o) {
+    enum { SHORT = 3, LONG = 4, ENTRIES = 11 };
+    uint64_t data_bytes = (uint64_t)o->row_bytes * o->height;
+    uint32_t ifd_offset = (uint32_t)(8 + data_bytes + (data_bytes & 1));
+    uint32_t extra_offset = ifd_offset + 2 + ENTRIES * 12 + 4;
+    uint16_t bits = (uint16_t)(fits_sample_size(o->type) * 8);
+    uint16_t format = 1;
+    if (o->type == FITS_SAMPLE_I32 || o->type == FITS_SAMPLE_I64) {
+        format = 2;
+    } else if (o->type == FITS_SAMPLE_F32 || o->type == FITS_SAMPLE_F64) {
+        format = 3;
+    }
+    int rgb = o->channels == 3;
+
+    uint8_t ifd[2 + ENTRIES * 12 + 4 + 12];
+    uint8_t* p = ifd;
+    put_le16(p, ENTRIES);
+    p += 2;
+    p = ifd_entry(p, 256, LONG, 1, (uint32_t)o->width);
+    p = ifd_entry(p, 257, LONG, 1, (uint32_t)o->height);
+    p = ifd_entry(p, 258, SHORT, o->channels, rgb ? extra_offset : bits);       // BitsPerSample
+    p = ifd_entry(p, 259, SHORT, 1, 1);                                         // no compression
+    p = ifd_entry(p, 262, SHORT, 1, rgb ? 2 : 1);                               // RGB or BlackIsZero
+    p = ifd_entry(p, 273, LONG, 1, 8);                                          // StripOffsets
+    p = ifd_entry(p, 277, SHORT, 1, (uint32_t)o->channels);
+    p = ifd_entry(p, 278, LONG, 1, (uint32_t)o->height);                        // RowsPerStrip
+    p = ifd_entry(p, 279, LONG, 1, (uint32_t)data_bytes);                       // StripByteCounts
+    p = ifd_entry(p, 284, SHORT, 1, 1);                                         // chunky
+    p = ifd_entry(p, 339, SHORT, o->channels, rgb ? extra_offset + 6 : format); // SampleFormat
+    put_le32(p, 0);  // no further IFD
+    p += 4;
+    if (rgb) {
+        for (int i = 0; i < 3; i++) put_le16(p + i * 2, bits);
+        for (int i = 0; i < 3; i++) put_le16(p + 6 + i * 2, format);
+        p += 12;
+    }
+
+    uint8_t pad = 0;
+    if ((data_bytes & 1) && fwrite(&pad, 1, 1, o->file) != 1) return 0;
+    if (fwrite(ifd, 1, (size_t)(p - ifd), o->file) != (size_t)(p - ifd)) return 0;
+
+    // point the header at the IFD now that its position is known
+    uint8_t offset[4];
+    put_le32(offset, ifd_offset);
+    return fseek(o->file, 4, SEEK_SET) == 0 && fwrite(offset, 1, 4, o->file) == 4;
+}
+
+// BigTIFF entries are 20 bytes with an 8-byte count and value. Values of up
+// to 8 bytes are stored in place; a SHORT is repeated count times, which is
+// what BitsPerSample and SampleFormat need for RGB.
+static uint8_t* bigtiff_entry(uint8_t* p, uint16_t tag, uint16_t type, uint64_t count, uint64_t value) {
+    put_le16(p, tag);
+    put_le16(p + 2, type);
+    put_le64(p + 4, count);
+    put_le64(p + 12, 0);
+    if (type == 3 && count <= 4) {
+        for (uint64_t i = 0; i < count; i++) put_le16(p + 12 + i * 2, (uint16_t)value);
+    } else if (type == 4 && count <= 2) {
+        put_le32(p + 12, (uint32_t)value);
+    } else {
+        put_le64(p + 12, value);
+    }
+    return p + 20;
+}
+
+// The data is cut into strips of about BIGTIFF_STRIP_SIZE so readers never
+// need the whole image as one block; the strip tables follow the IFD.
+static int bigtiff_finish(FITSOutput* o) {
+    enum { SHORT = 3, LONG = 4, LONG8 = 16, ENTRIES = 11, IFD_SIZE = 8 + ENTRIES * 20 + 8 };
+    uint64_t data_bytes = (uint64_t)o->row_bytes * o->height;
+    uint64_t padding = (8 - (data_bytes & 7)) & 7;
+    uint64_t ifd_offset = 16 + data_bytes + padding;
+    uint64_t strip_rows = BIGTIFF_STRIP_SIZE / o->row_bytes;
+    if (strip_rows == 0) strip_rows = 1;
+    if (strip_rows > o->height) strip_rows = o->height;
+    uint64_t strips = (o->height + strip_rows - 1) / strip_rows;
+    uint64_t offsets_at = strips > 1 ? ifd_offset + IFD_SIZE : 16;
+    uint64_t counts_at = strips > 1 ? offsets_at + strips * 8 : data_bytes;
+    uint16_t bits = (uint16_t)(fits_sample_size(o->type) * 8);
+    uint16_t format = 1;
+    if (o->type == FITS_SAMPLE_I32 || o->type == FITS_SAMPLE_I64) {
+        format = 2;
+    } else if (o->type == FITS_SAMPLE_F32 || o->type == FITS_SAMPLE_F64) {
+        format = 3;
+    }
+
+    uint8_t ifd[IFD_SIZE];
+    uint8_t* p = ifd;
+    put_le64(p, ENTRIES);
+    p += 8;
+    p = bigtiff_entry(p, 256, LONG, 1, o->width);
+    p = bigtiff_entry(p, 257, LONG, 1, o->height);
+    p = bigtiff_entry(p, 258, SHORT, (uint64_t)o->channels, bits);
+    p = bigtiff_entry(p, 259, SHORT, 1, 1);
+    p = bigtiff_entry(p, 262, SHORT, 1, o->channels == 3 ? 2 : 1);
+    p = bigtiff_entry(p, 273, LONG8, strips, offsets_at);
+    p = bigtiff_entry(p, 277, SHORT, 1, (uint64_t)o->channels);
+    p = bigtiff_entry(p, 278, LONG, 1, strip_rows);
+    p = bigtiff_entry(p, 279, LONG8, strips, counts_at);
+    p = bigtiff_entry(p, 284, SHORT, 1, 1);
+    p = bigtiff_entry(p, 339, SHORT, (uint64_t)o->channels, format);
+    put_le64(p, 0);
+
+    static const uint8_t zeros[8] = { 0 };
+    if (padding && fwrite(zeros, 1, (size_t)padding, o->file) != padding) return 0;
+    if (fwrite(ifd, 1, IFD_SIZE, o->file) != IFD_SIZE) return 0;
+    if (strips > 1) {
+        uint8_t* table = (uint8_t*)malloc((size_t)strips * 16);
+        if (!table) return 0;
+        for (uint64_t i = 0; i < strips; i++) {
+            uint64_t rows = i + 1 < strips ? strip_rows : o->height - i * strip_rows;
+            put_le64(table + i * 8, 16 + i * strip_rows * o->row_bytes);
+            put_le64(table + (strips + i) * 8, rows * o->row_bytes);
+        }
+        size_t written = fwrite(table, 16, (size_t)strips, o->file);
+        free(table);
+        if (written != strips) return 0;
+    }
+
+    uint8_t offset[8];
+    put_le64(offset, ifd_offset);
+    return fseek(o->file, 8, SEEK_SET) == 0 && fwrite(offset, 1, 8, o->file) == 8;
+}
+
+FITSOutput* fits_output_open_tiff(const char* path, size_t width, size_t height, int channels, FITSSampleType type) {
+    size_t pixel_bytes = (size_t)channels * fits_sample_size(type);
+    if (width == 0 || height == 0 || width > 0xFFFFFFFF || height > 0xFFFFFFFF ||
+        width > SIZE_MAX / pixel_bytes || (double)width * pixel_bytes * height > 9.0e18) return NULL;
+    size_t row_bytes = width * pixel_bytes;
+    FITSOutput* o = (FITSOutput*)calloc(1, sizeof(FITSOutput));
+    if (!o) return NULL;
+    o->width = width;
+    o->height = height;
+    o->channels = channels;
+    o->row_bytes = row_bytes;
+    o->type = type;
+    o->big = (double)row_bytes * height + 1024 > 4294967295.0;
+    o->file = fopen(path, "wb");
+    if (!o->file) {
+        free(o);
+        return NULL;
+    }
+    // little-endian header; the IFD offset is filled in at close
+    static const uint8_t header[8] = { 'I', 'I', 42, 0, 0, 0, 0, 0 };
+    static const uint8_t big_header[16] = { 'I', 'I', 43, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    if (o->big ? fwrite(big_header, 1, 16, o->file) != 16 : fwrite(header, 1, 8, o->file) != 8) o->failed = 1;
+    return o;
+}
+
+// ---------------------------------------------------------------------------
+
+int fits_output_write_rows(FITSOutput* output, const void* rows, size_t count) {
+    const uint8_t* p = (const uint8_t*)rows;
+    if (output->rows + count > output->height) {
+        output->failed = 1;
+        return 0;
+    }
+    if (output->z) {
+        for (size_t i = 0; i < count; i++) {
+            png_write_row(output, p + i * output->row_bytes);
+        }
+    } else if (fwrite(p, output->row_bytes, count, output->file) != count) {
+        output->failed = 1;
+    }
+    output->rows += count;
+    return !output->failed;
+}
+
+int fits_output_close(FITSOutput* output) {
+    if (!output) return 1;
+    int ok = 0;
+    if (output->file) {
+        if (!output->failed && output->rows == output->height) {
+            ok = output->z ? png_finish(output) : output->big ? bigtiff_finish(output) : tiff_finish(output);
+        }
+        if (fclose(output->file) != 0) ok = 0;
+    }
+    free(output->z);
+    free(output->previous);
+    free(output->best);
+    free(output->candidate);
+    free(output);
+    return ok;
+}
@@ -0,0 +1,32 @@
+#ifndef FITS_OUTPUT_H
+#define FITS_OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fits_kernels.h"
+
+// Row-oriented image writers for the streaming conversion. Rows are handed
+// over top to bottom, a few at a time, and go straight to the file, so
+// writing never needs the whole image in memory.
+typedef struct FITSOutput FITSOutput;
+
+// Uncompressed baseline TIFF with one strip. The pixel data is written as
+// it arrives and the IFD follows it at close. Samples are of the given type
+// (8-bit to 64-bit unsigned, signed or float); channels is 1 or 3. Images
+// too large for 32-bit offsets are written as BigTIFF in strips of about
+// 8 MB instead. Returns NULL if the file cannot be created.
+FITSOutput* fits_output_open_tiff(const char* path, size_t width, size_t height, int channels, FITSSampleType type);
+
+// 8-bit greyscale or RGB PNG. Each row is filtered against the previous one
+// and deflated incrementally into IDAT chunks.
+FITSOutput* fits_output_open_png(const char* path, size_t width, size_t height, int channels);
+
+// Append count rows of width * channels samples each. Returns 0 on I/O error.
+int fits_output_write_rows(FITSOutput* output, const void* rows, size_t count);
+
+// Finish the file and free the writer. Returns 0 if any write failed or
+// fewer rows than the image height were written. Safe to call with NULL.
+int fits_output_close(FITSOutput* output);
+
+#endif // FITS_OUTPUT_H
@@ -0,0 +1,219 @@
+#include "fits_platform.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <stdlib.h>
+
+#define FITS_MAX_THREADS 64
+
+double fits_time_seconds(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+int fits_cpu_has_sse2(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("sse2");
+#else
+    return 0;
+#endif
+}
+
+int fits_cpu_has_avx2(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+int fits_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+typedef struct {
+    void (*fn)(void* context, size_t index);
+    void* context;
+    size_t count;
+    volatile long next;  // next index to hand out
+} ParallelJob;
+
+static void run_parallel_job(ParallelJob* job) {
+    for (;;) {
+#ifdef _WIN32
+        size_t index = (size_t)(InterlockedIncrement(&job->next) - 1);
+#else
+        size_t index = (size_t)__atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+#endif
+        if (index >= job->count) break;
+        job->fn(job->context, index);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI parallel_worker(void* arg) {
+    run_parallel_job((ParallelJob*)arg);
+    return 0;
+}
+#else
+static void* parallel_worker(void* arg) {
+    run_parallel_job((ParallelJob*)arg);
+    return NULL;
+}
+#endif
+
+void fits_parallel_for(size_t count, int threads, void (*fn)(void* context, size_t index), void* context) {
+    if (threads <= 0) threads = fits_cpu_count();
+    if (threads > FITS_MAX_THREADS) threads = FITS_MAX_THREADS;
+    if ((size_t)threads > count) threads = (int)count;
+
+    ParallelJob job = { fn, context, count, 0 };
+    if (threads <= 1) {
+        run_parallel_job(&job);
+        return;
+    }
+
+    // threads - 1 helpers; the caller is the last worker. A helper that fails
+    // to start just leaves its share to the others.
+#ifdef _WIN32
+    HANDLE workers[FITS_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < threads - 1; i++) {
+        workers[started] = CreateThread(NULL, 0, parallel_worker, &job, 0, NULL);
+        if (workers[started]) started++;
+    }
+    run_parallel_job(&job);
+    for (int i = 0; i < started; i++) {
+        WaitForSingleObject(workers[i], INFINITE);
+        CloseHandle(workers[i]);
+    }
+#else
+    pthread_t workers[FITS_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&workers[started], NULL, parallel_worker, &job) == 0) started++;
+    }
+    run_parallel_job(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+#endif
+}
+
+#ifdef _WIN32
+void fits_mutex_init(FITSMutex* mutex) { InitializeSRWLock((SRWLOCK*)&mutex->lock); }
+void fits_mutex_destroy(FITSMutex* mutex) { (void)mutex; }
+void fits_mutex_lock(FITSMutex* mutex) { AcquireSRWLockExclusive((SRWLOCK*)&mutex->lock); }
+void fits_mutex_unlock(FITSMutex* mutex) { ReleaseSRWLockExclusive((SRWLOCK*)&mutex->lock); }
+
+void fits_cond_init(FITSCond* cond) { InitializeConditionVariable((CONDITION_VARIABLE*)&cond->cond); }
+void fits_cond_destroy(FITSCond* cond) { (void)cond; }
+void fits_cond_wait(FITSCond* cond, FITSMutex* mutex) {
+    SleepConditionVariableSRW((CONDITION_VARIABLE*)&cond->cond, (SRWLOCK*)&mutex->lock, INFINITE, 0);
+}
+void fits_cond_broadcast(FITSCond* cond) { WakeAllConditionVariable((CONDITION_VARIABLE*)&cond->cond); }
+#else
+void fits_mutex_init(FITSMutex* mutex) { pthread_mutex_init(&mutex->lock, NULL); }
+void fits_mutex_destroy(FITSMutex* mutex) { pthread_mutex_destroy(&mutex->lock); }
+void fits_mutex_lock(FITSMutex* mutex) { pthread_mutex_lock(&mutex->lock); }
+void fits_mutex_unlock(FITSMutex* mutex) { pthread_mutex_unlock(&mutex->lock); }
+
+void fits_cond_init(FITSCond* cond) { pthread_cond_init(&cond->cond, NULL); }
+void fits_cond_destroy(FITSCond* cond) { pthread_cond_destroy(&cond->cond); }
+void fits_cond_wait(FITSCond* cond, FITSMutex* mutex) { pthread_cond_wait(&cond->cond, &mutex->lock); }
+void fits_cond_broadcast(FITSCond* cond) { pthread_cond_broadcast(&cond->cond); }
+#endif
+
+typedef struct {
+    void (*fn)(void* arg);
+    void* arg;
+} ThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_trampoline(void* param) {
+#else
+static void* thread_trampoline(void* param) {
+#endif
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.fn(start.arg);
+    return 0;
+}
+
+int fits_thread_start(FITSThread* thread, void (*fn)(void* arg), void* arg) {
+    ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+    if (!start) return 0;
+    start->fn = fn;
+    start->arg = arg;
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+    if (thread->handle) return 1;
+#else
+    if (pthread_create(&thread->handle, NULL, thread_trampoline, start) == 0) return 1;
+#endif
+    free(start);
+    return 0;
+}
+
+void fits_thread_join(FITSThread* thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+}
+
+#ifdef _WIN32
+void* fits_memory_reserve(size_t size) {
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+int fits_memory_commit(void* address, size_t size) {
+    return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+void fits_memory_release(void* base, size_t size) {
+    (void)size;
+    VirtualFree(base, 0, MEM_RELEASE);
+}
+#else
+void* fits_memory_reserve(size_t size) {
+    void* base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return base == MAP_FAILED ? NULL : base;
+}
+
+int fits_memory_commit(void* address, size_t size) {
+    return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void fits_memory_release(void* base, size_t size) {
+    munmap(base, size);
+}
+#endif
@@ -0,0 +1,61 @@
+#ifndef FITS_PLATFORM_H
+#define FITS_PLATFORM_H
+
+#include <stddef.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+// Monotonic wall clock in seconds, for throughput reporting.
+double fits_time_seconds(void);
+
+// Runtime CPU feature checks. Always 0 on non-x86 builds.
+int fits_cpu_has_sse2(void);
+int fits_cpu_has_avx2(void);
+
+// Number of logical processors, at least 1.
+int fits_cpu_count(void);
+
+// Call fn(context, i) for every i in [0, count), spread over up to threads
+// worker threads (0 means one per logical processor). Indices are handed out
+// one at a time in increasing order, so uneven work items balance naturally.
+// The calling thread takes part and the call returns once all items are done.
+void fits_parallel_for(size_t count, int threads, void (*fn)(void* context, size_t index), void* context);
+
+// Minimal thread primitives for long-running helper threads. On Windows the
+// mutex and condition variable wrap an SRWLOCK and a CONDITION_VARIABLE.
+#ifdef _WIN32
+typedef struct { void* lock; } FITSMutex;
+typedef struct { void* cond; } FITSCond;
+typedef struct { void* handle; } FITSThread;
+#else
+typedef struct { pthread_mutex_t lock; } FITSMutex;
+typedef struct { pthread_cond_t cond; } FITSCond;
+typedef struct { pthread_t handle; } FITSThread;
+#endif
+
+void fits_mutex_init(FITSMutex* mutex);
+void fits_mutex_destroy(FITSMutex* mutex);
+void fits_mutex_lock(FITSMutex* mutex);
+void fits_mutex_unlock(FITSMutex* mutex);
+
+void fits_cond_init(FITSCond* cond);
+void fits_cond_destroy(FITSCond* cond);
+void fits_cond_wait(FITSCond* cond, FITSMutex* mutex);
+void fits_cond_broadcast(FITSCond* cond);
+
+// Run fn(arg) on a new thread. Returns 0 if the thread could not be started.
+int fits_thread_start(FITSThread* thread, void (*fn)(void* arg), void* arg);
+void fits_thread_join(FITSThread* thread);
+
+// Address space for a buffer whose final size is not known up front.
+// fits_memory_reserve sets aside size bytes without backing them (NULL on
+// failure); fits_memory_commit makes size bytes from a page aligned address
+// inside it usable in place (0 when memory runs out); fits_memory_release
+// gives the whole reservation back.
+void* fits_memory_reserve(size_t size);
+int fits_memory_commit(void* address, size_t size);
+void fits_memory_release(void* base, size_t size);
+
+#endif // FITS_PLATFORM_H
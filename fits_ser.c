@@ -0,0 +1,127 @@
+#include "fits_ser.h"
+#include "fits_kernels.h"
+
+#include <string.h>
+
+#define SER_HEADER_SIZE 178
+
+static int32_t read_le32(const uint8_t* p) {
+    return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static void read_text(char* dst, const uint8_t* src) {
+    memcpy(dst, src, 40);
+    dst[40] = '\0';
+    for (int i = 39; i >= 0 && (dst[i] == ' ' || dst[i] == '\0'); i--) {
+        dst[i] = '\0';
+    }
+}
+
+const char* fits_ser_color_name(int color_id) {
+    switch (color_id) {
+        case FITS_SER_MONO: return "MONO";
+        case FITS_SER_BAYER_RGGB: return "RGGB";
+        case FITS_SER_BAYER_GRBG: return "GRBG";
+        case FITS_SER_BAYER_GBRG: return "GBRG";
+        case FITS_SER_BAYER_BGGR: return "BGGR";
+        case FITS_SER_RGB: return "RGB";
+        case FITS_SER_BGR: return "BGR";
+        default: return "unknown";
+    }
+}
+
+int fits_ser_open(FITSSerFile* ser, const wchar_t* path) {
+    memset(ser, 0, sizeof(*ser));
+    if (!fits_map_open(&ser->file, path)) return 0;
+    const uint8_t* h = ser->file.data;
+    if (ser->file.size < SER_HEADER_SIZE || memcmp(h, "LUCAM-RECORDER", 14) != 0) goto invalid;
+
+    ser->color_id = read_le32(h + 18);
+    // The spec says 1 means little-endian, but nearly every capture program
+    // writes 0 for its little-endian data; readers follow the programs
+    ser->big_endian = read_le32(h + 22) != 0;
+    int32_t width = read_le32(h + 26);
+    int32_t height = read_le32(h + 30);
+    ser->depth = read_le32(h + 34);
+    int32_t frames = read_le32(h + 38);
+    read_text(ser->observer, h + 42);
+    read_text(ser->instrument, h + 82);
+    read_text(ser->telescope, h + 122);
+
+    if (width <= 0 || height <= 0 || ser->depth < 1 || ser->depth > 16 || frames < 0) goto invalid;
+    if (!(ser->color_id == FITS_SER_MONO || (ser->color_id >= FITS_SER_BAYER_RGGB && ser->color_id <= FITS_SER_BAYER_BGGR) ||
+          ser->color_id == FITS_SER_RGB || ser->color_id == FITS_SER_BGR)) {
+        goto invalid;
+    }
+    ser->width = (size_t)width;
+    ser->height = (size_t)height;
+    ser->channels = ser->color_id >= FITS_SER_RGB ? 3 : 1;
+    ser->sample_size = ser->depth > 8 ? 2 : 1;
+    ser->declared_frames = (size_t)frames;
+
+    // Each factor of the frame size is checked against the frame data the
+    // file holds before it is multiplied in, so the product cannot overflow;
+    // a file without room for one whole frame is rejected
+    size_t room = ser->file.size - SER_HEADER_SIZE;
+    size_t frame_size = ser->sample_size;
+    if (ser->width > room / frame_size) goto invalid;
+    frame_size *= ser->width;
+    if (ser->height > room / frame_size) goto invalid;
+    frame_size *= ser->height;
+    if ((size_t)ser->channels > room / frame_size) goto invalid;
+    frame_size *= (size_t)ser->channels;
+    if (frame_size == 0) goto invalid;
+    ser->frame_size = frame_size;
+
+    // A capture cut short keeps the frames it has
+    size_t present = room / ser->frame_size;
+    ser->frame_count = present < ser->declared_frames ? present : ser->declared_frames;
+    return 1;
+
+invalid:
+    fits_map_close(&ser->file);
+    return 0;
+}
+
+void fits_ser_close(FITSSerFile* ser) {
+    fits_map_close(&ser->file);
+    FITSMappedFile closed = ser->file;  // keeps the closed state, which is not all zero
+    memset(ser, 0, sizeof(*ser));
+    ser->file = closed;
+}
+
+const uint8_t* fits_ser_frame(const FITSSerFile* ser, size_t index) {
+    return ser->file.data + SER_HEADER_SIZE + index * ser->frame_size;
+}
+
+const void* fits_ser_load_frame(const FITSSerFile* ser, size_t index, void* dst) {
+    const uint8_t* src = fits_ser_frame(ser, index);
+    size_t samples = ser->frame_size / ser->sample_size;
+    int swap = ser->sample_size == 2 && ser->big_endian;
+    if (!swap && ser->color_id != FITS_SER_BGR) return src;
+
+    if (swap) {
+        fits_swap16(dst, src, samples);
+    } else {
+        memcpy(dst, src, ser->frame_size);
+    }
+    if (ser->color_id == FITS_SER_BGR) {
+        size_t pixels = ser->width * ser->height;
+        if (ser->sample_size == 1) {
+            uint8_t* p = (uint8_t*)dst;
+            for (size_t i = 0; i < pixels; i++) {
+                uint8_t b = p[i * 3];
+                p[i * 3] = p[i * 3 + 2];
+                p[i * 3 + 2] = b;
+            }
+        } else {
+            uint16_t* p = (uint16_t*)dst;
+            for (size_t i = 0; i < pixels; i++) {
+                uint16_t b = p[i * 3];
+                p[i * 3] = p[i * 3 + 2];
+                p[i * 3 + 2] = b;
+            }
+        }
+    }
+    return dst;
+}
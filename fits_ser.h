@@ -0,0 +1,58 @@
+#ifndef FITS_SER_H
+#define FITS_SER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#include "fits_io.h"
+
+// SER video files (LUCAM-RECORDER), the frame sequence format of planetary
+// capture software: a 178-byte header, then every frame back to back at a
+// fixed size, then an optional trailer of timestamps.
+
+// ColorID values
+enum {
+    FITS_SER_MONO = 0,
+    FITS_SER_BAYER_RGGB = 8,
+    FITS_SER_BAYER_GRBG = 9,
+    FITS_SER_BAYER_GBRG = 10,
+    FITS_SER_BAYER_BGGR = 11,
+    FITS_SER_RGB = 100,
+    FITS_SER_BGR = 101
+};
+
+typedef struct {
+    FITSMappedFile file;
+    int color_id;
+    size_t width;
+    size_t height;
+    int depth;            // significant bits per sample, 1..16
+    int channels;         // 3 for RGB and BGR, 1 otherwise
+    size_t sample_size;   // 1 for depth <= 8, else 2
+    int big_endian;       // byte order of 16-bit samples
+    size_t frame_size;    // bytes per frame
+    size_t frame_count;   // frames present in the file
+    size_t declared_frames;  // FrameCount from the header; more than frame_count if truncated
+    char observer[41];
+    char instrument[41];
+    char telescope[41];
+} FITSSerFile;
+
+// Map a SER file and read its header. Returns 0 if it is not a SER file, has
+// an unsupported color format or is too short to hold a single frame.
+int fits_ser_open(FITSSerFile* ser, const wchar_t* path);
+void fits_ser_close(FITSSerFile* ser);
+
+// Raw frame data straight from the mapping
+const uint8_t* fits_ser_frame(const FITSSerFile* ser, size_t index);
+
+// Copy a frame out as host-order samples with RGB channel order (BGR frames
+// are reordered). Returns a pointer into the mapping instead, without
+// copying, when the frame needs no change; dst must hold frame_size bytes.
+const void* fits_ser_load_frame(const FITSSerFile* ser, size_t index, void* dst);
+
+// "MONO", "RGGB", "GRBG", "GBRG", "BGGR", "RGB" or "BGR"
+const char* fits_ser_color_name(int color_id);
+
+#endif // FITS_SER_H
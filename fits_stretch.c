@@ -0,0 +1,131 @@
+#include "fits_stretch.h"
+#include "fits_platform.h"
+
+#include <stdlib.h>
+
+#define HISTOGRAM_BINS 65536
+
+// A 256 KB table per slice; more slices than this only add merging work
+#define HISTOGRAM_MAX_SLICES 16
+
+// Below this many samples per slice a thread costs more than it saves
+#define HISTOGRAM_MIN_SLICE ((size_t)1 << 18)
+
+// PixInsight's AutoSTF defaults: shadows clipped 2.8 sigma below the
+// median, where sigma is the MAD scaled to a normal distribution, and the
+// background lifted to 25% brightness
+#define STRETCH_SHADOWS_CLIP 2.8
+#define STRETCH_MAD_TO_SIGMA 1.4826
+#define STRETCH_TARGET_BACKGROUND 0.25
+
+int fits_histogram_init(FITSHistogram* histogram, int threads) {
+    if (threads <= 0) threads = fits_cpu_count();
+    if (threads > HISTOGRAM_MAX_SLICES) threads = HISTOGRAM_MAX_SLICES;
+    histogram->slices = threads;
+    histogram->tables = (uint32_t*)calloc((size_t)threads * HISTOGRAM_BINS, sizeof(uint32_t));
+    return histogram->tables != NULL;
+}
+
+void fits_histogram_free(FITSHistogram* histogram) {
+    free(histogram->tables);
+    histogram->tables = NULL;
+    histogram->slices = 0;
+}
+
+// Four counts per iteration, so the loads of the next samples overlap the
+// increments of the last ones
+static void count_samples(uint32_t* table, const uint16_t* samples, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        table[samples[i]]++;
+        table[samples[i + 1]]++;
+        table[samples[i + 2]]++;
+        table[samples[i + 3]]++;
+    }
+    for (; i < count; i++) table[samples[i]]++;
+}
+
+typedef struct {
+    uint32_t* tables;
+    const uint16_t* samples;
+    size_t count;
+    size_t per_slice;
+} HistogramJob;
+
+static void histogram_slice(void* context, size_t slice) {
+    const HistogramJob* job = (const HistogramJob*)context;
+    size_t first = slice * job->per_slice;
+    size_t count = job->count - first < job->per_slice ? job->count - first : job->per_slice;
+    count_samples(job->tables + slice * HISTOGRAM_BINS, job->samples + first, count);
+}
+
+void fits_histogram_add_u16(FITSHistogram* histogram, const uint16_t* samples, size_t count) {
+    size_t slices = count / HISTOGRAM_MIN_SLICE;
+    if (slices > (size_t)histogram->slices) slices = (size_t)histogram->slices;
+    if (slices <= 1) {
+        count_samples(histogram->tables, samples, count);
+        return;
+    }
+    HistogramJob job = { histogram->tables, samples, count, (count + slices - 1) / slices };
+    fits_parallel_for(slices, (int)slices, histogram_slice, &job);
+}
+
+// Midtones transfer function: 0 and 1 stay put and m maps to 0.5
+static double mtf(double m, double x) {
+    if (x <= 0.0) return 0.0;
+    if (x >= 1.0) return 1.0;
+    return (m - 1.0) * x / ((2.0 * m - 1.0) * x - m);
+}
+
+int fits_stretch_auto(const FITSHistogram* histogram, FITSStretch* stretch) {
+    uint64_t* bins = (uint64_t*)calloc(HISTOGRAM_BINS, sizeof(uint64_t));
+    if (!bins) return 0;
+    uint64_t total = 0;
+    for (int s = 0; s < histogram->slices; s++) {
+        const uint32_t* table = histogram->tables + (size_t)s * HISTOGRAM_BINS;
+        for (size_t v = 0; v < HISTOGRAM_BINS; v++) bins[v] += table[v];
+    }
+    for (size_t v = 0; v < HISTOGRAM_BINS; v++) total += bins[v];
+    if (total == 0) {
+        free(bins);
+        return 0;
+    }
+
+    // the median is the first value the cumulative count reaches half at;
+    // the MAD the first distance d at which values median - d .. median + d
+    // hold half of the samples
+    uint64_t half = (total + 1) / 2;
+    uint64_t seen = 0;
+    size_t median = 0;
+    for (; median < HISTOGRAM_BINS - 1; median++) {
+        seen += bins[median];
+        if (seen >= half) break;
+    }
+    seen = bins[median];
+    size_t deviation = 0;
+    while (seen < half) {
+        deviation++;
+        if (deviation <= median) seen += bins[median - deviation];
+        if (median + deviation < HISTOGRAM_BINS) seen += bins[median + deviation];
+    }
+    free(bins);
+
+    stretch->median = median / 65535.0;
+    stretch->mad = deviation / 65535.0;
+    double shadows = stretch->median - STRETCH_SHADOWS_CLIP * STRETCH_MAD_TO_SIGMA * stretch->mad;
+    stretch->shadows = shadows < 0.0 ? 0.0 : shadows;
+    // the balance that puts the clipped median at the target; an image with
+    // no spread around its median is left linear above the clip
+    double background = stretch->median - stretch->shadows;
+    stretch->midtones = background > 0.0 ? mtf(STRETCH_TARGET_BACKGROUND, background) : 0.5;
+    return 1;
+}
+
+void fits_stretch_lut(const FITSStretch* stretch, uint8_t* lut) {
+    double range = 1.0 - stretch->shadows;
+    for (size_t v = 0; v < HISTOGRAM_BINS; v++) {
+        double x = v / 65535.0 - stretch->shadows;
+        double y = x <= 0.0 || range <= 0.0 ? 0.0 : mtf(stretch->midtones, x / range);
+        lut[v] = (uint8_t)(y * 255.0 + 0.5);
+    }
+}
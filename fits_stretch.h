@@ -0,0 +1,44 @@
+#ifndef FITS_STRETCH_H
+#define FITS_STRETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Automatic screen transfer stretch for 8-bit output of linear 16-bit data,
+// as PixInsight's AutoSTF does it: black is clipped 2.8 normalized MADs
+// below the median, and a midtones transfer function then lifts the median
+// to a quarter of full brightness. The statistics come from a histogram of
+// all 65536 values, built while the data loads; the stretch itself is a
+// table of 65536 output bytes, so no pixel is touched by floating point.
+
+// Counts of every 16-bit value, in one table per slice so that threads
+// never share a counter. At most 2^32 - 1 samples may be added in all.
+typedef struct {
+    uint32_t* tables;  // slices x 65536 partial counts
+    int slices;
+} FITSHistogram;
+
+// Set up a histogram for up to threads threads (0 means one per logical
+// processor). Returns 0 if memory runs out.
+int fits_histogram_init(FITSHistogram* histogram, int threads);
+void fits_histogram_free(FITSHistogram* histogram);
+
+// Count count samples. Large pieces are split over the slices and counted on
+// that many threads; small ones are counted on the calling thread.
+void fits_histogram_add_u16(FITSHistogram* histogram, const uint16_t* samples, size_t count);
+
+typedef struct {
+    double median;    // of the samples, scaled to 0..1
+    double mad;       // median absolute deviation from it, scaled the same
+    double shadows;   // input level clipped to black
+    double midtones;  // MTF balance: the level above shadows that ends up at half brightness
+} FITSStretch;
+
+// Derive the stretch from a histogram. Returns 0 if it is empty or memory
+// runs out.
+int fits_stretch_auto(const FITSHistogram* histogram, FITSStretch* stretch);
+
+// Fill lut with the 65536 stretched output values, lut[v] for input v.
+void fits_stretch_lut(const FITSStretch* stretch, uint8_t* lut);
+
+#endif // FITS_STRETCH_H
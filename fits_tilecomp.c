@@ -0,0 +1,1091 @@
+#include "fits_tilecomp.h"
+#include "fits_inflate.h"
+#include "fits_platform.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_RANDOM 10000          // length of the standard dither sequence
+#define ZERO_VALUE -2147483646  // SUBTRACTIVE_DITHER_2 code for an exact 0.0
+
+static inline uint16_t read_be16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t read_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint64_t read_be64(const uint8_t* p) {
+    return ((uint64_t)read_be32(p) << 32) | read_be32(p + 4);
+}
+
+static inline void write_be(uint8_t* p, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        p[i] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+const char* fits_compression_name(FITSCompression compression) {
+    switch (compression) {
+        case FITS_COMP_RICE: return "RICE_1";
+        case FITS_COMP_GZIP_1: return "GZIP_1";
+        case FITS_COMP_GZIP_2: return "GZIP_2";
+        case FITS_COMP_PLIO: return "PLIO_1";
+        case FITS_COMP_HCOMPRESS: return "HCOMPRESS_1";
+        default: return "NOCOMPRESS";
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Dither sequence
+// ---------------------------------------------------------------------------
+
+// The fixed pseudo-random sequence every FITS writer uses for subtractive
+// dithering (Park & Miller minimal standard generator, seed 1), kept as float
+// so reconstructed values match the writer bit for bit
+static float random_values[N_RANDOM];
+static int random_values_ready = 0;
+
+static void init_random_values(void) {
+    if (random_values_ready) return;
+    double a = 16807.0, m = 2147483647.0, seed = 1.0;
+    for (int i = 0; i < N_RANDOM; i++) {
+        double temp = a * seed;
+        seed = temp - m * (double)(int)(temp / m);
+        random_values[i] = (float)(seed / m);
+    }
+    random_values_ready = 1;
+}
+
+// ---------------------------------------------------------------------------
+// RICE_1
+// ---------------------------------------------------------------------------
+
+// MSB-first bit reader; reading past the end returns zeros and sets overrun
+typedef struct {
+    const uint8_t* p;
+    const uint8_t* end;
+    uint64_t buf;   // the low count bits are unread
+    int count;
+    int overrun;
+} RiceBits;
+
+static inline void rice_fill(RiceBits* rb) {
+    rb->buf <<= 8;
+    if (rb->p < rb->end) {
+        rb->buf |= *rb->p++;
+    } else {
+        rb->overrun = 1;
+    }
+    rb->count += 8;
+}
+
+static inline uint32_t rice_get(RiceBits* rb, int n) {
+    while (rb->count < n) rice_fill(rb);
+    rb->count -= n;
+    return (uint32_t)((rb->buf >> rb->count) & ((1ull << n) - 1));
+}
+
+// Number of 0 bits before the next 1 bit, consuming all of them and the 1
+static inline int rice_zeros(RiceBits* rb) {
+    int zeros = 0;
+    while ((rb->buf & ((1ull << rb->count) - 1)) == 0) {
+        zeros += rb->count;
+        rb->count = 0;
+        rice_fill(rb);
+        if (rb->overrun) return zeros;
+    }
+    uint64_t rest = rb->buf & ((1ull << rb->count) - 1);
+    int top = 63 - __builtin_clzll(rest);  // position of the leading 1
+    zeros += rb->count - 1 - top;
+    rb->count = top;
+    return zeros;
+}
+
+// Decode one Rice-coded tile of count pixels stored with bytepix bytes each
+static int rice_decode(const uint8_t* src, size_t size, int32_t* out, size_t count,
+                       int blocksize, int bytepix) {
+    int fsbits, fsmax, bbits = bytepix * 8;
+    switch (bytepix) {
+        case 1: fsbits = 3; fsmax = 6; break;
+        case 2: fsbits = 4; fsmax = 14; break;
+        case 4: fsbits = 5; fsmax = 25; break;
+        default: return 0;
+    }
+    if (size < (size_t)bytepix || blocksize <= 0) return 0;
+
+    // the first pixel is stored verbatim
+    uint32_t last = 0;
+    for (int i = 0; i < bytepix; i++) last = (last << 8) | src[i];
+    RiceBits rb = { src + bytepix, src + size, 0, 0, 0 };
+    uint32_t mask = bytepix == 4 ? 0xffffffffu : (1u << bbits) - 1;
+
+    for (size_t i = 0; i < count;) {
+        int fs = (int)rice_get(&rb, fsbits) - 1;
+        size_t block_end = count - i < (size_t)blocksize ? count : i + blocksize;
+        if (fs < 0) {
+            // low-entropy block: every difference is zero
+            for (; i < block_end; i++) out[i] = (int32_t)last;
+            continue;
+        }
+        for (; i < block_end; i++) {
+            uint32_t diff;
+            if (fs == fsmax) {
+                diff = rice_get(&rb, bbits);  // high-entropy block: raw differences
+            } else {
+                uint32_t high = (uint32_t)rice_zeros(&rb);
+                diff = (high << fs) | (fs ? rice_get(&rb, fs) : 0);
+            }
+            // undo the sign folding of the differences
+            diff = (diff & 1) ? ~(diff >> 1) : (diff >> 1);
+            last = (last + diff) & mask;
+            out[i] = (int32_t)last;
+        }
+        if (rb.overrun) return 0;
+    }
+    if (rb.overrun) return 0;
+
+    // widen to the stored integer type: bytes are unsigned, shorts signed
+    if (bytepix == 2) {
+        for (size_t i = 0; i < count; i++) out[i] = (int16_t)out[i];
+    }
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// PLIO_1
+// ---------------------------------------------------------------------------
+
+// Expand an IRAF PLIO line list into count pixels
+static int plio_decode(const int16_t* list, size_t nwords, int32_t* out, size_t count) {
+    if (nwords < 3) return 0;
+    size_t length, first;
+    if (list[2] > 0) {
+        length = (size_t)list[2];
+        first = 3;
+    } else {
+        if (nwords < 5) return 0;
+        length = ((size_t)(uint16_t)list[4] << 15) + (uint16_t)list[3];
+        first = (size_t)list[1];
+    }
+    if (length > nwords) length = nwords;
+
+    size_t op = 0;    // next output pixel
+    int64_t x = 0;    // position in the line, pixels before it are done
+    int32_t pv = 1;   // current high value
+    for (size_t ip = first; ip < length; ip++) {
+        int opcode = ((uint16_t)list[ip] >> 12) & 15;
+        int data = list[ip] & 4095;
+        switch (opcode) {
+            case 0:    // data zeros
+            case 4:    // data pixels of pv
+            case 5: {  // data - 1 zeros followed by one pv
+                int64_t n = data;
+                if ((size_t)x + n > count) n = (int64_t)(count - (size_t)x);
+                if (n > 0) {
+                    int32_t v = opcode == 4 ? pv : 0;
+                    for (int64_t k = 0; k < n; k++) out[op++] = v;
+                    if (opcode == 5 && n == data) out[op - 1] = pv;
+                }
+                x += data;
+                break;
+            }
+            case 1:    // set pv from this and the next word
+                if (ip + 1 >= length) return 0;
+                pv = (int32_t)list[ip + 1] * 4096 + data;  // the high word is signed
+                ip++;
+                break;
+            case 2: pv += data; break;
+            case 3: pv -= data; break;
+            case 6:    // adjust pv and emit one pixel
+            case 7:
+                pv += opcode == 6 ? data : -data;
+                if ((size_t)x < count) out[op++] = pv;
+                x++;
+                break;
+            default:
+                break;
+        }
+    }
+    while (op < count) out[op++] = 0;
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// HCOMPRESS_1
+// ---------------------------------------------------------------------------
+
+// The H-transform coder works on a 2-D array a[nx][ny] with ny varying
+// fastest, i.e. ny is the tile width and nx its height.
+
+typedef struct {
+    const uint8_t* p;
+    const uint8_t* end;
+    unsigned buffer;  // only the low bits_to_go bits are still unread
+    int bits_to_go;
+    int overrun;
+} HBits;
+
+static inline int h_byte(HBits* hb) {
+    if (hb->p < hb->end) return *hb->p++;
+    hb->overrun = 1;
+    return 0;
+}
+
+static inline int h_bit(HBits* hb) {
+    if (hb->bits_to_go == 0) {
+        hb->buffer = h_byte(hb);
+        hb->bits_to_go = 8;
+    }
+    hb->bits_to_go--;
+    return (int)((hb->buffer >> hb->bits_to_go) & 1);
+}
+
+static inline int h_nbits(HBits* hb, int n) {
+    if (hb->bits_to_go < n) {
+        hb->buffer = (hb->buffer << 8) | (unsigned)h_byte(hb);
+        hb->bits_to_go += 8;
+    }
+    hb->bits_to_go -= n;
+    return (int)((hb->buffer >> hb->bits_to_go) & ((1u << n) - 1));
+}
+
+// Fixed Huffman code for the 4-bit quadtree nybbles
+static int h_huffman(HBits* hb) {
+    int c = h_nbits(hb, 3);
+    if (c < 4) return 1 << c;
+    c = h_bit(hb) | (c << 1);
+    switch (c) {
+        case 8: return 3;
+        case 9: return 5;
+        case 10: return 10;
+        case 11: return 12;
+        case 12: return 15;
+    }
+    c = h_bit(hb) | (c << 1);
+    switch (c) {
+        case 26: return 6;
+        case 27: return 7;
+        case 28: return 9;
+        case 29: return 11;
+        case 30: return 13;
+    }
+    c = h_bit(hb) | (c << 1);
+    return c == 62 ? 0 : 14;
+}
+
+static int ceil_log2(int n) {
+    int log2n = 0;
+    while ((1 << log2n) < n) log2n++;
+    return log2n;
+}
+
+// Expand the 4-bit codes of a[(nx+1)/2][(ny+1)/2] into one bit per element
+// of b[nx][ny]; a and b may be the same array
+static void qtree_copy(const uint8_t* a, int nx, int ny, uint8_t* b) {
+    int nx2 = (nx + 1) / 2, ny2 = (ny + 1) / 2;
+    // spread the codes to the even positions, backwards in case a == b
+    int k = ny2 * nx2 - 1;
+    for (int i = nx2 - 1; i >= 0; i--) {
+        int s00 = 2 * (ny * i + ny2 - 1);
+        for (int j = ny2 - 1; j >= 0; j--, k--, s00 -= 2) b[s00] = a[k];
+    }
+    int i, j;
+    for (i = 0; i < nx - 1; i += 2) {
+        int s00 = ny * i, s10 = s00 + ny;
+        for (j = 0; j < ny - 1; j += 2, s00 += 2, s10 += 2) {
+            int v = b[s00];
+            b[s10 + 1] = v & 1;
+            b[s10] = (v >> 1) & 1;
+            b[s00 + 1] = (v >> 2) & 1;
+            b[s00] = (v >> 3) & 1;
+        }
+        if (j < ny) {
+            b[s10] = (b[s00] >> 1) & 1;
+            b[s00] = (b[s00] >> 3) & 1;
+        }
+    }
+    if (i < nx) {
+        int s00 = ny * i;
+        for (j = 0; j < ny - 1; j += 2, s00 += 2) {
+            b[s00 + 1] = (b[s00] >> 2) & 1;
+            b[s00] = (b[s00] >> 3) & 1;
+        }
+        if (j < ny) b[s00] = (b[s00] >> 3) & 1;
+    }
+}
+
+// OR the 4-bit codes of a[(nx+1)/2][(ny+1)/2] into bit plane bit of b[nx][n]
+static void qtree_bitins(const uint8_t* a, int nx, int ny, int64_t* b, int n, int bit) {
+    int64_t plane = (int64_t)1 << bit;
+    int k = 0, i, j;
+    for (i = 0; i < nx - 1; i += 2) {
+        int s00 = n * i;
+        for (j = 0; j < ny - 1; j += 2, s00 += 2, k++) {
+            int v = a[k];
+            if (v & 1) b[s00 + n + 1] |= plane;
+            if (v & 2) b[s00 + n] |= plane;
+            if (v & 4) b[s00 + 1] |= plane;
+            if (v & 8) b[s00] |= plane;
+        }
+        if (j < ny) {
+            if (a[k] & 2) b[s00 + n] |= plane;
+            if (a[k] & 8) b[s00] |= plane;
+            k++;
+        }
+    }
+    if (i < nx) {
+        int s00 = n * i;
+        for (j = 0; j < ny - 1; j += 2, s00 += 2, k++) {
+            if (a[k] & 4) b[s00 + 1] |= plane;
+            if (a[k] & 8) b[s00] |= plane;
+        }
+        if (j < ny) {
+            if (a[k] & 8) b[s00] |= plane;
+        }
+    }
+}
+
+// Decode the bit planes of one quadrant a[nqx][nqy] (row stride n)
+static int qtree_decode(HBits* hb, int64_t* a, int n, int nqx, int nqy, int nbitplanes, uint8_t* scratch) {
+    int nqmax = nqx > nqy ? nqx : nqy;
+    int log2n = ceil_log2(nqmax);
+    for (int bit = nbitplanes - 1; bit >= 0; bit--) {
+        int format = h_nbits(hb, 4);
+        if (format == 0) {
+            // bit plane written directly, four pixels per nybble
+            int count = ((nqx + 1) / 2) * ((nqy + 1) / 2);
+            for (int i = 0; i < count; i++) scratch[i] = (uint8_t)h_nbits(hb, 4);
+        } else if (format == 0xf) {
+            // quadtree coded: log2n expansions from a single root code
+            scratch[0] = (uint8_t)h_huffman(hb);
+            int nx = 1, ny = 1, nfx = nqx, nfy = nqy, c = 1 << log2n;
+            for (int k = 1; k < log2n; k++) {
+                c >>= 1;
+                nx <<= 1;
+                ny <<= 1;
+                if (nfx <= c) nx--; else nfx -= c;
+                if (nfy <= c) ny--; else nfy -= c;
+                qtree_copy(scratch, nx, ny, scratch);
+                for (int i = nx * ny - 1; i >= 0; i--) {
+                    if (scratch[i]) scratch[i] = (uint8_t)h_huffman(hb);
+                }
+            }
+        } else {
+            return 0;
+        }
+        if (hb->overrun) return 0;
+        qtree_bitins(scratch, nqx, nqy, a, n, bit);
+    }
+    return 1;
+}
+
+// Inverse of the interleave done by the H-transform: a[0], a[n2], ... holds
+// the even elements followed by the odd ones
+static void unshuffle(int64_t* a, int n, int n2, int64_t* tmp) {
+    int nhalf = (n + 1) >> 1;
+    for (int i = nhalf, t = 0; i < n; i++, t++) tmp[t] = a[n2 * i];
+    for (int i = nhalf - 1; i >= 0; i--) a[2 * n2 * i] = a[n2 * i];
+    for (int i = 1, t = 0; i < n; i += 2, t++) a[n2 * i] = tmp[t];
+}
+
+// Inverse H-transform of a[nx][ny] in place
+static void hinv(int64_t* a, int nx, int ny, int64_t* tmp) {
+    int nmax = nx > ny ? nx : ny;
+    int log2n = ceil_log2(nmax);
+    if (log2n == 0) return;
+
+    int shift = 1;
+    int64_t bit0 = (int64_t)1 << (log2n - 1), bit1 = bit0 << 1, bit2 = bit0 << 2;
+    // ~(bit - 1) clears the bits below bit without shifting a negative value
+    int64_t mask0 = ~(bit0 - 1), mask1 = ~(bit1 - 1), mask2 = ~(bit2 - 1);
+    int64_t prnd0 = bit0 >> 1, prnd1 = bit1 >> 1, prnd2 = bit2 >> 1;
+    int64_t nrnd0 = prnd0 - 1, nrnd1 = prnd1 - 1, nrnd2 = prnd2 - 1;
+
+    // round h0 to a multiple of bit2
+    a[0] = (a[0] + (a[0] >= 0 ? prnd2 : nrnd2)) & mask2;
+
+    int nxtop = 1, nytop = 1, nxf = nx, nyf = ny, c = 1 << log2n;
+    for (int k = log2n - 1; k >= 0; k--) {
+        c >>= 1;
+        nxtop <<= 1;
+        nytop <<= 1;
+        if (nxf <= c) nxtop--; else nxf -= c;
+        if (nyf <= c) nytop--; else nyf -= c;
+        if (k == 0) {
+            // the last pass divides by 4 and has no rounding offset
+            nrnd0 = 0;
+            shift = 2;
+        }
+        for (int i = 0; i < nxtop; i++) unshuffle(&a[ny * i], nytop, 1, tmp);
+        for (int j = 0; j < nytop; j++) unshuffle(&a[j], nxtop, ny, tmp);
+
+        int oddx = nxtop % 2, oddy = nytop % 2, i, j;
+        for (i = 0; i < nxtop - oddx; i += 2) {
+            int s00 = ny * i, s10 = s00 + ny;
+            for (j = 0; j < nytop - oddy; j += 2, s00 += 2, s10 += 2) {
+                int64_t h0 = a[s00], hx = a[s10], hy = a[s00 + 1], hc = a[s10 + 1];
+                // round hx, hy to multiples of bit1 and hc to a multiple of bit0
+                hx = (hx + (hx >= 0 ? prnd1 : nrnd1)) & mask1;
+                hy = (hy + (hy >= 0 ? prnd1 : nrnd1)) & mask1;
+                hc = (hc + (hc >= 0 ? prnd0 : nrnd0)) & mask0;
+                // propagate the low bits of hc, hx, hy into h0
+                int64_t lowbit0 = hc & bit0;
+                hx = hx >= 0 ? hx - lowbit0 : hx + lowbit0;
+                hy = hy >= 0 ? hy - lowbit0 : hy + lowbit0;
+                int64_t lowbit1 = (hc ^ hx ^ hy) & bit1;
+                h0 = h0 >= 0 ? h0 + lowbit0 - lowbit1 : h0 + (lowbit0 == 0 ? lowbit1 : lowbit0 - lowbit1);
+                a[s10 + 1] = (h0 + hx + hy + hc) >> shift;
+                a[s10] = (h0 + hx - hy - hc) >> shift;
+                a[s00 + 1] = (h0 - hx + hy - hc) >> shift;
+                a[s00] = (h0 - hx - hy + hc) >> shift;
+            }
+            if (oddy) {
+                int64_t h0 = a[s00], hx = a[s10];
+                hx = (hx + (hx >= 0 ? prnd1 : nrnd1)) & mask1;
+                int64_t lowbit1 = hx & bit1;
+                h0 = h0 >= 0 ? h0 - lowbit1 : h0 + lowbit1;
+                a[s10] = (h0 + hx) >> shift;
+                a[s00] = (h0 - hx) >> shift;
+            }
+        }
+        if (oddx) {
+            int s00 = ny * i;
+            for (j = 0; j < nytop - oddy; j += 2, s00 += 2) {
+                int64_t h0 = a[s00], hy = a[s00 + 1];
+                hy = (hy + (hy >= 0 ? prnd1 : nrnd1)) & mask1;
+                int64_t lowbit1 = hy & bit1;
+                h0 = h0 >= 0 ? h0 - lowbit1 : h0 + lowbit1;
+                a[s00 + 1] = (h0 + hy) >> shift;
+                a[s00] = (h0 - hy) >> shift;
+            }
+            if (oddy) a[s00] >>= shift;
+        }
+
+        bit2 = bit1;
+        bit1 = bit0;
+        bit0 >>= 1;
+        mask1 = mask0;
+        mask0 = ~(bit0 - 1);
+        prnd1 = prnd0;
+        prnd0 >>= 1;
+        nrnd1 = nrnd0;
+        nrnd0 = prnd0 - 1;
+    }
+}
+
+// Decode an HCOMPRESS tile of width x height pixels into out
+static int hcompress_decode(const uint8_t* src, size_t size, int64_t* out, int width, int height) {
+    if (size < 2 + 4 + 4 + 4 + 8 + 3 || src[0] != 0xDD || src[1] != 0x99) return 0;
+    int nx = (int32_t)read_be32(src + 2);
+    int ny = (int32_t)read_be32(src + 6);
+    int scale = (int32_t)read_be32(src + 10);
+    int64_t sumall = (int64_t)read_be64(src + 14);
+    const uint8_t* nbitplanes = src + 22;
+    // the format counts pixels in 32-bit ints, which bounds a tile
+    if (nx != height || ny != width || (int64_t)nx * ny > 0x7FFFFFFF) return 0;
+
+    int nel = nx * ny;
+    int nx2 = (nx + 1) / 2, ny2 = (ny + 1) / 2;
+    uint8_t* scratch = (uint8_t*)malloc((size_t)nx2 * ny2 + 1);
+    int64_t* tmp = (int64_t*)malloc(((size_t)(nx > ny ? nx : ny) + 1) / 2 * sizeof(int64_t) + sizeof(int64_t));
+    int ok = scratch && tmp;
+    memset(out, 0, (size_t)nel * sizeof(int64_t));
+
+    // bit planes of the four quadrants, then a zero nybble as terminator
+    HBits hb = { src + 25, src + size, 0, 0, 0 };
+    ok = ok && qtree_decode(&hb, &out[0], ny, nx2, ny2, nbitplanes[0], scratch);
+    ok = ok && qtree_decode(&hb, &out[ny2], ny, nx2, ny / 2, nbitplanes[1], scratch);
+    ok = ok && qtree_decode(&hb, &out[ny * nx2], ny, nx / 2, ny2, nbitplanes[1], scratch);
+    ok = ok && qtree_decode(&hb, &out[ny * nx2 + ny2], ny, nx / 2, ny / 2, nbitplanes[2], scratch);
+    ok = ok && h_nbits(&hb, 4) == 0;
+
+    if (ok) {
+        // sign bits of the non-zero coefficients, from a fresh byte
+        hb.bits_to_go = 0;
+        for (int i = 0; i < nel; i++) {
+            if (out[i] && h_bit(&hb)) out[i] = -out[i];
+        }
+        ok = !hb.overrun;
+    }
+    if (ok) {
+        out[0] = sumall;
+        if (scale > 1) {
+            for (int i = 0; i < nel; i++) out[i] *= scale;
+        }
+        hinv(out, nx, ny, tmp);
+    }
+    free(scratch);
+    free(tmp);
+    return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Table layout
+// ---------------------------------------------------------------------------
+
+static size_t tform_type_size(char type) {
+    switch (type) {
+        case 'L': case 'B': case 'A': return 1;
+        case 'I': return 2;
+        case 'J': case 'E': return 4;
+        case 'K': case 'D': case 'C': case 'P': return 8;
+        case 'M': case 'Q': return 16;
+        default: return 0;
+    }
+}
+
+// Width in bytes of a TFORMn field, filling in column details for
+// variable-length array descriptors
+static size_t parse_tform(const char* tform, FITSTableColumn* column) {
+    const char* p = tform;
+    size_t repeat = 0;
+    int has_repeat = 0;
+    while (*p >= '0' && *p <= '9') {
+        repeat = repeat * 10 + (size_t)(*p++ - '0');
+        has_repeat = 1;
+    }
+    if (!has_repeat) repeat = 1;
+    char type = *p;
+    if (type == 'X') return (repeat + 7) / 8;
+    if (type == 'P' || type == 'Q') {
+        column->wide = type == 'Q';
+        column->type = p[1];
+    }
+    return repeat * tform_type_size(type);
+}
+
+static void find_columns(FITSTiledImage* image, const FITSHeader* header) {
+    static const struct {
+        const char* name;
+        size_t member;
+    } names[] = {
+        { "COMPRESSED_DATA", offsetof(FITSTiledImage, compressed_data) },
+        { "GZIP_COMPRESSED_DATA", offsetof(FITSTiledImage, gzip_data) },
+        { "UNCOMPRESSED_DATA", offsetof(FITSTiledImage, uncompressed_data) },
+        { "ZSCALE", offsetof(FITSTiledImage, zscale_column) },
+        { "ZZERO", offsetof(FITSTiledImage, zzero_column) },
+        { "ZBLANK", offsetof(FITSTiledImage, zblank_column) },
+    };
+    int64_t tfields = 0;
+    fits_header_get_int(header, "TFIELDS", &tfields);
+    size_t offset = 0;
+    for (int64_t i = 1; i <= tfields; i++) {
+        char keyword[16], ttype[72] = "", tform[72] = "";
+        snprintf(keyword, sizeof(keyword), "TTYPE%d", (int)i);
+        fits_header_get_string(header, keyword, ttype, sizeof(ttype));
+        snprintf(keyword, sizeof(keyword), "TFORM%d", (int)i);
+        fits_header_get_string(header, keyword, tform, sizeof(tform));
+
+        FITSTableColumn column = { 1, offset, 0, 0 };
+        offset += parse_tform(tform, &column);
+        for (size_t n = 0; n < sizeof(names) / sizeof(names[0]); n++) {
+            if (strcmp(ttype, names[n].name) == 0) {
+                FITSTableColumn* target = (FITSTableColumn*)((uint8_t*)image + names[n].member);
+                *target = column;
+                if (!column.type) target->type = tform[strspn(tform, "0123456789")];
+            }
+        }
+    }
+}
+
+// Read a ZNAMEn/ZVALn compression parameter
+static int compression_param(const FITSHeader* header, const char* name, int64_t* value) {
+    for (int i = 1; i < 100; i++) {
+        char keyword[16], zname[72];
+        snprintf(keyword, sizeof(keyword), "ZNAME%d", i);
+        if (!fits_header_get_string(header, keyword, zname, sizeof(zname))) return 0;
+        if (strcmp(zname, name) == 0) {
+            snprintf(keyword, sizeof(keyword), "ZVAL%d", i);
+            return fits_header_get_int(header, keyword, value);
+        }
+    }
+    return 0;
+}
+
+int fits_tiled_image_open(FITSTiledImage* image, const FITSHeader* header, const uint8_t* data, size_t size) {
+    memset(image, 0, sizeof(*image));
+    int zimage = 0;
+    int64_t value;
+    if (!fits_header_get_logical(header, "ZIMAGE", &zimage) || !zimage) return 0;
+
+    // table shape and heap location
+    int64_t naxis1 = 0, naxis2 = 0, pcount = 0;
+    fits_header_key_int(header, FITS_KEY_NAXIS1, &naxis1);
+    fits_header_key_int(header, FITS_KEY_NAXIS1 + 1, &naxis2);
+    fits_header_key_int(header, FITS_KEY_PCOUNT, &pcount);
+    if (naxis1 <= 0 || naxis2 <= 0 || pcount < 0) return 0;
+    image->table = data;
+    image->row_size = (size_t)naxis1;
+    image->nrows = (size_t)naxis2;
+    int64_t theap = naxis1 * naxis2;
+    fits_header_get_int(header, "THEAP", &theap);
+    if (theap < naxis1 * naxis2 || (uint64_t)theap > size) return 0;
+    image->heap = data + theap;
+    image->heap_size = size - (size_t)theap;
+
+    // image shape and tiling; the default tile is one row
+    if (!fits_header_get_int(header, "ZBITPIX", &value)) return 0;
+    image->bitpix = (int)value;
+    if (!fits_header_get_int(header, "ZNAXIS", &value) || value < 1 || value > FITS_MAX_NAXIS) return 0;
+    image->naxis = (int)value;
+    image->ntiles = 1;
+    for (int i = 0; i < image->naxis; i++) {
+        char keyword[16];
+        snprintf(keyword, sizeof(keyword), "ZNAXIS%d", i + 1);
+        if (!fits_header_get_int(header, keyword, &image->naxes[i]) || image->naxes[i] <= 0) return 0;
+        image->tile[i] = i == 0 ? image->naxes[0] : 1;
+        snprintf(keyword, sizeof(keyword), "ZTILE%d", i + 1);
+        fits_header_get_int(header, keyword, &image->tile[i]);
+        if (image->tile[i] <= 0) return 0;
+        image->ntiles *= (size_t)((image->naxes[i] + image->tile[i] - 1) / image->tile[i]);
+    }
+    if (image->ntiles > image->nrows) return 0;
+
+    char name[72] = "";
+    fits_header_get_string(header, "ZCMPTYPE", name, sizeof(name));
+    if (strcmp(name, "RICE_1") == 0 || strcmp(name, "RICE_ONE") == 0) {
+        image->compression = FITS_COMP_RICE;
+    } else if (strcmp(name, "GZIP_1") == 0) {
+        image->compression = FITS_COMP_GZIP_1;
+    } else if (strcmp(name, "GZIP_2") == 0) {
+        image->compression = FITS_COMP_GZIP_2;
+    } else if (strcmp(name, "PLIO_1") == 0) {
+        image->compression = FITS_COMP_PLIO;
+    } else if (strcmp(name, "HCOMPRESS_1") == 0) {
+        image->compression = FITS_COMP_HCOMPRESS;
+    } else if (strcmp(name, "NOCOMPRESS") == 0) {
+        image->compression = FITS_COMP_NONE;
+    } else {
+        return 0;
+    }
+
+    image->rice_blocksize = 32;
+    image->rice_bytepix = 4;
+    if (compression_param(header, "BLOCKSIZE", &value)) image->rice_blocksize = (int)value;
+    if (compression_param(header, "BYTEPIX", &value)) image->rice_bytepix = (int)value;
+    // HCOMPRESS SMOOTH only affects lossy decoding and is not applied
+
+    find_columns(image, header);
+    if (!image->compressed_data.present) return 0;
+
+    // floating-point images are normally quantized to integers per tile
+    image->zscale = 1.0;
+    image->zzero = 0.0;
+    fits_header_get_double(header, "ZSCALE", &image->zscale);
+    fits_header_get_double(header, "ZZERO", &image->zzero);
+    char quantize[72] = "";
+    fits_header_get_string(header, "ZQUANTIZ", quantize, sizeof(quantize));
+    if (image->bitpix < 0 && strcmp(quantize, "NONE") != 0 &&
+        (image->zscale_column.present || fits_header_find(header, "ZSCALE"))) {
+        image->quantize = 1;
+        if (strcmp(quantize, "SUBTRACTIVE_DITHER_1") == 0) image->dither = 1;
+        if (strcmp(quantize, "SUBTRACTIVE_DITHER_2") == 0) image->dither = 2;
+    }
+    if (fits_header_get_int(header, "ZDITHER0", &value)) image->dither_seed = (int)value;
+    image->has_zblank = fits_header_get_int(header, "ZBLANK", &image->zblank);
+
+    if (image->dither) init_random_values();
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Tile decoding
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int64_t start[FITS_MAX_NAXIS];
+    int64_t size[FITS_MAX_NAXIS];
+    size_t pixels;
+} TileGeometry;
+
+static void tile_geometry(const FITSTiledImage* image, size_t index, TileGeometry* g) {
+    g->pixels = 1;
+    for (int d = 0; d < image->naxis; d++) {
+        size_t across = (size_t)((image->naxes[d] + image->tile[d] - 1) / image->tile[d]);
+        g->start[d] = (int64_t)(index % across) * image->tile[d];
+        g->size[d] = image->naxes[d] - g->start[d] < image->tile[d] ? image->naxes[d] - g->start[d] : image->tile[d];
+        index /= across;
+        g->pixels *= (size_t)g->size[d];
+    }
+}
+
+// Heap bytes of a variable-length array cell, or NULL if empty or invalid
+static const uint8_t* heap_array(const FITSTiledImage* image, const FITSTableColumn* column, size_t row, size_t* count) {
+    const uint8_t* cell = image->table + row * image->row_size + column->offset;
+    uint64_t n, offset;
+    if (column->wide) {
+        n = read_be64(cell);
+        offset = read_be64(cell + 8);
+    } else {
+        n = read_be32(cell);
+        offset = read_be32(cell + 4);
+    }
+    size_t elem = tform_type_size(column->type);
+    if (n == 0 || elem == 0 || offset > image->heap_size || n > (image->heap_size - offset) / elem) return NULL;
+    *count = (size_t)n;
+    return image->heap + offset;
+}
+
+// Value of a scalar column in a row
+static double cell_value(const FITSTiledImage* image, const FITSTableColumn* column, size_t row) {
+    const uint8_t* cell = image->table + row * image->row_size + column->offset;
+    switch (column->type) {
+        case 'I': return (int16_t)read_be16(cell);
+        case 'J': return (int32_t)read_be32(cell);
+        case 'K': return (double)(int64_t)read_be64(cell);
+        case 'E': { uint32_t u = read_be32(cell); float f; memcpy(&f, &u, 4); return f; }
+        case 'D': { uint64_t u = read_be64(cell); double d; memcpy(&d, &u, 8); return d; }
+        default: return 0.0;
+    }
+}
+
+// Rows of a tile: runs along the first axis, row_pixels long, found by their
+// position in the tile and placed in the image by next_tile_row
+typedef struct {
+    const FITSTiledImage* image;
+    const TileGeometry* g;
+    size_t row_pixels;
+} TileRows;
+
+static size_t next_tile_row(const TileRows* rows, size_t tile_pos) {
+    // image offset of the tile row starting at tile pixel tile_pos
+    size_t rest = tile_pos / rows->row_pixels, offset = 0, stride = 1;
+    const FITSTiledImage* image = rows->image;
+    for (int d = 0; d < image->naxis; d++) {
+        int64_t coord = rows->g->start[d];
+        if (d > 0) {
+            coord += (int64_t)(rest % (size_t)rows->g->size[d]);
+            rest /= (size_t)rows->g->size[d];
+        }
+        offset += (size_t)coord * stride;
+        stride *= (size_t)image->naxes[d];
+    }
+    return offset;
+}
+
+// Write integer tile values to tile as big-endian ZBITPIX samples, in tile
+// order, dequantizing floating-point images
+static void store_ints(const FITSTiledImage* image, const TileGeometry* g, size_t tile_index,
+                       const int32_t* values, uint8_t* tile) {
+    int pixel_size = abs(image->bitpix) / 8;
+    uint8_t* out = tile;
+
+    if (image->bitpix > 0) {
+        for (size_t i = 0; i < g->pixels; i++, out += pixel_size) {
+            write_be(out, (uint64_t)(int64_t)values[i], pixel_size);
+        }
+        return;
+    }
+
+    double zscale = image->zscale_column.present ? cell_value(image, &image->zscale_column, tile_index) : image->zscale;
+    double zzero = image->zzero_column.present ? cell_value(image, &image->zzero_column, tile_index) : image->zzero;
+    int has_blank = image->zblank_column.present || image->has_zblank;
+    int64_t blank = image->zblank_column.present ? (int64_t)cell_value(image, &image->zblank_column, tile_index) : image->zblank;
+
+    // the dither sequence restarts for every tile at a seed-dependent point
+    int iseed = 0, next = 0;
+    if (image->dither) {
+        iseed = (int)(((int64_t)tile_index + image->dither_seed - 1) % N_RANDOM);
+        if (iseed < 0) iseed += N_RANDOM;
+        next = (int)(random_values[iseed] * 500);
+    }
+
+    for (size_t i = 0; i < g->pixels; i++, out += pixel_size) {
+        int32_t raw = values[i];
+        double v;
+        if (has_blank && raw == blank) {
+            v = NAN;
+        } else if (image->dither == 2 && raw == ZERO_VALUE) {
+            v = 0.0;
+        } else if (image->dither) {
+            v = ((double)raw - random_values[next] + 0.5) * zscale + zzero;
+        } else {
+            v = (double)raw * zscale + zzero;
+        }
+        if (image->dither && ++next == N_RANDOM) {
+            if (++iseed == N_RANDOM) iseed = 0;
+            next = (int)(random_values[iseed] * 500);
+        }
+        if (pixel_size == 4) {
+            float f = (float)v;
+            uint32_t u;
+            memcpy(&u, &f, 4);
+            write_be(out, u, 4);
+        } else {
+            uint64_t u;
+            memcpy(&u, &v, 8);
+            write_be(out, u, 8);
+        }
+    }
+}
+
+// Undo the GZIP_2 byte shuffle: all first bytes, then all second bytes, ...
+static void unshuffle_bytes(const uint8_t* src, uint8_t* dst, size_t count, size_t elem) {
+    for (size_t b = 0; b < elem; b++) {
+        const uint8_t* plane = src + b * count;
+        for (size_t i = 0; i < count; i++) dst[i * elem + b] = plane[i];
+    }
+}
+
+// Tile of big-endian samples elem bytes wide: either the image samples
+// themselves, which are used where they are, or, when quantized, the scaled
+// integers of a float tile
+static int store_plain(const FITSTiledImage* image, const TileGeometry* g, size_t tile_index,
+                       const uint8_t* src, size_t elem, int quantized, int32_t* ints, uint8_t* tile,
+                       const uint8_t** samples) {
+    size_t pixel_size = (size_t)abs(image->bitpix) / 8;
+    if (elem == pixel_size && !quantized) {
+        *samples = src;
+        return 1;
+    }
+    if (image->bitpix < 0 && !quantized) return 0;
+    for (size_t i = 0; i < g->pixels; i++) {
+        switch (elem) {
+            case 1: ints[i] = src[i]; break;
+            case 2: ints[i] = (int16_t)read_be16(src + 2 * i); break;
+            case 4: ints[i] = (int32_t)read_be32(src + 4 * i); break;
+            default: return 0;
+        }
+    }
+    store_ints(image, g, tile_index, ints, tile);
+    return 1;
+}
+
+// Decode one tile into its big-endian ZBITPIX samples in tile order. They go
+// to tile (g->pixels samples), except that tiles stored as plain samples are
+// left where they are; *samples points at them either way.
+static int decode_tile(const FITSTiledImage* image, size_t index, const TileGeometry* g, uint8_t* tile,
+                       const uint8_t** samples) {
+    size_t n = g->pixels;
+    *samples = tile;
+
+    // scratch: decoded integers plus room for any byte-level intermediate
+    int32_t* ints = (int32_t*)malloc(n * sizeof(int32_t));
+    uint8_t* bytes = (uint8_t*)malloc(n * 8 * 2);
+    int64_t* wide = image->compression == FITS_COMP_HCOMPRESS ? (int64_t*)malloc(n * sizeof(int64_t)) : NULL;
+    int ok = ints && bytes && (wide || image->compression != FITS_COMP_HCOMPRESS);
+
+    size_t count = 0;
+    const uint8_t* src = ok ? heap_array(image, &image->compressed_data, index, &count) : NULL;
+    if (!ok) {
+        // out of memory
+    } else if (!src) {
+        // tiles that could not be quantized are stored gzipped or raw instead
+        if (image->gzip_data.present && (src = heap_array(image, &image->gzip_data, index, &count))) {
+            size_t out_size;
+            ok = fits_decompress(bytes, n * 8, &out_size, src, count) && out_size % n == 0 &&
+                 store_plain(image, g, index, bytes, out_size / n, 0, ints, tile, samples);
+            if (ok && *samples == bytes) {
+                memcpy(tile, bytes, out_size);  // bytes is freed below
+                *samples = tile;
+            }
+        } else if (image->uncompressed_data.present && (src = heap_array(image, &image->uncompressed_data, index, &count))) {
+            size_t elem = tform_type_size(image->uncompressed_data.type);
+            ok = count == n && store_plain(image, g, index, src, elem, 0, ints, tile, samples);
+        } else {
+            ok = 0;
+        }
+    } else {
+        size_t bytes_in = count * tform_type_size(image->compressed_data.type);
+        switch (image->compression) {
+            case FITS_COMP_RICE:
+                ok = rice_decode(src, bytes_in, ints, n, image->rice_blocksize, image->rice_bytepix);
+                if (ok) store_ints(image, g, index, ints, tile);
+                break;
+            case FITS_COMP_GZIP_1:
+            case FITS_COMP_GZIP_2: {
+                size_t out_size;
+                ok = fits_decompress(bytes, n * 8, &out_size, src, bytes_in) && out_size % n == 0;
+                if (ok) {
+                    size_t elem = out_size / n;
+                    const uint8_t* plain = bytes;
+                    if (image->compression == FITS_COMP_GZIP_2 && elem > 1) {
+                        unshuffle_bytes(bytes, bytes + n * 8, n, elem);
+                        plain = bytes + n * 8;
+                    }
+                    ok = store_plain(image, g, index, plain, elem, image->quantize, ints, tile, samples);
+                    if (ok && *samples == plain) {
+                        memcpy(tile, plain, out_size);  // bytes is freed below
+                        *samples = tile;
+                    }
+                }
+                break;
+            }
+            case FITS_COMP_PLIO: {
+                int16_t* list = (int16_t*)bytes;
+                if (count > n * 8) {
+                    ok = 0;
+                    break;
+                }
+                for (size_t i = 0; i < count; i++) list[i] = (int16_t)read_be16(src + 2 * i);
+                ok = plio_decode(list, count, ints, n);
+                if (ok) store_ints(image, g, index, ints, tile);
+                break;
+            }
+            case FITS_COMP_HCOMPRESS: {
+                int height = image->naxis > 1 ? (int)g->size[1] : 1;
+                ok = g->size[0] <= 0x7FFFFFFF && g->pixels == (size_t)g->size[0] * height &&
+                     hcompress_decode(src, bytes_in, wide, (int)g->size[0], height);
+                if (ok) {
+                    for (size_t i = 0; i < n; i++) ints[i] = (int32_t)wide[i];
+                    store_ints(image, g, index, ints, tile);
+                }
+                break;
+            }
+            default:
+                ok = bytes_in % n == 0 &&
+                     store_plain(image, g, index, src, bytes_in / n, image->quantize, ints, tile, samples);
+                break;
+        }
+    }
+    free(ints);
+    free(bytes);
+    free(wide);
+    return ok;
+}
+
+// Tiles are numbered with the first axis fastest, like pixels, so the tiles
+// holding image pixels first .. last all lie between the tile of first with
+// its first-axis tile index set to 0 and the tile of last with it set to the
+// highest one
+static size_t tile_of_pixel(const FITSTiledImage* image, size_t pixel, int last) {
+    size_t index = 0, stride = 1;
+    for (int d = 0; d < image->naxis; d++) {
+        size_t across = (size_t)((image->naxes[d] + image->tile[d] - 1) / image->tile[d]);
+        size_t coord = pixel % (size_t)image->naxes[d];
+        pixel /= (size_t)image->naxes[d];
+        size_t t = d == 0 ? (last ? across - 1 : 0) : coord / (size_t)image->tile[d];
+        index += t * stride;
+        stride *= across;
+    }
+    return index;
+}
+
+typedef struct {
+    const FITSTiledImage* image;
+    uint8_t* dst;
+    FITSSampleType type;
+    const FITSLoadParams* params;
+    size_t first, end;      // image pixels to load
+    size_t plane;           // pixels per plane when interleaving three planes, else 0
+    size_t first_tile;
+    double* ranges;         // fits_tiled_image_range: min and max per tile, NaN for none
+    volatile int failed;
+} LoadJob;
+
+// Copy count loaded samples to every third sample of dst
+static void store_interleaved(uint8_t* dst, const uint8_t* src, size_t count, size_t sample_size) {
+    for (size_t i = 0; i < count; i++) memcpy(dst + i * 3 * sample_size, src + i * sample_size, sample_size);
+}
+
+// Load the part of one tile row that lies in the job's range
+static int load_tile_row(const LoadJob* job, const uint8_t* samples, size_t offset, size_t count,
+                         uint8_t* scratch, size_t scratch_samples) {
+    size_t pixel_size = (size_t)abs(job->image->bitpix) / 8;
+    size_t sample_size = fits_sample_size(job->type);
+    size_t begin = offset > job->first ? offset : job->first;
+    size_t end = offset + count < job->end ? offset + count : job->end;
+    if (begin >= end) return 1;
+    samples += (begin - offset) * pixel_size;
+    if (!job->plane) {
+        return fits_load_samples(job->dst + (begin - job->first) * sample_size, job->type, samples, end - begin,
+                                 job->params);
+    }
+    // a row never crosses a plane, so it goes to one colour of the triples
+    size_t c = begin / job->plane, p = begin % job->plane;
+    uint8_t* out = job->dst + (p * 3 + c) * sample_size;
+    for (size_t i = begin; i < end; i += scratch_samples) {
+        size_t n = end - i < scratch_samples ? end - i : scratch_samples;
+        if (!fits_load_samples(scratch, job->type, samples, n, job->params)) return 0;
+        store_interleaved(out, scratch, n, sample_size);
+        samples += n * pixel_size;
+        out += n * 3 * sample_size;
+    }
+    return 1;
+}
+
+#define LOAD_SCRATCH_SAMPLES 1024
+
+static void load_tile_job(void* context, size_t i) {
+    LoadJob* job = (LoadJob*)context;
+    if (job->failed) return;
+    const FITSTiledImage* image = job->image;
+    size_t index = job->first_tile + i;
+    TileGeometry g;
+    tile_geometry(image, index, &g);
+    TileRows rows = { image, &g, (size_t)g.size[0] };
+    size_t pixel_size = (size_t)abs(image->bitpix) / 8;
+
+    // tiles in the candidate span that miss the range are not decoded
+    size_t low = next_tile_row(&rows, 0);
+    size_t high = next_tile_row(&rows, g.pixels - rows.row_pixels) + rows.row_pixels;
+    if (low >= job->end || high <= job->first) {
+        if (job->ranges) job->ranges[2 * i] = job->ranges[2 * i + 1] = NAN;
+        return;
+    }
+
+    uint8_t* tile = (uint8_t*)malloc(g.pixels * pixel_size);
+    const uint8_t* samples;
+    int ok = tile && decode_tile(image, index, &g, tile, &samples);
+    if (ok && job->ranges) {
+        if (!fits_physical_range(samples, g.pixels, job->params->bitpix, job->params->bzero, job->params->bscale,
+                                 &job->ranges[2 * i], &job->ranges[2 * i + 1])) {
+            job->ranges[2 * i] = job->ranges[2 * i + 1] = NAN;
+        }
+    } else if (ok) {
+        uint64_t scratch[LOAD_SCRATCH_SAMPLES];
+        for (size_t pos = 0; ok && pos < g.pixels; pos += rows.row_pixels) {
+            ok = load_tile_row(job, samples + pos * pixel_size, next_tile_row(&rows, pos), rows.row_pixels,
+                               (uint8_t*)scratch, LOAD_SCRATCH_SAMPLES);
+        }
+    }
+    free(tile);
+    if (!ok) job->failed = 1;
+}
+
+static int run_load_job(LoadJob* job, int threads) {
+    size_t first_tile = tile_of_pixel(job->image, job->first, 0);
+    size_t last_tile = tile_of_pixel(job->image, job->end - 1, 1);
+    job->first_tile = first_tile;
+    fits_parallel_for(last_tile - first_tile + 1, threads, load_tile_job, job);
+    return !job->failed;
+}
+
+int fits_tiled_image_load(const FITSTiledImage* image, void* dst, FITSSampleType type, const FITSLoadParams* params,
+                          size_t first, size_t count, int interleave, int threads) {
+    if (count == 0) return 1;
+    size_t plane = 0;
+    if (interleave) {
+        plane = (size_t)image->naxes[0] * (size_t)(image->naxis > 1 ? image->naxes[1] : 1);
+        if (first != 0 || count != 3 * plane) return 0;
+    }
+    LoadJob job = { image, (uint8_t*)dst, type, params, first, first + count, plane, 0, NULL, 0 };
+    return run_load_job(&job, threads);
+}
+
+int fits_tiled_image_range(const FITSTiledImage* image, size_t count, double bzero, double bscale, int threads,
+                           double* min_value, double* max_value) {
+    if (count == 0) return 0;
+    FITSLoadParams params = { image->bitpix, bzero, bscale, 0.0, 0.0 };
+    LoadJob job = { image, NULL, FITS_SAMPLE_U8, &params, 0, count, 0, 0, NULL, 0 };
+    size_t tiles = tile_of_pixel(image, count - 1, 1) + 1;
+    job.ranges = (double*)malloc(tiles * 2 * sizeof(double));
+    if (!job.ranges) return 0;
+    int ok = run_load_job(&job, threads);
+    double lo = INFINITY, hi = -INFINITY;
+    for (size_t i = 0; ok && i < tiles; i++) {
+        if (isnan(job.ranges[2 * i])) continue;
+        if (job.ranges[2 * i] < lo) lo = job.ranges[2 * i];
+        if (job.ranges[2 * i + 1] > hi) hi = job.ranges[2 * i + 1];
+    }
+    free(job.ranges);
+    if (!ok || lo > hi) return 0;
+    *min_value = lo;
+    *max_value = hi;
+    return 1;
+}
@@ -0,0 +1,88 @@
+#ifndef FITS_TILECOMP_H
+#define FITS_TILECOMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fits_header.h"
+#include "fits_kernels.h"
+
+// Tile compression algorithms of the compressed image convention (ZCMPTYPE)
+typedef enum {
+    FITS_COMP_NONE,        // NOCOMPRESS
+    FITS_COMP_RICE,        // RICE_1
+    FITS_COMP_GZIP_1,
+    FITS_COMP_GZIP_2,      // gzip of byte-shuffled samples
+    FITS_COMP_PLIO,        // PLIO_1
+    FITS_COMP_HCOMPRESS    // HCOMPRESS_1
+} FITSCompression;
+
+// A variable-length array column of the compressed image table
+typedef struct {
+    int present;
+    size_t offset;   // byte offset of the descriptor within a row
+    int wide;        // 1 for 'Q' (64-bit) descriptors, 0 for 'P'
+    char type;       // element type code: B, I, J, K, E or D
+} FITSTableColumn;
+
+// A tile-compressed image stored in a binary table extension (ZIMAGE = T),
+// as written by fpack. Each table row holds one tile; a tile decodes to the
+// big-endian ZBITPIX samples an ordinary data unit would hold, which go
+// through the same sample loaders as uncompressed files.
+typedef struct {
+    const uint8_t* table;       // first row of the table
+    size_t row_size;            // NAXIS1
+    size_t nrows;               // NAXIS2, one row per tile
+    const uint8_t* heap;        // variable-length array heap
+    size_t heap_size;
+
+    int bitpix;                 // ZBITPIX
+    int naxis;                  // ZNAXIS
+    int64_t naxes[FITS_MAX_NAXIS];   // ZNAXISn
+    int64_t tile[FITS_MAX_NAXIS];    // ZTILEn
+    size_t ntiles;
+
+    FITSCompression compression;
+    int rice_blocksize;         // BLOCKSIZE, default 32
+    int rice_bytepix;           // BYTEPIX, default 4
+    int quantize;               // floats stored as scaled integers
+    int dither;                 // 0 NO_DITHER, 1 SUBTRACTIVE_DITHER_1, 2 SUBTRACTIVE_DITHER_2
+    int dither_seed;            // ZDITHER0
+    double zscale, zzero;       // ZSCALE/ZZERO keywords, used when there is no column
+    int64_t zblank;             // raw value marking undefined pixels
+    int has_zblank;
+
+    FITSTableColumn compressed_data;
+    FITSTableColumn gzip_data;          // GZIP_COMPRESSED_DATA: losslessly gzipped float tiles
+    FITSTableColumn uncompressed_data;
+    FITSTableColumn zscale_column;
+    FITSTableColumn zzero_column;
+    FITSTableColumn zblank_column;
+} FITSTiledImage;
+
+// Read the compression keywords and table layout of a compressed image HDU.
+// data/size is the binary table data unit including its heap. Returns 0 for
+// tables that are not compressed images or use unsupported settings.
+int fits_tiled_image_open(FITSTiledImage* image, const FITSHeader* header, const uint8_t* data, size_t size);
+
+// Load image pixels first .. first + count - 1, counted in data unit order,
+// into dst as the given type, like fits_load_samples on the uncompressed
+// data unit would. With interleave the range must be the whole of a three
+// plane image, which lands in dst as RGB triples. Only the tiles holding
+// the range are decoded; they are spread over threads workers (0 = one per
+// logical processor), each loading its tile straight into its part of dst.
+// Returns 0 if any of those tiles is corrupt.
+int fits_tiled_image_load(const FITSTiledImage* image, void* dst, FITSSampleType type, const FITSLoadParams* params,
+                          size_t first, size_t count, int interleave, int threads);
+
+// Physical min/max over the finite samples of the first count pixels, like
+// fits_physical_range on the uncompressed data unit. Tiles are decoded one
+// at a time per worker. Returns 0 if there are no finite samples or a tile
+// is corrupt.
+int fits_tiled_image_range(const FITSTiledImage* image, size_t count, double bzero, double bscale, int threads,
+                           double* min_value, double* max_value);
+
+// ZCMPTYPE name of an algorithm
+const char* fits_compression_name(FITSCompression compression);
+
+#endif // FITS_TILECOMP_H
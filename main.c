@@ -9,6 +9,16 @@
 #include "stb_image_write.h"
 
 #include "tinytiffwriter.h"
+#include "fits_io.h"
+#include "fits_header.h"
+#include "fits_kernels.h"
+#include "fits_catalog.h"
+#include "fits_platform.h"
+#include "fits_tilecomp.h"
+#include "fits_output.h"
+#include "fits_demosaic.h"
+#include "fits_ser.h"
+#include "fits_stretch.h"
 
 #define WINDOW_WIDTH 400
 #define WINDOW_HEIGHT 200
@@ -27,43 +37,41 @@
 // Global variables
 HWND hwndButton, hwndStatus, hwndTiffRadio, hwndJpgRadio,hwndPngRadio, hwndDemosaicCheck;
 HINSTANCE hInstance;
+BOOL commandLineMode = FALSE;  // errors go to the console instead of message boxes
 
+// How --demosaic interpolates the Bayer mosaic
+typedef enum {
+    DEMOSAIC_BILINEAR,
+    DEMOSAIC_SUPERPIXEL,  // one pixel per 2x2 quad, at half the size
+    DEMOSAIC_RCD          // ratio corrected: slower, without zippering or colour fringes
+} DemosaicMethod;
 
-// FITS header card structure (80 bytes each)
-#pragma pack(push, 1)
+// Conversion settings shared by the GUI and the command line
 typedef struct {
-    char card[80];  // Fixed 80-byte card format: keyword(8) + value(72)
-} FITSHeaderCard;
-
-// FITS header block (2880 bytes = 36 cards of 80 bytes each)
-typedef struct {
-    FITSHeaderCard cards[36];  // 36 cards per block
-} FITHeader;
-#pragma pack(pop)
-
-// Helper function to parse header card values
-int parse_card_value(const char* card, const char* keyword, int* value) {
-    char temp[81] = {0};  // +1 for null terminator
-    strncpy_s(temp, sizeof(temp), card, 80);
-    
-    // Check if this is the keyword we're looking for
-    if (strncmp(temp, keyword, strlen(keyword)) == 0) {
-        // FITS format: keyword(8) + "= " + value + comment
-        // Find the equals sign and parse after it
-        char* equals = strchr(temp, '=');
-        if (equals) {
-            return sscanf_s(equals + 1, "%d", value);
-        }
-    }
-    return 0;
-}
+    int outputFormat;        // 0 = TIFF, 1 = JPG, 2 = PNG
+    BOOL demosaic;
+    DemosaicMethod demosaic_method;
+    int bayer;               // FITSBayerPattern given with --bayer, -1 reads it from the file
+    BOOL stretch;            // auto-stretch 16-bit data for JPG/PNG instead of keeping its top 8 bits
+    int hdu;                 // HDU to convert (0 = primary), -1 picks the first one with image data
+    const wchar_t* extname;  // select the HDU by EXTNAME instead when non-NULL
+    BOOL cube;               // write every NAXIS3 plane as a TIFF frame, even for 3 planes
+    BOOL planar;             // write RGB TIFFs plane by plane (PlanarConfiguration 2)
+    BOOL stream;             // convert row by row in constant memory (TIFF and PNG)
+    BOOL drop_cache;         // evict each input from the page cache once converted (Linux)
+    BOOL direct_io;          // read inputs with O_DIRECT, bypassing the page cache (Linux)
+    BOOL verify;             // check DATASUM/CHECKSUM while loading; a mismatch fails the file
+    int threads;             // worker threads for demosaic and tile decoding, 0 = one per processor
+    FITSPrefetcher* prefetcher;  // reads the batch ahead of the conversion, or NULL
+} ConvertOptions;
 
 // Function declarations
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 void HandleConversion(HWND hwnd);
-int ConvertFITtoTIF(const wchar_t* inputPath, BOOL useTiff, BOOL demosaic);
+int ConvertFITtoTIF(const wchar_t* inputPath, const ConvertOptions* options);
 void ShowError(HWND hwnd, const wchar_t* format, ...);
 void UpdateStatus(const wchar_t* message, BOOL isError);
+int RunCommandLine(int argc, wchar_t** argv);
 
 int WINAPI wWinMain(HINSTANCE hInst, HINSTANCE hPrevInstance, PWSTR pCmdLine, int nCmdShow) {
     UNREFERENCED_PARAMETER(hPrevInstance);
@@ -71,6 +79,16 @@ int WINAPI wWinMain(HINSTANCE hInst, HINSTANCE hPrevInstance, PWSTR pCmdLine, in
     
     hInstance = hInst;
 
+    // Any arguments switch to command line conversion without a window
+    int argc = 0;
+    wchar_t** argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    if (argv && argc > 1) {
+        int result = RunCommandLine(argc, argv);
+        LocalFree(argv);
+        return result;
+    }
+    if (argv) LocalFree(argv);
+
     // Register the window class
     const wchar_t CLASS_NAME[] = L"FITConverter";
     WNDCLASSW wc = {0};
@@ -119,7 +137,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             // Add Demosaic checkbox at the top
             hwndDemosaicCheck = CreateWindowW(
                 L"BUTTON",
-                L"Demosaic RGGB",
+                L"Demosaic Bayer",
                 WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX,
                 (WINDOW_WIDTH - BUTTON_WIDTH) / 2,
                 10,  // At the top
@@ -241,7 +259,7 @@ void HandleConversion(HWND hwnd) {
     OPENFILENAMEW ofn = {0};
     ofn.lStructSize = sizeof(ofn);
     ofn.hwndOwner = hwnd;
-    ofn.lpstrFilter = L"FIT Files\0*.FIT\0All Files\0*.*\0";
+    ofn.lpstrFilter = L"FIT Files\0*.FIT\0SER Videos\0*.SER\0All Files\0*.*\0";
     ofn.lpstrFile = filename;
     ofn.nMaxFile = MAX_PATH;
     ofn.lpstrTitle = L"Select FIT File";
@@ -253,18 +271,573 @@ void HandleConversion(HWND hwnd) {
     if (GetOpenFileNameW(&ofn)) {
         BOOL useTiff = (SendMessage(hwndTiffRadio, BM_GETCHECK, 0, 0) == BST_CHECKED);
         BOOL useJpg = (SendMessage(hwndJpgRadio, BM_GETCHECK, 0, 0) == BST_CHECKED);
-        BOOL demosaic = (SendMessage(hwndDemosaicCheck, BM_GETCHECK, 0, 0) == BST_CHECKED);
-        if (ConvertFITtoTIF(filename, useTiff ? 0 : useJpg ? 1 : 2, demosaic)) {
+        ConvertOptions options = {0};
+        options.outputFormat = useTiff ? 0 : useJpg ? 1 : 2;
+        options.demosaic = (SendMessage(hwndDemosaicCheck, BM_GETCHECK, 0, 0) == BST_CHECKED);
+        options.hdu = -1;
+        options.bayer = -1;
+        if (ConvertFITtoTIF(filename, &options)) {
             UpdateStatus(L"Conversion successful!", FALSE);
         }
     }
 }
 
-uint8_t write_simple_tiff(const char *filepath, void *image_data, int bitpix, size_t width, size_t height, uint8_t channels) {
-    TinyTIFFWriterFile* tif=TinyTIFFWriter_open(filepath, bitpix, TinyTIFFWriter_UInt, channels, width, height, TinyTIFFWriter_AutodetectSampleInterpetation);
+void PrintUsage(void) {
+    printf("Usage: fitconverter [options] file...\n");
+    printf("Files are FITS images (optionally .gz) or SER videos (.ser), converted frame by frame\n");
+    printf("  --tiff | --jpg | --png   output format (default: tiff)\n");
+    printf("  --demosaic               demosaic Bayer data; the pattern is read from\n");
+    printf("                           BAYERPAT/XBAYROFF/YBAYROFF (default: RGGB)\n");
+    printf("  --superpixel             demosaic each 2x2 Bayer quad into one pixel, for\n");
+    printf("                           quick half-size previews (implies --demosaic)\n");
+    printf("  --rcd                    demosaic with RCD, slower than bilinear but free\n");
+    printf("                           of zippering and colour fringes (implies --demosaic)\n");
+    printf("  --bayer RGGB|GRBG|GBRG|BGGR  Bayer pattern to use instead of the file's\n");
+    printf("  --stretch                auto-stretch linear 16-bit data for JPG/PNG output\n");
+    printf("                           (clipped shadows and a midtones curve from the\n");
+    printf("                           median and MAD, like an automatic screen stretch)\n");
+    printf("  --hdu N|EXTNAME          HDU to convert, by number (0 = primary) or EXTNAME\n");
+    printf("                           (default: first HDU with image data)\n");
+    printf("  --cube                   write each plane as a frame of a multi-page TIFF\n");
+    printf("                           (default for anything but 1 or 3 planes)\n");
+    printf("  --planar                 write RGB TIFFs with separate planes, not interleaved\n");
+    printf("  --stream                 convert row by row, holding only a few rows in memory\n");
+    printf("                           (TIFF and PNG output)\n");
+    printf("  --prefetch N             read the next N files ahead while converting (default: 2)\n");
+    printf("  --prefetch-mb M          memory for files read ahead, in MB (default: 256;\n");
+    printf("                           0 leaves read-ahead to the OS)\n");
+    printf("  --drop-cache             evict each file from the page cache once converted\n");
+    printf("  --direct                 read files with O_DIRECT, bypassing the page cache\n");
+    printf("  --verify                 check the DATASUM and CHECKSUM cards while loading\n");
+    printf("  --threads N              threads for demosaic and tile decoding\n");
+    printf("                           (default: one per logical processor)\n");
+    printf("  --catalog FILE           convert nothing; write the image properties of the\n");
+    printf("                           files (or the FITS files below directories) to FILE,\n");
+    printf("                           as CSV or, for .json/.jsonl, JSON lines\n");
+}
+
+static BOOL is_ser_path(const wchar_t* path) {
+    const wchar_t* ext = wcsrchr(path, L'.');
+    return ext && _wcsicmp(ext, L".ser") == 0;
+}
+
+// Index of the next file argument after argv[i], skipping options and their
+// values; argc if there is none
+static int next_input_file(int argc, wchar_t** argv, int i) {
+    for (i++; i < argc; i++) {
+        if (wcscmp(argv[i], L"--hdu") == 0 || wcscmp(argv[i], L"--prefetch") == 0 ||
+            wcscmp(argv[i], L"--prefetch-mb") == 0 || wcscmp(argv[i], L"--catalog") == 0 ||
+            wcscmp(argv[i], L"--threads") == 0 || wcscmp(argv[i], L"--bayer") == 0) {
+            i++;
+        } else if (wcsncmp(argv[i], L"--", 2) != 0) {
+            return i;
+        }
+    }
+    return argc;
+}
+
+// --catalog: read only the headers of all files, in parallel, into a
+// catalog. Rows of files unchanged since the last run are kept.
+static int RunCatalog(int argc, wchar_t** argv, const wchar_t* catalog) {
+    FITSPathList files = {0};
+    int args = 0;
+    for (int i = next_input_file(argc, argv, 0); i < argc; i = next_input_file(argc, argv, i)) {
+        args++;
+        if (!fits_path_list_add(&files, argv[i])) {
+            ShowError(NULL, L"Could not allocate memory for the file list");
+            fits_path_list_free(&files);
+            return 1;
+        }
+    }
+    if (args == 0) {
+        PrintUsage();
+        return 2;
+    }
+
+    char path[MAX_PATH];
+    wcstombs(path, catalog, MAX_PATH);
+    path[MAX_PATH - 1] = '\0';
+    double start = fits_time_seconds();
+    FITSCatalogStats stats;
+    int ok = fits_catalog_write(path, files.paths, files.count, 0, &stats);
+    if (ok) {
+        printf("Catalog %s: %zu files, %zu scanned, %zu unchanged, %zu without image data (%.2f s)\n", path,
+               files.count, stats.scanned, stats.reused, stats.unreadable, fits_time_seconds() - start);
+    } else {
+        ShowError(NULL, L"Could not write catalog %ls", catalog);
+    }
+    fits_path_list_free(&files);
+    return ok ? 0 : 1;
+}
+
+int RunCommandLine(int argc, wchar_t** argv) {
+    // Reuse the console of the shell that started us, if there is one
+    if (AttachConsole(ATTACH_PARENT_PROCESS)) {
+        freopen("CONOUT$", "w", stdout);
+        freopen("CONOUT$", "w", stderr);
+    }
+    commandLineMode = TRUE;
+
+    for (int i = 1; i + 1 < argc; i++) {
+        if (wcscmp(argv[i], L"--catalog") == 0) return RunCatalog(argc, argv, argv[i + 1]);
+    }
+
+    ConvertOptions options = {0};
+    options.hdu = -1;
+    options.bayer = -1;
+    int files = 0, failures = 0;
+    int prefetch = 2, prefetched = 0;
+    long prefetch_mb = 256;
+    for (int i = 1; i < argc; i++) {
+        if (wcscmp(argv[i], L"--tiff") == 0) {
+            options.outputFormat = 0;
+        } else if (wcscmp(argv[i], L"--jpg") == 0) {
+            options.outputFormat = 1;
+        } else if (wcscmp(argv[i], L"--png") == 0) {
+            options.outputFormat = 2;
+        } else if (wcscmp(argv[i], L"--demosaic") == 0) {
+            options.demosaic = TRUE;
+        } else if (wcscmp(argv[i], L"--superpixel") == 0) {
+            options.demosaic = TRUE;
+            options.demosaic_method = DEMOSAIC_SUPERPIXEL;
+        } else if (wcscmp(argv[i], L"--rcd") == 0) {
+            options.demosaic = TRUE;
+            options.demosaic_method = DEMOSAIC_RCD;
+        } else if (wcscmp(argv[i], L"--stretch") == 0) {
+            options.stretch = TRUE;
+        } else if (wcscmp(argv[i], L"--cube") == 0) {
+            options.cube = TRUE;
+        } else if (wcscmp(argv[i], L"--planar") == 0) {
+            options.planar = TRUE;
+        } else if (wcscmp(argv[i], L"--stream") == 0) {
+            options.stream = TRUE;
+        } else if (wcscmp(argv[i], L"--drop-cache") == 0) {
+            options.drop_cache = TRUE;
+        } else if (wcscmp(argv[i], L"--direct") == 0) {
+            options.direct_io = TRUE;
+        } else if (wcscmp(argv[i], L"--verify") == 0) {
+            options.verify = TRUE;
+        } else if (wcscmp(argv[i], L"--prefetch") == 0 && i + 1 < argc) {
+            prefetch = (int)wcstol(argv[++i], NULL, 10);
+        } else if (wcscmp(argv[i], L"--prefetch-mb") == 0 && i + 1 < argc) {
+            prefetch_mb = wcstol(argv[++i], NULL, 10);
+        } else if (wcscmp(argv[i], L"--bayer") == 0 && i + 1 < argc) {
+            char name[8] = "";
+            FITSBayerPattern pattern;
+            if (wcstombs(name, argv[++i], sizeof(name)) >= sizeof(name) ||
+                !fits_bayer_pattern_parse(name, 0, 0, &pattern)) {
+                PrintUsage();
+                return 2;
+            }
+            options.bayer = (int)pattern;
+        } else if (wcscmp(argv[i], L"--threads") == 0 && i + 1 < argc) {
+            options.threads = (int)wcstol(argv[++i], NULL, 10);
+        } else if (wcscmp(argv[i], L"--hdu") == 0 && i + 1 < argc) {
+            wchar_t* end;
+            long hdu = wcstol(argv[++i], &end, 10);
+            if (*end == L'\0' && hdu >= 0) {
+                options.hdu = (int)hdu;
+                options.extname = NULL;
+            } else {
+                options.hdu = -1;
+                options.extname = argv[i];
+            }
+        } else if (wcsncmp(argv[i], L"--", 2) == 0) {
+            PrintUsage();
+            return 2;
+        } else {
+            // Read the batch ahead into memory while the files convert. The
+            // options before the first file apply to all of them.
+            if (files == 0 && prefetch > 0 && prefetch_mb > 0 && next_input_file(argc, argv, i) < argc) {
+                wchar_t** paths = (wchar_t**)malloc(argc * sizeof(wchar_t*));
+                size_t count = 0;
+                for (int next = i; next < argc; next = next_input_file(argc, argv, next)) {
+                    // SER videos are mapped frame by frame, never read ahead whole
+                    if (paths && !is_ser_path(argv[next])) paths[count++] = argv[next];
+                }
+                int input_flags = (options.drop_cache ? FITS_INPUT_DROP_CACHE : 0) |
+                                  (options.direct_io ? FITS_INPUT_DIRECT : 0);
+                if (paths) {
+                    options.prefetcher = fits_prefetcher_create(paths, count, (size_t)prefetch,
+                                                                (size_t)prefetch_mb << 20, input_flags);
+                }
+                free(paths);
+                if (options.prefetcher) {
+                    printf("Prefetching %d files ahead with %s, up to %ld MB\n", prefetch,
+                           fits_prefetcher_engine(options.prefetcher), prefetch_mb);
+                }
+            }
+
+            // otherwise let the OS read the next files ahead while this one converts
+            int next = options.prefetcher ? argc : i;
+            for (int k = 0; k < prefetch && next < argc; k++) {
+                next = next_input_file(argc, argv, next);
+                if (next >= argc) break;
+                if (next > prefetched) {
+                    fits_input_prefetch(argv[next]);
+                    prefetched = next;
+                }
+            }
+            files++;
+            if (!ConvertFITtoTIF(argv[i], &options)) failures++;
+        }
+    }
+    fits_prefetcher_destroy(options.prefetcher);
+    if (files == 0) {
+        PrintUsage();
+        return 2;
+    }
+    return failures ? 1 : 0;
+}
+
+// Wait until the input holds its first end bytes; plain files always do
+static int wait_for_input(FITSInput* input, size_t end) {
+    return fits_input_wait(input, end, NULL) >= end;
+}
+
+// Gzip input is only known to be intact once the whole stream has been
+// inflated and checked against its trailer
+static int input_intact(FITSInput* input) {
+    if (fits_input_verify(input)) return 1;
+    ShowError(NULL, L"Compressed input is corrupt (gzip CRC-32 or length mismatch)");
+    return 0;
+}
+
+// Output path next to the input with its extension replaced. A trailing .gz
+// goes as well, so name.fits.gz converts to name.TIF, not name.fits.TIF.
+static void output_filepath(const wchar_t* inputPath, const wchar_t* extension, char* filepath) {
+    wchar_t filepath_w[MAX_PATH];
+    wcscpy_s(filepath_w, MAX_PATH, inputPath);
+    wchar_t* ext = wcsrchr(filepath_w, L'.');
+    if (ext && _wcsicmp(ext, L".gz") == 0) {
+        *ext = L'\0';
+        ext = wcsrchr(filepath_w, L'.');
+    }
+    if (ext) {
+        wcscpy_s(ext, 5, extension);
+    } else {
+        wcscat_s(filepath_w, MAX_PATH, extension);
+    }
+
+    // filepath to simple char array
+    wcstombs(filepath, filepath_w, MAX_PATH);
+}
+
+static enum TinyTIFFWriterSampleFormat tiff_sample_format(FITSSampleType type) {
+    if (type == FITS_SAMPLE_I32 || type == FITS_SAMPLE_I64) return TinyTIFFWriter_Int;
+    if (type == FITS_SAMPLE_F32 || type == FITS_SAMPLE_F64) return TinyTIFFWriter_Float;
+    return TinyTIFFWriter_UInt;
+}
+
+// One cube plane to be loaded into a frame buffer
+typedef struct {
+    FITSInput* input;           // waited on for the plane's bytes; NULL when already complete
+    size_t end;                 // input offset just past the plane
+    const uint8_t* src;
+    const FITSTiledImage* tiled;    // tile-compressed cube the plane is decoded from, or NULL
+    int threads;                // its tile decoding workers
+    void* buffer;
+    int in_place;               // unscaled 8-bit planes are written straight from src
+    size_t count;
+    FITSSampleType type;
+    const FITSLoadParams* params;
+    const void* frame;          // the loaded plane
+    uint32_t* datasum;          // checksum the stored plane is added to, or NULL
+    size_t position;            // offset of the plane in the data unit
+    int ok;
+} CubePlane;
+
+static void load_cube_plane(void* arg) {
+    CubePlane* plane = (CubePlane*)arg;
+    plane->ok = 0;
+    if (plane->input && !wait_for_input(plane->input, plane->end)) return;
+    if (plane->datasum) {
+        size_t bytes = plane->count * (abs(plane->params->bitpix) / 8);
+        *plane->datasum = fits_checksum_add(*plane->datasum, plane->src, bytes, plane->position);
+    }
+    if (plane->in_place) {
+        plane->frame = plane->src;
+    } else if (plane->tiled) {
+        size_t first = plane->position / (abs(plane->params->bitpix) / 8);
+        if (!fits_tiled_image_load(plane->tiled, plane->buffer, plane->type, plane->params, first, plane->count, 0,
+                                   plane->threads)) {
+            return;
+        }
+        plane->frame = plane->buffer;
+    } else {
+        if (!fits_load_samples(plane->buffer, plane->type, plane->src, plane->count, plane->params)) return;
+        plane->frame = plane->buffer;
+    }
+    plane->ok = 1;
+}
+
+// Write a data cube as a multi-page TIFF, one frame per plane. Only two frame
+// buffers exist: plane k+1 is loaded on a helper thread while plane k is being
+// written, so memory stays at two planes however deep the cube is. Each plane
+// is added to datasum as it loads, unless that is NULL. A tile-compressed cube
+// (tiled not NULL) is decoded plane by plane the same way.
+static int write_cube_tiff(const char* filepath, FITSInput* input, const FITSTiledImage* tiled, int threads,
+                           const uint8_t* data_unit, size_t data_offset, size_t planes, size_t width, size_t height,
+                           FITSSampleType type, const FITSLoadParams* params, uint32_t* datasum) {
+    size_t plane_size = width * height;
+    size_t plane_bytes = plane_size * (abs(params->bitpix) / 8);
+    size_t sample_size = fits_sample_size(type);
+
+    // TinyTIFF writes classic TIFF, whose offsets are 32-bit
+    if ((double)plane_size * sample_size * planes + planes * 4096.0 > 4294967295.0) {
+        ShowError(NULL, L"Cube of %zu frames does not fit in a TIFF file (4 GB limit)", planes);
+        return 0;
+    }
+
+    CubePlane loads[2];
+    int in_place = !tiled && type == FITS_SAMPLE_U8 && params->bitpix == 8 && params->bzero == 0.0 &&
+                   params->bscale == 1.0;
+    for (int i = 0; i < 2; i++) {
+        memset(&loads[i], 0, sizeof(loads[i]));
+        loads[i].input = input;
+        loads[i].tiled = tiled;
+        loads[i].threads = threads;
+        loads[i].in_place = in_place;
+        loads[i].count = plane_size;
+        loads[i].type = type;
+        loads[i].params = params;
+        loads[i].datasum = datasum;
+        if (!in_place) loads[i].buffer = malloc(plane_size * sample_size);
+    }
+    int success = 0;
+    TinyTIFFWriterFile* tif = NULL;
+    if (!in_place && (!loads[0].buffer || !loads[1].buffer)) {
+        ShowError(NULL, L"Could not allocate memory for image data");
+        goto done;
+    }
+    tif = TinyTIFFWriter_open(filepath, sample_size * 8, tiff_sample_format(type), 1, width, height, TinyTIFFWriter_Greyscale);
+    if (!tif) {
+        ShowError(NULL, L"Could not create TIF writer");
+        goto done;
+    }
+
+    loads[0].src = data_unit;
+    loads[0].end = data_offset + plane_bytes;
+    load_cube_plane(&loads[0]);
+    for (size_t k = 0; k < planes; k++) {
+        CubePlane* current = &loads[k & 1];
+        CubePlane* next = &loads[(k + 1) & 1];
+        if (!current->ok) {
+            if (tiled) {
+                ShowError(NULL, L"Corrupt %hs compressed tile", fits_compression_name(tiled->compression));
+            } else {
+                ShowError(NULL, L"FITS data unit is truncated");
+            }
+            goto done;
+        }
+
+        FITSThread loader;
+        int loading = 0;
+        if (k + 1 < planes) {
+            next->src = data_unit + (k + 1) * plane_bytes;
+            next->position = (k + 1) * plane_bytes;
+            next->end = data_offset + (k + 2) * plane_bytes;
+            loading = fits_thread_start(&loader, load_cube_plane, next);
+            if (!loading) load_cube_plane(next);
+        }
+        int written = TinyTIFFWriter_writeImage(tif, current->frame) == TINYTIFF_TRUE;
+        if (loading) fits_thread_join(&loader);
+        if (!written) {
+            ShowError(NULL, L"TinyTIFFWriter_writeImage failed");
+            goto done;
+        }
+    }
+    printf("Wrote %zu frames to %s\n", planes, filepath);
+    success = 1;
+
+done:
+    if (tif) TinyTIFFWriter_close(tif);
+    free(loads[0].buffer);
+    free(loads[1].buffer);
+    return success;
+}
+
+// Rows of a tile-compressed image for convert_streaming, decoded one band of
+// whole tile rows at a time so each tile is decoded once
+typedef struct {
+    const FITSTiledImage* image;
+    FITSSampleType type;
+    const FITSLoadParams* params;
+    int threads;
+    size_t width, height;
+    size_t band_rows;           // ZTILE2, the rows a tile spans
+    uint8_t* band[3];           // the current band of each plane
+    size_t band_start[3];       // its first row, SIZE_MAX before the first load
+} TileBands;
+
+static int load_band_row(TileBands* bands, uint8_t* dst, int c, size_t y) {
+    size_t row_bytes = bands->width * fits_sample_size(bands->type);
+    size_t start = y - y % bands->band_rows;
+    if (bands->band_start[c] != start) {
+        size_t rows = bands->height - start < bands->band_rows ? bands->height - start : bands->band_rows;
+        if (!fits_tiled_image_load(bands->image, bands->band[c], bands->type, bands->params,
+                                   (c * bands->height + start) * bands->width, rows * bands->width, 0,
+                                   bands->threads)) {
+            return 0;
+        }
+        bands->band_start[c] = start;
+    }
+    memcpy(dst, bands->band[c] + (y - start) * row_bytes, row_bytes);
+    return 1;
+}
+
+// Convert row by row. Mosaic rows are loaded into a three-row ring, which is
+// all the demosaic needs (superpixel rows take two of its slots), RGB planes
+// are interleaved one row at a time, PNG output is narrowed to 8 bits per
+// row, and each finished row goes straight to a row writer. Memory stays at
+// a few rows whatever the image size. Stored rows are added to datasum as
+// they load, unless that is NULL. Rows of a tile-compressed image (tiled not
+// NULL) come from a band of one tile row of tiles per plane instead.
+static int convert_streaming(const char* filepath, FITSInput* input, const FITSTiledImage* tiled, int threads,
+                             const uint8_t* data_unit, size_t data_offset, size_t width, size_t height, int channels,
+                             BOOL demosaic, FITSBayerPattern pattern, BOOL superpixel, BOOL png, FITSSampleType type,
+                             const FITSLoadParams* params, uint32_t* datasum) {
+    size_t sample_size = fits_sample_size(type);
+    size_t row_bytes = width * sample_size;
+    size_t stored_row = width * (abs(params->bitpix) / 8);
+    size_t plane_bytes = stored_row * height;
+    demosaic = demosaic && channels == 1;
+    superpixel = superpixel && demosaic;
+    int out_channels = demosaic ? 3 : channels;
+    size_t out_width = superpixel ? width / 2 : width;
+    size_t out_height = superpixel ? height / 2 : height;
+
+    int success = 0;
+    FITSOutput* out = NULL;
+    uint8_t* ring = (uint8_t*)malloc(3 * row_bytes);
+    uint8_t* pixels = (uint8_t*)malloc(out_channels * row_bytes);
+    uint8_t* narrow = png && type == FITS_SAMPLE_U16 ? (uint8_t*)malloc(width * out_channels) : NULL;
+    TileBands bands = { tiled, type, params, threads, width, height, 1, { NULL, NULL, NULL },
+                        { SIZE_MAX, SIZE_MAX, SIZE_MAX } };
+    int bands_ok = 1;
+    if (tiled) {
+        if (tiled->naxis > 1) bands.band_rows = (size_t)tiled->tile[1];
+        for (int c = 0; c < channels; c++) {
+            bands.band[c] = (uint8_t*)malloc(bands.band_rows * row_bytes);
+            bands_ok = bands_ok && bands.band[c];
+        }
+    }
+    if (!ring || !pixels || (png && type == FITS_SAMPLE_U16 && !narrow) || !bands_ok) {
+        ShowError(NULL, L"Could not allocate memory for image data");
+        goto done;
+    }
+    out = png ? fits_output_open_png(filepath, out_width, out_height, out_channels)
+              : fits_output_open_tiff(filepath, out_width, out_height, out_channels, type);
+    if (!out) {
+        ShowError(NULL, L"Could not create %hs", filepath);
+        goto done;
+    }
+
+    size_t loaded = 0;  // mosaic rows loaded so far; row k sits in ring slot k % 3
+    for (size_t y = 0; y < out_height; y++) {
+        const uint8_t* result;
+        if (channels == 3) {
+            if (input && !wait_for_input(input, data_offset + 2 * plane_bytes + (y + 1) * stored_row)) goto truncated;
+            for (int c = 0; c < 3; c++) {
+                size_t position = c * plane_bytes + y * stored_row;
+                if (tiled) {
+                    if (!load_band_row(&bands, ring + c * row_bytes, c, y)) goto corrupt;
+                    continue;
+                }
+                fits_load_samples(ring + c * row_bytes, type, data_unit + position, width, params);
+                if (datasum) *datasum = fits_checksum_add(*datasum, data_unit + position, stored_row, position);
+            }
+            fits_interleave3(pixels, ring, ring + row_bytes, ring + 2 * row_bytes, width, sample_size);
+            result = pixels;
+        } else {
+            // keep rows y - 1 .. y + 1 in the ring (just row y without
+            // demosaic, rows 2y and 2y + 1 for superpixels)
+            size_t needed = superpixel ? 2 * y + 2 : demosaic && y + 1 < height ? y + 2 : y + 1;
+            for (; loaded < needed; loaded++) {
+                if (input && !wait_for_input(input, data_offset + (loaded + 1) * stored_row)) goto truncated;
+                if (tiled) {
+                    if (!load_band_row(&bands, ring + (loaded % 3) * row_bytes, 0, loaded)) goto corrupt;
+                    continue;
+                }
+                fits_load_samples(ring + (loaded % 3) * row_bytes, type, data_unit + loaded * stored_row, width, params);
+                if (datasum) {
+                    *datasum = fits_checksum_add(*datasum, data_unit + loaded * stored_row, stored_row, loaded * stored_row);
+                }
+            }
+            result = ring + (y % 3) * row_bytes;
+            if (superpixel) {
+                const uint8_t* top = ring + (2 * y % 3) * row_bytes;
+                const uint8_t* bottom = ring + ((2 * y + 1) % 3) * row_bytes;
+                if (type == FITS_SAMPLE_U8) {
+                    fits_superpixel_row_u8(pixels, top, bottom, width, pattern);
+                } else if (type == FITS_SAMPLE_F32) {
+                    fits_superpixel_row_f32((float*)pixels, (const float*)top, (const float*)bottom, width,
+                                            pattern);
+                } else {
+                    fits_superpixel_row_u16((uint16_t*)pixels, (const uint16_t*)top, (const uint16_t*)bottom,
+                                            width, pattern);
+                }
+                result = pixels;
+            } else if (demosaic) {
+                size_t above = y > 0 ? y - 1 : (height > 1 ? 1 : 0);
+                size_t below = y + 1 < height ? y + 1 : (height > 1 ? y - 1 : y);
+                const uint8_t* a = ring + (above % 3) * row_bytes;
+                const uint8_t* b = ring + (below % 3) * row_bytes;
+                if (type == FITS_SAMPLE_U8) {
+                    fits_demosaic_row_u8(pixels, a, result, b, width, y, pattern);
+                } else if (type == FITS_SAMPLE_F32) {
+                    fits_demosaic_row_f32((float*)pixels, (const float*)a, (const float*)result, (const float*)b,
+                                          width, y, pattern);
+                } else {
+                    fits_demosaic_row_u16((uint16_t*)pixels, (const uint16_t*)a, (const uint16_t*)result,
+                                          (const uint16_t*)b, width, y, pattern);
+                }
+                result = pixels;
+            }
+        }
+        if (narrow) {
+            for (size_t i = 0; i < out_width * out_channels; i++) {
+                narrow[i] = ((const uint16_t*)result)[i] >> 8;
+            }
+            result = narrow;
+        }
+        if (!fits_output_write_rows(out, result, 1)) {
+            ShowError(NULL, L"Could not write %hs", filepath);
+            goto done;
+        }
+    }
+    // an odd last row that no superpixel covers still counts for DATASUM
+    for (; datasum && superpixel && loaded < height; loaded++) {
+        if (input && !wait_for_input(input, data_offset + (loaded + 1) * stored_row)) goto truncated;
+        *datasum = fits_checksum_add(*datasum, data_unit + loaded * stored_row, stored_row, loaded * stored_row);
+    }
+    success = fits_output_close(out);
+    out = NULL;
+    if (!success) {
+        ShowError(NULL, L"Could not write %hs", filepath);
+    }
+    goto done;
+
+truncated:
+    ShowError(NULL, L"FITS data unit is truncated");
+    goto done;
+corrupt:
+    ShowError(NULL, L"Corrupt %hs compressed tile", fits_compression_name(tiled->compression));
+done:
+    fits_output_close(out);
+    free(ring);
+    free(pixels);
+    free(narrow);
+    for (int c = 0; c < 3; c++) free(bands.band[c]);
+    return success;
+}
+
+uint8_t write_simple_tiff(const char *filepath, void *image_data, int bits, enum TinyTIFFWriterSampleFormat format, size_t width, size_t height, uint8_t channels, int planar) {
+    TinyTIFFWriterFile* tif=TinyTIFFWriter_open(filepath, bits, format, channels, width, height, TinyTIFFWriter_AutodetectSampleInterpetation);
     if (tif) {
         // const uint8_t* data=readImage();
-        if (TINYTIFF_TRUE != TinyTIFFWriter_writeImage(tif, image_data)) {
+        enum TinyTIFFSampleLayout layout = planar ? TinyTIFF_Separate : TinyTIFF_Interleaved;
+        if (TINYTIFF_TRUE != TinyTIFFWriter_writeImageMultiSample(tif, image_data, layout, layout)) {
             ShowError(NULL, L"TinyTIFFWriter_writeImage failed");
             TinyTIFFWriter_close(tif);
             return 0;
@@ -278,266 +851,795 @@ uint8_t write_simple_tiff(const char *filepath, void *image_data, int bitpix, si
     return 1;
 }
 
-void demosaic_RGGB_16bit(uint16_t *raw_data, uint16_t *output_image, int width, int height) {
-    int i, j;
-
-    for (i = 0; i < height; i++) {
-        for (j = 0; j < width; j++) {
-            int pixel_index = i * width*3 + j*3;
-            int r, g, b;
-
-            if (i % 2 == 0 && j % 2 == 0) {
-                // Red pixel
-                r = raw_data[pixel_index];
-                g = (raw_data[pixel_index + 1] + raw_data[pixel_index + width*3]) / 2; // average of neighboring green pixels
-                b = (raw_data[pixel_index + width*3 + 1] + raw_data[pixel_index + width*3 - 1]) / 2; // average of neighboring blue pixels
-            } else if (i % 2 == 0 && j % 2 == 1) {
-                // Green pixel (even row, odd column)
-                g = raw_data[pixel_index];
-                r = (raw_data[pixel_index - 1] + raw_data[pixel_index + 1]) / 2; // average of neighboring red pixels
-                b = (raw_data[pixel_index + width*3] + raw_data[pixel_index + width*3 - 1]) / 2; // average of neighboring blue pixels
-            } else if (i % 2 == 1 && j % 2 == 0) {
-                // Green pixel (odd row, even column)
-                g = raw_data[pixel_index];
-                r = (raw_data[pixel_index - width*3] + raw_data[pixel_index + width*3]) / 2; // average of neighboring red pixels
-                b = (raw_data[pixel_index - 1] + raw_data[pixel_index + 1]) / 2; // average of neighboring blue pixels
-            } else {
-                // Blue pixel
-                b = raw_data[pixel_index];
-                g = (raw_data[pixel_index - width*3] + raw_data[pixel_index + width*3]) / 2; // average of neighboring green pixels
-                r = (raw_data[pixel_index - width*3 - 1] + raw_data[pixel_index + width*3 + 1]) / 2; // average of neighboring red pixels
-            }
+// Demosaic a whole mosaic of 8-bit, 16-bit or float samples into interleaved
+// RGB, of the same size or, for superpixels, half of it. With a lut, 16-bit samples
+// come out as 8-bit RGB mapped through it: the bilinear demosaic does that in
+// the same pass, the others through a 16-bit image. Returns 0 if memory runs
+// out.
+static int demosaic_image(void* out, const void* mosaic, size_t width, size_t height, size_t sample_size,
+                          FITSBayerPattern pattern, DemosaicMethod method, const uint8_t* lut, int threads) {
+    static const char* const names[] = { "Bilinear", "Superpixel", "RCD" };
+    if (method == DEMOSAIC_RCD && sample_size == 4) {
+        printf("RCD takes 8- and 16-bit samples; float data is demosaiced bilinearly\n");
+        method = DEMOSAIC_BILINEAR;
+    }
+    if (lut && sample_size == 2 && method != DEMOSAIC_BILINEAR) {
+        size_t out_pixels = method == DEMOSAIC_SUPERPIXEL ? (width / 2) * (height / 2) : width * height;
+        uint16_t* rgb = (uint16_t*)malloc(out_pixels * 3 * sizeof(uint16_t));
+        int ok = rgb && demosaic_image(rgb, mosaic, width, height, 2, pattern, method, NULL, threads);
+        if (ok) fits_lut_u16((uint8_t*)out, rgb, out_pixels * 3, lut);
+        free(rgb);
+        return ok;
+    }
+    double start = fits_time_seconds();
+    int ok = 1;
+    if (lut && sample_size == 2) {
+        fits_demosaic_u16_lut((uint8_t*)out, (const uint16_t*)mosaic, width, height, pattern, lut, threads);
+    } else if (method == DEMOSAIC_SUPERPIXEL) {
+        if (sample_size == 1) {
+            fits_superpixel_u8((uint8_t*)out, (const uint8_t*)mosaic, width, height, pattern, threads);
+        } else if (sample_size == 4) {
+            fits_superpixel_f32((float*)out, (const float*)mosaic, width, height, pattern, threads);
+        } else {
+            fits_superpixel_u16((uint16_t*)out, (const uint16_t*)mosaic, width, height, pattern, threads);
+        }
+    } else if (method == DEMOSAIC_RCD) {
+        ok = sample_size == 1
+                 ? fits_demosaic_rcd_u8((uint8_t*)out, (const uint8_t*)mosaic, width, height, pattern, threads)
+                 : fits_demosaic_rcd_u16((uint16_t*)out, (const uint16_t*)mosaic, width, height, pattern, threads);
+    } else if (sample_size == 1) {
+        fits_demosaic_u8((uint8_t*)out, (const uint8_t*)mosaic, width, height, pattern, threads);
+    } else if (sample_size == 4) {
+        fits_demosaic_f32((float*)out, (const float*)mosaic, width, height, pattern, threads);
+    } else {
+        fits_demosaic_u16((uint16_t*)out, (const uint16_t*)mosaic, width, height, pattern, threads);
+    }
+    double seconds = fits_time_seconds() - start;
+    if (ok && seconds > 0) {
+        printf("%s demosaic%s (%s): %.0f MP/s\n", names[method], lut && sample_size == 2 ? " to 8 bits" : "",
+               fits_demosaic_kernel_name(), (double)(width * height) / seconds / 1e6);
+    }
+    return ok;
+}
 
-            // Store the result in the output image (RGB)
-            output_image[pixel_index] = r;  // Red channel
-            output_image[pixel_index + 1] = g;  // Green channel
-            output_image[pixel_index + 2] = b;  // Blue channel
+// CFA pattern of an image: the --bayer one if given, otherwise BAYERPAT
+// shifted by XBAYROFF/YBAYROFF, from the image header or else the primary
+// header (NULL for the primary HDU itself). Without BAYERPAT the mosaic is
+// taken to be RGGB. Returns 0 for a BAYERPAT naming no supported pattern.
+static int image_bayer_pattern(const FITSHeader* header, const FITSHeader* primary, int forced,
+                               FITSBayerPattern* pattern) {
+    *pattern = FITS_BAYER_RGGB;
+    if (forced >= 0) {
+        *pattern = (FITSBayerPattern)forced;
+        return 1;
+    }
+    char name[72];
+    const FITSHeader* source = header;
+    if (!fits_header_get_string(source, "BAYERPAT", name, sizeof(name))) {
+        source = primary;
+        if (!source || !fits_header_get_string(source, "BAYERPAT", name, sizeof(name))) {
+            printf("No BAYERPAT keyword, assuming RGGB\n");
+            return 1;
+        }
+    }
+    int64_t x_offset = 0, y_offset = 0;
+    fits_header_get_int(source, "XBAYROFF", &x_offset);
+    fits_header_get_int(source, "YBAYROFF", &y_offset);
+    if (!fits_bayer_pattern_parse(name, x_offset, y_offset, pattern)) {
+        ShowError(NULL, L"Unsupported Bayer pattern: %hs", name);
+        return 0;
+    }
+    printf("Bayer pattern: %s (BAYERPAT %s, offset %lld,%lld)\n", fits_bayer_pattern_name(*pattern), name,
+           (long long)x_offset, (long long)y_offset);
+    return 1;
+}
+
+// Check an HDU against its DATASUM and CHECKSUM cards (--verify). datasum
+// holds the first summed bytes of the data unit, added up by the load pass;
+// the rest of the unit and its block padding are summed here. CHECKSUM is
+// right when header and data together sum to -0 (all bits set). Returns 0 on
+// a mismatch.
+static int verify_checksums(FITSInput* input, const FITSHDU* hdu, const FITSHeader* header,
+                            uint32_t datasum, size_t summed) {
+    size_t padded = (hdu->data_size + FITS_BLOCK_SIZE - 1) / FITS_BLOCK_SIZE * FITS_BLOCK_SIZE;
+    if (summed < padded) {
+        // a file cut short inside its last padding block sums as if it were there
+        size_t available = fits_input_wait(input, hdu->data_offset + padded, NULL);
+        size_t end = available < hdu->data_offset + padded ? available : hdu->data_offset + padded;
+        if (end > hdu->data_offset + summed) {
+            datasum = fits_checksum_add(datasum, input->data + hdu->data_offset + summed,
+                                        end - hdu->data_offset - summed, summed);
+        }
+    }
+
+    char value[72];
+    int64_t stored;
+    int has_datasum = 0;
+    if (fits_header_get_string(header, "DATASUM", value, sizeof(value))) {
+        stored = (int64_t)strtoull(value, NULL, 10);
+        has_datasum = 1;
+    } else {
+        has_datasum = fits_header_get_int(header, "DATASUM", &stored);
+    }
+    int has_checksum = fits_header_find(header, "CHECKSUM") != NULL;
+    if (!has_datasum && !has_checksum) {
+        printf("No DATASUM or CHECKSUM cards to verify\n");
+        return 1;
+    }
+    if (has_datasum && (uint64_t)stored != datasum) {
+        ShowError(NULL, L"DATASUM mismatch: header says %lld, data sums to %lu", (long long)stored,
+                  (unsigned long)datasum);
+        return 0;
+    }
+    if (has_checksum) {
+        uint32_t total = fits_checksum_add(datasum, input->data + hdu->header_offset,
+                                           hdu->data_offset - hdu->header_offset, 0);
+        if (total != 0xFFFFFFFFu) {
+            ShowError(NULL, L"CHECKSUM mismatch: HDU sums to %08lx instead of ffffffff", (unsigned long)total);
+            return 0;
         }
     }
+    printf("Checksums verified:%s%s\n", has_datasum ? " DATASUM" : "", has_checksum ? " CHECKSUM" : "");
+    return 1;
 }
 
-void demosaic_RGGB_8bit(uint8_t *raw_data, uint8_t *output_image, int width, int height) {
-    int i, j;
-
-    for (i = 0; i < height; i++) {
-        for (j = 0; j < width; j++) {
-            int pixel_index = i * width*3 + j*3;
-            int r, g, b;
-
-            if (i % 2 == 0 && j % 2 == 0) {
-                // Red pixel
-                r = raw_data[pixel_index];
-                g = (raw_data[pixel_index + 1] + raw_data[pixel_index + width*3]) / 2; // average of neighboring green pixels
-                b = (raw_data[pixel_index + width*3 + 1] + raw_data[pixel_index + width*3 - 1]) / 2; // average of neighboring blue pixels
-            } else if (i % 2 == 0 && j % 2 == 1) {
-                // Green pixel (even row, odd column)
-                g = raw_data[pixel_index];
-                r = (raw_data[pixel_index - 1] + raw_data[pixel_index + 1]) / 2; // average of neighboring red pixels
-                b = (raw_data[pixel_index + width*3] + raw_data[pixel_index + width*3 - 1]) / 2; // average of neighboring blue pixels
-            } else if (i % 2 == 1 && j % 2 == 0) {
-                // Green pixel (odd row, even column)
-                g = raw_data[pixel_index];
-                r = (raw_data[pixel_index - width*3] + raw_data[pixel_index + width*3]) / 2; // average of neighboring red pixels
-                b = (raw_data[pixel_index - 1] + raw_data[pixel_index + 1]) / 2; // average of neighboring blue pixels
+// Convert a SER video frame by frame, straight from the mapping. TIFF output
+// is one multi-page file; JPG and PNG get one numbered image per frame
+// (name_00001.PNG, ...). Only the frame being written is held in memory.
+static int ConvertSER(const wchar_t* inputPath, const ConvertOptions* options) {
+    FITSSerFile ser;
+    if (!fits_ser_open(&ser, inputPath)) {
+        ShowError(NULL, L"Could not read SER file");
+        return 0;
+    }
+    int success = 0;
+    TinyTIFFWriterFile* tif = NULL;
+    uint8_t *frame = NULL, *demosaiced = NULL, *narrow = NULL;
+    uint8_t *lut = NULL;  // --stretch table, taken from the first frame
+
+    printf("SER %zux%zu, %d-bit %s, %zu frames\n", ser.width, ser.height, ser.depth,
+           fits_ser_color_name(ser.color_id), ser.frame_count);
+    if (ser.instrument[0]) printf("Instrument: %s\n", ser.instrument);
+    if (ser.frame_count < ser.declared_frames) {
+        printf("File is truncated: %zu of %zu frames present\n", ser.frame_count, ser.declared_frames);
+    }
+    if (ser.frame_count == 0) {
+        ShowError(NULL, L"SER file contains no frames");
+        goto done;
+    }
+
+    // RGB sequences ignore --demosaic, and mono ones unless --bayer names
+    // their pattern (many cameras record raw frames as mono). The colour IDs
+    // of the Bayer sequences are in FITSBayerPattern order.
+    BOOL bayer = ser.color_id >= FITS_SER_BAYER_RGGB && ser.color_id <= FITS_SER_BAYER_BGGR;
+    BOOL demosaic = options->demosaic && (bayer || (ser.color_id == FITS_SER_MONO && options->bayer >= 0));
+    FITSBayerPattern pattern = options->bayer >= 0 ? (FITSBayerPattern)options->bayer
+                               : bayer ? (FITSBayerPattern)(ser.color_id - FITS_SER_BAYER_RGGB)
+                                       : FITS_BAYER_RGGB;
+    BOOL superpixel = demosaic && options->demosaic_method == DEMOSAIC_SUPERPIXEL;
+    if (superpixel && (ser.width < 2 || ser.height < 2)) {
+        ShowError(NULL, L"Frames of %zux%zu pixels have no complete Bayer quad", ser.width, ser.height);
+        goto done;
+    }
+    size_t width = superpixel ? ser.width / 2 : ser.width;
+    size_t height = superpixel ? ser.height / 2 : ser.height;
+    int channels = demosaic ? 3 : ser.channels;
+    size_t pixels = width * height;
+    size_t sample_size = ser.sample_size;
+    // stb takes int sizes, and JPEG itself stops at 65535 pixels a side
+    if ((options->outputFormat == 1 && (width > 65535 || height > 65535)) ||
+        (options->outputFormat != 0 && (double)(width * channels + 1) * height > 0x7FFFFFFF)) {
+        ShowError(NULL, L"Frames of %zux%zu pixels are too large for this output format", width, height);
+        goto done;
+    }
+    frame = (uint8_t*)malloc(ser.frame_size);
+    demosaiced = demosaic ? (uint8_t*)malloc(pixels * 3 * sample_size) : NULL;
+    narrow = options->outputFormat != 0 && sample_size == 2 ? (uint8_t*)malloc(pixels * channels) : NULL;
+    if (!frame || (demosaic && !demosaiced) || (options->outputFormat != 0 && sample_size == 2 && !narrow)) {
+        ShowError(NULL, L"Could not allocate memory for image data");
+        goto done;
+    }
+
+    char filepath[MAX_PATH];
+    if (options->outputFormat == 0) {
+        output_filepath(inputPath, L".TIF", filepath);
+        // TinyTIFF writes classic TIFF, whose offsets are 32-bit
+        if ((double)pixels * channels * sample_size * ser.frame_count + ser.frame_count * 4096.0 > 4294967295.0) {
+            ShowError(NULL, L"%zu frames do not fit in a TIFF file (4 GB limit)", ser.frame_count);
+            goto done;
+        }
+        tif = TinyTIFFWriter_open(filepath, sample_size * 8, TinyTIFFWriter_UInt, channels, width, height,
+                                  channels == 3 ? TinyTIFFWriter_RGB : TinyTIFFWriter_Greyscale);
+        if (!tif) {
+            ShowError(NULL, L"Could not create TIF writer");
+            goto done;
+        }
+    }
+
+    // 8-bit output keeps the top 8 of the significant bits, or with --stretch
+    // goes through one auto-stretch for the whole sequence, so frames do
+    // not flicker
+    int narrow_shift = ser.depth > 8 ? ser.depth - 8 : 0;
+    double start = fits_time_seconds();
+    for (size_t k = 0; k < ser.frame_count; k++) {
+        const void* image = fits_ser_load_frame(&ser, k, frame);
+        if (superpixel) {
+            if (sample_size == 1) {
+                fits_superpixel_u8(demosaiced, (const uint8_t*)image, ser.width, ser.height, pattern,
+                                   options->threads);
             } else {
-                // Blue pixel
-                b = raw_data[pixel_index];
-                g = (raw_data[pixel_index - width*3] + raw_data[pixel_index + width*3]) / 2; // average of neighboring green pixels
-                r = (raw_data[pixel_index - width*3 - 1] + raw_data[pixel_index + width*3 + 1]) / 2; // average of neighboring red pixels
+                fits_superpixel_u16((uint16_t*)demosaiced, (const uint16_t*)image, ser.width, ser.height, pattern,
+                                    options->threads);
             }
+            image = demosaiced;
+        } else if (demosaic && options->demosaic_method == DEMOSAIC_RCD) {
+            int ok = sample_size == 1 ? fits_demosaic_rcd_u8(demosaiced, (const uint8_t*)image, width, height,
+                                                             pattern, options->threads)
+                                      : fits_demosaic_rcd_u16((uint16_t*)demosaiced, (const uint16_t*)image, width,
+                                                              height, pattern, options->threads);
+            if (!ok) {
+                ShowError(NULL, L"Could not allocate memory for image data");
+                goto done;
+            }
+            image = demosaiced;
+        } else if (demosaic) {
+            if (sample_size == 1) {
+                fits_demosaic_u8(demosaiced, (const uint8_t*)image, width, height, pattern, options->threads);
+            } else {
+                fits_demosaic_u16((uint16_t*)demosaiced, (const uint16_t*)image, width, height, pattern,
+                                  options->threads);
+            }
+            image = demosaiced;
+        }
 
-            // Store the result in the output image (RGB)
-            output_image[pixel_index] = r;  // Red channel
-            output_image[pixel_index + 1] = g;  // Green channel
-            output_image[pixel_index + 2] = b;  // Blue channel
+        if (tif) {
+            if (TinyTIFFWriter_writeImage(tif, image) != TINYTIFF_TRUE) {
+                ShowError(NULL, L"TinyTIFFWriter_writeImage failed");
+                goto done;
+            }
+            continue;
+        }
+        if (narrow && options->stretch) {
+            if (!lut) {
+                FITSHistogram histogram;
+                FITSStretch stretch;
+                lut = (uint8_t*)malloc(65536);
+                int ok = lut && fits_histogram_init(&histogram, options->threads);
+                if (ok) {
+                    fits_histogram_add_u16(&histogram, (const uint16_t*)image, pixels * channels);
+                    ok = fits_stretch_auto(&histogram, &stretch);
+                    fits_histogram_free(&histogram);
+                }
+                if (!ok) {
+                    ShowError(NULL, L"Could not allocate memory for image data");
+                    goto done;
+                }
+                fits_stretch_lut(&stretch, lut);
+                printf("Auto-stretch: median %.5f, MAD %.5f, shadows %.5f, midtones %.5f\n", stretch.median,
+                       stretch.mad, stretch.shadows, stretch.midtones);
+            }
+            fits_lut_u16(narrow, (const uint16_t*)image, pixels * channels, lut);
+            image = narrow;
+        } else if (narrow) {
+            const uint16_t* wide = (const uint16_t*)image;
+            for (size_t i = 0; i < pixels * channels; i++) {
+                unsigned v = wide[i] >> narrow_shift;
+                narrow[i] = v > 255 ? 255 : (uint8_t)v;
+            }
+            image = narrow;
+        }
+        wchar_t extension[16];
+        swprintf(extension, 16, L"_%05zu%ls", k + 1, options->outputFormat == 1 ? L".JPG" : L".PNG");
+        output_filepath(inputPath, L"", filepath);
+        size_t len = strlen(filepath);
+        wcstombs(filepath + len, extension, MAX_PATH - len);
+        int written = options->outputFormat == 1
+                          ? stbi_write_jpg(filepath, (int)width, (int)height, channels, image, 100)
+                          : stbi_write_png(filepath, (int)width, (int)height, channels, image, (int)(width * channels));
+        if (!written) {
+            ShowError(NULL, L"Could not write %hs", filepath);
+            goto done;
         }
     }
+    double seconds = fits_time_seconds() - start;
+    printf("Wrote %zu frames in %.2f s (%.1f frames/s)\n", ser.frame_count, seconds,
+           seconds > 0 ? ser.frame_count / seconds : 0.0);
+    success = 1;
+
+done:
+    if (tif) TinyTIFFWriter_close(tif);
+    free(frame);
+    free(demosaiced);
+    free(narrow);
+    free(lut);
+    fits_ser_close(&ser);
+    return success;
 }
 
-int ConvertFITtoTIF(const wchar_t* inputPath, int outputFormat, BOOL demosaic) {
-    FILE* inFile = NULL;
+int ConvertFITtoTIF(const wchar_t* inputPath, const ConvertOptions* options) {
+    if (is_ser_path(inputPath)) return ConvertSER(inputPath, options);
+
+    int outputFormat = options->outputFormat;
+    BOOL demosaic = options->demosaic;
+    BOOL superpixel = options->demosaic_method == DEMOSAIC_SUPERPIXEL;
+    FITSInput input = {0};
+    FITSHDUIndex hdus = {0};
     FILE* outFile = NULL;
     int success = 0;
-    int width = 0, height = 0, channels = 0, bitpix = 0, bzero = 0;
-
-    // Open input file
-    _wfopen_s(&inFile, inputPath, L"rb");
-    if (!inFile) {
+    size_t width = 0, height = 0;
+    int channels = 0, bitpix = 0;
+    double bzero = 0.0, bscale = 1.0, datamin = 0.0, datamax = 0.0;
+    int has_datamin = 0, has_datamax = 0;
+    void *image_data = NULL;        // pixel data handed to the writers
+    void *image_data_owned = NULL;  // non-NULL when image_data is a private copy
+    FITSTiledImage tiled_image;
+    const FITSTiledImage* tiled = NULL;  // tile-compressed HDU, decoded as it is loaded
+    void *demosaic_data = NULL;     // RGB image produced by --demosaic
+    uint8_t *narrow_data = NULL;    // 8-bit copy of 16-bit data for JPG/PNG
+    uint8_t *lut = NULL;            // its 16- to 8-bit table
+    FITSHistogram histogram = {0};  // 16-bit value counts for --stretch, taken after loading
+    FITSStretch stretch_params = {0};
+    uint32_t datasum = 0;           // checksum of the stored data unit, with --verify
+    uint32_t* checksum = options->verify ? &datasum : NULL;
+
+    // Map the input file; header and data are read from the mapping. For
+    // .fits.gz input a background thread inflates it while we work.
+    int input_flags = (options->drop_cache ? FITS_INPUT_DROP_CACHE : 0) | (options->direct_io ? FITS_INPUT_DIRECT : 0);
+    int opened = options->prefetcher ? fits_input_open_prefetched(&input, options->prefetcher, inputPath, input_flags)
+                                     : fits_input_open(&input, inputPath, input_flags);
+    if (!opened) {
         ShowError(NULL, L"Could not open input file");
         goto cleanup;
     }
-    
-    // keep reading cards until END card is found
-    int i = 0;
-    while (1) {
-        FITSHeaderCard card;
-        if (fread(&card, sizeof(card), 1, inFile) != 1) {
-            ShowError(NULL, L"Could not read FITS header");
+
+    // Index HDUs by hopping over the data units until the requested one is
+    // found; gzip input only has to be inflated up to its header for that
+    char extname[72] = "";
+    if (options->extname) {
+        wcstombs(extname, options->extname, sizeof(extname));
+        extname[sizeof(extname) - 1] = '\0';
+    }
+    int hdu_number = -1;
+    size_t available = 0;
+    int at_end = 0;
+    for (;;) {
+        if (!fits_hdu_index_extend(&hdus, input.data, available, at_end)) {
+            ShowError(NULL, L"Could not allocate memory for the HDU index");
             goto cleanup;
         }
-        if (strncmp(card.card, "END", 3) == 0) {
-            printf("END card found\n"); 
-            break;
+        if (options->extname) {
+            hdu_number = fits_hdu_index_find(&hdus, extname);
+        } else if (options->hdu >= 0) {
+            hdu_number = (size_t)options->hdu < hdus.count ? options->hdu : -1;
+        } else {
+            hdu_number = fits_hdu_index_first_image(&hdus);
         }
+        if (hdu_number >= 0 || hdus.complete) break;
+        size_t next = available > hdus.next_offset ? available : hdus.next_offset;
+        available = fits_input_wait(&input, next + FITS_BLOCK_SIZE, &at_end);
+    }
+    for (size_t i = 0; i < hdus.count; i++) {
+        const FITSHDU* h = &hdus.hdus[i];
+        printf("HDU %zu: %s%s%s BITPIX %d NAXIS %d, data at %zu (%zu bytes)\n", i,
+               h->xtension[0] ? h->xtension : "PRIMARY", h->extname[0] ? " " : "", h->extname,
+               h->bitpix, h->naxis, h->data_offset, h->data_size);
+    }
 
-        // Debug output for each card
-        char debug_card[81] = {0};
-        strncpy_s(debug_card, sizeof(debug_card), card.card, 80);
-        printf("Card %d: '%s'\n", i, debug_card);
+    if (hdus.count == 0) {
+        ShowError(NULL, L"Could not read FITS header");
+        goto cleanup;
+    }
+    if (hdu_number < 0) {
+        if (options->extname) {
+            ShowError(NULL, L"No HDU with EXTNAME %ls", options->extname);
+        } else if (options->hdu >= 0) {
+            ShowError(NULL, L"HDU %d does not exist (file has %zu)", options->hdu, hdus.count);
+        } else {
+            ShowError(NULL, L"File contains no image data");
+        }
+        goto cleanup;
+    }
+    const FITSHDU* hdu = &hdus.hdus[hdu_number];
+    if (!hdu->is_image) {
+        ShowError(NULL, L"HDU %d does not contain an image", hdu_number);
+        goto cleanup;
+    }
+
+    // The selected header is re-read in place for its scaling keywords
+    FITSHeader header;
+    fits_header_parse(&header, input.data + hdu->header_offset, available - hdu->header_offset);
+
+    bitpix = hdu->bitpix;
+    width = (size_t)hdu->naxes[0];
+    height = hdu->naxis > 1 ? (size_t)hdu->naxes[1] : 1;
 
-        // Parse specific values
-        parse_card_value(card.card, "BITPIX", &bitpix);
-        parse_card_value(card.card, "NAXIS1", &width);
-        parse_card_value(card.card, "NAXIS2", &height);
-        parse_card_value(card.card, "NAXIS3", &channels);
-        parse_card_value(card.card, "BZERO", &bzero);
+    // Every axis past NAXIS2 counts planes. One or three planes become a grey
+    // or RGB image, anything else (or --cube) a multi-page TIFF, one frame
+    // per plane.
+    size_t planes = 1;
+    for (int i = 2; i < hdu->naxis; i++) {
+        planes *= (size_t)hdu->naxes[i];
     }
+    BOOL cube = options->cube || (planes != 1 && planes != 3);
+    channels = cube ? 1 : (int)planes;
+    fits_header_key_double(&header, FITS_KEY_BZERO, &bzero);
+    fits_header_key_double(&header, FITS_KEY_BSCALE, &bscale);
+    has_datamin = fits_header_key_double(&header, FITS_KEY_DATAMIN, &datamin);
+    has_datamax = fits_header_key_double(&header, FITS_KEY_DATAMAX, &datamax);
 
-    size_t file_position = ftell(inFile);
-    size_t offset = 2880 - (file_position % 2880);
+    size_t data_offset = hdu->data_offset;
 
     // Debug output
-    printf("Parsed FITS Header Values:\n");
+    printf("Parsed FITS Header Values (HDU %d):\n", hdu_number);
+    printf("Header cards: %zu\n", header.ncards);
     printf("BITPIX: %d\n", bitpix);
-    printf("Width (NAXIS1): %d\n", width);
-    printf("Height (NAXIS2): %d\n", height);
+    printf("Width (NAXIS1): %zu\n", width);
+    printf("Height (NAXIS2): %zu\n", height);
     printf("Channels (NAXIS3): %d\n", channels);
-    printf("Current file position: %ld\n", ftell(inFile));
-    printf("Padding: %lld\n", offset);
-
-    // Seek forward to data with offset
-    fseek(inFile, offset, SEEK_CUR);
-
-    // Validate dimensions
-    if (width <= 0 || width > 65535) {
-        ShowError(NULL, L"Invalid image width: %d", width);
+    if (cube) printf("Cube planes: %zu\n", planes);
+    printf("BZERO: %g, BSCALE: %g\n", bzero, bscale);
+    printf("Data offset: %zu\n", data_offset);
+
+    // Validate dimensions. Sizes are size_t from here on; the only limit is
+    // that the image stays addressable at up to 8 bytes a sample.
+    if (width == 0 || height == 0) {
+        ShowError(NULL, L"Invalid image size: %zux%zu", width, height);
+        goto cleanup;
+    }
+    if (planes == 0) {
+        ShowError(NULL, L"Image has no planes");
         goto cleanup;
     }
-    if (height <= 0 || height > 65535) {
-        ShowError(NULL, L"Invalid image height: %d", height);
+    double elements = 1.0;
+    for (int i = 0; i < hdu->naxis; i++) {
+        elements *= (double)hdu->naxes[i];
+    }
+    if (elements * 8 >= (double)SIZE_MAX) {
+        ShowError(NULL, L"Image of %.0f pixels is too large to load", elements);
+        goto cleanup;
+    }
+    if (cube && (outputFormat != 0 || demosaic)) {
+        ShowError(NULL, L"Data cubes can only be written as TIFF, without demosaic");
         goto cleanup;
     }
-    if (channels != 1 && channels != 3) {
-        ShowError(NULL, L"Invalid number of channels: %d (must be 1 or 3)", channels);
+    // only a single-plane image can be a Bayer mosaic
+    demosaic = demosaic && channels == 1;
+    superpixel = superpixel && demosaic;
+    if (superpixel && (width < 2 || height < 2)) {
+        ShowError(NULL, L"Image of %zux%zu pixels has no complete Bayer quad", width, height);
         goto cleanup;
     }
+    FITSBayerPattern pattern = FITS_BAYER_RGGB;
+    if (demosaic) {
+        FITSHeader primary;
+        if (hdu_number > 0) fits_header_parse(&primary, input.data, available);
+        if (!image_bayer_pattern(&header, hdu_number > 0 ? &primary : NULL, options->bayer, &pattern)) {
+            goto cleanup;
+        }
+    }
+    // Planar TIFF takes the planes in the order FITS stores them, so the
+    // image is loaded like a single-channel one and never interleaved
+    BOOL planar = options->planar && channels == 3 && outputFormat == 0 && !demosaic;
+    // Streaming needs a row writer, which stb has not got for JPG
+    BOOL stream = options->stream && !cube;
+    if (stream && outputFormat == 1) {
+        printf("JPG output is not streamed; converting the whole image\n");
+        stream = FALSE;
+    }
 
     // Validate BITPIX
-    if (bitpix != 8 && bitpix != 16) {
+    if (bitpix != 8 && bitpix != 16 && bitpix != 32 && bitpix != 64 && bitpix != -32 && bitpix != -64) {
         ShowError(NULL, L"Unsupported BITPIX value: %d", bitpix);
         goto cleanup;
     }
 
-    size_t data_size = width * height * channels;
-    void *image_data;
-    size_t pixel_size;
-    if (bitpix == 8) {
-        image_data = malloc(data_size * sizeof(uint8_t));
-        pixel_size = sizeof(uint8_t);
-    } else if (bitpix == 16) {
-        image_data = malloc(data_size * sizeof(uint16_t));
-        pixel_size = sizeof(uint16_t);
+    // TIFF keeps the full physical values (float data is written as float);
+    // JPG/PNG need 8-bit samples, which 16-bit data reaches through a table
+    // below and everything wider by normalizing its value range while loading.
+    FITSSampleType sample_type;
+    if (outputFormat == 0) {
+        sample_type = fits_native_sample_type(bitpix, bzero, bscale);
     } else {
-        ShowError(NULL, L"Unsupported BITPIX value: %d", bitpix);
+        sample_type = bitpix == 16 ? FITS_SAMPLE_U16 : FITS_SAMPLE_U8;
+    }
+    size_t sample_size = fits_sample_size(sample_type);
+
+    // The whole-image writers use 32-bit sizes and offsets (TinyTIFF, stb),
+    // and JPEG stops at 65535 pixels a side. Bigger TIFFs and PNGs are written
+    // by the row writers, which have no such limits; JPG has no row writer,
+    // so a JPG within its limits is always written whole.
+    int out_channels = demosaic ? 3 : channels;
+    size_t out_width = superpixel ? width / 2 : width;
+    size_t out_height = superpixel ? height / 2 : height;
+    double output_bytes = (double)out_width * out_height * out_channels * (outputFormat == 0 ? sample_size : 1);
+    if (outputFormat == 1 && (out_width > 65535 || out_height > 65535 || output_bytes > 0x7FFFFFFF)) {
+        ShowError(NULL, L"Image of %zux%zu pixels is too large for JPG", width, height);
         goto cleanup;
     }
+    if (!stream && !cube && outputFormat != 1 && output_bytes > (outputFormat == 0 ? 4.0e9 : 1.0e9)) {
+        printf("Image too large to convert in one piece; streaming it row by row\n");
+        stream = TRUE;
+    }
 
-    // read image data, one channel at a time due to how FIT data is stored
-    void* tmpPixel = malloc(pixel_size);
-    for (int i = 0; i < channels; i++) {
-        for (int j = 0; j < width * height; j++) {
-            // fread(image_data + j * channels + i, pixel_size, 1, inFile);
-            fread(tmpPixel, pixel_size, 1, inFile);
-            if (bitpix == 8) {
-                ((uint8_t*)image_data)[j * channels + i] = ((uint8_t*)tmpPixel)[0];
-            } else if (bitpix == 16) {
-                ((uint16_t*)image_data)[j * channels + i] = ((uint16_t*)tmpPixel)[0];
-            }
+    // The stretch needs statistics of the whole image before any of it is
+    // written, so streamed output keeps the top 8 bits
+    BOOL stretch = options->stretch && outputFormat != 0 && sample_type == FITS_SAMPLE_U16;
+    if (stretch && stream) {
+        printf("Streamed output is not auto-stretched\n");
+        stretch = FALSE;
+    }
+    if (stretch && !fits_histogram_init(&histogram, options->threads)) {
+        ShowError(NULL, L"Could not allocate memory for image data");
+        goto cleanup;
+    }
+
+    size_t data_size = width * height * planes;
+    size_t pixel_size = abs(bitpix) / 8;
+    size_t stored_size = hdu->compressed ? hdu->data_size : data_size * pixel_size;
+    // Catches mapped files cut short. Gzip input.size is only the room
+    // reserved for the inflated data, so a short gzip file passes here and
+    // is caught by wait_for_input instead.
+    if (data_offset > input.size || input.size - data_offset < stored_size) {
+        ShowError(NULL, L"FITS data unit is truncated");
+        goto cleanup;
+    }
+    const uint8_t* data_unit = input.data + data_offset;
+
+    // Passes that need the whole data unit wait for all of it up front;
+    // the plain load below waits chunk by chunk instead
+    int scaled = bzero != 0.0 || bscale != 1.0;
+    int need_all = hdu->compressed || (!cube && !stream && (channels == 1 || planar) && bitpix == 8 && !scaled) ||
+                   (outputFormat != 0 && bitpix != 8 && bitpix != 16 && !(has_datamin && has_datamax && datamax > datamin));
+    if (need_all && !wait_for_input(&input, data_offset + stored_size)) {
+        ShowError(NULL, L"FITS data unit is truncated");
+        goto cleanup;
+    }
+
+    if (hdu->compressed) {
+        // The checksum covers the stored tiles, not the image they decode to
+        if (checksum) datasum = fits_checksum_add(0, data_unit, stored_size, 0);
+        checksum = NULL;
+
+        // Tiles are decoded where the pixels are loaded, each one straight
+        // into its part of the image, plane or streamed band
+        if (!fits_tiled_image_open(&tiled_image, &header, data_unit, hdu->data_size)) {
+            ShowError(NULL, L"Unsupported tile-compressed image");
+            goto cleanup;
         }
+        tiled = &tiled_image;
     }
-    free(tmpPixel);
 
-    if (outputFormat == 0) { // TIFF
-         // Create output filename (replace .FIT with .TIF)
-        wchar_t filepath_w[MAX_PATH];
-        wcscpy_s(filepath_w, MAX_PATH, inputPath);
-        wchar_t* ext = wcsrchr(filepath_w, L'.');
-        if (ext) {
-            wcscpy_s(ext, 5, L".TIF");
-            // wcscpy_s(ext, 5, L".JPG");
+    FITSLoadParams load_params = { bitpix, bzero, bscale, datamin, datamax };
+    if (sample_type == FITS_SAMPLE_U8 && bitpix != 8) {
+        // prefer the header's DATAMIN/DATAMAX, otherwise scan the data once
+        if (!(has_datamin && has_datamax && datamax > datamin)) {
+            int found = tiled ? fits_tiled_image_range(tiled, data_size, bzero, bscale, options->threads,
+                                                       &load_params.range_min, &load_params.range_max)
+                              : fits_physical_range(data_unit, data_size, bitpix, bzero, bscale,
+                                                    &load_params.range_min, &load_params.range_max);
+            if (!found) {
+                ShowError(NULL, tiled ? L"Image contains no finite pixel values or a corrupt tile"
+                                      : L"Image contains no finite pixel values");
+                goto cleanup;
+            }
         }
+        printf("Normalization range: %g .. %g\n", load_params.range_min, load_params.range_max);
+    }
 
-        // filepath to simple char array
-        char filepath[MAX_PATH];
-        wcstombs(filepath, filepath_w, MAX_PATH);
+    if (demosaic && sample_type != FITS_SAMPLE_U8 && sample_type != FITS_SAMPLE_U16 &&
+        sample_type != FITS_SAMPLE_F32) {
+        ShowError(NULL, L"Demosaic is not supported for BITPIX %d TIFF output", bitpix);
+        goto cleanup;
+    }
 
-        void* image_data_demosaic = malloc(width * height * channels * sizeof(uint16_t));
-        if (demosaic) {
-            demosaic_RGGB_16bit((uint16_t*)image_data, (uint16_t*)image_data_demosaic, width, height);
+    if (stream) {
+        if (demosaic && options->demosaic_method == DEMOSAIC_RCD) {
+            printf("RCD needs whole tiles; the streamed rows are demosaiced bilinearly\n");
+        }
+        char filepath[MAX_PATH];
+        output_filepath(inputPath, outputFormat == 2 ? L".PNG" : L".TIF", filepath);
+        if (!convert_streaming(filepath, hdu->compressed ? NULL : &input, tiled, options->threads, data_unit,
+                               data_offset, width, height, channels, demosaic, pattern, superpixel, outputFormat == 2,
+                               sample_type, &load_params, checksum)) {
+            goto cleanup;
         }
+        if (!input_intact(&input)) goto cleanup;
+        if (options->verify && !verify_checksums(&input, hdu, &header, datasum, stored_size)) goto cleanup;
+        success = 1;
+        goto cleanup;
+    }
 
-        // write tiff version
-        if (!write_simple_tiff(filepath, demosaic ? (uint16_t*)image_data_demosaic : (uint16_t*)image_data, bitpix, width, height, channels)) {
-            ShowError(NULL, L"Could not write tiff image data");
+    if (cube) {
+        // planes are loaded one at a time while the frames are written
+        char filepath[MAX_PATH];
+        output_filepath(inputPath, L".TIF", filepath);
+        if (!write_cube_tiff(filepath, hdu->compressed ? NULL : &input, tiled, options->threads, data_unit,
+                             data_offset, planes, width, height, sample_type, &load_params, checksum)) {
             goto cleanup;
         }
+        if (!input_intact(&input)) goto cleanup;
+        if (options->verify && !verify_checksums(&input, hdu, &header, datasum, stored_size)) goto cleanup;
+        success = 1;
+        goto cleanup;
+    }
+
+    if (!tiled && (channels == 1 || planar) && bitpix == 8 && !scaled) {
+        // unscaled 8-bit data in plane order is used in place, straight from the mapping
+        image_data = (void*)data_unit;
+        if (checksum) datasum = fits_checksum_add(0, data_unit, stored_size, 0);
     } else {
-        // Create output filename (replace .FIT with .TIF)
-        wchar_t filepath_w[MAX_PATH];
-        wcscpy_s(filepath_w, MAX_PATH, inputPath);
-        wchar_t* ext = wcsrchr(filepath_w, L'.');
-        if (ext) {
-            // wcscpy_s(ext, 5, L".TIF");
-            if (outputFormat == 1) {
-                wcscpy_s(ext, 5, L".JPG");
-            } else {
-                wcscpy_s(ext, 5, L".PNG");
+        image_data_owned = malloc(data_size * sample_size);
+        if (!image_data_owned) {
+            ShowError(NULL, L"Could not allocate memory for image data");
+            goto cleanup;
+        }
+        image_data = image_data_owned;
+
+        // FIT data is big-endian and stored one channel plane after the other.
+        // Byte order, BZERO/BSCALE and any narrowing are all applied in a
+        // single pass while copying out of the mapping.
+        size_t plane_size = width * height;
+        double load_start = fits_time_seconds();
+        if (tiled) {
+            // every tile worker loads its pixels straight into image_data,
+            // as RGB triples for interleaved output
+            if (!fits_tiled_image_load(tiled, image_data, sample_type, &load_params, 0, data_size,
+                                       channels == 3 && !planar, options->threads)) {
+                ShowError(NULL, L"Corrupt %hs compressed tile", fits_compression_name(tiled->compression));
+                goto cleanup;
             }
+            printf("Decoded %zu %s tiles in %.3f s\n", tiled->ntiles, fits_compression_name(tiled->compression),
+                   fits_time_seconds() - load_start);
+        } else if (channels == 1 || planar) {
+            // chunked so gzip input is loaded while later chunks still inflate
+            size_t chunk = ((size_t)1 << 20) / pixel_size;
+            uint8_t* out = (uint8_t*)image_data;
+            for (size_t j = 0; j < data_size; j += chunk) {
+                size_t n = data_size - j < chunk ? data_size - j : chunk;
+                if (!wait_for_input(&input, data_offset + (j + n) * pixel_size)) {
+                    ShowError(NULL, L"FITS data unit is truncated");
+                    goto cleanup;
+                }
+                fits_load_samples(out + j * sample_size, sample_type, data_unit + j * pixel_size, n, &load_params);
+                // summed while the chunk is still in cache
+                if (checksum) datasum = fits_checksum_add(datasum, data_unit + j * pixel_size, n * pixel_size, j * pixel_size);
+            }
+        } else {
+            // Load a cache-sized tile of each of the three planes, then write
+            // the tiles out as RGB triples in one sequential pass
+            uint8_t tiles[3][8192];
+            size_t tile_elems = sizeof(tiles[0]) / 8;
+            uint8_t* out = (uint8_t*)image_data;
+            for (size_t j = 0; j < plane_size; j += tile_elems) {
+                size_t n = plane_size - j < tile_elems ? plane_size - j : tile_elems;
+                if (!wait_for_input(&input, data_offset + (2 * plane_size + j + n) * pixel_size)) {
+                    ShowError(NULL, L"FITS data unit is truncated");
+                    goto cleanup;
+                }
+                for (int c = 0; c < 3; c++) {
+                    size_t position = (c * plane_size + j) * pixel_size;
+                    fits_load_samples(tiles[c], sample_type, data_unit + position, n, &load_params);
+                    if (checksum) datasum = fits_checksum_add(datasum, data_unit + position, n * pixel_size, position);
+                }
+                fits_interleave3(out + j * 3 * sample_size, tiles[0], tiles[1], tiles[2], n, sample_size);
+            }
+        }
+        double load_seconds = fits_time_seconds() - load_start;
+        if (!tiled && load_seconds > 0) {
+            printf("Load (%s swap, %s scaling): %.2f GB/s\n", fits_swap_kernel_name(),
+                   fits_scale_kernel_name(bzero, bscale), (double)(data_size * pixel_size) / load_seconds / 1e9);
         }
+    }
 
-        // filepath to simple char array
-        char filepath[MAX_PATH];
-        wcstombs(filepath, filepath_w, MAX_PATH);
+    if (stretch) {
+        // one pass over the loaded image, split over the histogram's threads
+        // once rather than per load chunk; RGB triples count like the planes
+        fits_histogram_add_u16(&histogram, (const uint16_t*)image_data, data_size);
+        if (!fits_stretch_auto(&histogram, &stretch_params)) {
+            ShowError(NULL, L"Could not allocate memory for image data");
+            goto cleanup;
+        }
+        printf("Auto-stretch: median %.5f, MAD %.5f, shadows %.5f, midtones %.5f\n", stretch_params.median,
+               stretch_params.mad, stretch_params.shadows, stretch_params.midtones);
+    }
+
+    // checked before anything is written, so a damaged file leaves no output
+    if (!input_intact(&input)) goto cleanup;
+    if (options->verify && !verify_checksums(&input, hdu, &header, datasum, stored_size)) goto cleanup;
 
-        uint8_t *data_8bit = 0x0;
-        uint8_t *data_8bit_raw = (uint8_t *)malloc(width * height * channels);
-        uint8_t *data_8bit_demosaic = (uint8_t *)malloc(width * height * channels);
-        if (!data_8bit_raw || !data_8bit_demosaic) {
+    if (superpixel) {
+        // Binned at full sample depth, before any narrowing. The quarter-size
+        // RGB image then takes the mosaic's place and is written below like
+        // any loaded RGB image.
+        demosaic_data = malloc(out_width * out_height * 3 * sample_size);
+        if (!demosaic_data) {
             ShowError(NULL, L"Could not allocate memory for image data");
             goto cleanup;
         }
+        demosaic_image(demosaic_data, image_data, width, height, sample_size, pattern, DEMOSAIC_SUPERPIXEL, NULL,
+                       options->threads);
+        image_data = demosaic_data;
+        width = out_width;
+        height = out_height;
+        channels = 3;
+        demosaic = FALSE;
+    }
 
-        if (bitpix == 8) {
-            memcpy(data_8bit_raw, image_data, width * height * channels);
-        } else if (bitpix == 16) {
-            for (int i = 0; i < width * height * channels; i++) {
-                uint8_t d = (((uint16_t*)image_data)[i]) >> 8;
-                data_8bit_raw[i] = d;
+    if (outputFormat == 0) { // TIFF
+         // Create output filename (replace .FIT with .TIF)
+        char filepath[MAX_PATH];
+        output_filepath(inputPath, L".TIF", filepath);
+
+        if (demosaic) {
+            demosaic_data = malloc(width * height * 3 * sample_size);
+            if (!demosaic_data) {
+                ShowError(NULL, L"Could not allocate memory for image data");
+                goto cleanup;
+            }
+            if (!demosaic_image(demosaic_data, image_data, width, height, sample_size, pattern,
+                                options->demosaic_method, NULL, options->threads)) {
+                ShowError(NULL, L"Could not allocate memory for image data");
+                goto cleanup;
             }
-        } else if (bitpix == -32) {
-            ShowError(NULL, L"Unsupported BITPIX value for conversion: %d", bitpix);
-            goto cleanup;
-        } else if (bitpix == -64) { 
-            ShowError(NULL, L"Unsupported BITPIX value for conversion: %d", bitpix);
-            goto cleanup;
         }
 
+        // write tiff version
+        if (!write_simple_tiff(filepath, demosaic ? demosaic_data : image_data, sample_size * 8,
+                               tiff_sample_format(sample_type), width, height, out_channels, planar)) {
+            ShowError(NULL, L"Could not write tiff image data");
+            goto cleanup;
+        }
+    } else {
+        // Create output filename (replace .FIT with .JPG or .PNG)
+        char filepath[MAX_PATH];
+        output_filepath(inputPath, outputFormat == 1 ? L".JPG" : L".PNG", filepath);
+
+        // 8-bit data is already in the right format and is used without
+        // copying. 16-bit data goes to 8 bits through a table (its top 8
+        // bits, or the auto-stretch), after the demosaic so colours are
+        // interpolated at full precision; the bilinear demosaic does both in
+        // one pass.
+        uint8_t *data_8bit = (uint8_t *)image_data;
+        if (sample_type == FITS_SAMPLE_U16) {
+            lut = (uint8_t *)malloc(65536);
+            narrow_data = (uint8_t *)malloc(width * height * out_channels);
+            if (!lut || !narrow_data) {
+                ShowError(NULL, L"Could not allocate memory for image data");
+                goto cleanup;
+            }
+            if (stretch) {
+                fits_stretch_lut(&stretch_params, lut);
+            } else {
+                for (size_t v = 0; v < 65536; v++) lut[v] = (uint8_t)(v >> 8);
+            }
+            if (!demosaic) fits_lut_u16(narrow_data, (const uint16_t *)image_data, width * height * channels, lut);
+            data_8bit = narrow_data;
+        }
         if (demosaic) {
-            demosaic_RGGB_8bit(data_8bit_raw, data_8bit_demosaic, width, height);
-            data_8bit = data_8bit_demosaic;
-        } else {
-            data_8bit = data_8bit_raw;
+            if (sample_type == FITS_SAMPLE_U8) {
+                demosaic_data = malloc(width * height * 3);
+                if (!demosaic_data) {
+                    ShowError(NULL, L"Could not allocate memory for image data");
+                    goto cleanup;
+                }
+                data_8bit = (uint8_t *)demosaic_data;
+            }
+            if (!demosaic_image(data_8bit, image_data, width, height, sample_size, pattern, options->demosaic_method,
+                                lut, options->threads)) {
+                ShowError(NULL, L"Could not allocate memory for image data");
+                goto cleanup;
+            }
         }
 
         // write png version
         // if (!stbi_write_jpg(filepath, width, height, channels, data_8bit, 100)) {
         if (outputFormat == 2) {
-            if (!stbi_write_png(filepath, width, height, channels, data_8bit, width * channels)) {
+            if (!stbi_write_png(filepath, (int)width, (int)height, out_channels, data_8bit, (int)(width * out_channels))) {
                 ShowError(NULL, L"Could not write PNG data");
                 goto cleanup;
             }
         } else {
-            if (!stbi_write_jpg(filepath, width, height, channels, data_8bit, 100)) {
+            if (!stbi_write_jpg(filepath, (int)width, (int)height, out_channels, data_8bit, 100)) {
                 ShowError(NULL, L"Could not write JPG data");
                 goto cleanup;
             }
@@ -549,9 +1651,14 @@ int ConvertFITtoTIF(const wchar_t* inputPath, int outputFormat, BOOL demosaic) {
     success = 1;
 
 cleanup:
-    if (inFile) fclose(inFile);
     if (outFile) fclose(outFile);
-    free(image_data);
+    free(image_data_owned);
+    free(demosaic_data);
+    free(narrow_data);
+    free(lut);
+    fits_histogram_free(&histogram);
+    fits_hdu_index_free(&hdus);
+    fits_input_close(&input);
     return success;
 }
 
@@ -563,7 +1670,9 @@ void ShowError(HWND hwnd, const wchar_t* format, ...) {
     vswprintf_s(message, _countof(message), format, args);
     va_end(args);
     
-    MessageBoxW(hwnd, message, L"Error", MB_OK | MB_ICONERROR);
+    if (!commandLineMode) {
+        MessageBoxW(hwnd, message, L"Error", MB_OK | MB_ICONERROR);
+    }
     UpdateStatus(message, TRUE);
     printf("Error: %ls\n", message);
 }